@@ -0,0 +1,40 @@
+# Prints the flash and RAM footprint of the library and its largest stack frames.
+# Run by the ccronexpr_footprint target of a build configured with -DCRON_FOOTPRINT=1:
+#   cmake -DSIZE=<size tool> -DLIBRARY=<archive> -DSTACK_DIR=<object dir> -P footprint.cmake
+
+if (NOT SIZE OR NOT LIBRARY OR NOT STACK_DIR)
+    message(FATAL_ERROR "SIZE, LIBRARY and STACK_DIR must be defined")
+endif ()
+
+# text is flash, data is flash and RAM, bss is RAM
+execute_process(COMMAND ${SIZE} ${LIBRARY} RESULT_VARIABLE size_res)
+if (NOT size_res EQUAL 0)
+    message(FATAL_ERROR "${SIZE} failed on ${LIBRARY}")
+endif ()
+
+# frames reported by -fstack-usage, the stack used by a call is the sum along the call chain
+file(GLOB_RECURSE stack_files "${STACK_DIR}/*.su")
+set(frames "")
+foreach (stack_file ${stack_files})
+    file(STRINGS ${stack_file} lines)
+    foreach (line ${lines})
+        if (line MATCHES "^.*:([A-Za-z0-9_]+)\t([0-9]+)\t(.*)$")
+            set(bytes "0000000${CMAKE_MATCH_2}")
+            string(LENGTH "${bytes}" len)
+            math(EXPR start "${len} - 8")
+            string(SUBSTRING "${bytes}" ${start} 8 bytes)
+            list(APPEND frames "${bytes} ${CMAKE_MATCH_1} (${CMAKE_MATCH_3})")
+        endif ()
+    endforeach ()
+endforeach ()
+list(SORT frames)
+list(REVERSE frames)
+list(LENGTH frames count)
+if (count GREATER 10)
+    list(GET frames 0 1 2 3 4 5 6 7 8 9 frames)
+endif ()
+message("\nLargest stack frames, bytes:")
+foreach (frame ${frames})
+    string(REGEX REPLACE "^0*([0-9]+) " "\\1 " frame "${frame}")
+    message("  ${frame}")
+endforeach ()
@@ -21,16 +21,43 @@
  * Created on February 24, 2015, 9:35 AM
  */
 
+#if (defined(CRON_USE_STATS) || defined(CRON_USE_TRACE)) && !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+/* clock_gettime and pthreads */
+#define _POSIX_C_SOURCE 200112L
+#endif /* CRON_USE_STATS || CRON_USE_TRACE */
+
+#ifdef CRON_FREESTANDING
+#if defined(CRON_USE_LOCAL_TIME) || defined(CRON_USE_STATS) || defined(CRON_USE_TRACE)
+#error "CRON_FREESTANDING cannot be combined with CRON_USE_LOCAL_TIME, CRON_USE_STATS or CRON_USE_TRACE"
+#endif /* CRON_USE_LOCAL_TIME || CRON_USE_STATS || CRON_USE_TRACE */
+#else /* CRON_FREESTANDING */
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
+#endif /* CRON_FREESTANDING */
 #include <limits.h>
 #include <string.h>
-#include <math.h>
 
 #include "ccronexpr.h"
 
+/**
+ * Constant tables kept in flash on Harvard architectures, read byte by byte.
+ */
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define CRON_FLASH PROGMEM
+#define CRON_FLASH_BYTE(addr) pgm_read_byte(addr)
+#elif defined(ESP8266)
+#include <pgmspace.h>
+#define CRON_FLASH PROGMEM
+#define CRON_FLASH_BYTE(addr) pgm_read_byte(addr)
+#else /* __AVR__ || ESP8266 */
+#define CRON_FLASH
+#define CRON_FLASH_BYTE(addr) (*(addr))
+#endif /* __AVR__ || ESP8266 */
+
 #define CRON_MAX_SECONDS 60
 #define CRON_MAX_MINUTES 60
 #define CRON_MAX_HOURS 24
@@ -47,17 +74,20 @@
 #define CRON_CF_YEAR 6
 
 #define CRON_CF_ARR_LEN 7
+#define CRON_FIELDS_LEN 6
 
-
-static const char* const DAYS_ARR[] = { "SUN", "MON", "TUE", "WED", "THU", "FRI", "SAT" };
+#define CRON_NAME_LEN 3
+static const char DAYS_ARR[] CRON_FLASH = "SUNMONTUEWEDTHUFRISAT";
 #define CRON_DAYS_ARR_LEN 7
-static const char* const MONTHS_ARR[] = { "FOO", "JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC" };
+static const char MONTHS_ARR[] CRON_FLASH = "FOOJANFEBMARAPRMAYJUNJULAUGSEPOCTNOVDEC";
 #define CRON_MONTHS_ARR_LEN 13
 
 #define CRON_MAX_STR_LEN_TO_SPLIT 256
 #define CRON_SIZE_STRING_MAX_LEN 20
 
-#ifndef CRON_TEST_MALLOC
+#if defined(CRON_FREESTANDING)
+/* no heap, the functions that allocate are not compiled */
+#elif !defined(CRON_TEST_MALLOC)
 #define cron_malloc(x) malloc(x)
 #define cron_free(x) free(x)
 #else /* CRON_TEST_MALLOC */
@@ -65,6 +95,287 @@ void* cron_malloc(size_t n);
 void cron_free(void* p);
 #endif /* CRON_TEST_MALLOC */
 
+/**
+ * Static tracepoints for perf/bpftrace/SystemTap, compiled in with CRON_USE_USDT.
+ * Provider 'ccronexpr', probes: parse__entry(expression), parse__return(expression, error),
+ * next__entry(expr, date), next__return(expr, date, result), prev__entry, prev__return,
+ * next__rollover(field, value) and prev__rollover(field, value).
+ */
+#ifdef CRON_USE_USDT
+#include <sys/sdt.h>
+#define CRON_PROBE1(name, a) DTRACE_PROBE1(ccronexpr, name, a)
+#define CRON_PROBE2(name, a, b) DTRACE_PROBE2(ccronexpr, name, a, b)
+#define CRON_PROBE3(name, a, b, c) DTRACE_PROBE3(ccronexpr, name, a, b, c)
+#else /* CRON_USE_USDT */
+#define CRON_PROBE1(name, a)
+#define CRON_PROBE2(name, a, b)
+#define CRON_PROBE3(name, a, b, c)
+#endif /* CRON_USE_USDT */
+
+/**
+ * Statistics.
+ * With CRON_USE_STATS every thread accumulates its own counters,
+ * 'cron_stats_read' sums the counters of all threads.
+ */
+#ifdef CRON_USE_STATS
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif /* _WIN32 */
+
+typedef struct cron_stats_block {
+    cron_stats stats;
+    uint64_t depth;
+    int in_use;
+    struct cron_stats_block* next;
+} cron_stats_block;
+
+#ifndef _WIN32
+
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static cron_stats_block* stats_blocks = NULL;
+
+static void stats_release(void* block) {
+    /* counters are kept, the block is reused by the next new thread */
+    pthread_mutex_lock(&stats_lock);
+    ((cron_stats_block*) block)->in_use = 0;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void stats_init(void) {
+    pthread_key_create(&stats_key, stats_release);
+}
+
+static cron_stats_block* stats_local(void) {
+    cron_stats_block* block;
+    pthread_once(&stats_once, stats_init);
+    block = (cron_stats_block*) pthread_getspecific(stats_key);
+    if (block) return block;
+    pthread_mutex_lock(&stats_lock);
+    for (block = stats_blocks; block && block->in_use; block = block->next);
+    if (!block) {
+        /* not counted by cron_malloc, blocks live until the process exits */
+        block = (cron_stats_block*) calloc(1, sizeof(cron_stats_block));
+        if (block) {
+            block->next = stats_blocks;
+            stats_blocks = block;
+        }
+    }
+    if (block) {
+        block->in_use = 1;
+        block->depth = 0;
+    }
+    pthread_mutex_unlock(&stats_lock);
+    if (block) pthread_setspecific(stats_key, block);
+    return block;
+}
+
+#define CRON_STATS_LOCK() pthread_mutex_lock(&stats_lock)
+#define CRON_STATS_UNLOCK() pthread_mutex_unlock(&stats_lock)
+
+#else /* _WIN32 */
+
+/* single set of counters, updates from concurrent threads may be lost */
+static cron_stats_block stats_global;
+static cron_stats_block* stats_blocks = &stats_global;
+
+static cron_stats_block* stats_local(void) {
+    return &stats_global;
+}
+
+#define CRON_STATS_LOCK()
+#define CRON_STATS_UNLOCK()
+
+#endif /* _WIN32 */
+
+static uint64_t stats_now(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#else /* CLOCK_MONOTONIC */
+    return (uint64_t) clock() * (1000000000 / CLOCKS_PER_SEC);
+#endif /* CLOCK_MONOTONIC */
+}
+
+static void stats_latency(int api, uint64_t start) {
+    uint64_t elapsed = stats_now() - start;
+    int bucket = 0;
+    cron_stats_block* block = stats_local();
+    if (!block) return;
+    while (elapsed > 1 && bucket < CRON_STATS_LATENCY_BUCKETS - 1) {
+        elapsed >>= 1;
+        bucket++;
+    }
+    block->stats.calls[api] += 1;
+    block->stats.latency[api][bucket] += 1;
+}
+
+static void stats_enter(void) {
+    cron_stats_block* block = stats_local();
+    if (!block) return;
+    block->depth += 1;
+    block->stats.recursions += 1;
+    if (block->depth > block->stats.max_depth) block->stats.max_depth = block->depth;
+}
+
+static void stats_leave(void) {
+    cron_stats_block* block = stats_local();
+    if (block) block->depth -= 1;
+}
+
+static uint64_t stats_allocations(void) {
+    cron_stats_block* block = stats_local();
+    return block ? block->stats.allocations : 0;
+}
+
+static void* stats_malloc(size_t n) {
+    cron_stats_block* block = stats_local();
+    if (block) block->stats.allocations += 1;
+    return cron_malloc(n);
+}
+
+#undef cron_malloc
+#define cron_malloc(x) stats_malloc(x)
+
+#define CRON_STATS_START(start) uint64_t start = stats_now()
+#define CRON_STATS_LATENCY(api, start) stats_latency(api, start)
+#define CRON_STATS_ENTER() stats_enter()
+#define CRON_STATS_LEAVE() stats_leave()
+#define CRON_STATS_ADD(field, value) do { cron_stats_block* stats_block = stats_local(); \
+    if (stats_block) stats_block->stats.field += (value); } while (0)
+
+void cron_stats_read(cron_stats* out) {
+    const cron_stats_block* block;
+    const uint64_t* from;
+    uint64_t* to;
+    uint64_t max_depth = 0;
+    size_t i;
+    if (!out) return;
+    memset(out, 0, sizeof(cron_stats));
+    CRON_STATS_LOCK();
+    for (block = stats_blocks; block; block = block->next) {
+        /* all fields are counters, except for the maximal depth */
+        from = (const uint64_t*) &block->stats;
+        to = (uint64_t*) out;
+        for (i = 0; i < sizeof(cron_stats) / sizeof(uint64_t); i++) {
+            to[i] += from[i];
+        }
+        if (block->stats.max_depth > max_depth) max_depth = block->stats.max_depth;
+    }
+    CRON_STATS_UNLOCK();
+    out->max_depth = max_depth;
+}
+
+void cron_stats_reset(void) {
+    cron_stats_block* block;
+    CRON_STATS_LOCK();
+    for (block = stats_blocks; block; block = block->next) {
+        memset(&block->stats, 0, sizeof(cron_stats));
+    }
+    CRON_STATS_UNLOCK();
+}
+
+#else /* CRON_USE_STATS */
+
+#define CRON_STATS_START(start)
+#define CRON_STATS_LATENCY(api, start)
+#define CRON_STATS_ENTER()
+#define CRON_STATS_LEAVE()
+#define CRON_STATS_ADD(field, value)
+
+#endif /* CRON_USE_STATS */
+
+/**
+ * Trace capture, compiled in with CRON_USE_TRACE, see the end of the file.
+ */
+#ifdef CRON_USE_TRACE
+static void trace_search(char api, const cron_expr* expr, time_t date, time_t res);
+#define CRON_TRACE(api, expr, date, res) trace_search(api, expr, date, res)
+#else /* CRON_USE_TRACE */
+#define CRON_TRACE(api, expr, date, res)
+#endif /* CRON_USE_TRACE */
+
+/**
+ * Civil calendar arithmetic.
+ * Proleptic Gregorian calendar computed without the standard library,
+ * used to evaluate expressions in wall time of a time zone and as UTC
+ * time functions on platforms without 'timegm'.
+ * http://howardhinnant.github.io/date_algorithms.html
+ */
+
+static int64_t floor_div(int64_t a, int64_t b) {
+    /* rounding of negative division is implementation-defined in C89 */
+    int64_t q = a / b;
+    if (q * b > a) q -= 1;
+    return q;
+}
+
+static int64_t days_from_civil(int64_t year, int month, int day) {
+    int64_t era;
+    int64_t yoe;
+    int64_t doy;
+    int64_t doe;
+    if (month <= 2) year -= 1;
+    era = floor_div(year, 400);
+    yoe = year - era * 400;
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void civil_from_days(int64_t days, int64_t* year, int* month, int* day) {
+    int64_t era;
+    int64_t doe;
+    int64_t yoe;
+    int64_t doy;
+    int64_t mp;
+    days += 719468;
+    era = floor_div(days, 146097);
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *day = (int) (doy - (153 * mp + 2) / 5 + 1);
+    *month = (int) (mp < 10 ? mp + 3 : mp - 9);
+    *year = yoe + era * 400 + (*month <= 2 ? 1 : 0);
+}
+
+static void civil_to_tm(int64_t date, struct tm* out) {
+    int64_t days = floor_div(date, 86400);
+    int64_t secs = date - days * 86400;
+    int64_t year = 0;
+    int month = 0;
+    int day = 0;
+    civil_from_days(days, &year, &month, &day);
+    memset(out, 0, sizeof(struct tm));
+    out->tm_sec = (int) (secs % 60);
+    out->tm_min = (int) (secs / 60 % 60);
+    out->tm_hour = (int) (secs / 3600);
+    out->tm_mday = day;
+    out->tm_mon = month - 1;
+    out->tm_year = (int) (year - 1900);
+    out->tm_wday = (int) (days - floor_div(days + 4, 7) * 7 + 4);
+    out->tm_yday = (int) (days - days_from_civil(year, 1, 1));
+}
+
+/* normalizes out of range fields the same way as 'timegm' */
+static time_t cron_mktime_civil(struct tm* tm) {
+    int64_t years = floor_div(tm->tm_mon, 12);
+    int64_t date = (days_from_civil(tm->tm_year + 1900 + years, (int) (tm->tm_mon - years * 12) + 1, 1) + tm->tm_mday - 1) * 86400
+            + (int64_t) tm->tm_hour * 3600 + (int64_t) tm->tm_min * 60 + tm->tm_sec;
+    if ((int64_t) (time_t) date != date) return CRON_INVALID_INSTANT;
+    civil_to_tm(date, tm);
+    return (time_t) date;
+}
+
+static struct tm* cron_time_civil(time_t* date, struct tm* out) {
+    civil_to_tm((int64_t) *date, out);
+    return out;
+}
+
 /**
  * Time functions from standard library.
  * This part defines: cron_mktime: create time_t from tm
@@ -73,7 +384,8 @@ void cron_free(void* p);
 
 /* forward declarations for platforms that may need them */
 /* can be hidden in time.h */
-#if !defined(_WIN32) && !defined(__AVR__) && !defined(ESP8266) && !defined(ESP_PLATFORM) && !defined(ANDROID) && !defined(TARGET_LIKE_MBED)
+#if !defined(_WIN32) && !defined(__AVR__) && !defined(ESP8266) && !defined(ESP_PLATFORM) && !defined(ANDROID) && !defined(TARGET_LIKE_MBED) \
+        && !defined(CRON_FREESTANDING)
 struct tm *gmtime_r(const time_t *timep, struct tm *result);
 time_t timegm(struct tm* __tp);
 struct tm *localtime_r(const time_t *timep, struct tm *result);
@@ -83,26 +395,21 @@ struct tm *localtime_r(const time_t *timep, struct tm *result);
 time_t _mkgmtime(struct tm* tm);
 #endif /* __MINGW32__ */
 
-#if defined(ESP8266) || defined(ESP_PLATFORM) || defined(TARGET_LIKE_MBED)
-  #if !defined(CRON_USE_LOCAL_TIME)
-    #define CRON_USE_LOCAL_TIME
-  #endif
-#endif
-
 /* function definitions */
 #ifndef CRON_USE_LOCAL_TIME
 
 static time_t cron_mktime_gm(struct tm* tm) {
-#if defined(_WIN32)
+#if defined(CRON_FREESTANDING)
+    return cron_mktime_civil(tm);
+#elif defined(_WIN32)
 /* http://stackoverflow.com/a/22557778 */
     return _mkgmtime(tm);
 #elif defined(__AVR__)
 /* https://www.nongnu.org/avr-libc/user-manual/group__avr__time.html */
     return mk_gmtime(tm);
 #elif defined(ESP8266) || defined(ESP_PLATFORM) || defined(TARGET_LIKE_MBED)
-
-#error "timegm() is not supported on the ESP platform, please use this library with CRON_USE_LOCAL_TIME"
-
+    /* timegm() is not available, only reached with CRON_USE_UTC */
+    return cron_mktime_civil(tm);
 #elif defined(ANDROID) && !defined(__LP64__)
     /* https://github.com/adobe/chromium/blob/cfe5bf0b51b1f6b9fe239c2a3c2f2364da9967d7/base/os_compat_android.cc#L20 */
     static const time_t kTimeMax = ~(1L << (sizeof (time_t) * CHAR_BIT - 1));
@@ -116,7 +423,10 @@ static time_t cron_mktime_gm(struct tm* tm) {
 }
 
 static struct tm* cron_time_gm(time_t* date, struct tm* out) {
-#if defined(__MINGW32__)
+#if defined(CRON_FREESTANDING)
+    civil_to_tm((int64_t) *date, out);
+    return out;
+#elif defined(__MINGW32__)
     (void)(out); /* To avoid unused warning */
     return gmtime(date);
 #elif defined(_WIN32)
@@ -126,6 +436,9 @@ static struct tm* cron_time_gm(time_t* date, struct tm* out) {
     /* https://www.nongnu.org/avr-libc/user-manual/group__avr__time.html */
     gmtime_r(date, out);
     return out;
+#elif defined(ESP8266) || defined(ESP_PLATFORM) || defined(TARGET_LIKE_MBED)
+    civil_to_tm((int64_t) *date, out);
+    return out;
 #else
     return gmtime_r(date, out);
 #endif
@@ -174,6 +487,52 @@ struct tm* cron_time(time_t* date, struct tm* out) {
 
 #endif /* CRON_USE_LOCAL_TIME */
 
+/**
+ * Calendar functions used by a single next/prev search
+ */
+typedef struct {
+    struct tm* (*to_calendar)(time_t* date, struct tm* out);
+    time_t (*normalize)(struct tm* calendar);
+    struct cron_budget* budget; /* NULL for an unlimited search */
+} cron_search;
+
+/**
+ * Work limit of a budgeted search, in calendar normalizations, and the last
+ * calendar state the search can be resumed from
+ */
+typedef struct cron_budget {
+    unsigned long remaining;
+    unsigned long spent;
+    int exhausted;
+    struct tm checkpoint;
+} cron_budget;
+
+static const cron_search SEARCH_DEFAULT = { cron_time, cron_mktime, NULL };
+static const cron_search SEARCH_CIVIL = { cron_time_civil, cron_mktime_civil, NULL };
+
+static time_t search_normalize(const cron_search* search, struct tm* calendar) {
+    CRON_STATS_ADD(normalizations, 1);
+    if (search->budget) {
+        if (0 == search->budget->remaining) {
+            search->budget->exhausted = 1;
+            return CRON_INVALID_INSTANT;
+        }
+        search->budget->remaining--;
+        search->budget->spent++;
+    }
+    return search->normalize(calendar);
+}
+
+/**
+ * Records a calendar state no later than the searched date with no matching
+ * date between the search start and it, a budgeted search is resumed from it
+ */
+static void search_checkpoint(const cron_search* search, const struct tm* calendar) {
+    if (search->budget) {
+        search->budget->checkpoint = *calendar;
+    }
+}
+
 /**
  * Functions.
  */
@@ -203,28 +562,7 @@ uint8_t cron_get_bit(const uint8_t* rbyte, int idx) {
     }
 }
 
-static void free_splitted(char** splitted, size_t len) {
-    size_t i;
-    if (!splitted) return;
-    for (i = 0; i < len; i++) {
-        if (splitted[i]) {
-            cron_free(splitted[i]);
-        }
-    }
-    cron_free(splitted);
-}
-
-static char* strdupl(const char* str, size_t len) {
-    char* res = NULL;
-    if (!str) return NULL;
-    res = (char*) cron_malloc(len + 1);
-    if (!res) return NULL;
-    memcpy(res, str, len);
-    res[len] = '\0';
-    return res;
-}
-
-static int next_set_bit(uint8_t* bits, int max, int from_index, int* notfound) {
+static int next_set_bit(const uint8_t* bits, int max, int from_index, int* notfound) {
     int i;
     if (!bits) {
         *notfound = 1;
@@ -253,7 +591,109 @@ static void push_to_fields_arr(int* arr, int fi) {
     }
 }
 
-static int add_to_field(struct tm* calendar, int field, int val) {
+static int days_in_month(int month, int year) {
+    static const uint8_t DAYS[] CRON_FLASH = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+    int y = year + 1900;
+    if (1 == month && ((0 == y % 4 && 0 != y % 100) || 0 == y % 400)) {
+        return 29;
+    }
+    return CRON_FLASH_BYTE(DAYS + month);
+}
+
+static int any_bit(const uint8_t* bits, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (bits[i]) return 1;
+    }
+    return 0;
+}
+
+/* An expression with no seconds, minutes, hours or months never fires, e.g. a zeroed or partially parsed one */
+static int has_empty_field(const cron_expr* expr) {
+    return !any_bit(expr->seconds, sizeof(expr->seconds)) || !any_bit(expr->minutes, sizeof(expr->minutes))
+            || !any_bit(expr->hours, sizeof(expr->hours)) || !any_bit(expr->months, sizeof(expr->months));
+}
+
+static int has_day_modifiers(const cron_expr* expr) {
+    size_t i;
+    uint8_t any = (uint8_t) (expr->days_of_week_last[0] | expr->days_of_week_nth[4]);
+    for (i = 0; i < 4; i++) {
+        any |= (uint8_t) (expr->days_of_month_last[i] | expr->days_of_month_weekday[i] | expr->days_of_week_nth[i]);
+    }
+    return 0 != any;
+}
+
+static uint32_t count_bits(const uint8_t* bits, int max) {
+    int i;
+    uint32_t res = 0;
+    for (i = 0; i < max; i++) {
+        res += cron_get_bit(bits, i);
+    }
+    return res;
+}
+
+/* Weekday nearest to the specified day within the month, 'first_wday' is the day of week of the 1st */
+static int nearest_weekday(int day, int len, int first_wday) {
+    int wday = (first_wday + day - 1) % 7;
+    if (6 == wday) {
+        return 1 == day ? day + 2 : day - 1;
+    }
+    if (0 == wday) {
+        return len == day ? day - 2 : day + 1;
+    }
+    return day;
+}
+
+/**
+ * Calculates the mask of days of the specified month matching both days of month
+ * and days of week of the expression, resolving L, W and # modifiers from
+ * the month length and the day of week of the 1st.
+ */
+static void month_days(const cron_expr* expr, int year, int month, int first_wday, uint8_t* days) {
+    uint8_t dom[4];
+    uint8_t dow[4];
+    int len = days_in_month(month, year);
+    int last_wday = (first_wday + len - 1) % 7;
+    int i;
+    int d;
+    int n;
+
+    memcpy(dom, expr->days_of_month, sizeof(dom));
+    memset(dow, 0, sizeof(dow));
+    if (has_day_modifiers(expr)) {
+        for (i = 0; i < len; i++) {
+            if (cron_get_bit(expr->days_of_month_last, i)) {
+                cron_set_bit(dom, len - i);
+            }
+            if (cron_get_bit(expr->days_of_month_weekday, i + 1)) {
+                cron_set_bit(dom, nearest_weekday(i + 1, len, first_wday));
+            }
+        }
+        if (cron_get_bit(expr->days_of_month_weekday, 0)) {
+            /* LW */
+            cron_set_bit(dom, 6 == last_wday ? len - 1 : 0 == last_wday ? len - 2 : len);
+        }
+        for (d = 0; d < 7; d++) {
+            if (cron_get_bit(expr->days_of_week_last, d)) {
+                cron_set_bit(dow, len - (last_wday - d + 7) % 7);
+            }
+            for (n = 0; n < 5; n++) {
+                i = 1 + (d - first_wday + 7) % 7 + 7 * n;
+                if (cron_get_bit(&expr->days_of_week_nth[n], d) && i <= len) {
+                    cron_set_bit(dow, i);
+                }
+            }
+        }
+    }
+    memset(days, 0, 4);
+    for (i = 1; i <= len; i++) {
+        if (cron_get_bit(dom, i) && (cron_get_bit(expr->days_of_week, (first_wday + i - 1) % 7) || cron_get_bit(dow, i))) {
+            cron_set_bit(days, i);
+        }
+    }
+}
+
+static int add_to_field(const cron_search* search, struct tm* calendar, int field, int val) {
     time_t res = 0;
     if (!calendar || -1 == field) {
         return 1;
@@ -281,7 +721,7 @@ static int add_to_field(struct tm* calendar, int field, int val) {
     default:
         return 1; /* unknown field */
     }
-    res = cron_mktime(calendar);
+    res = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == res) {
         return 1;
     }
@@ -291,7 +731,7 @@ static int add_to_field(struct tm* calendar, int field, int val) {
 /**
  * Reset the calendar setting all the fields provided to zero.
  */
-static int reset_min(struct tm* calendar, int field) {
+static int reset_min(const cron_search* search, struct tm* calendar, int field) {
     time_t res = 0;
     if (!calendar || -1 == field) {
         return 1;
@@ -321,14 +761,14 @@ static int reset_min(struct tm* calendar, int field) {
     default:
         return 1; /* unknown field */
     }
-    res = cron_mktime(calendar);
+    res = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == res) {
         return 1;
     }
     return 0;
 }
 
-static int reset_all_min(struct tm* calendar, int* fields) {
+static int reset_all_min(const cron_search* search, struct tm* calendar, int* fields) {
     int i;
     int res = 0;
     if (!calendar || !fields) {
@@ -336,14 +776,14 @@ static int reset_all_min(struct tm* calendar, int* fields) {
     }
     for (i = 0; i < CRON_CF_ARR_LEN; i++) {
         if (-1 != fields[i]) {
-            res = reset_min(calendar, fields[i]);
+            res = reset_min(search, calendar, fields[i]);
             if (0 != res) return res;
         }
     }
     return 0;
 }
 
-static int set_field(struct tm* calendar, int field, int val) {
+static int set_field(const cron_search* search, struct tm* calendar, int field, int val) {
     time_t res = 0;
     if (!calendar || -1 == field) {
         return 1;
@@ -366,6 +806,11 @@ static int set_field(struct tm* calendar, int field, int val) {
         break;
     case CRON_CF_MONTH:
         calendar->tm_mon = val;
+        /* do not let a day missing in the target month roll over to the next one,
+           lower fields are reset by the caller */
+        if (calendar->tm_mday > days_in_month(val, calendar->tm_year)) {
+            calendar->tm_mday = days_in_month(val, calendar->tm_year);
+        }
         break;
     case CRON_CF_YEAR:
         calendar->tm_year = val;
@@ -373,7 +818,7 @@ static int set_field(struct tm* calendar, int field, int val) {
     default:
         return 1; /* unknown field */
     }
-    res = cron_mktime(calendar);
+    res = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == res) {
         return 1;
     }
@@ -384,23 +829,24 @@ static int set_field(struct tm* calendar, int field, int val) {
  * Search the bits provided for the next set bit after the value provided,
  * and reset the calendar.
  */
-static int find_next(uint8_t* bits, int max, int value, struct tm* calendar, int field, int nextField, int* lower_orders, int* res_out) {
+static int find_next(const cron_search* search, const uint8_t* bits, int max, int value, struct tm* calendar, int field, int nextField, int* lower_orders, int* res_out) {
     int notfound = 0;
     int err = 0;
     int next_value = next_set_bit(bits, max, value, &notfound);
     /* roll over if needed */
     if (notfound) {
-        err = add_to_field(calendar, nextField, 1);
+        CRON_PROBE2(next__rollover, field, value);
+        err = add_to_field(search, calendar, nextField, 1);
         if (err) goto return_error;
-        err = reset_min(calendar, field);
+        err = reset_min(search, calendar, field);
         if (err) goto return_error;
         notfound = 0;
         next_value = next_set_bit(bits, max, 0, &notfound);
     }
     if (notfound || next_value != value) {
-        err = set_field(calendar, field, next_value);
+        err = set_field(search, calendar, field, next_value);
         if (err) goto return_error;
-        err = reset_all_min(calendar, lower_orders);
+        err = reset_all_min(search, calendar, lower_orders);
         if (err) goto return_error;
     }
     return next_value;
@@ -410,110 +856,143 @@ static int find_next(uint8_t* bits, int max, int value, struct tm* calendar, int
     return 0;
 }
 
-static int find_next_day(struct tm* calendar, uint8_t* days_of_month, int day_of_month, uint8_t* days_of_week, int day_of_week, int* resets, int* res_out) {
-    int err;
-    unsigned int count = 0;
-    unsigned int max = 366;
-    while ((!cron_get_bit(days_of_month, day_of_month) || !cron_get_bit(days_of_week, day_of_week)) && count++ < max) {
-        err = add_to_field(calendar, CRON_CF_DAY_OF_MONTH, 1);
+static int first_wday(const struct tm* calendar) {
+    return ((calendar->tm_wday - (calendar->tm_mday - 1)) % 7 + 7) % 7;
+}
 
+/**
+ * Moves the calendar to the next day matching the expression, month by month.
+ * Returns 1 if the calendar was moved, 0 if the current day matches, fails more than
+ * CRON_MAX_YEARS_DIFF years after the year the search started in ('dot').
+ */
+static int find_next_day(const cron_search* search, const cron_expr* expr, struct tm* calendar, int dot, int* resets, int* res_out) {
+    uint8_t days[4];
+    int moved = 0;
+    int notfound = 0;
+    int day = 0;
+    int err = 0;
+    for (;;) {
+        CRON_STATS_ADD(day_iterations, 1);
+        month_days(expr, calendar->tm_year, calendar->tm_mon, first_wday(calendar), days);
+        notfound = 0;
+        day = next_set_bit(days, CRON_MAX_DAYS_OF_MONTH, calendar->tm_mday, &notfound);
+        if (!notfound) break;
+        if (calendar->tm_year - dot > CRON_MAX_YEARS_DIFF) goto return_error;
+        CRON_PROBE2(next__rollover, CRON_CF_DAY_OF_MONTH, calendar->tm_mday);
+        calendar->tm_mday = 1;
+        err = add_to_field(search, calendar, CRON_CF_MONTH, 1);
+        if (err) goto return_error;
+        err = reset_all_min(search, calendar, resets);
+        if (err) goto return_error;
+        search_checkpoint(search, calendar);
+        moved = 1;
+    }
+    if (day != calendar->tm_mday) {
+        err = set_field(search, calendar, CRON_CF_DAY_OF_MONTH, day);
+        if (err) goto return_error;
+        err = reset_all_min(search, calendar, resets);
         if (err) goto return_error;
-        day_of_month = calendar->tm_mday;
-        day_of_week = calendar->tm_wday;
-        reset_all_min(calendar, resets);
+        moved = 1;
     }
-    return day_of_month;
+    return moved;
 
     return_error:
     *res_out = 1;
     return 0;
 }
 
-static int do_next(cron_expr* expr, struct tm* calendar, int dot) {
+static int do_next(const cron_search* search, const cron_expr* expr, struct tm* calendar, int dot) {
     int i;
     int res = 0;
     int resets[CRON_CF_ARR_LEN];
     int empty_list[CRON_CF_ARR_LEN];
     int second = 0;
-    int update_second = 0;
     int minute = 0;
     int update_minute = 0;
     int hour = 0;
     int update_hour = 0;
-    int day_of_week = 0;
-    int day_of_month = 0;
-    int update_day_of_month = 0;
+    int day_moved = 0;
     int month = 0;
     int update_month = 0;
 
+    CRON_STATS_ENTER();
+    search_checkpoint(search, calendar);
     for (i = 0; i < CRON_CF_ARR_LEN; i++) {
         resets[i] = -1;
         empty_list[i] = -1;
     }
 
     second = calendar->tm_sec;
-    update_second = find_next(expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
+    find_next(search, expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
     if (0 != res) goto return_result;
-    if (second == update_second) {
-        push_to_fields_arr(resets, CRON_CF_SECOND);
-    }
+    /* seconds are not searched again by a recursion, reset them when a higher field moves even if they did not match */
+    push_to_fields_arr(resets, CRON_CF_SECOND);
 
     minute = calendar->tm_min;
-    update_minute = find_next(expr->minutes, CRON_MAX_MINUTES, minute, calendar, CRON_CF_MINUTE, CRON_CF_HOUR_OF_DAY, resets, &res);
+    update_minute = find_next(search, expr->minutes, CRON_MAX_MINUTES, minute, calendar, CRON_CF_MINUTE, CRON_CF_HOUR_OF_DAY, resets, &res);
     if (0 != res) goto return_result;
     if (minute == update_minute) {
         push_to_fields_arr(resets, CRON_CF_MINUTE);
     } else {
-        res = do_next(expr, calendar, dot);
+        res = do_next(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
 
     hour = calendar->tm_hour;
-    update_hour = find_next(expr->hours, CRON_MAX_HOURS, hour, calendar, CRON_CF_HOUR_OF_DAY, CRON_CF_DAY_OF_WEEK, resets, &res);
+    update_hour = find_next(search, expr->hours, CRON_MAX_HOURS, hour, calendar, CRON_CF_HOUR_OF_DAY, CRON_CF_DAY_OF_WEEK, resets, &res);
     if (0 != res) goto return_result;
     if (hour == update_hour) {
         push_to_fields_arr(resets, CRON_CF_HOUR_OF_DAY);
     } else {
-        res = do_next(expr, calendar, dot);
+        res = do_next(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
 
-    day_of_week = calendar->tm_wday;
-    day_of_month = calendar->tm_mday;
-    update_day_of_month = find_next_day(calendar, expr->days_of_month, day_of_month, expr->days_of_week, day_of_week, resets, &res);
+    day_moved = find_next_day(search, expr, calendar, dot, resets, &res);
     if (0 != res) goto return_result;
-    if (day_of_month == update_day_of_month) {
+    if (!day_moved) {
         push_to_fields_arr(resets, CRON_CF_DAY_OF_MONTH);
     } else {
-        res = do_next(expr, calendar, dot);
+        res = do_next(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
 
     month = calendar->tm_mon; /*day already adds one if no day in same month is found*/
-    update_month = find_next(expr->months, CRON_MAX_MONTHS, month, calendar, CRON_CF_MONTH, CRON_CF_YEAR, resets, &res);
+    update_month = find_next(search, expr->months, CRON_MAX_MONTHS, month, calendar, CRON_CF_MONTH, CRON_CF_YEAR, resets, &res);
     if (0 != res) goto return_result;
     if (month != update_month) {
         if (calendar->tm_year - dot > 4) {
             res = -1;
             goto return_result;
         }
-        res = do_next(expr, calendar, dot);
+        res = do_next(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
     goto return_result;
 
     return_result:
+    CRON_STATS_LEAVE();
     return res;
 }
 
-static int to_upper(char* str) {
-    int i = 0;
-    if (!str) return 1;
-    for (i = 0; '\0' != str[i]; i++) {
-        int c = (int)str[i];
-        str[i] = (char) toupper(c);
+/**
+ * Parser.
+ * Fields are copied to a buffer on the stack, names are replaced in place
+ * and the items are parsed as slices of the buffer, so parsing does not
+ * allocate and does not depend on the C library beyond 'memcpy' and 'memset'.
+ */
+
+static int is_space(char c) {
+    return ' ' == c || '\t' == c || '\n' == c || '\v' == c || '\f' == c || '\r' == c;
+}
+
+static void to_upper(char* str, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (str[i] >= 'a' && str[i] <= 'z') {
+            str[i] = (char) (str[i] - 'a' + 'A');
+        }
     }
-    return 0;
 }
 
 static void strreverse(char* begin, char* end)
@@ -537,315 +1016,351 @@ size_t to_string(size_t value, char* str)
     return (size_t)(wstr - str);
 }
 
-static char* str_replace(char *orig, const char *rep, const char *with) {
-    char *result; /* the return string */
-    char *ins; /* the next insert point */
-    char *tmp; /* varies */
-    size_t len_rep; /* length of rep */
-    size_t len_with; /* length of with */
-    size_t len_front; /* distance between rep and end of last rep */
-    size_t count; /* number of replacements */
-    if (!orig) return NULL;
-    if (!rep) rep = "";
-    if (!with) with = "";
-    len_rep = strlen(rep);
-    len_with = strlen(with);
-
-    ins = orig;
-    for (count = 0; NULL != (tmp = strstr(ins, rep)); ++count) {
-        ins = tmp + len_rep;
-    }
-
-    /* first time through the loop, all the variable are set correctly
-     from here on,
-     tmp points to the end of the result string
-     ins points to the next occurrence of rep in orig
-     orig points to the remainder of orig after "end of rep"
-     */
-    tmp = result = (char*) cron_malloc(strlen(orig) + (len_with - len_rep) * count + 1);
-    if (!result) return NULL;
-
-    while (count--) {
-        ins = strstr(orig, rep);
-        len_front = (size_t)(ins - orig);
-        tmp = strncpy(tmp, orig, len_front) + len_front;
-        tmp = strcpy(tmp, with) + len_with;
-        orig += len_front + len_rep; /* move to next "end of rep" */
+static int name_at(const char* str, size_t len, const char* name) {
+    size_t i;
+    if (len < CRON_NAME_LEN) return 0;
+    for (i = 0; i < CRON_NAME_LEN; i++) {
+        if (str[i] != (char) CRON_FLASH_BYTE(name + i)) return 0;
     }
-    strcpy(tmp, orig);
-    return result;
+    return 1;
 }
 
-static int parse_uint(const char* str, int* errcode) {
-    char* endptr = NULL;
-    long int l;
-    errno = 0;
-    l = strtol(str, &endptr, 10);
-    if (errno == ERANGE || *endptr != '\0' || l < 0 || l > INT_MAX) {
-        *errcode = 1;
-        return 0;
-    } else {
-        *errcode = 0;
-        return (int) l;
+/**
+ * Replaces every name of the table with its index, one name after another.
+ * Indices are shorter than names, so the value is rewritten in place.
+ *
+ * @param value field to rewrite
+ * @param len length of the field
+ * @param names table of CRON_NAME_LEN characters long names
+ * @param names_len number of names in the table
+ * @return length of the rewritten field
+ */
+static size_t replace_ordinals(char* value, size_t len, const char* names, size_t names_len) {
+    size_t i;
+    char strnum[CRON_SIZE_STRING_MAX_LEN + 1];
+
+    for (i = 0; i < names_len; i++) {
+        size_t num_len = to_string(i, strnum);
+        size_t from = 0;
+        size_t to = 0;
+        while (from < len) {
+            if (name_at(value + from, len - from, names + i * CRON_NAME_LEN)) {
+                memcpy(value + to, strnum, num_len);
+                to += num_len;
+                from += CRON_NAME_LEN;
+            } else {
+                value[to++] = value[from++];
+            }
+        }
+        len = to;
     }
+    return len;
 }
 
-static char** split_str(const char* str, char del, size_t* len_out) {
+/* accepts what 'strtol' accepts for a non-negative 'int' in the C locale: an optional sign and decimal digits */
+static int parse_uint(const char* str, size_t len, int* errcode) {
     size_t i = 0;
-    size_t stlen = 0;
-    size_t len = 0;
-    int accum = 0;
-    char* buf = NULL;
-    char** res = NULL;
-    size_t bi = 0;
-    size_t ri = 0;
-    char* tmp = NULL;
+    int negative = 0;
+    int res = 0;
+    *errcode = 1;
+    if (len > 0 && ('+' == str[0] || '-' == str[0])) {
+        negative = '-' == str[0];
+        i = 1;
+        if (1 == len) return 0;
+    }
+    for (; i < len; i++) {
+        int digit = str[i] - '0';
+        if (digit < 0 || digit > 9) return 0;
+        if (res > (INT_MAX - digit) / 10) return 0;
+        res = res * 10 + digit;
+    }
+    if (negative && 0 != res) return 0;
+    *errcode = 0;
+    return res;
+}
 
-    if (!str) goto return_error;
-    for (i = 0; '\0' != str[i]; i++) {
-        stlen += 1;
-        if (stlen >= CRON_MAX_STR_LEN_TO_SPLIT) goto return_error;
+static int has_char(const char* str, size_t len, char ch) {
+    size_t i = 0;
+    for (i = 0; i < len; i++) {
+        if (str[i] == ch) return 1;
     }
+    return 0;
+}
 
-    for (i = 0; i < stlen; i++) {
-        int c = (unsigned char)str[i];
-        if (del == str[i]) {
-            if (accum > 0) {
-                len += 1;
-                accum = 0;
-            }
-        } else if (!isspace(c)) {
-            accum += 1;
-        }
+static int has_any_char(const char* str, size_t len, const char* chars) {
+    for (; '\0' != *chars; chars++) {
+        if (has_char(str, len, *chars)) return 1;
     }
-    /* tail */
-    if (accum > 0) {
-        len += 1;
-    }
-    if (0 == len) return NULL;
-
-    buf = (char*) cron_malloc(stlen + 1);
-    if (!buf) goto return_error;
-    memset(buf, 0, stlen + 1);
-    res = (char**) cron_malloc(len * sizeof(char*));
-    if (!res) goto return_error;
-    memset(res, 0, len * sizeof(char*));
-
-    for (i = 0; i < stlen; i++) {
-        int c = (unsigned char)str[i];
-        if (del == str[i]) {
-            if (bi > 0) {
-                if (ri >= len)  goto return_error;
-                tmp = strdupl(buf, bi);
-                if (!tmp) goto return_error;
-                res[ri++] = tmp;
-                memset(buf, 0, stlen + 1);
-                bi = 0;
-            }
-        } else if (!isspace(c)) {
-            buf[bi++] = str[i];
-        }
+    return 0;
+}
+
+/**
+ * Finds the next non-empty item of a separated slice.
+ *
+ * @param str slice to split
+ * @param len length of the slice
+ * @param del separator
+ * @param pos position to search from, moved past the item found
+ * @param item set to the start of the item found
+ * @return length of the item, 0 when there are no more items
+ */
+static size_t next_item(const char* str, size_t len, char del, size_t* pos, const char** item) {
+    size_t start;
+    while (*pos < len && del == str[*pos]) {
+        *pos += 1;
     }
-    /* tail */
-    if (bi > 0) {
-        if (ri >= len)  goto return_error;
-        tmp = strdupl(buf, bi);
-        if (!tmp) goto return_error;
-        res[ri++] = tmp;
+    start = *pos;
+    while (*pos < len && del != str[*pos]) {
+        *pos += 1;
     }
-    cron_free(buf);
-    *len_out = len;
-    return res;
+    *item = str + start;
+    return *pos - start;
+}
 
-    return_error:
-    if (buf) {
-        cron_free(buf);
+static size_t count_items(const char* str, size_t len, char del) {
+    size_t pos = 0;
+    size_t count = 0;
+    const char* item = NULL;
+    while (0 != next_item(str, len, del, &pos, &item)) {
+        count += 1;
     }
-    free_splitted(res, len);
-    *len_out = 0;
-    return NULL;
+    return count;
 }
 
-static char* replace_ordinals(char* value, const char* const * arr, size_t arr_len) {
+/**
+ * Copies the space separated fields of the expression to the buffer skipping
+ * other whitespace characters.
+ *
+ * @param expression expression to split
+ * @param buf buffer of CRON_MAX_STR_LEN_TO_SPLIT characters
+ * @param fields set to the starts of the first CRON_FIELDS_LEN fields
+ * @param lens set to the lengths of the first CRON_FIELDS_LEN fields
+ * @return number of fields, 0 for an expression too long to split
+ */
+static size_t split_fields(const char* expression, char* buf, char** fields, size_t* lens) {
     size_t i;
-    char* cur = value;
-    char* res = NULL;
-    int first = 1;
-    char strnum[CRON_SIZE_STRING_MAX_LEN + 1];
-
-    for (i = 0; i < arr_len; i++) {
-        to_string(i, strnum);
-
-        res = str_replace(cur, arr[i], strnum);
-        if (!first) {
-            cron_free(cur);
-        }
-        if (!res) {
-            return NULL;
-        }
-        cur = res;
-        if (first) {
-            first = 0;
+    size_t bi = 0;
+    size_t count = 0;
+    int in_field = 0;
+
+    for (i = 0; '\0' != expression[i]; i++) {
+        if (i + 1 >= CRON_MAX_STR_LEN_TO_SPLIT) return 0;
+    }
+    for (i = 0; '\0' != expression[i]; i++) {
+        char c = expression[i];
+        if (' ' == c) {
+            in_field = 0;
+        } else if (!is_space(c)) {
+            if (!in_field) {
+                in_field = 1;
+                count += 1;
+                if (count <= CRON_FIELDS_LEN) {
+                    fields[count - 1] = buf + bi;
+                    lens[count - 1] = 0;
+                }
+            }
+            if (count <= CRON_FIELDS_LEN) {
+                buf[bi++] = c;
+                lens[count - 1] += 1;
+            }
         }
     }
-    return res;
-}
-
-static int has_char(const char* str, char ch) {
-    size_t i = 0;
-    if (!str) return 0;
-    for (i = 0; str[i] != '\0'; i++) {
-        if (str[i] == ch) return 1;
-    }
-    return 0;
+    return count;
 }
 
-static void get_range(const char* field, int min, int max, int* res, const char** error) {
-    char** parts = NULL;
-    size_t len = 0;
+static void get_range(const char* field, size_t len, int min, int max, int* res, const char** error) {
+    const char* part = NULL;
+    size_t part_len = 0;
+    size_t pos = 0;
     int err = 0;
     int val;
-    if (!res) {
-        *error = "NULL";
-        goto return_error;
-    }
 
     res[0] = 0;
     res[1] = 0;
-    if (1 == strlen(field) && '*' == field[0]) {
+    if (1 == len && '*' == field[0]) {
         res[0] = min;
         res[1] = max - 1;
-    } else if (!has_char(field, '-')) {
+    } else if (!has_char(field, len, '-')) {
         err = 0;
-        val = parse_uint(field, &err);
+        val = parse_uint(field, len, &err);
         if (err) {
             *error = "Unsigned integer parse error 1";
-            goto return_error;
+            return;
         }
 
         res[0] = val;
         res[1] = val;
     } else {
-        parts = split_str(field, '-', &len);
-        if (2 != len) {
+        if (2 != count_items(field, len, '-')) {
             *error = "Specified range requires two fields";
-            goto return_error;
+            return;
         }
         err = 0;
-        res[0] = parse_uint(parts[0], &err);
+        part_len = next_item(field, len, '-', &pos, &part);
+        res[0] = parse_uint(part, part_len, &err);
         if (err) {
             *error = "Unsigned integer parse error 2";
-            goto return_error;
+            return;
         }
-        res[1] = parse_uint(parts[1], &err);
+        part_len = next_item(field, len, '-', &pos, &part);
+        res[1] = parse_uint(part, part_len, &err);
         if (err) {
             *error = "Unsigned integer parse error 3";
-            goto return_error;
+            return;
         }
     }
     if (res[0] >= max || res[1] >= max) {
         *error = "Specified range exceeds maximum";
-        goto return_error;
+        return;
     }
     if (res[0] < min || res[1] < min) {
         *error = "Specified range is less than minimum";
-        goto return_error;
+        return;
     }
     if (res[0] > res[1]) {
         *error = "Specified range start exceeds range end";
-        goto return_error;
+        return;
     }
 
-    free_splitted(parts, len);
     *error = NULL;
-    return;
+}
 
-    return_error:
-    free_splitted(parts, len);
+/* Mixes the expression seed with the field index, so that fields of one expression are hashed independently */
+static uint32_t hash_field(uint32_t seed, int field) {
+    uint32_t h = seed ^ ((uint32_t) (field + 1) * 0x9e3779b9U);
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
 }
 
-static void set_number_hits(const char* value, uint8_t* target, int min, int max, const char** error) {
-    size_t i = 0;
-    int i1 = 0;
-    size_t len = 0;
+/**
+ * Sets hits for 'H', 'H(a-b)', 'H/n' and 'H(a-b)/n' items: a single value or the
+ * start of an incrementer is picked from the range by the field hash.
+ */
+static void set_hashed_hits(const char* value, size_t len, uint8_t* target, int min, int max, uint32_t hash, const char** error) {
+    const char* end = value + len;
+    const char* cur = value + 1;
+    const char* close = NULL;
     int range[2];
     int err = 0;
-    int delta;
+    int step = 0;
+    int i;
 
-    char** fields = split_str(value, ',', &len);
-    if (!fields) {
-        *error = "Comma split error";
-        goto return_result;
+    /* default ranges avoid days missing in some months and the duplicate Sunday */
+    range[0] = min;
+    range[1] = CRON_MAX_DAYS_OF_MONTH == max ? 28 : CRON_DAYS_ARR_LEN + 1 == max ? CRON_DAYS_ARR_LEN - 1 : max - 1;
+    if (cur < end && '(' == *cur) {
+        for (close = cur; close < end && ')' != *close; close++) {
+        }
+        if (close == end) {
+            *error = "Unterminated hash range";
+            return;
+        }
+        get_range(cur + 1, (size_t) (close - cur - 1), min, max, range, error);
+        if (*error) return;
+        cur = close + 1;
+    }
+    if (cur < end && '/' == *cur) {
+        step = parse_uint(cur + 1, (size_t) (end - cur - 1), &err);
+        if (err || 0 == step) {
+            *error = "Invalid hash incrementer";
+            return;
+        }
+    } else if (cur < end) {
+        *error = "Invalid hash format";
+        return;
     }
 
-    for (i = 0; i < len; i++) {
-        if (!has_char(fields[i], '/')) {
-            /* Not an incrementer so it must be a range (possibly empty) */
-
-            get_range(fields[i], min, max, range, error);
-
-            if (*error) {
-                goto return_result;
-            }
+    if (0 == step) {
+        cron_set_bit(target, range[0] + (int) (hash % (uint32_t) (range[1] - range[0] + 1)));
+        return;
+    }
+    if (step > range[1] - range[0] + 1) {
+        step = range[1] - range[0] + 1;
+    }
+    for (i = range[0] + (int) (hash % (uint32_t) step); i <= range[1]; i += step) {
+        cron_set_bit(target, i);
+    }
+}
+
+static void set_number_hits(const char* value, size_t len, uint8_t* target, int min, int max, uint32_t hash, const char** error) {
+    size_t pos = 0;
+    const char* item = NULL;
+    size_t item_len = 0;
+    int i1 = 0;
+    int range[2];
+    int err = 0;
+    int delta;
+
+    if (0 == count_items(value, len, ',')) {
+        *error = "Comma split error";
+        return;
+    }
+
+    while (0 != (item_len = next_item(value, len, ',', &pos, &item))) {
+        if ('H' == item[0] || 'h' == item[0]) {
+            set_hashed_hits(item, item_len, target, min, max, hash, error);
+            if (*error) {
+                return;
+            }
+        } else if (!has_char(item, item_len, '/')) {
+            /* Not an incrementer so it must be a range (possibly empty) */
+
+            get_range(item, item_len, min, max, range, error);
+
+            if (*error) {
+                return;
+            }
 
             for (i1 = range[0]; i1 <= range[1]; i1++) {
                 cron_set_bit(target, i1);
 
             }
         } else {
-            size_t len2 = 0;
-            char** split = split_str(fields[i], '/', &len2);
-            if (2 != len2) {
+            size_t split_pos = 0;
+            const char* part = NULL;
+            size_t part_len = 0;
+            if (2 != count_items(item, item_len, '/')) {
                 *error = "Incrementer must have two fields";
-                free_splitted(split, len2);
-                goto return_result;
+                return;
             }
-            get_range(split[0], min, max, range, error);
+            part_len = next_item(item, item_len, '/', &split_pos, &part);
+            get_range(part, part_len, min, max, range, error);
             if (*error) {
-                free_splitted(split, len2);
-                goto return_result;
+                return;
             }
-            if (!has_char(split[0], '-')) {
+            if (!has_char(part, part_len, '-')) {
                 range[1] = max - 1;
             }
-            delta = parse_uint(split[1], &err);
+            part_len = next_item(item, item_len, '/', &split_pos, &part);
+            delta = parse_uint(part, part_len, &err);
             if (err) {
                 *error = "Unsigned integer parse error 4";
-                free_splitted(split, len2);
-                goto return_result;
+                return;
             }
             if (0 == delta) {
                 *error = "Incrementer may not be zero";
-                free_splitted(split, len2);
-                goto return_result;
+                return;
             }
             for (i1 = range[0]; i1 <= range[1]; i1 += delta) {
                 cron_set_bit(target, i1);
+                /* a large incrementer would overflow the index */
+                if (delta > range[1] - i1) break;
             }
-            free_splitted(split, len2);
         }
     }
-    goto return_result;
-
-    return_result:
-    free_splitted(fields, len);
-
 }
 
-static void set_months(char* value, uint8_t* targ, const char** error) {
+static void set_months(char* value, size_t len, uint8_t* targ, uint32_t hash, const char** error) {
     int i;
     int max = 12;
 
-    char* replaced = NULL;
-
-    to_upper(value);
-    replaced = replace_ordinals(value, MONTHS_ARR, CRON_MONTHS_ARR_LEN);
-    if (!replaced) {
-        *error = "Invalid month format";
-        return;
-    }
-    set_number_hits(replaced, targ, 1, max + 1, error);
-    cron_free(replaced);
+    to_upper(value, len);
+    len = replace_ordinals(value, len, MONTHS_ARR, CRON_MONTHS_ARR_LEN);
+    set_number_hits(value, len, targ, 1, max + 1, hash, error);
 
     /* ... and then rotate it to the front of the months */
     for (i = 1; i <= max; i++) {
@@ -856,79 +1371,187 @@ static void set_months(char* value, uint8_t* targ, const char** error) {
     }
 }
 
-static void set_days_of_week(char* field, uint8_t* targ, const char** error) {
-    const int max = 7;
-    char* replaced = NULL;
+static int parse_day_number(const char* str, size_t len, int min, int max, int* errcode) {
+    int res = 0;
+    *errcode = 1;
+    if (0 == len) {
+        return 0;
+    }
+    res = parse_uint(str, len, errcode);
+    if (res < min || res > max) {
+        *errcode = 1;
+    }
+    return res;
+}
 
-    if (1 == strlen(field) && '?' == field[0]) {
-        field[0] = '*';
+/* Parses 'dL' and 'd#n' items of the days of week field, digits are already substituted for names */
+static void set_day_of_week_modifier(const char* item, size_t len, cron_expr* target, const char** error) {
+    size_t hash = 0;
+    int err = 0;
+    int day = 0;
+    int nth = 0;
+    if (1 == len && 'L' == item[0]) {
+        /* last day of week */
+        cron_set_bit(target->days_of_week, 6);
+        return;
+    }
+    while (hash < len && '#' != item[hash]) {
+        hash++;
+    }
+    if (hash < len) {
+        day = parse_day_number(item, hash, 0, 7, &err);
+        if (!err) nth = parse_day_number(item + hash + 1, len - hash - 1, 1, 5, &err);
+        if (err) {
+            *error = "Invalid nth day of week";
+            return;
+        }
+        cron_set_bit(&target->days_of_week_nth[nth - 1], day % 7);
+    } else if (len > 1 && 'L' == item[len - 1]) {
+        day = parse_day_number(item, len - 1, 0, 7, &err);
+        if (err) {
+            *error = "Invalid last day of week";
+            return;
+        }
+        cron_set_bit(target->days_of_week_last, day % 7);
+    } else {
+        *error = "Invalid day of week modifier";
+    }
+}
+
+/* Parses 'L', 'L-n', 'LW' and 'nW' items of the days of month field */
+static void set_day_of_month_modifier(const char* item, size_t len, cron_expr* target, const char** error) {
+    int err = 0;
+    int day = 0;
+    if (1 == len && 'L' == item[0]) {
+        cron_set_bit(target->days_of_month_last, 0);
+    } else if (2 == len && 'L' == item[0] && 'W' == item[1]) {
+        cron_set_bit(target->days_of_month_weekday, 0);
+    } else if (len > 2 && 'L' == item[0] && '-' == item[1]) {
+        day = parse_day_number(item + 2, len - 2, 0, CRON_MAX_DAYS_OF_MONTH - 2, &err);
+        if (err) {
+            *error = "Invalid offset from the last day of month";
+            return;
+        }
+        cron_set_bit(target->days_of_month_last, day);
+    } else if (len > 1 && 'W' == item[len - 1]) {
+        day = parse_day_number(item, len - 1, 1, CRON_MAX_DAYS_OF_MONTH - 1, &err);
+        if (err) {
+            *error = "Invalid nearest weekday";
+            return;
+        }
+        cron_set_bit(target->days_of_month_weekday, day);
+    } else {
+        *error = "Invalid day of month modifier";
+    }
+}
+
+/**
+ * Sets the items of a comma separated field that contain one of the modifier
+ * characters with the specified function, plain items are set as number hits.
+ */
+static void set_modified_hits(const char* field, size_t len, const char* modifiers, uint8_t* targ, int min, int max, uint32_t hash,
+        cron_expr* target, void (*set_modifier)(const char*, size_t, cron_expr*, const char**), const char** error) {
+    size_t pos = 0;
+    const char* item = NULL;
+    size_t item_len = 0;
+    if (!has_any_char(field, len, modifiers)) {
+        set_number_hits(field, len, targ, min, max, hash, error);
+        return;
     }
-    to_upper(field);
-    replaced = replace_ordinals(field, DAYS_ARR, CRON_DAYS_ARR_LEN);
-    if (!replaced) {
-        *error = "Invalid day format";
+    if (0 == count_items(field, len, ',')) {
+        *error = "Comma split error";
         return;
     }
-    set_number_hits(replaced, targ, 0, max + 1, error);
-    cron_free(replaced);
-    if (cron_get_bit(targ, 7)) {
+    while (!*error && 0 != (item_len = next_item(field, len, ',', &pos, &item))) {
+        if (has_any_char(item, item_len, modifiers)) {
+            set_modifier(item, item_len, target, error);
+        } else {
+            set_number_hits(item, item_len, targ, min, max, hash, error);
+        }
+    }
+}
+
+static void set_days_of_week(char* field, size_t len, cron_expr* target, uint32_t hash, const char** error) {
+    const int max = 7;
+
+    if (1 == len && '?' == field[0]) {
+        field[0] = '*';
+    }
+    to_upper(field, len);
+    len = replace_ordinals(field, len, DAYS_ARR, CRON_DAYS_ARR_LEN);
+    set_modified_hits(field, len, "L#", target->days_of_week, 0, max + 1, hash, target, set_day_of_week_modifier, error);
+    if (cron_get_bit(target->days_of_week, 7)) {
         /* Sunday can be represented as 0 or 7*/
-        cron_set_bit(targ, 0);
-        cron_del_bit(targ, 7);
+        cron_set_bit(target->days_of_week, 0);
+        cron_del_bit(target->days_of_week, 7);
     }
 }
 
-static void set_days_of_month(char* field, uint8_t* targ, const char** error) {
+static void set_days_of_month(char* field, size_t len, cron_expr* target, uint32_t hash, const char** error) {
     /* Days of month start with 1 (in Cron and Calendar) so add one */
-    if (1 == strlen(field) && '?' == field[0]) {
+    if (1 == len && '?' == field[0]) {
         field[0] = '*';
     }
-    set_number_hits(field, targ, 1, CRON_MAX_DAYS_OF_MONTH, error);
+    to_upper(field, len);
+    set_modified_hits(field, len, "LW", target->days_of_month, 1, CRON_MAX_DAYS_OF_MONTH, hash, target, set_day_of_month_modifier,
+            error);
 }
 
-void cron_parse_expr(const char* expression, cron_expr* target, const char** error) {
+static void parse_expr(const char* expression, cron_expr* target, uint32_t seed, const char** error) {
     const char* err_local;
-    size_t len = 0;
-    char** fields = NULL;
+    char buf[CRON_MAX_STR_LEN_TO_SPLIT];
+    char* fields[CRON_FIELDS_LEN];
+    size_t lens[CRON_FIELDS_LEN];
     if (!error) {
         error = &err_local;
     }
     *error = NULL;
     if (!expression) {
         *error = "Invalid NULL expression";
-        goto return_res;
+        return;
     }
     if (!target) {
         *error = "Invalid NULL target";
-        goto return_res;
+        return;
     }
 
-    fields = split_str(expression, ' ', &len);
-    if (len != 6) {
+    if (CRON_FIELDS_LEN != split_fields(expression, buf, fields, lens)) {
         *error = "Invalid number of fields, expression must consist of 6 fields";
-        goto return_res;
+        return;
     }
     memset(target, 0, sizeof(*target));
-    set_number_hits(fields[0], target->seconds, 0, 60, error);
-    if (*error) goto return_res;
-    set_number_hits(fields[1], target->minutes, 0, 60, error);
-    if (*error) goto return_res;
-    set_number_hits(fields[2], target->hours, 0, 24, error);
-    if (*error) goto return_res;
-    set_days_of_month(fields[3], target->days_of_month, error);
-    if (*error) goto return_res;
-    set_months(fields[4], target->months, error);
-    if (*error) goto return_res;
-    set_days_of_week(fields[5], target->days_of_week, error);
-    if (*error) goto return_res;
-
-    goto return_res;
+    set_number_hits(fields[0], lens[0], target->seconds, 0, 60, hash_field(seed, CRON_CF_SECOND), error);
+    if (*error) return;
+    set_number_hits(fields[1], lens[1], target->minutes, 0, 60, hash_field(seed, CRON_CF_MINUTE), error);
+    if (*error) return;
+    set_number_hits(fields[2], lens[2], target->hours, 0, 24, hash_field(seed, CRON_CF_HOUR_OF_DAY), error);
+    if (*error) return;
+    set_days_of_month(fields[3], lens[3], target, hash_field(seed, CRON_CF_DAY_OF_MONTH), error);
+    if (*error) return;
+    set_months(fields[4], lens[4], target->months, hash_field(seed, CRON_CF_MONTH), error);
+    if (*error) return;
+    set_days_of_week(fields[5], lens[5], target, hash_field(seed, CRON_CF_DAY_OF_WEEK), error);
+}
 
-    return_res:
-    free_splitted(fields, len);
+void cron_parse_expr_seeded(const char* expression, cron_expr* target, uint32_t seed, const char** error) {
+#ifdef CRON_USE_STATS
+    uint64_t start = stats_now();
+    uint64_t allocations = stats_allocations();
+#endif /* CRON_USE_STATS */
+    CRON_PROBE1(parse__entry, expression);
+    parse_expr(expression, target, seed, error);
+    CRON_PROBE2(parse__return, expression, error ? *error : NULL);
+#ifdef CRON_USE_STATS
+    CRON_STATS_ADD(parse_allocations, stats_allocations() - allocations);
+    stats_latency(CRON_STATS_PARSE, start);
+#endif /* CRON_USE_STATS */
 }
 
-time_t cron_next(cron_expr* expr, time_t date) {
+void cron_parse_expr(const char* expression, cron_expr* target, const char** error) {
+    cron_parse_expr_seeded(expression, target, 0, error);
+}
+
+static time_t search_next(const cron_search* search, const cron_expr* expr, time_t date) {
     /*
      The plan:
 
@@ -953,33 +1576,227 @@ time_t cron_next(cron_expr* expr, time_t date) {
     int res;
     time_t calculated;
 
-    if (!expr) return CRON_INVALID_INSTANT;
+    if (!expr || has_empty_field(expr)) return CRON_INVALID_INSTANT;
     memset(&calval, 0, sizeof(struct tm));
-    calendar = cron_time(&date, &calval);
+    calendar = search->to_calendar(&date, &calval);
     if (!calendar) return CRON_INVALID_INSTANT;
-    original = cron_mktime(calendar);
+    original = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == original) return CRON_INVALID_INSTANT;
 
-    res = do_next(expr, calendar, calendar->tm_year);
+    res = do_next(search, expr, calendar, calendar->tm_year);
     if (0 != res) return CRON_INVALID_INSTANT;
 
-    calculated = cron_mktime(calendar);
+    calculated = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == calculated) return CRON_INVALID_INSTANT;
     if (calculated == original) {
         /* We arrived at the original timestamp - round up to the next whole second and try again... */
-        res = add_to_field(calendar, CRON_CF_SECOND, 1);
+        res = add_to_field(search, calendar, CRON_CF_SECOND, 1);
         if (0 != res) return CRON_INVALID_INSTANT;
-        res = do_next(expr, calendar, calendar->tm_year);
+        res = do_next(search, expr, calendar, calendar->tm_year);
         if (0 != res) return CRON_INVALID_INSTANT;
     }
 
-    return cron_mktime(calendar);
+    return search_normalize(search, calendar);
+}
+
+static time_t next_fire(const cron_expr* expr, time_t date) {
+    return search_next(&SEARCH_DEFAULT, expr, date);
+}
+
+time_t cron_next(const cron_expr* expr, time_t date) {
+    time_t res;
+    CRON_STATS_START(start);
+    CRON_PROBE2(next__entry, expr, date);
+    res = next_fire(expr, date);
+    CRON_PROBE3(next__return, expr, date, res);
+    CRON_TRACE('N', expr, date, res);
+    CRON_STATS_LATENCY(CRON_STATS_NEXT, start);
+    return res;
+}
+
+/**
+ * Budgeted search.
+ *
+ * The search is split at checkpoints: calendar states no later than the result,
+ * with no match between the start date and them (every recursion of 'do_next'
+ * and every month skipped by 'find_next_day'). When the budget runs out the search
+ * is aborted and the next step restarts 'do_next' from the last checkpoint, which
+ * finds the same earliest match. The most work between two checkpoints is a pass
+ * of 'do_next' up to its recursion: 3 normalizations for seconds, 4 for minutes,
+ * 5 for hours and 7 for months, plus the 2 normalizations around the round up
+ * to the next second, within CRON_STEP_MIN_BUDGET.
+ */
+
+#define CRON_STEP_PHASE_START 0
+#define CRON_STEP_PHASE_SEARCH 1
+#define CRON_STEP_PHASE_ROUNDED 2
+#define CRON_STEP_PHASE_DONE 3
+
+void cron_next_init(cron_next_state* state, const cron_expr* expr, time_t date) {
+    if (!state) return;
+    memset(state, 0, sizeof(cron_next_state));
+    state->expr = expr;
+    state->date = date;
+    state->original = CRON_INVALID_INSTANT;
+    state->result = CRON_INVALID_INSTANT;
+    state->phase = CRON_STEP_PHASE_START;
+}
+
+int cron_next_step(cron_next_state* state, unsigned long budget) {
+    cron_budget limit;
+    cron_search search;
+    struct tm calendar;
+    time_t calculated;
+    int res = 0;
+
+    if (!state) return CRON_STEP_DONE;
+    memset(&limit, 0, sizeof(cron_budget));
+    limit.remaining = budget < CRON_STEP_MIN_BUDGET ? CRON_STEP_MIN_BUDGET : budget;
+    search = SEARCH_DEFAULT;
+    search.budget = &limit;
+
+    while (CRON_STEP_PHASE_DONE != state->phase) {
+        if (CRON_STEP_PHASE_START == state->phase) {
+            memset(&calendar, 0, sizeof(struct tm));
+            if (!state->expr || has_empty_field(state->expr) || !search.to_calendar(&state->date, &calendar)) goto return_error;
+            state->original = search_normalize(&search, &calendar);
+            if (CRON_INVALID_INSTANT == state->original) goto return_aborted;
+            state->calendar = calendar;
+            state->year = calendar.tm_year;
+            state->phase = CRON_STEP_PHASE_SEARCH;
+            continue;
+        }
+        calendar = state->calendar;
+        res = do_next(&search, state->expr, &calendar, state->year);
+        if (0 != res) {
+            if (limit.exhausted) state->calendar = limit.checkpoint;
+            goto return_aborted;
+        }
+        /* a matching calendar is searched again without normalizations */
+        state->calendar = calendar;
+        calculated = search_normalize(&search, &calendar);
+        if (CRON_INVALID_INSTANT == calculated) goto return_aborted;
+        if (CRON_STEP_PHASE_SEARCH == state->phase && calculated == state->original) {
+            /* We arrived at the original timestamp - round up to the next whole second and try again... */
+            res = add_to_field(&search, &calendar, CRON_CF_SECOND, 1);
+            if (0 != res) goto return_aborted;
+            state->calendar = calendar;
+            state->year = calendar.tm_year;
+            state->phase = CRON_STEP_PHASE_ROUNDED;
+            continue;
+        }
+        state->result = calculated;
+        state->phase = CRON_STEP_PHASE_DONE;
+    }
+    goto return_result;
+
+    return_aborted:
+    if (limit.exhausted) {
+        state->spent += limit.spent;
+        return CRON_STEP_PENDING;
+    }
+    goto return_error;
+
+    return_error:
+    state->result = CRON_INVALID_INSTANT;
+    state->phase = CRON_STEP_PHASE_DONE;
+    goto return_result;
+
+    return_result:
+    state->spent += limit.spent;
+    return CRON_STEP_DONE;
+}
+
+/* Most normalizations of a 'find_next' call, none if every value matches */
+static unsigned long find_next_cost(const uint8_t* bits, int max, unsigned long lower_orders) {
+    int i;
+    for (i = 0; i < max; i++) {
+        if (!cron_get_bit(bits, i)) {
+            /* roll over (add to the next field, reset this one), set, reset lower fields */
+            return (cron_get_bit(bits, max - 1) ? 1UL : 3UL) + lower_orders;
+        }
+    }
+    return 0;
+}
+
+/* Longest span of months from a search start to the month of the next match */
+static unsigned long month_span(const cron_expr* expr, int* every_day) {
+    uint8_t days[4];
+    unsigned long run = 0;
+    unsigned long span = 0;
+    int64_t first_day;
+    int year;
+    int month;
+    int i;
+
+    *every_day = 1;
+    /* the days of week repeat every 400 years of the Gregorian calendar, the extra
+       years cover the runs going over the end of the cycle */
+    for (year = 2000; year < 2400 + CRON_MAX_YEARS_DIFF + 1; year++) {
+        for (month = 0; month < CRON_MAX_MONTHS; month++) {
+            /* 1970-01-01 was a Thursday */
+            first_day = days_from_civil(year, month + 1, 1) + 4;
+            month_days(expr, year - 1900, month, (int) (first_day - floor_div(first_day, 7) * 7), days);
+            for (i = 1; i <= days_in_month(month, year - 1900); i++) {
+                if (!cron_get_bit(days, i)) *every_day = 0;
+            }
+            if (cron_get_bit(expr->months, month) && (days[0] | days[1] | days[2] | days[3])) {
+                run = 0;
+            } else {
+                run++;
+            }
+            if (run > span) span = run;
+        }
+    }
+    /* searches give up after the years limit */
+    if (span > 12 * (CRON_MAX_YEARS_DIFF + 1)) span = 12 * (CRON_MAX_YEARS_DIFF + 1);
+    return span + 1;
+}
+
+unsigned long cron_next_cost_bound(const cron_expr* expr) {
+    unsigned long months;
+    unsigned long per_call;
+    unsigned long calls;
+    unsigned long moving = 0;
+    unsigned long runs = 0;
+    unsigned long cost;
+    int every_day = 1;
+    int i;
+
+    if (!expr) return 0;
+    months = month_span(expr, &every_day);
+    per_call = find_next_cost(expr->seconds, CRON_MAX_SECONDS, 0);
+    cost = find_next_cost(expr->minutes, CRON_MAX_MINUTES, 1);
+    if (cost > 0) moving++;
+    per_call += cost;
+    cost = find_next_cost(expr->hours, CRON_MAX_HOURS, 2);
+    if (cost > 0) moving++;
+    per_call += cost;
+    cost = find_next_cost(expr->months, CRON_MAX_MONTHS, 4);
+    if (cost > 0) moving++;
+    per_call += cost;
+    if (!every_day) {
+        /* set the day, reset lower fields */
+        moving++;
+        per_call += 4;
+    }
+    /* the months field moves at most once per run of matching months in a year,
+       every move can be followed by one move of each lower field, each move starts a recursion */
+    for (i = 0; i < CRON_MAX_MONTHS; i++) {
+        if (cron_get_bit(expr->months, i) && !cron_get_bit(expr->months, (i + CRON_MAX_MONTHS - 1) % CRON_MAX_MONTHS)) {
+            runs++;
+        }
+    }
+    calls = (1 + moving) * (runs * (months / 12 + 1) + 2);
+    /* initial and final normalizations, round up to the next second,
+       months skipped by the days search: next month, reset lower fields */
+    return 4 + calls * per_call + (every_day ? 0 : 4 * months);
 }
 
 
 /* https://github.com/staticlibs/ccronexpr/pull/8 */
 
-static int prev_set_bit(uint8_t* bits, int from_index, int to_index, int* notfound) {
+static int prev_set_bit(const uint8_t* bits, int from_index, int to_index, int* notfound) {
     int i;
     if (!bits) {
         *notfound = 1;
@@ -992,24 +1809,10 @@ static int prev_set_bit(uint8_t* bits, int from_index, int to_index, int* notfou
     return 0;
 }
 
-static int last_day_of_month(int month, int year) {
-    struct tm cal;
-    time_t t;
-    memset(&cal,0,sizeof(cal));
-    cal.tm_sec=0;
-    cal.tm_min=0;
-    cal.tm_hour=0;
-    cal.tm_mon = month+1;
-    cal.tm_mday = 0;
-    cal.tm_year=year;
-    t=mktime(&cal);
-    return gmtime(&t)->tm_mday;
-}
-
 /**
  * Reset the calendar setting all the fields provided to zero.
  */
-static int reset_max(struct tm* calendar, int field) {
+static int reset_max(const cron_search* search, struct tm* calendar, int field) {
     time_t res = 0;
     if (!calendar || -1 == field) {
         return 1;
@@ -1028,26 +1831,28 @@ static int reset_max(struct tm* calendar, int field) {
         calendar->tm_wday = 6;
         break;
     case CRON_CF_DAY_OF_MONTH:
-        calendar->tm_mday = last_day_of_month(calendar->tm_mon, calendar->tm_year);
+        calendar->tm_mday = days_in_month(calendar->tm_mon, calendar->tm_year);
         break;
     case CRON_CF_MONTH:
         calendar->tm_mon = 11;
         break;
     case CRON_CF_YEAR:
         /* I don't think this is supposed to happen ... */
+#ifndef CRON_FREESTANDING
         fprintf(stderr, "reset CRON_CF_YEAR\n");
+#endif /* CRON_FREESTANDING */
         break;
     default:
         return 1; /* unknown field */
     }
-    res = cron_mktime(calendar);
+    res = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == res) {
         return 1;
     }
     return 0;
 }
 
-static int reset_all_max(struct tm* calendar, int* fields) {
+static int reset_all_max(const cron_search* search, struct tm* calendar, int* fields) {
     int i;
     int res = 0;
     if (!calendar || !fields) {
@@ -1055,7 +1860,7 @@ static int reset_all_max(struct tm* calendar, int* fields) {
     }
     for (i = 0; i < CRON_CF_ARR_LEN; i++) {
         if (-1 != fields[i]) {
-            res = reset_max(calendar, fields[i]);
+            res = reset_max(search, calendar, fields[i]);
             if (0 != res) return res;
         }
     }
@@ -1066,23 +1871,24 @@ static int reset_all_max(struct tm* calendar, int* fields) {
  * Search the bits provided for the next set bit after the value provided,
  * and reset the calendar.
  */
-static int find_prev(uint8_t* bits, int max, int value, struct tm* calendar, int field, int nextField, int* lower_orders, int* res_out) {
+static int find_prev(const cron_search* search, const uint8_t* bits, int max, int value, struct tm* calendar, int field, int nextField, int* lower_orders, int* res_out) {
     int notfound = 0;
     int err = 0;
     int next_value = prev_set_bit(bits, value, 0, &notfound);
     /* roll under if needed */
     if (notfound) {
-        err = add_to_field(calendar, nextField, -1);
+        CRON_PROBE2(prev__rollover, field, value);
+        err = add_to_field(search, calendar, nextField, -1);
         if (err) goto return_error;
-        err = reset_max(calendar, field);
+        err = reset_max(search, calendar, field);
         if (err) goto return_error;
         notfound = 0;
         next_value = prev_set_bit(bits, max - 1, value, &notfound);
     }
     if (notfound || next_value != value) {
-        err = set_field(calendar, field, next_value);
+        err = set_field(search, calendar, field, next_value);
         if (err) goto return_error;
-        err = reset_all_max(calendar, lower_orders);
+        err = reset_all_max(search, calendar, lower_orders);
         if (err) goto return_error;
     }
     return next_value;
@@ -1092,103 +1898,120 @@ static int find_prev(uint8_t* bits, int max, int value, struct tm* calendar, int
     return 0;
 }
 
-static int find_prev_day(struct tm* calendar, uint8_t* days_of_month, int day_of_month, uint8_t* days_of_week, int day_of_week, int* resets, int* res_out) {
-    int err;
-    unsigned int count = 0;
-    unsigned int max = 366;
-    while ((!cron_get_bit(days_of_month, day_of_month) || !cron_get_bit(days_of_week, day_of_week)) && count++ < max) {
-        err = add_to_field(calendar, CRON_CF_DAY_OF_MONTH, -1);
-
+/**
+ * Moves the calendar to the previous day matching the expression, month by month.
+ * Returns 1 if the calendar was moved, 0 if the current day matches, fails more than
+ * CRON_MAX_YEARS_DIFF years before the year the search started in ('dot').
+ */
+static int find_prev_day(const cron_search* search, const cron_expr* expr, struct tm* calendar, int dot, int* resets, int* res_out) {
+    uint8_t days[4];
+    int moved = 0;
+    int notfound = 0;
+    int day = 0;
+    int err = 0;
+    for (;;) {
+        CRON_STATS_ADD(day_iterations, 1);
+        month_days(expr, calendar->tm_year, calendar->tm_mon, first_wday(calendar), days);
+        notfound = 0;
+        day = prev_set_bit(days, calendar->tm_mday, 1, &notfound);
+        if (!notfound) break;
+        if (dot - calendar->tm_year > CRON_MAX_YEARS_DIFF) goto return_error;
+        CRON_PROBE2(prev__rollover, CRON_CF_DAY_OF_MONTH, calendar->tm_mday);
+        /* day zero is the last day of the previous month */
+        err = set_field(search, calendar, CRON_CF_DAY_OF_MONTH, 0);
+        if (err) goto return_error;
+        err = reset_all_max(search, calendar, resets);
+        if (err) goto return_error;
+        moved = 1;
+    }
+    if (day != calendar->tm_mday) {
+        err = set_field(search, calendar, CRON_CF_DAY_OF_MONTH, day);
+        if (err) goto return_error;
+        err = reset_all_max(search, calendar, resets);
         if (err) goto return_error;
-        day_of_month = calendar->tm_mday;
-        day_of_week = calendar->tm_wday;
-        reset_all_max(calendar, resets);
+        moved = 1;
     }
-    return day_of_month;
+    return moved;
 
     return_error:
     *res_out = 1;
     return 0;
 }
 
-static int do_prev(cron_expr* expr, struct tm* calendar, int dot) {
+static int do_prev(const cron_search* search, const cron_expr* expr, struct tm* calendar, int dot) {
     int i;
     int res = 0;
     int resets[CRON_CF_ARR_LEN];
     int empty_list[CRON_CF_ARR_LEN];
     int second = 0;
-    int update_second = 0;
     int minute = 0;
     int update_minute = 0;
     int hour = 0;
     int update_hour = 0;
-    int day_of_week = 0;
-    int day_of_month = 0;
-    int update_day_of_month = 0;
+    int day_moved = 0;
     int month = 0;
     int update_month = 0;
 
+    CRON_STATS_ENTER();
     for (i = 0; i < CRON_CF_ARR_LEN; i++) {
         resets[i] = -1;
         empty_list[i] = -1;
     }
 
     second = calendar->tm_sec;
-    update_second = find_prev(expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
+    find_prev(search, expr->seconds, CRON_MAX_SECONDS, second, calendar, CRON_CF_SECOND, CRON_CF_MINUTE, empty_list, &res);
     if (0 != res) goto return_result;
-    if (second == update_second) {
-        push_to_fields_arr(resets, CRON_CF_SECOND);
-    }
+    /* seconds are not searched again by a recursion, reset them when a higher field moves even if they did not match */
+    push_to_fields_arr(resets, CRON_CF_SECOND);
 
     minute = calendar->tm_min;
-    update_minute = find_prev(expr->minutes, CRON_MAX_MINUTES, minute, calendar, CRON_CF_MINUTE, CRON_CF_HOUR_OF_DAY, resets, &res);
+    update_minute = find_prev(search, expr->minutes, CRON_MAX_MINUTES, minute, calendar, CRON_CF_MINUTE, CRON_CF_HOUR_OF_DAY, resets, &res);
     if (0 != res) goto return_result;
     if (minute == update_minute) {
         push_to_fields_arr(resets, CRON_CF_MINUTE);
     } else {
-        res = do_prev(expr, calendar, dot);
+        res = do_prev(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
 
     hour = calendar->tm_hour;
-    update_hour = find_prev(expr->hours, CRON_MAX_HOURS, hour, calendar, CRON_CF_HOUR_OF_DAY, CRON_CF_DAY_OF_WEEK, resets, &res);
+    update_hour = find_prev(search, expr->hours, CRON_MAX_HOURS, hour, calendar, CRON_CF_HOUR_OF_DAY, CRON_CF_DAY_OF_WEEK, resets, &res);
     if (0 != res) goto return_result;
     if (hour == update_hour) {
         push_to_fields_arr(resets, CRON_CF_HOUR_OF_DAY);
     } else {
-        res = do_prev(expr, calendar, dot);
+        res = do_prev(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
 
-    day_of_week = calendar->tm_wday;
-    day_of_month = calendar->tm_mday;
-    update_day_of_month = find_prev_day(calendar, expr->days_of_month, day_of_month, expr->days_of_week, day_of_week, resets, &res);
+    day_moved = find_prev_day(search, expr, calendar, dot, resets, &res);
     if (0 != res) goto return_result;
-    if (day_of_month == update_day_of_month) {
+    if (!day_moved) {
         push_to_fields_arr(resets, CRON_CF_DAY_OF_MONTH);
     } else {
-        res = do_prev(expr, calendar, dot);
+        res = do_prev(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
 
     month = calendar->tm_mon; /*day already adds one if no day in same month is found*/
-    update_month = find_prev(expr->months, CRON_MAX_MONTHS, month, calendar, CRON_CF_MONTH, CRON_CF_YEAR, resets, &res);
+    update_month = find_prev(search, expr->months, CRON_MAX_MONTHS, month, calendar, CRON_CF_MONTH, CRON_CF_YEAR, resets, &res);
     if (0 != res) goto return_result;
     if (month != update_month) {
         if (dot - calendar->tm_year > CRON_MAX_YEARS_DIFF) {
             res = -1;
             goto return_result;
         }
-        res = do_prev(expr, calendar, dot);
+        res = do_prev(search, expr, calendar, dot);
         if (0 != res) goto return_result;
     }
     goto return_result;
 
     return_result:
+    CRON_STATS_LEAVE();
     return res;
 }
 
-time_t cron_prev(cron_expr* expr, time_t date) {
+static time_t search_prev(const cron_search* search, const cron_expr* expr, time_t date) {
     /*
      The plan:
 
@@ -1212,27 +2035,1422 @@ time_t cron_prev(cron_expr* expr, time_t date) {
     int res;
     time_t original;
     time_t calculated;
-    if (!expr) return CRON_INVALID_INSTANT;
+    if (!expr || has_empty_field(expr)) return CRON_INVALID_INSTANT;
     memset(&calval, 0, sizeof(struct tm));
-    calendar = cron_time(&date, &calval);
+    calendar = search->to_calendar(&date, &calval);
     if (!calendar) return CRON_INVALID_INSTANT;
-    original = cron_mktime(calendar);
+    original = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == original) return CRON_INVALID_INSTANT;
 
     /* calculate the previous occurrence */
-    res = do_prev(expr, calendar, calendar->tm_year);
+    res = do_prev(search, expr, calendar, calendar->tm_year);
     if (0 != res) return CRON_INVALID_INSTANT;
 
     /* check for a match, try from the next second if one wasn't found */
-    calculated = cron_mktime(calendar);
+    calculated = search_normalize(search, calendar);
     if (CRON_INVALID_INSTANT == calculated) return CRON_INVALID_INSTANT;
     if (calculated == original) {
         /* We arrived at the original timestamp - round up to the next whole second and try again... */
-        res = add_to_field(calendar, CRON_CF_SECOND, -1);
+        res = add_to_field(search, calendar, CRON_CF_SECOND, -1);
         if (0 != res) return CRON_INVALID_INSTANT;
-        res = do_prev(expr, calendar, calendar->tm_year);
+        res = do_prev(search, expr, calendar, calendar->tm_year);
         if (0 != res) return CRON_INVALID_INSTANT;
     }
 
-    return cron_mktime(calendar);
+    return search_normalize(search, calendar);
+}
+
+static time_t prev_fire(const cron_expr* expr, time_t date) {
+    return search_prev(&SEARCH_DEFAULT, expr, date);
 }
+
+time_t cron_prev(const cron_expr* expr, time_t date) {
+    time_t res;
+    CRON_STATS_START(start);
+    CRON_PROBE2(prev__entry, expr, date);
+    res = prev_fire(expr, date);
+    CRON_PROBE3(prev__return, expr, date, res);
+    CRON_TRACE('P', expr, date, res);
+    CRON_STATS_LATENCY(CRON_STATS_PREV, start);
+    return res;
+}
+
+/**
+ * Millisecond resolution.
+ * 'Fire' dates are always whole seconds, so a millisecond date is split
+ * into whole seconds and a remainder and the search is done on seconds.
+ */
+
+static int split_ms(int64_t date_ms, time_t* seconds, int* remainder) {
+    int64_t sec = date_ms / 1000;
+    int64_t rem = date_ms % 1000;
+    /* rounding of negative division is implementation-defined in C89 */
+    if (rem < 0) {
+        sec -= 1;
+        rem += 1000;
+    }
+    *seconds = (time_t) sec;
+    if ((int64_t) *seconds != sec) return 1;
+    *remainder = (int) rem;
+    return 0;
+}
+
+static int64_t to_ms(time_t date) {
+    if (CRON_INVALID_INSTANT == date) return CRON_INVALID_INSTANT_MS;
+    return (int64_t) date * 1000;
+}
+
+int64_t cron_next_ms(const cron_expr* expr, int64_t date_ms) {
+    time_t date;
+    int remainder;
+    if (split_ms(date_ms, &date, &remainder)) return CRON_INVALID_INSTANT_MS;
+    /* a 'fire' date within the current second is not after 'date_ms' */
+    return to_ms(next_fire(expr, date));
+}
+
+int64_t cron_prev_ms(const cron_expr* expr, int64_t date_ms) {
+    time_t date;
+    int remainder;
+    if (split_ms(date_ms, &date, &remainder)) return CRON_INVALID_INSTANT_MS;
+    /* the start of the current second is before 'date_ms' and can match */
+    if (remainder > 0) date += 1;
+    return to_ms(prev_fire(expr, date));
+}
+
+/* the structure holds only bytes, so it has no padding */
+uint32_t cron_expr_hash(const cron_expr* expr) {
+    const uint8_t* bytes = (const uint8_t*) expr;
+    uint32_t hash = 2166136261U;
+    size_t i;
+    for (i = 0; i < sizeof(cron_expr); i++) {
+        hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    return hash;
+}
+
+
+/**
+ * Materialized timelines.
+ *
+ * Serialized layout: a header ("CRTL" magic, version byte, flags byte, then
+ * 'from', 'to' and entries count as little-endian 64-bit integers) followed
+ * by one entry per occurrence. Each entry is a varint delta from the previous
+ * occurrence ('from' for the first one), merged timelines append a varint
+ * job id to every entry.
+ * Timelines and histograms allocate, they are not compiled with CRON_FREESTANDING.
+ */
+#ifndef CRON_FREESTANDING
+
+#define CRON_TIMELINE_VERSION 1
+#define CRON_TIMELINE_HEADER_LEN 30
+#define CRON_TIMELINE_FLAG_MERGED 1
+#define CRON_TIMELINE_BLOCK_LEN 64
+#define CRON_VARINT_MAX_LEN 10
+
+static const uint8_t TIMELINE_MAGIC[] = { 'C', 'R', 'T', 'L' };
+
+static void* grow_array(void* arr, size_t len, size_t* capacity, size_t needed, size_t elem_size) {
+    size_t cap = *capacity > 0 ? *capacity : 16;
+    void* res = NULL;
+    if (needed <= *capacity) return arr;
+    while (cap < needed) {
+        cap *= 2;
+    }
+    res = cron_malloc(cap * elem_size);
+    if (!res) return NULL;
+    if (arr) {
+        memcpy(res, arr, len * elem_size);
+        cron_free(arr);
+    }
+    *capacity = cap;
+    return res;
+}
+
+static size_t put_varint(uint8_t* out, uint64_t value) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (uint8_t) value;
+    return n;
+}
+
+static size_t get_varint(const uint8_t* in, size_t len, uint64_t* value) {
+    size_t n = 0;
+    unsigned int shift = 0;
+    *value = 0;
+    while (n < len && n < CRON_VARINT_MAX_LEN) {
+        *value |= ((uint64_t) (in[n] & 0x7f)) << shift;
+        if (0 == (in[n++] & 0x80)) return n;
+        shift += 7;
+    }
+    return 0; /* truncated or too long */
+}
+
+static void put_int64le(uint8_t* out, int64_t value) {
+    uint64_t uv = (uint64_t) value;
+    int i;
+    for (i = 0; i < 8; i++) {
+        out[i] = (uint8_t) (uv >> (8 * i));
+    }
+}
+
+static int64_t get_int64le(const uint8_t* in) {
+    uint64_t uv = 0;
+    int i;
+    for (i = 0; i < 8; i++) {
+        uv |= ((uint64_t) in[i]) << (8 * i);
+    }
+    return (int64_t) uv;
+}
+
+static int timeline_init(cron_timeline* tl, time_t from, time_t to, uint8_t flags) {
+    void* data;
+    memset(tl, 0, sizeof(*tl));
+    data = grow_array(NULL, 0, &tl->capacity, CRON_TIMELINE_HEADER_LEN + CRON_TIMELINE_BLOCK_LEN, 1);
+    if (!data) return 1;
+    tl->data = (uint8_t*) data;
+    memcpy(tl->data, TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC));
+    tl->data[4] = CRON_TIMELINE_VERSION;
+    tl->data[5] = flags;
+    put_int64le(tl->data + 6, (int64_t) from);
+    put_int64le(tl->data + 14, (int64_t) to);
+    put_int64le(tl->data + 22, 0);
+    tl->len = CRON_TIMELINE_HEADER_LEN;
+    tl->from = from;
+    tl->to = to;
+    tl->last = from;
+    tl->merged = (flags & CRON_TIMELINE_FLAG_MERGED) ? 1 : 0;
+    return 0;
+}
+
+static int timeline_add_block(cron_timeline* tl, size_t offset) {
+    void* blocks = grow_array(tl->blocks, tl->blocks_len, &tl->blocks_capacity, tl->blocks_len + 1, sizeof(cron_timeline_block));
+    if (!blocks) return 1;
+    tl->blocks = (cron_timeline_block*) blocks;
+    tl->blocks[tl->blocks_len].base = tl->last;
+    tl->blocks[tl->blocks_len].offset = offset;
+    tl->blocks_len += 1;
+    return 0;
+}
+
+static int timeline_append(cron_timeline* tl, time_t date, uint32_t job_id) {
+    void* data;
+    if (0 == tl->count % CRON_TIMELINE_BLOCK_LEN) {
+        if (timeline_add_block(tl, tl->len)) return 1;
+    }
+    data = grow_array(tl->data, tl->len, &tl->capacity, tl->len + 2 * CRON_VARINT_MAX_LEN, 1);
+    if (!data) return 1;
+    tl->data = (uint8_t*) data;
+    tl->len += put_varint(tl->data + tl->len, (uint64_t) (date - tl->last));
+    if (tl->merged) {
+        tl->len += put_varint(tl->data + tl->len, job_id);
+    }
+    tl->last = date;
+    tl->count += 1;
+    return 0;
+}
+
+/* min-heap of expression indices ordered by their next fire time, ties broken by index */
+static int timeline_heap_less(const time_t* times, size_t a, size_t b) {
+    return times[a] < times[b] || (times[a] == times[b] && a < b);
+}
+
+static void timeline_heap_down(size_t* heap, size_t len, const time_t* times, size_t pos) {
+    size_t child;
+    size_t tmp;
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= len) return;
+        if (child + 1 < len && timeline_heap_less(times, heap[child + 1], heap[child])) {
+            child += 1;
+        }
+        if (!timeline_heap_less(times, heap[child], heap[pos])) return;
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+}
+
+static int build_timeline(const cron_expr* exprs, const uint32_t* ids, size_t count, uint8_t flags,
+        time_t from, time_t to, cron_timeline* out) {
+    time_t* times = NULL;
+    size_t* heap = NULL;
+    size_t heap_len = 0;
+    size_t i;
+    size_t top;
+    time_t next;
+
+    if (!out) return 1;
+    if (timeline_init(out, from, to, flags)) goto return_error;
+    if (!exprs || 0 == count || from >= to) return 0;
+
+    times = (time_t*) cron_malloc(count * sizeof(time_t));
+    heap = (size_t*) cron_malloc(count * sizeof(size_t));
+    if (!times || !heap) goto return_error;
+
+    for (i = 0; i < count; i++) {
+        times[i] = next_fire(&exprs[i], from - 1);
+        if (CRON_INVALID_INSTANT != times[i] && times[i] >= from && times[i] < to) {
+            heap[heap_len++] = i;
+        }
+    }
+    for (i = heap_len / 2; i > 0; i--) {
+        timeline_heap_down(heap, heap_len, times, i - 1);
+    }
+
+    while (heap_len > 0) {
+        top = heap[0];
+        if (timeline_append(out, times[top], ids ? ids[top] : (uint32_t) top)) goto return_error;
+        next = next_fire(&exprs[top], times[top]);
+        if (CRON_INVALID_INSTANT == next || next <= times[top] || next >= to) {
+            heap[0] = heap[--heap_len];
+        } else {
+            times[top] = next;
+        }
+        timeline_heap_down(heap, heap_len, times, 0);
+    }
+    put_int64le(out->data + 22, (int64_t) out->count);
+
+    cron_free(times);
+    cron_free(heap);
+    return 0;
+
+    return_error:
+    if (times) cron_free(times);
+    if (heap) cron_free(heap);
+    cron_timeline_free(out);
+    return 1;
+}
+
+int cron_timeline_build(const cron_expr* expr, time_t from, time_t to, cron_timeline* out) {
+    return build_timeline(expr, NULL, expr ? 1 : 0, 0, from, to, out);
+}
+
+int cron_timeline_build_merged(const cron_expr* exprs, const uint32_t* ids, size_t count, time_t from, time_t to, cron_timeline* out) {
+    return build_timeline(exprs, ids, count, CRON_TIMELINE_FLAG_MERGED, from, to, out);
+}
+
+int cron_timeline_load(const uint8_t* data, size_t len, cron_timeline* out) {
+    size_t offset = CRON_TIMELINE_HEADER_LEN;
+    size_t n;
+    int64_t count;
+    uint64_t value;
+    time_t date;
+
+    if (!out) return 1;
+    memset(out, 0, sizeof(*out));
+    if (!data || len < CRON_TIMELINE_HEADER_LEN) return 1;
+    if (0 != memcmp(data, TIMELINE_MAGIC, sizeof(TIMELINE_MAGIC)) || CRON_TIMELINE_VERSION != data[4]) return 1;
+    if (timeline_init(out, (time_t) get_int64le(data + 6), (time_t) get_int64le(data + 14), data[5])) return 1;
+    count = get_int64le(data + 22);
+    if (count < 0) goto return_error;
+
+    while (offset < len) {
+        if (0 == out->count % CRON_TIMELINE_BLOCK_LEN) {
+            if (timeline_add_block(out, offset)) goto return_error;
+        }
+        n = get_varint(data + offset, len - offset, &value);
+        if (0 == n) goto return_error;
+        offset += n;
+        /* checked before the addition, a large delta must not overflow */
+        if (out->last >= out->to || value >= (uint64_t) out->to - (uint64_t) out->last) goto return_error;
+        date = (time_t) (out->last + (time_t) value);
+        if (out->merged) {
+            n = get_varint(data + offset, len - offset, &value);
+            if (0 == n || value > 0xffffffffUL) goto return_error;
+            offset += n;
+        }
+        out->last = date;
+        out->count += 1;
+    }
+    if ((uint64_t) count != (uint64_t) out->count) goto return_error;
+
+    out->data = (uint8_t*) grow_array(out->data, 0, &out->capacity, len, 1);
+    if (!out->data) goto return_error;
+    memcpy(out->data, data, len);
+    out->len = len;
+    return 0;
+
+    return_error:
+    cron_timeline_free(out);
+    return 1;
+}
+
+void cron_timeline_free(cron_timeline* timeline) {
+    if (!timeline) return;
+    if (timeline->data) cron_free(timeline->data);
+    if (timeline->blocks) cron_free(timeline->blocks);
+    memset(timeline, 0, sizeof(*timeline));
+}
+
+void cron_timeline_begin(const cron_timeline* timeline, cron_timeline_iter* it) {
+    it->timeline = timeline;
+    it->offset = CRON_TIMELINE_HEADER_LEN;
+    it->index = 0;
+    it->time = timeline->from;
+}
+
+/* Decodes the entry at the iterator position without consuming it, returns the entry length */
+static size_t timeline_peek(const cron_timeline_iter* it, time_t* date, uint32_t* job_id) {
+    const cron_timeline* tl = it->timeline;
+    size_t n;
+    size_t m = 0;
+    uint64_t value = 0;
+    if (it->index >= tl->count) return 0;
+    n = get_varint(tl->data + it->offset, tl->len - it->offset, &value);
+    if (0 == n) return 0;
+    *date = (time_t) (it->time + (time_t) value);
+    *job_id = 0;
+    if (tl->merged) {
+        m = get_varint(tl->data + it->offset + n, tl->len - it->offset - n, &value);
+        if (0 == m) return 0;
+        *job_id = (uint32_t) value;
+    }
+    return n + m;
+}
+
+int cron_timeline_next(cron_timeline_iter* it, time_t* date, uint32_t* job_id) {
+    time_t entry_date;
+    uint32_t entry_id;
+    size_t n = timeline_peek(it, &entry_date, &entry_id);
+    if (0 == n) return 0;
+    it->offset += n;
+    it->index += 1;
+    it->time = entry_date;
+    if (date) *date = entry_date;
+    if (job_id) *job_id = entry_id;
+    return 1;
+}
+
+void cron_timeline_seek(const cron_timeline* timeline, time_t date, cron_timeline_iter* it) {
+    size_t lo = 0;
+    size_t hi = timeline->blocks_len;
+    size_t mid;
+    time_t entry_date;
+    uint32_t entry_id;
+
+    cron_timeline_begin(timeline, it);
+    /* find the last block which starts after an entry not later than 'date' */
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (timeline->blocks[mid].base <= date) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < timeline->blocks_len) {
+        it->offset = timeline->blocks[lo].offset;
+        it->index = lo * CRON_TIMELINE_BLOCK_LEN;
+        it->time = timeline->blocks[lo].base;
+    }
+    while (0 != timeline_peek(it, &entry_date, &entry_id) && entry_date <= date) {
+        cron_timeline_next(it, NULL, NULL);
+    }
+}
+
+
+/**
+ * Load histogram.
+ *
+ * Calendar days of the range are resolved once for the whole expressions set,
+ * then occurrences of every expression are counted per bucket from the field
+ * masks: an hour or a minute that falls entirely into one bucket contributes
+ * the product of the lower fields popcounts without enumerating its seconds.
+ */
+
+typedef struct {
+    int mday;
+    int wday;
+    int mon;
+    int year;
+    time_t hours[CRON_MAX_HOURS + 1]; /* start of every hour and of the next day */
+} cron_load_day;
+
+static cron_load_day* load_days(time_t from, time_t to, size_t* len_out) {
+    cron_load_day* days = NULL;
+    size_t len = 0;
+    size_t capacity = 0;
+    void* grown;
+    struct tm calval;
+    struct tm hourval;
+    struct tm* calendar;
+    int i;
+
+    memset(&calval, 0, sizeof(struct tm));
+    calendar = cron_time(&from, &calval);
+    if (!calendar) return NULL;
+    calendar->tm_hour = 0;
+    calendar->tm_min = 0;
+    calendar->tm_sec = 0;
+    do {
+        grown = grow_array(days, len, &capacity, len + 1, sizeof(cron_load_day));
+        if (!grown) goto return_error;
+        days = (cron_load_day*) grown;
+        for (i = 0; i <= CRON_MAX_HOURS; i++) {
+            memcpy(&hourval, calendar, sizeof(struct tm));
+            hourval.tm_hour = i;
+            days[len].hours[i] = cron_mktime(&hourval);
+            if (CRON_INVALID_INSTANT == days[len].hours[i]) goto return_error;
+            if (0 == i) {
+                days[len].mday = hourval.tm_mday;
+                days[len].wday = hourval.tm_wday;
+                days[len].mon = hourval.tm_mon;
+                days[len].year = hourval.tm_year;
+            }
+        }
+        calendar->tm_mday += 1;
+        len += 1;
+    } while (days[len - 1].hours[CRON_MAX_HOURS] < to);
+    *len_out = len;
+    return days;
+
+    return_error:
+    if (days) cron_free(days);
+    return NULL;
+}
+
+typedef struct {
+    uint64_t* counts;
+    time_t from;
+    time_t to;
+    time_t bucket;
+    const cron_expr* expr;
+    uint32_t weight;
+    uint32_t sec_count;
+    uint32_t min_count;
+} cron_load_state;
+
+static void load_add(const cron_load_state* st, time_t start, int field) {
+    time_t len = CRON_CF_HOUR_OF_DAY == field ? 3600 : 60;
+    const uint8_t* bits = CRON_CF_HOUR_OF_DAY == field ? st->expr->minutes : st->expr->seconds;
+    int i;
+    if (start + len <= st->from || start >= st->to) return;
+    if (start >= st->from && start + len <= st->to && (start - st->from) / st->bucket == (start + len - 1 - st->from) / st->bucket) {
+        /* whole interval falls into one bucket */
+        st->counts[(start - st->from) / st->bucket] += (uint64_t) st->weight * (CRON_CF_MINUTE == field ? st->sec_count : st->min_count * st->sec_count);
+        return;
+    }
+    for (i = 0; i < CRON_MAX_MINUTES; i++) {
+        if (0 == (i & 7) && 0 == bits[i >> 3]) {
+            i += 7;
+        } else if (!cron_get_bit(bits, i)) {
+            continue;
+        } else if (CRON_CF_HOUR_OF_DAY == field) {
+            load_add(st, start + i * 60, CRON_CF_MINUTE);
+        } else if (start + i >= st->from && start + i < st->to) {
+            st->counts[(start + i - st->from) / st->bucket] += st->weight;
+        }
+    }
+}
+
+/* Collapses identical expressions, returns indices of the distinct ones and their multiplicities */
+static size_t* load_distinct(const cron_expr* exprs, size_t count, uint32_t** weights_out, size_t* len_out) {
+    size_t* table = NULL;
+    size_t* distinct = NULL;
+    uint32_t* weights = NULL;
+    size_t capacity = 16;
+    size_t len = 0;
+    size_t i;
+    size_t pos;
+
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    table = (size_t*) cron_malloc(capacity * sizeof(size_t));
+    distinct = (size_t*) cron_malloc(count * sizeof(size_t));
+    weights = (uint32_t*) cron_malloc(count * sizeof(uint32_t));
+    if (!table || !distinct || !weights) goto return_error;
+    memset(table, 0, capacity * sizeof(size_t));
+
+    for (i = 0; i < count; i++) {
+        /* table slots hold 1-based positions in 'distinct', linear probing */
+        pos = cron_expr_hash(&exprs[i]) & (capacity - 1);
+        while (0 != table[pos] && 0 != memcmp(&exprs[distinct[table[pos] - 1]], &exprs[i], sizeof(cron_expr))) {
+            pos = (pos + 1) & (capacity - 1);
+        }
+        if (0 == table[pos]) {
+            distinct[len] = i;
+            weights[len] = 0;
+            table[pos] = ++len;
+        }
+        weights[table[pos] - 1] += 1;
+    }
+
+    cron_free(table);
+    *weights_out = weights;
+    *len_out = len;
+    return distinct;
+
+    return_error:
+    if (table) cron_free(table);
+    if (distinct) cron_free(distinct);
+    if (weights) cron_free(weights);
+    return NULL;
+}
+
+int cron_load_histogram(const cron_expr* exprs, size_t count, time_t from, time_t to, unsigned int bucket_seconds, uint64_t* out_counts) {
+    cron_load_state st;
+    cron_load_day* days = NULL;
+    size_t days_len = 0;
+    size_t* distinct = NULL;
+    uint32_t* weights = NULL;
+    size_t distinct_len = 0;
+    size_t i;
+    size_t d;
+    int h;
+    int modifiers;
+    uint8_t month_mask[4];
+    const cron_load_day* day;
+
+    if ((!exprs && count > 0) || !out_counts || 0 == bucket_seconds || from > to) return 1;
+    if (0 == count || from == to) return 0;
+    days = load_days(from, to, &days_len);
+    if (!days) return 1;
+    distinct = load_distinct(exprs, count, &weights, &distinct_len);
+    if (!distinct) {
+        cron_free(days);
+        return 1;
+    }
+
+    st.counts = out_counts;
+    st.from = from;
+    st.to = to;
+    st.bucket = (time_t) bucket_seconds;
+    for (i = 0; i < distinct_len; i++) {
+        st.expr = &exprs[distinct[i]];
+        st.weight = weights[i];
+        st.sec_count = count_bits(st.expr->seconds, CRON_MAX_SECONDS);
+        st.min_count = count_bits(st.expr->minutes, CRON_MAX_MINUTES);
+        modifiers = has_day_modifiers(st.expr);
+        for (d = 0; d < days_len; d++) {
+            day = &days[d];
+            if (!cron_get_bit(st.expr->months, day->mon)) continue;
+            if (modifiers) {
+                if (0 == d || 1 == day->mday) {
+                    month_days(st.expr, day->year, day->mon, ((day->wday - day->mday + 1) % 7 + 7) % 7, month_mask);
+                }
+                if (!cron_get_bit(month_mask, day->mday)) continue;
+            } else if (!cron_get_bit(st.expr->days_of_month, day->mday) || !cron_get_bit(st.expr->days_of_week, day->wday)) {
+                continue;
+            }
+            for (h = 0; h < CRON_MAX_HOURS; h++) {
+                /* hours skipped by a DST transition resolve to the start of the next one */
+                if (cron_get_bit(st.expr->hours, h) && day->hours[h] < day->hours[h + 1]) {
+                    load_add(&st, day->hours[h], CRON_CF_HOUR_OF_DAY);
+                }
+            }
+        }
+    }
+
+    cron_free(weights);
+    cron_free(distinct);
+    cron_free(days);
+    return 0;
+}
+
+#endif /* CRON_FREESTANDING */
+
+
+/**
+ * Intersection.
+ *
+ * A date matches an expression when every field matches, days of month
+ * and days of week included, so two expressions fire at the same date
+ * exactly when it matches the per-field AND of their masks.
+ */
+
+static int and_bits(const uint8_t* a, const uint8_t* b, uint8_t* out, size_t len) {
+    size_t i;
+    int any = 0;
+    for (i = 0; i < len; i++) {
+        out[i] = (uint8_t) (a[i] & b[i]);
+        any |= out[i];
+    }
+    return 0 != any;
+}
+
+static int and_fields(const cron_expr* a, const cron_expr* b, cron_expr* out) {
+    int res = 1;
+    memset(out, 0, sizeof(*out));
+    res &= and_bits(a->seconds, b->seconds, out->seconds, sizeof(out->seconds));
+    res &= and_bits(a->minutes, b->minutes, out->minutes, sizeof(out->minutes));
+    res &= and_bits(a->hours, b->hours, out->hours, sizeof(out->hours));
+    res &= and_bits(a->months, b->months, out->months, sizeof(out->months));
+    /* emptiness of days is checked by the caller, depending on the day modifiers */
+    and_bits(a->days_of_week, b->days_of_week, out->days_of_week, sizeof(out->days_of_week));
+    and_bits(a->days_of_month, b->days_of_month, out->days_of_month, sizeof(out->days_of_month));
+    return res;
+}
+
+static void copy_day_fields(const cron_expr* from, cron_expr* to) {
+    memcpy(to->days_of_week, from->days_of_week, sizeof(to->days_of_week));
+    memcpy(to->days_of_month, from->days_of_month, sizeof(to->days_of_month));
+    memcpy(to->days_of_month_last, from->days_of_month_last, sizeof(to->days_of_month_last));
+    memcpy(to->days_of_month_weekday, from->days_of_month_weekday, sizeof(to->days_of_month_weekday));
+    memcpy(to->days_of_week_last, from->days_of_week_last, sizeof(to->days_of_week_last));
+    memcpy(to->days_of_week_nth, from->days_of_week_nth, sizeof(to->days_of_week_nth));
+}
+
+static int matches_every_day(const cron_expr* expr) {
+    return CRON_MAX_DAYS_OF_MONTH - 1 == count_bits(expr->days_of_month, CRON_MAX_DAYS_OF_MONTH) &&
+            7 == count_bits(expr->days_of_week, 7);
+}
+
+int cron_expr_intersect(const cron_expr* a, const cron_expr* b, cron_expr* out) {
+    cron_expr common;
+    int res = 0;
+    int a_modifiers = 0;
+    int b_modifiers = 0;
+    if (!a || !b || !out) return 0;
+    res = and_fields(a, b, &common);
+    a_modifiers = has_day_modifiers(a);
+    b_modifiers = has_day_modifiers(b);
+    if (a_modifiers || b_modifiers) {
+        /* days matched through L, W or # modifiers can only be kept as is */
+        if ((a_modifiers && b_modifiers) || !matches_every_day(a_modifiers ? b : a)) return -1;
+        copy_day_fields(a_modifiers ? a : b, &common);
+    } else if (0 == count_bits(common.days_of_month, CRON_MAX_DAYS_OF_MONTH) || 0 == count_bits(common.days_of_week, 7)) {
+        res = 0;
+    }
+    memcpy(out, &common, sizeof(common));
+    return res;
+}
+
+/* Alternates searches of both expressions until they arrive at the same date */
+static time_t leapfrog_fire(const cron_expr* a, const cron_expr* b, time_t date, int forward) {
+    cron_expr ca;
+    cron_expr cb;
+    time_t limit = (time_t) (CRON_MAX_YEARS_DIFF + 1) * 366 * 24 * 3600;
+    time_t ta;
+    time_t tb;
+    /* narrow both expressions by the fields that can be combined */
+    if (!and_fields(a, b, &ca)) return CRON_INVALID_INSTANT;
+    memcpy(&cb, &ca, sizeof(ca));
+    copy_day_fields(a, &ca);
+    copy_day_fields(b, &cb);
+    ta = forward ? next_fire(&ca, date) : prev_fire(&ca, date);
+    while (CRON_INVALID_INSTANT != ta && (forward ? ta - date : date - ta) <= limit) {
+        tb = forward ? next_fire(&cb, ta - 1) : prev_fire(&cb, ta + 1);
+        if (tb == ta || CRON_INVALID_INSTANT == tb) return tb;
+        ta = forward ? next_fire(&ca, tb - 1) : prev_fire(&ca, tb + 1);
+    }
+    return CRON_INVALID_INSTANT;
+}
+
+time_t cron_next_common(const cron_expr* a, const cron_expr* b, time_t date) {
+    cron_expr common;
+    int res = cron_expr_intersect(a, b, &common);
+    if (-1 == res) return leapfrog_fire(a, b, date, 1);
+    if (0 == res) return CRON_INVALID_INSTANT;
+    return next_fire(&common, date);
+}
+
+time_t cron_prev_common(const cron_expr* a, const cron_expr* b, time_t date) {
+    cron_expr common;
+    int res = cron_expr_intersect(a, b, &common);
+    if (-1 == res) return leapfrog_fire(a, b, date, 0);
+    if (0 == res) return CRON_INVALID_INSTANT;
+    return prev_fire(&common, date);
+}
+
+
+/**
+ * Time zones.
+ *
+ * A zone is a sorted table of UTC instants at which the UTC offset changes,
+ * read from a TZif file (RFC 8536). Transitions described by the POSIX TZ
+ * rule at the end of the file are precomputed up to CRON_ZONE_LAST_YEAR.
+ * Expressions are evaluated in the wall time of the zone with the civil
+ * calendar functions, then mapped back to UTC:
+ * - wall dates skipped by a forward transition fire shifted forward
+ *   by the length of the gap;
+ * - wall dates repeated by a backward transition fire only once,
+ *   at their first occurrence.
+ * With CRON_FREESTANDING only zones with a fixed offset are available.
+ */
+
+#ifndef CRON_ZONEINFO_DIR
+#define CRON_ZONEINFO_DIR "/usr/share/zoneinfo/"
+#endif /* CRON_ZONEINFO_DIR */
+#define CRON_ZONE_FIRST_YEAR 1970
+#define CRON_ZONE_LAST_YEAR 2200
+#define CRON_ZONE_MAX_PATH_LEN 256
+#define CRON_ZONE_MAX_RULE_LEN 128
+#define CRON_ZONE_MAX_STEPS 8
+#define CRON_ZONE_MAX_OFFSET 93600
+#define CRON_TZIF_HEADER_LEN 44
+
+#define CRON_ZONE_NORMAL 0
+#define CRON_ZONE_GAP 1
+#define CRON_ZONE_OVERLAP 2
+
+static int32_t zone_offset(const cron_zone* zone, size_t period) {
+    return 0 == period ? zone->initial_offset : zone->offsets[period - 1];
+}
+
+#ifndef CRON_FREESTANDING
+
+static const uint8_t TZIF_MAGIC[] = { 'T', 'Z', 'i', 'f' };
+
+typedef struct {
+    char kind; /* 'J', 'M' or 0 for zero-based day of year */
+    int day;
+    int month;
+    int week;
+    int32_t time;
+} cron_zone_rule_date;
+
+typedef struct {
+    int32_t std_offset;
+    int32_t dst_offset;
+    int has_dst;
+    cron_zone_rule_date start;
+    cron_zone_rule_date end;
+} cron_zone_rule;
+
+static uint32_t get_uint32be(const uint8_t* in) {
+    return ((uint32_t) in[0] << 24) | ((uint32_t) in[1] << 16) | ((uint32_t) in[2] << 8) | (uint32_t) in[3];
+}
+
+static int64_t get_int64be(const uint8_t* in) {
+    uint64_t res = ((uint64_t) get_uint32be(in) << 32) | get_uint32be(in + 4);
+    return (int64_t) res;
+}
+
+static int64_t get_timebe(const uint8_t* in, size_t size) {
+    if (4 == size) return (int32_t) get_uint32be(in);
+    return get_int64be(in);
+}
+
+static const char* parse_zone_name(const char* str) {
+    const char* start = str;
+    if ('<' == *str) {
+        while (*str && '>' != *str) {
+            str++;
+        }
+        return '>' == *str ? str + 1 : NULL;
+    }
+    while (isalpha((unsigned char) *str)) {
+        str++;
+    }
+    return str - start >= 3 ? str : NULL;
+}
+
+static const char* parse_zone_time(const char* str, int32_t* out) {
+    int32_t sign = 1;
+    int32_t part = 0;
+    int32_t res = 0;
+    int i;
+    if ('+' == *str || '-' == *str) {
+        sign = '-' == *str ? -1 : 1;
+        str++;
+    }
+    for (i = 0; i < 3; i++) {
+        if (i > 0) {
+            if (':' != *str) break;
+            str++;
+        }
+        if (!isdigit((unsigned char) *str)) return NULL;
+        part = 0;
+        while (isdigit((unsigned char) *str) && part < 1000) {
+            part = part * 10 + (*str - '0');
+            str++;
+        }
+        if (i > 0 && part > 59) return NULL;
+        if (0 == i && part > 167) return NULL;
+        res = res * 60 + part;
+    }
+    for (; i < 3; i++) {
+        res *= 60;
+    }
+    *out = sign * res;
+    return str;
+}
+
+static const char* parse_zone_number(const char* str, int min, int max, int* out) {
+    int res = 0;
+    if (!isdigit((unsigned char) *str)) return NULL;
+    while (isdigit((unsigned char) *str) && res <= max) {
+        res = res * 10 + (*str - '0');
+        str++;
+    }
+    if (res < min || res > max) return NULL;
+    *out = res;
+    return str;
+}
+
+static const char* parse_zone_date(const char* str, cron_zone_rule_date* out) {
+    memset(out, 0, sizeof(cron_zone_rule_date));
+    out->time = 7200;
+    if ('J' == *str) {
+        out->kind = 'J';
+        str = parse_zone_number(str + 1, 1, 365, &out->day);
+    } else if ('M' == *str) {
+        out->kind = 'M';
+        str = parse_zone_number(str + 1, 1, 12, &out->month);
+        if (!str || '.' != *str) return NULL;
+        str = parse_zone_number(str + 1, 1, 5, &out->week);
+        if (!str || '.' != *str) return NULL;
+        str = parse_zone_number(str + 1, 0, 6, &out->day);
+    } else {
+        str = parse_zone_number(str, 0, 365, &out->day);
+    }
+    if (str && '/' == *str) {
+        str = parse_zone_time(str + 1, &out->time);
+    }
+    return str;
+}
+
+static int parse_zone_rule(const char* str, cron_zone_rule* out) {
+    int32_t offset = 0;
+    memset(out, 0, sizeof(cron_zone_rule));
+    str = parse_zone_name(str);
+    if (!str) return 1;
+    str = parse_zone_time(str, &offset);
+    if (!str) return 1;
+    /* POSIX offsets are positive west of Greenwich */
+    out->std_offset = -offset;
+    if ('\0' == *str) return 0;
+    str = parse_zone_name(str);
+    if (!str) return 1;
+    out->has_dst = 1;
+    out->dst_offset = out->std_offset + 3600;
+    if ('\0' != *str && ',' != *str) {
+        str = parse_zone_time(str, &offset);
+        if (!str) return 1;
+        out->dst_offset = -offset;
+    }
+    if ('\0' == *str) {
+        /* rules are implementation-defined if omitted, use the US ones */
+        str = parse_zone_date("M3.2.0", &out->start);
+        str = parse_zone_date("M11.1.0", &out->end);
+        return 0;
+    }
+    str = parse_zone_date(str + 1, &out->start);
+    if (!str || ',' != *str) return 1;
+    str = parse_zone_date(str + 1, &out->end);
+    if (!str || '\0' != *str) return 1;
+    return 0;
+}
+
+static int64_t zone_rule_day(const cron_zone_rule_date* date, int64_t year) {
+    int64_t first = days_from_civil(year, 1, 1);
+    int len = 0;
+    int day = 0;
+    if ('J' == date->kind) {
+        /* February 29 is never counted */
+        return first + date->day - 1 + (date->day >= 60 && 29 == days_in_month(1, (int) (year - 1900)) ? 1 : 0);
+    }
+    if ('M' != date->kind) return first + date->day;
+    first = days_from_civil(year, date->month, 1);
+    len = days_in_month(date->month - 1, (int) (year - 1900));
+    day = (int) ((date->day - (first + 4) + floor_div(first + 4, 7) * 7 + 7) % 7) + (date->week - 1) * 7;
+    while (day >= len) {
+        day -= 7;
+    }
+    return first + day;
+}
+
+static void zone_append(cron_zone* zone, int64_t date, int32_t offset) {
+    if (offset == zone_offset(zone, zone->count)) return;
+    if (zone->count > 0 && date <= zone->transitions[zone->count - 1]) return;
+    zone->transitions[zone->count] = date;
+    zone->offsets[zone->count] = offset;
+    zone->count += 1;
+}
+
+static void zone_append_rule(cron_zone* zone, const cron_zone_rule* rule) {
+    int64_t year = CRON_ZONE_FIRST_YEAR;
+    int month = 0;
+    int day = 0;
+    int64_t start;
+    int64_t end;
+    if (zone->count > 0) {
+        civil_from_days(floor_div(zone->transitions[zone->count - 1], 86400), &year, &month, &day);
+    }
+    for (; year <= CRON_ZONE_LAST_YEAR; year++) {
+        start = zone_rule_day(&rule->start, year) * 86400 + rule->start.time - rule->std_offset;
+        end = zone_rule_day(&rule->end, year) * 86400 + rule->end.time - rule->dst_offset;
+        /* transitions listed in the file take precedence */
+        if (start < end) {
+            zone_append(zone, start, rule->dst_offset);
+            zone_append(zone, end, rule->std_offset);
+        } else {
+            zone_append(zone, end, rule->std_offset);
+            zone_append(zone, start, rule->dst_offset);
+        }
+    }
+}
+
+int cron_zone_load(const uint8_t* data, size_t len, cron_zone* out) {
+    uint32_t counts[6];
+    size_t time_size = 4;
+    size_t block = CRON_TZIF_HEADER_LEN;
+    size_t block_len = 0;
+    size_t footer = 0;
+    size_t footer_len = 0;
+    size_t capacity = 0;
+    size_t i;
+    const uint8_t* types;
+    const uint8_t* infos;
+    char rule_str[CRON_ZONE_MAX_RULE_LEN];
+    cron_zone_rule rule;
+    int has_rule = 0;
+    int pass;
+
+    if (!out) return 1;
+    memset(out, 0, sizeof(cron_zone));
+    if (!data) return 1;
+    /* version 1 data block uses 32-bit times, version 2+ data block that follows it uses 64-bit times */
+    for (pass = 0; pass < 2; pass++) {
+        if (len < block || 0 != memcmp(data + block - CRON_TZIF_HEADER_LEN, TZIF_MAGIC, sizeof(TZIF_MAGIC))) return 1;
+        for (i = 0; i < 6; i++) {
+            counts[i] = get_uint32be(data + block - CRON_TZIF_HEADER_LEN + 20 + i * 4);
+        }
+        /* isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt */
+        if (counts[4] < 1 || counts[3] > 0xffff || counts[4] > 0xff || counts[2] > 0xffff || counts[5] > 0xffff
+                || counts[0] > counts[4] || counts[1] > counts[4]) return 1;
+        block_len = counts[3] * (time_size + 1) + counts[4] * 6 + counts[5] + counts[2] * (time_size + 4) + counts[1] + counts[0];
+        if (len - block < block_len) return 1;
+        if (0 != pass || '2' > data[block - CRON_TZIF_HEADER_LEN + 4]) break;
+        block += block_len + CRON_TZIF_HEADER_LEN;
+        time_size = 8;
+    }
+    types = data + block + counts[3] * time_size;
+    infos = types + counts[3];
+    for (i = 0; i < counts[3]; i++) {
+        if (types[i] >= counts[4]) return 1;
+    }
+    if (8 == time_size) {
+        footer = block + block_len;
+        if (footer >= len || '\n' != data[footer]) return 1;
+        footer += 1;
+        while (footer + footer_len < len && '\n' != data[footer + footer_len]) {
+            footer_len++;
+        }
+        if (footer + footer_len >= len || footer_len >= CRON_ZONE_MAX_RULE_LEN) return 1;
+        if (footer_len > 0) {
+            memcpy(rule_str, data + footer, footer_len);
+            rule_str[footer_len] = '\0';
+            if (0 != parse_zone_rule(rule_str, &rule)) return 1;
+            has_rule = 1;
+        }
+    }
+
+    capacity = counts[3];
+    if (has_rule && rule.has_dst) {
+        capacity += 2 * (CRON_ZONE_LAST_YEAR - CRON_ZONE_FIRST_YEAR + 1);
+    }
+    if (capacity > 0) {
+        out->transitions = (int64_t*) cron_malloc(capacity * sizeof(int64_t));
+        out->offsets = (int32_t*) cron_malloc(capacity * sizeof(int32_t));
+        if (!out->transitions || !out->offsets) {
+            cron_zone_free(out);
+            return 1;
+        }
+    }
+    /* dates before the first transition use the first time type */
+    out->initial_offset = (int32_t) get_uint32be(infos);
+    if (0 == counts[3] && has_rule) {
+        out->initial_offset = rule.std_offset;
+    }
+    for (i = 0; i < counts[3]; i++) {
+        zone_append(out, get_timebe(data + block + i * time_size, time_size), (int32_t) get_uint32be(infos + types[i] * 6));
+    }
+    if (has_rule && rule.has_dst) {
+        zone_append_rule(out, &rule);
+    }
+    return 0;
+}
+
+int cron_zone_load_file(const char* name, cron_zone* out) {
+    char path[CRON_ZONE_MAX_PATH_LEN];
+    size_t dir_len = 0;
+    size_t name_len = 0;
+    FILE* file = NULL;
+    long file_len = 0;
+    uint8_t* data = NULL;
+    int res = 1;
+
+    if (!out) return 1;
+    memset(out, 0, sizeof(cron_zone));
+    if (!name) return 1;
+    name_len = strlen(name);
+    if ('/' != name[0]) {
+        /* IANA names are resolved in the zoneinfo directory only */
+        if (strstr(name, "..")) return 1;
+        dir_len = strlen(CRON_ZONEINFO_DIR);
+    }
+    if (dir_len + name_len >= CRON_ZONE_MAX_PATH_LEN) return 1;
+    memcpy(path, CRON_ZONEINFO_DIR, dir_len);
+    memcpy(path + dir_len, name, name_len + 1);
+
+    file = fopen(path, "rb");
+    if (!file) return 1;
+    if (0 != fseek(file, 0, SEEK_END)) goto return_res;
+    file_len = ftell(file);
+    if (file_len <= 0 || 0 != fseek(file, 0, SEEK_SET)) goto return_res;
+    data = (uint8_t*) cron_malloc((size_t) file_len);
+    if (!data) goto return_res;
+    if ((size_t) file_len != fread(data, 1, (size_t) file_len, file)) goto return_res;
+    res = cron_zone_load(data, (size_t) file_len, out);
+
+    return_res:
+    if (data) cron_free(data);
+    fclose(file);
+    return res;
+}
+
+#endif /* CRON_FREESTANDING */
+
+int cron_zone_fixed(int32_t offset, cron_zone* out) {
+    if (!out) return 1;
+    memset(out, 0, sizeof(cron_zone));
+    if (offset <= -CRON_ZONE_MAX_OFFSET || offset >= CRON_ZONE_MAX_OFFSET) return 1;
+    out->initial_offset = offset;
+    return 0;
+}
+
+void cron_zone_free(cron_zone* zone) {
+    if (!zone) return;
+#ifndef CRON_FREESTANDING
+    if (zone->transitions) cron_free(zone->transitions);
+    if (zone->offsets) cron_free(zone->offsets);
+#endif /* CRON_FREESTANDING */
+    zone->transitions = NULL;
+    zone->offsets = NULL;
+    zone->count = 0;
+}
+
+/* number of transitions at or before the specified UTC date */
+static size_t zone_period(const cron_zone* zone, int64_t date) {
+    size_t lo = 0;
+    size_t hi = zone->count;
+    size_t mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (zone->transitions[mid] <= date) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* number of transitions at or before the specified wall date */
+static size_t zone_period_wall(const cron_zone* zone, int64_t wall) {
+    size_t lo = 0;
+    size_t hi = zone->count;
+    size_t mid;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (zone->transitions[mid] + zone->offsets[mid] <= wall) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Maps a wall date to UTC. For a date in a gap sets 'end' to the end
+ * of the gap, for a date in an overlap returns its first occurrence and
+ * sets 'end' to the end of the overlap.
+ */
+static int zone_resolve(const cron_zone* zone, int64_t wall, int64_t* date, int64_t* end) {
+    size_t period = zone_period_wall(zone, wall);
+    *date = wall - zone_offset(zone, period);
+    *end = wall + 1;
+    if (period < zone->count && *date >= zone->transitions[period]) {
+        *end = zone->transitions[period] + zone->offsets[period];
+        return CRON_ZONE_GAP;
+    }
+    if (period > 0 && wall - zone_offset(zone, period - 1) < zone->transitions[period - 1]) {
+        *date = wall - zone_offset(zone, period - 1);
+        *end = zone->transitions[period - 1] + zone_offset(zone, period - 1);
+        return CRON_ZONE_OVERLAP;
+    }
+    return CRON_ZONE_NORMAL;
+}
+
+static int zone_search(const cron_expr* expr, int64_t wall, int forward, int64_t* out) {
+    time_t date = (time_t) wall;
+    time_t res;
+    if ((int64_t) date != wall) return 0;
+    res = forward ? search_next(&SEARCH_CIVIL, expr, date) : search_prev(&SEARCH_CIVIL, expr, date);
+    if (CRON_INVALID_INSTANT == res) return 0;
+    *out = (int64_t) res;
+    return 1;
+}
+
+static time_t zone_result(int found, int64_t date) {
+    if (!found || (int64_t) (time_t) date != date) return CRON_INVALID_INSTANT;
+    return (time_t) date;
+}
+
+static time_t zone_next(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    int64_t now = (int64_t) date;
+    int64_t best = 0;
+    int found = 0;
+    int gaps = 0;
+    int kind;
+    int64_t wall;
+    int64_t cand;
+    int64_t res;
+    int64_t end;
+    size_t period;
+    int i;
+    if (!expr || !zone) return CRON_INVALID_INSTANT;
+    period = zone_period(zone, now);
+    /* right after a forward transition the shifted dates of the gap are still ahead */
+    if (period > 0 && zone_offset(zone, period) > zone_offset(zone, period - 1)
+            && now < zone->transitions[period - 1] + zone_offset(zone, period) - zone_offset(zone, period - 1)
+            && zone_search(expr, now + zone_offset(zone, period - 1), 1, &cand)
+            && cand < zone->transitions[period - 1] + zone_offset(zone, period)) {
+        best = cand - zone_offset(zone, period - 1);
+        found = 1;
+    }
+    wall = now + zone_offset(zone, period);
+    for (i = 0; i < CRON_ZONE_MAX_STEPS; i++) {
+        if (!zone_search(expr, wall, 1, &cand)) break;
+        kind = zone_resolve(zone, cand, &res, &end);
+        if (CRON_ZONE_OVERLAP == kind && res <= now) {
+            /* already fired at the first occurrence */
+            wall = end - 1;
+            continue;
+        }
+        if (!found || res < best) best = res;
+        found = 1;
+        /* dates right after a gap may come before the shifted one */
+        if (CRON_ZONE_GAP != kind || gaps++ > 0) break;
+        wall = end - 1;
+    }
+    return zone_result(found, best);
+}
+
+static time_t zone_prev(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    int64_t now = (int64_t) date;
+    int64_t best = 0;
+    int found = 0;
+    int64_t wall;
+    int64_t cand;
+    int64_t res;
+    int64_t end;
+    int64_t gap_start;
+    int64_t gap_end;
+    size_t period;
+    int i;
+    if (!expr || !zone) return CRON_INVALID_INSTANT;
+    period = zone_period(zone, now);
+    /* in the second occurrence of an overlap the first occurrences of later wall dates are behind */
+    if (period > 0 && zone_offset(zone, period) < zone_offset(zone, period - 1)
+            && now < zone->transitions[period - 1] + zone_offset(zone, period - 1) - zone_offset(zone, period)
+            && zone_search(expr, zone->transitions[period - 1] + zone_offset(zone, period - 1), 0, &cand)
+            && cand >= zone->transitions[period - 1] + zone_offset(zone, period)) {
+        best = cand - zone_offset(zone, period - 1);
+        found = 1;
+    }
+    wall = now + zone_offset(zone, period);
+    for (i = 0; i < CRON_ZONE_MAX_STEPS; i++) {
+        if (!zone_search(expr, wall, 0, &cand)) break;
+        zone_resolve(zone, cand, &res, &end);
+        if (res < now) {
+            if (!found || res > best) best = res;
+            found = 1;
+            break;
+        }
+        /* a date in a gap shifted forward past 'date', search before it */
+        wall = now + (cand - res);
+    }
+    period = found ? zone_period(zone, best) : 0;
+    /* shifted dates of a gap can come after the dates right after the gap */
+    if (period > 0 && zone_offset(zone, period) > zone_offset(zone, period - 1)) {
+        gap_start = zone->transitions[period - 1] + zone_offset(zone, period - 1);
+        gap_end = zone->transitions[period - 1] + zone_offset(zone, period);
+        wall = now + zone_offset(zone, period - 1) < gap_end ? now + zone_offset(zone, period - 1) : gap_end;
+        if (best < zone->transitions[period - 1] + gap_end - gap_start
+                && zone_search(expr, wall, 0, &cand) && cand >= gap_start
+                && cand - zone_offset(zone, period - 1) > best) {
+            best = cand - zone_offset(zone, period - 1);
+        }
+    }
+    return zone_result(found, best);
+}
+
+time_t cron_next_tz(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    time_t res;
+    CRON_STATS_START(start);
+    res = zone_next(expr, zone, date);
+    CRON_STATS_LATENCY(CRON_STATS_NEXT_TZ, start);
+    return res;
+}
+
+time_t cron_prev_tz(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    time_t res;
+    CRON_STATS_START(start);
+    res = zone_prev(expr, zone, date);
+    CRON_STATS_LATENCY(CRON_STATS_PREV_TZ, start);
+    return res;
+}
+
+
+/**
+ * Trace capture.
+ *
+ * A trace file is a sequence of sessions, one per 'cron_trace_start'. A session
+ * starts with a header ("CRTR" magic, version byte, flags byte with bit 0 set
+ * for local time builds) followed by records of a type byte and varints:
+ * - 'E': expression id, then the expression structure as is;
+ * - 'N' or 'P' ('cron_next' or 'cron_prev'): expression id, zigzag delta
+ *   of the input date from the input date of the previous record, zigzag delta
+ *   of the result from the input date.
+ * Every expression is written once per session, before the first query using it.
+ */
+#ifdef CRON_USE_TRACE
+
+#ifndef _WIN32
+#include <pthread.h>
+#else /* _WIN32 */
+#include <windows.h>
+#endif /* _WIN32 */
+
+#define CRON_TRACE_VERSION 1
+#define CRON_TRACE_FLAG_LOCAL_TIME 1
+#define CRON_TRACE_RECORD_MAX_LEN (1 + 10 + sizeof(cron_expr) + 3 * 10)
+
+static const uint8_t TRACE_MAGIC[] = { 'C', 'R', 'T', 'R' };
+
+typedef struct {
+    cron_expr expr;
+    uint32_t id;
+    int used;
+} cron_trace_entry;
+
+static FILE* trace_file = NULL;
+static cron_trace_entry* trace_table = NULL;
+static size_t trace_capacity = 0;
+static size_t trace_len = 0;
+static time_t trace_last = 0;
+
+#ifndef _WIN32
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CRON_TRACE_LOCK() pthread_mutex_lock(&trace_lock)
+#define CRON_TRACE_UNLOCK() pthread_mutex_unlock(&trace_lock)
+#else /* _WIN32 */
+static SRWLOCK trace_lock = SRWLOCK_INIT;
+#define CRON_TRACE_LOCK() AcquireSRWLockExclusive(&trace_lock)
+#define CRON_TRACE_UNLOCK() ReleaseSRWLockExclusive(&trace_lock)
+#endif /* _WIN32 */
+
+static uint64_t zigzag(int64_t value) {
+    return value < 0 ? ((uint64_t) (-(value + 1)) << 1) | 1 : (uint64_t) value << 1;
+}
+
+static int trace_grow(void) {
+    cron_trace_entry* old = trace_table;
+    size_t old_capacity = trace_capacity;
+    size_t i;
+    size_t j;
+    trace_capacity = old_capacity > 0 ? old_capacity * 2 : 64;
+    /* not counted by cron_malloc, like the statistics */
+    trace_table = (cron_trace_entry*) calloc(trace_capacity, sizeof(cron_trace_entry));
+    if (!trace_table) {
+        trace_table = old;
+        trace_capacity = old_capacity;
+        return 1;
+    }
+    for (i = 0; i < old_capacity; i++) {
+        if (!old[i].used) continue;
+        j = cron_expr_hash(&old[i].expr) & (trace_capacity - 1);
+        while (trace_table[j].used) {
+            j = (j + 1) & (trace_capacity - 1);
+        }
+        trace_table[j] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+/* returns the id of the expression, writing it to the record first if it is new */
+static uint32_t trace_expr_id(const cron_expr* expr, uint8_t* record, size_t* len) {
+    size_t i;
+    if (2 * (trace_len + 1) > trace_capacity && 0 != trace_grow()) return 0;
+    i = cron_expr_hash(expr) & (trace_capacity - 1);
+    while (trace_table[i].used) {
+        if (0 == memcmp(&trace_table[i].expr, expr, sizeof(cron_expr))) return trace_table[i].id;
+        i = (i + 1) & (trace_capacity - 1);
+    }
+    trace_table[i].used = 1;
+    trace_table[i].id = (uint32_t) ++trace_len;
+    memcpy(&trace_table[i].expr, expr, sizeof(cron_expr));
+    record[(*len)++] = 'E';
+    *len += put_varint(record + *len, trace_table[i].id);
+    memcpy(record + *len, expr, sizeof(cron_expr));
+    *len += sizeof(cron_expr);
+    return trace_table[i].id;
+}
+
+static void trace_search(char api, const cron_expr* expr, time_t date, time_t res) {
+    uint8_t record[2 * CRON_TRACE_RECORD_MAX_LEN];
+    size_t len = 0;
+    uint32_t id;
+    if (!expr) return;
+    CRON_TRACE_LOCK();
+    if (trace_file) {
+        id = trace_expr_id(expr, record, &len);
+        if (id > 0) {
+            record[len++] = (uint8_t) api;
+            len += put_varint(record + len, id);
+            len += put_varint(record + len, zigzag((int64_t) date - (int64_t) trace_last));
+            len += put_varint(record + len, zigzag((int64_t) res - (int64_t) date));
+            trace_last = date;
+            fwrite(record, 1, len, trace_file);
+        }
+    }
+    CRON_TRACE_UNLOCK();
+}
+
+int cron_trace_start(const char* path) {
+    uint8_t header[6];
+    int res = 1;
+    if (!path) return 1;
+    CRON_TRACE_LOCK();
+    if (!trace_file) {
+        trace_file = fopen(path, "ab");
+        if (trace_file) {
+            memcpy(header, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+            header[4] = CRON_TRACE_VERSION;
+#ifdef CRON_USE_LOCAL_TIME
+            header[5] = CRON_TRACE_FLAG_LOCAL_TIME;
+#else
+            header[5] = 0;
+#endif
+            fwrite(header, 1, sizeof(header), trace_file);
+            trace_last = 0;
+            res = 0;
+        }
+    }
+    CRON_TRACE_UNLOCK();
+    return res;
+}
+
+void cron_trace_stop(void) {
+    CRON_TRACE_LOCK();
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    free(trace_table);
+    trace_table = NULL;
+    trace_capacity = 0;
+    trace_len = 0;
+    CRON_TRACE_UNLOCK();
+}
+
+#endif /* CRON_USE_TRACE */
@@ -36,8 +36,16 @@ extern "C" {
 
 #include <stdint.h> /*added for use if uint*_t data types*/
 
+/* local time by default where 'timegm' is missing, CRON_USE_UTC opts out,
+   defined here so that the headers built on this one see the same mode */
+#if (defined(ESP8266) || defined(ESP_PLATFORM) || defined(TARGET_LIKE_MBED)) && !defined(CRON_FREESTANDING)
+  #if !defined(CRON_USE_LOCAL_TIME) && !defined(CRON_USE_UTC)
+    #define CRON_USE_LOCAL_TIME
+  #endif
+#endif
 
 #define CRON_INVALID_INSTANT ((time_t) -1)
+#define CRON_INVALID_INSTANT_MS ((int64_t) -1)
 
 
 /**
@@ -50,6 +58,10 @@ typedef struct {
     uint8_t days_of_week[1];
     uint8_t days_of_month[4];
     uint8_t months[2];
+    uint8_t days_of_month_last[4];    /* L, L-n: bit n for n days before the last day of month */
+    uint8_t days_of_month_weekday[4]; /* nW: bit n for the weekday nearest to day n, bit 0 for LW */
+    uint8_t days_of_week_last[1];     /* dL: bit d for the last day of week d in month */
+    uint8_t days_of_week_nth[5];      /* d#n: bit d of byte n - 1 for the n-th day of week d in month */
 } cron_expr;
 
 /**
@@ -65,6 +77,22 @@ typedef struct {
  */
 void cron_parse_expr(const char* expression, cron_expr* target, const char** error);
 
+/**
+ * Parses specified cron expression, resolving hashed 'H' items of the fields
+ * with the specified seed. 'H' picks a stable value from the whole field range
+ * (1-28 for days of month), 'H(a-b)' picks it from the given range, 'H/n' and
+ * 'H(a-b)/n' pick the start of the incrementer. The same expression and seed
+ * always produce the same result, 'cron_parse_expr' uses seed 0.
+ *
+ * @param expression cron expression as nul-terminated string,
+ *        should be no longer that 256 bytes
+ * @param target pointer to cron expression structure
+ * @param seed seed of the hashed items, e.g. hash of the job id
+ * @param error output error message, will be set to string literal
+ *        error message in case of error. Will be set to NULL on success.
+ */
+void cron_parse_expr_seeded(const char* expression, cron_expr* target, uint32_t seed, const char** error);
+
 /**
  * Uses the specified expression to calculate the next 'fire' date after
  * the specified date. All dates are processed as UTC (GMT) dates 
@@ -75,7 +103,7 @@ void cron_parse_expr(const char* expression, cron_expr* target, const char** err
  * @param date start date to start calculation from
  * @return next 'fire' date in case of success, '((time_t) -1)' in case of error.
  */
-time_t cron_next(cron_expr* expr, time_t date);
+time_t cron_next(const cron_expr* expr, time_t date);
 
 /**
  * Uses the specified expression to calculate the previous 'fire' date after
@@ -87,7 +115,410 @@ time_t cron_next(cron_expr* expr, time_t date);
  * @param date start date to start calculation from
  * @return previous 'fire' date in case of success, '((time_t) -1)' in case of error.
  */
-time_t cron_prev(cron_expr* expr, time_t date);
+time_t cron_prev(const cron_expr* expr, time_t date);
+
+#define CRON_STEP_DONE 0
+#define CRON_STEP_PENDING 1
+
+/* Smallest budget of a single step, enough to reach the next resumption point */
+#define CRON_STEP_MIN_BUDGET 24
+
+/**
+ * State of a next 'fire' date search performed in bounded steps,
+ * initialized with 'cron_next_init', fields other than 'result'
+ * and 'spent' are internal.
+ */
+typedef struct {
+    const cron_expr* expr;
+    time_t date;
+    time_t original;
+    time_t result;        /* next 'fire' date once 'cron_next_step' returns CRON_STEP_DONE */
+    unsigned long spent;  /* work units spent by all the steps so far */
+    struct tm calendar;
+    int year;
+    int phase;
+} cron_next_state;
+
+/**
+ * Initializes a search of the next 'fire' date after the specified date,
+ * no work is done until 'cron_next_step' is called.
+ *
+ * @param state search state to initialize
+ * @param expr parsed cron expression, must stay valid until the search is done
+ * @param date start date to start calculation from
+ */
+void cron_next_init(cron_next_state* state, const cron_expr* expr, time_t date);
+
+/**
+ * Continues the search of the next 'fire' date doing at most 'budget' units
+ * of work, one unit being a calendar normalization (a 'timegm' or 'mktime' call),
+ * the dominant cost of the search. The result is the same as of 'cron_next'
+ * for the same expression and date.
+ *
+ * @param state search state initialized with 'cron_next_init'
+ * @param budget most work units to spend, at least CRON_STEP_MIN_BUDGET
+ * @return CRON_STEP_DONE if the search is finished and 'state->result' holds
+ *         the next 'fire' date or '((time_t) -1)' in case of error,
+ *         CRON_STEP_PENDING if the budget ran out and the search needs another step
+ */
+int cron_next_step(cron_next_state* state, unsigned long budget);
+
+/**
+ * Calculates an upper bound of the work units a next 'fire' date search
+ * with the specified expression takes from any start date. A step that runs
+ * out of budget repeats at most CRON_STEP_MIN_BUDGET units in the next step,
+ * so steps with a budget 'b' greater than CRON_STEP_MIN_BUDGET finish any search
+ * in at most 'bound / (b - CRON_STEP_MIN_BUDGET) + 1' calls.
+ *
+ * @param expr parsed cron expression
+ * @return most work units of a search
+ */
+unsigned long cron_next_cost_bound(const cron_expr* expr);
+
+/**
+ * Calculates the next 'fire' date strictly after the specified date
+ * with millisecond resolution. A job that fires at a whole second
+ * is returned as exactly that second, without rounding to the second
+ * of the specified date.
+ *
+ * @param expr parsed cron expression to use in next date calculation
+ * @param date_ms start date in milliseconds since the epoch
+ * @return next 'fire' date in milliseconds since the epoch in case of success,
+ *         '((int64_t) -1)' in case of error.
+ */
+int64_t cron_next_ms(const cron_expr* expr, int64_t date_ms);
+
+/**
+ * Calculates the previous 'fire' date strictly before the specified date
+ * with millisecond resolution.
+ *
+ * @param expr parsed cron expression to use in previous date calculation
+ * @param date_ms start date in milliseconds since the epoch
+ * @return previous 'fire' date in milliseconds since the epoch in case of success,
+ *         '((int64_t) -1)' in case of error.
+ */
+int64_t cron_prev_ms(const cron_expr* expr, int64_t date_ms);
+
+/**
+ * Hashes a parsed expression (FNV-1a over its bit fields), for the hash
+ * tables that intern identical expressions: identical expressions hash
+ * the same, candidates of a bucket are compared with 'memcmp'.
+ *
+ * @param expr parsed cron expression
+ * @return 32-bit hash
+ */
+uint32_t cron_expr_hash(const cron_expr* expr);
+
+#ifndef CRON_FREESTANDING
+
+/**
+ * Block index entry of a materialized timeline, one per 64 entries
+ */
+typedef struct {
+    time_t base;
+    size_t offset;
+} cron_timeline_block;
+
+/**
+ * Occurrences of one or more expressions over the [from, to) range,
+ * stored as a self-contained buffer of varint-encoded deltas.
+ * 'data' and 'len' can be shipped to another process as is
+ * and read back with 'cron_timeline_load'.
+ */
+typedef struct {
+    uint8_t* data;
+    size_t len;
+    size_t capacity;
+    time_t from;
+    time_t to;
+    time_t last;
+    size_t count;
+    int merged;
+    cron_timeline_block* blocks;
+    size_t blocks_len;
+    size_t blocks_capacity;
+} cron_timeline;
+
+/**
+ * Position in a materialized timeline
+ */
+typedef struct {
+    const cron_timeline* timeline;
+    size_t offset;
+    size_t index;
+    time_t time;
+} cron_timeline_iter;
+
+/**
+ * Materializes all 'fire' dates of the specified expression within
+ * the [from, to) range.
+ *
+ * @param expr parsed cron expression
+ * @param from start of the range (inclusive)
+ * @param to end of the range (exclusive)
+ * @param out timeline to initialize, must be released with 'cron_timeline_free'
+ * @return 0 on success, non-zero on error
+ */
+int cron_timeline_build(const cron_expr* expr, time_t from, time_t to, cron_timeline* out);
+
+/**
+ * Materializes a single ordered timeline of all 'fire' dates of the specified
+ * expressions within the [from, to) range. Each entry carries the job id of
+ * the expression that fired, entries with the same date are ordered
+ * as the expressions in the input array.
+ *
+ * @param exprs array of parsed cron expressions
+ * @param ids job ids of the expressions, array indices are used if NULL
+ * @param count number of expressions
+ * @param from start of the range (inclusive)
+ * @param to end of the range (exclusive)
+ * @param out timeline to initialize, must be released with 'cron_timeline_free'
+ * @return 0 on success, non-zero on error
+ */
+int cron_timeline_build_merged(const cron_expr* exprs, const uint32_t* ids, size_t count, time_t from, time_t to, cron_timeline* out);
+
+/**
+ * Restores a timeline from a buffer previously produced by one of the build
+ * functions. The buffer is validated and copied.
+ *
+ * @param data serialized timeline
+ * @param len length of the serialized timeline in bytes
+ * @param out timeline to initialize, must be released with 'cron_timeline_free'
+ * @return 0 on success, non-zero if the buffer is malformed
+ */
+int cron_timeline_load(const uint8_t* data, size_t len, cron_timeline* out);
+
+/**
+ * Releases memory held by the timeline.
+ *
+ * @param timeline timeline to release
+ */
+void cron_timeline_free(cron_timeline* timeline);
+
+/**
+ * Positions the iterator at the first entry of the timeline.
+ *
+ * @param timeline timeline to iterate
+ * @param it iterator to initialize
+ */
+void cron_timeline_begin(const cron_timeline* timeline, cron_timeline_iter* it);
+
+/**
+ * Positions the iterator at the first entry strictly after the specified date
+ * using the block index.
+ *
+ * @param timeline timeline to iterate
+ * @param date date to search from
+ * @param it iterator to initialize
+ */
+void cron_timeline_seek(const cron_timeline* timeline, time_t date, cron_timeline_iter* it);
+
+/**
+ * Reads the entry at the iterator position and advances the iterator.
+ *
+ * @param it timeline iterator
+ * @param date output 'fire' date of the entry, may be NULL
+ * @param job_id output job id of the entry (0 for non-merged timelines), may be NULL
+ * @return 1 if an entry was read, 0 at the end of the timeline
+ */
+int cron_timeline_next(cron_timeline_iter* it, time_t* date, uint32_t* job_id);
+
+/**
+ * Counts 'fire' dates of the specified expressions per fixed-size bucket
+ * within the [from, to) range without enumerating every occurrence.
+ * Bucket 'i' covers [from + i * bucket_seconds, from + (i + 1) * bucket_seconds).
+ * Counts are added to the existing values of 'out_counts', so disjoint
+ * subsets of a large expressions set can be processed on separate threads
+ * into separate arrays and summed afterwards. Counters are 64-bit, as a busy
+ * bucket of a large set exceeds 2^32 fires (200k every-second jobs over a day).
+ *
+ * @param exprs array of parsed cron expressions
+ * @param count number of expressions
+ * @param from start of the range (inclusive)
+ * @param to end of the range (exclusive)
+ * @param bucket_seconds bucket size in seconds
+ * @param out_counts array of at least '(to - from + bucket_seconds - 1) / bucket_seconds' counters
+ * @return 0 on success, non-zero on error
+ */
+int cron_load_histogram(const cron_expr* exprs, size_t count, time_t from, time_t to, unsigned int bucket_seconds, uint64_t* out_counts);
+
+#endif /* CRON_FREESTANDING */
+
+/**
+ * Builds an expression that matches exactly the dates matched by both
+ * specified expressions. Days of month and days of week must both match
+ * for a date to fire, so the intersection is computed field by field.
+ *
+ * @param a first parsed cron expression
+ * @param b second parsed cron expression
+ * @param out intersection of the expressions, may point to 'a' or 'b'
+ * @return 1 if every field of the intersection is non-empty, 0 if the expressions
+ *         can never fire at the same instant, -1 if the L, W or # day modifiers
+ *         of the expressions cannot be combined into a single expression
+ */
+int cron_expr_intersect(const cron_expr* a, const cron_expr* b, cron_expr* out);
+
+/**
+ * Calculates the next date after the specified one at which both
+ * expressions fire.
+ *
+ * @param a first parsed cron expression
+ * @param b second parsed cron expression
+ * @param date start date to start calculation from
+ * @return next common 'fire' date in case of success, '((time_t) -1)' if there is none or in case of error.
+ */
+time_t cron_next_common(const cron_expr* a, const cron_expr* b, time_t date);
+
+/**
+ * Calculates the previous date before the specified one at which both
+ * expressions fire.
+ *
+ * @param a first parsed cron expression
+ * @param b second parsed cron expression
+ * @param date start date to start calculation from
+ * @return previous common 'fire' date in case of success, '((time_t) -1)' if there is none or in case of error.
+ */
+time_t cron_prev_common(const cron_expr* a, const cron_expr* b, time_t date);
+
+/**
+ * Time zone: UTC offsets in effect between the transitions, loaded from
+ * a TZif file or fixed. Transitions of the daylight saving time rule stored
+ * at the end of a TZif file are precomputed up to the year 2200.
+ */
+typedef struct {
+    int64_t* transitions;   /* UTC dates at which the offset changes, ascending */
+    int32_t* offsets;       /* UTC offset in seconds in effect from the matching transition */
+    size_t count;
+    int32_t initial_offset; /* UTC offset in seconds before the first transition */
+} cron_zone;
+
+#ifndef CRON_FREESTANDING
+
+/**
+ * Loads a time zone from a TZif buffer, e.g. a file of the IANA time zone
+ * database. The buffer is not referenced after the call.
+ *
+ * @param data TZif data
+ * @param len length of the data in bytes
+ * @param out zone to initialize, must be released with 'cron_zone_free'
+ * @return 0 on success, non-zero if the data is malformed
+ */
+int cron_zone_load(const uint8_t* data, size_t len, cron_zone* out);
+
+/**
+ * Loads a time zone from a TZif file.
+ *
+ * @param name absolute path to the file or IANA time zone name, e.g. "Europe/Berlin",
+ *        that is looked up in the CRON_ZONEINFO_DIR directory ("/usr/share/zoneinfo/" by default)
+ * @param out zone to initialize, must be released with 'cron_zone_free'
+ * @return 0 on success, non-zero on error
+ */
+int cron_zone_load_file(const char* name, cron_zone* out);
+
+#endif /* CRON_FREESTANDING */
+
+/**
+ * Initializes a zone with a fixed UTC offset and no transitions, e.g. 0 for UTC.
+ * Evaluation in such zone is done arithmetically, the zone does not hold any memory.
+ *
+ * @param offset UTC offset in seconds, positive east of Greenwich, less than 26 hours
+ * @param out zone to initialize
+ * @return 0 on success, non-zero if the offset is out of range
+ */
+int cron_zone_fixed(int32_t offset, cron_zone* out);
+
+/**
+ * Releases memory held by the zone.
+ *
+ * @param zone zone to release
+ */
+void cron_zone_free(cron_zone* zone);
+
+/**
+ * Calculates the next 'fire' date after the specified date evaluating
+ * the expression in the wall time of the specified zone. Standard library
+ * time functions are not used, so zones can differ between calls and threads.
+ * Wall dates skipped by a forward transition fire shifted forward by the length
+ * of the gap, wall dates repeated by a backward transition fire only once,
+ * at their first occurrence.
+ *
+ * @param expr parsed cron expression to use in next date calculation
+ * @param zone time zone to evaluate the expression in
+ * @param date start date to start calculation from
+ * @return next 'fire' date in case of success, '((time_t) -1)' in case of error.
+ */
+time_t cron_next_tz(const cron_expr* expr, const cron_zone* zone, time_t date);
+
+/**
+ * Calculates the previous 'fire' date before the specified date evaluating
+ * the expression in the wall time of the specified zone, see 'cron_next_tz'.
+ *
+ * @param expr parsed cron expression to use in previous date calculation
+ * @param zone time zone to evaluate the expression in
+ * @param date start date to start calculation from
+ * @return previous 'fire' date in case of success, '((time_t) -1)' in case of error.
+ */
+time_t cron_prev_tz(const cron_expr* expr, const cron_zone* zone, time_t date);
+
+#ifdef CRON_USE_STATS
+
+#define CRON_STATS_PARSE 0
+#define CRON_STATS_NEXT 1
+#define CRON_STATS_PREV 2
+#define CRON_STATS_NEXT_TZ 3
+#define CRON_STATS_PREV_TZ 4
+#define CRON_STATS_API_COUNT 5
+#define CRON_STATS_LATENCY_BUCKETS 32
+
+/**
+ * Counters collected when compiled with '-DCRON_USE_STATS'
+ */
+typedef struct {
+    uint64_t calls[CRON_STATS_API_COUNT];       /* calls of the public functions, indexed by CRON_STATS_* */
+    uint64_t latency[CRON_STATS_API_COUNT][CRON_STATS_LATENCY_BUCKETS]; /* bucket n: calls that took [2^n, 2^(n+1)) ns */
+    uint64_t recursions;        /* search steps, including the internal searches of the other functions */
+    uint64_t max_depth;         /* deepest search recursion */
+    uint64_t day_iterations;    /* months scanned while looking for a matching day */
+    uint64_t normalizations;    /* calendar normalizations ('cron_mktime' calls) */
+    uint64_t allocations;       /* all allocations */
+    uint64_t parse_allocations; /* allocations made while parsing */
+} cron_stats;
+
+/**
+ * Reads counters summed over all threads. Counters of a thread are
+ * updated by that thread only, without synchronization, so a read
+ * concurrent with searches is approximate.
+ *
+ * @param out counters to fill
+ */
+void cron_stats_read(cron_stats* out);
+
+/**
+ * Resets counters of all threads.
+ */
+void cron_stats_reset(void);
+
+#endif /* CRON_USE_STATS */
+
+#ifdef CRON_USE_TRACE
+
+/**
+ * Starts appending every 'cron_next' and 'cron_prev' call (expression,
+ * input date, result) to the specified trace file, available when compiled
+ * with '-DCRON_USE_TRACE'. Expressions are stored parsed, without their text.
+ * Traces are replayed with the 'ccronexpr_replay' tool.
+ *
+ * @param path trace file, created or appended to
+ * @return 0 on success, non-zero if the file cannot be opened or a capture is already running
+ */
+int cron_trace_start(const char* path);
+
+/**
+ * Stops the trace capture and closes the trace file.
+ */
+void cron_trace_stop(void);
+
+#endif /* CRON_USE_TRACE */
 
 
 #if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
@@ -0,0 +1,861 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr.hpp
+ *
+ * Header-only C++20 layer over the C API: value-type expressions,
+ * std::chrono time points, lazy ranges of occurrences and expressions
+ * parsed at compile time. Does not throw, errors are returned as values.
+ */
+
+#ifndef CCRONEXPR_HPP
+#define CCRONEXPR_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <ranges>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "ccronexpr.h"
+
+namespace cron {
+
+using sys_seconds = std::chrono::sys_seconds;
+
+/**
+ * Parse error, the message is a static string of the C parser
+ */
+class parse_error {
+public:
+    constexpr explicit parse_error(const char* message) noexcept : message_(message) { }
+
+    constexpr const char* message() const noexcept {
+        return message_;
+    }
+
+    friend bool operator==(const parse_error& a, const parse_error& b) noexcept {
+        return 0 == std::strcmp(a.message_, b.message_);
+    }
+
+private:
+    const char* message_;
+};
+
+/**
+ * Either a value or a parse error, modelled after std::expected
+ * without the exceptions: 'value()' on an error is undefined behavior.
+ */
+template <class T>
+class result {
+public:
+    constexpr result(T value) noexcept : value_(std::move(value)), error_(nullptr) { }
+
+    constexpr result(parse_error error) noexcept : value_(), error_(error.message()) { }
+
+    constexpr bool has_value() const noexcept {
+        return nullptr == error_;
+    }
+
+    constexpr explicit operator bool() const noexcept {
+        return has_value();
+    }
+
+    constexpr const T& value() const& noexcept {
+        return value_;
+    }
+
+    constexpr T&& value() && noexcept {
+        return std::move(value_);
+    }
+
+    constexpr const T& operator*() const& noexcept {
+        return value_;
+    }
+
+    constexpr const T* operator->() const noexcept {
+        return &value_;
+    }
+
+    constexpr T value_or(T other) const noexcept {
+        return has_value() ? value_ : other;
+    }
+
+    constexpr parse_error error() const noexcept {
+        return parse_error(error_);
+    }
+
+private:
+    T value_;
+    const char* error_;
+};
+
+/**
+ * Parsed cron expression, a trivially copyable value
+ */
+class expr {
+public:
+    /** Expression that never fires */
+    constexpr expr() noexcept : raw_() { }
+
+    constexpr explicit expr(const cron_expr& raw) noexcept : raw_(raw) { }
+
+    /**
+     * Parses the specified cron expression.
+     *
+     * @param text cron expression, does not need to be null-terminated
+     * @param seed seed of the hashed 'H' items, e.g. a job id hash
+     * @return parsed expression or the parse error
+     */
+    static result<expr> parse(std::string_view text, std::uint32_t seed = 0) noexcept {
+        /* longer expressions are rejected by the C parser, a copy is made only to report its error */
+        char buf[256];
+        expr res;
+        const char* error = nullptr;
+        if (text.size() < sizeof(buf)) {
+            std::memcpy(buf, text.data(), text.size());
+            buf[text.size()] = '\0';
+            cron_parse_expr_seeded(buf, &res.raw_, seed, &error);
+        } else {
+            cron_parse_expr_seeded(std::string(text).c_str(), &res.raw_, seed, &error);
+        }
+        if (error) return parse_error(error);
+        return res;
+    }
+
+    /**
+     * Calculates the next 'fire' date strictly after the specified date.
+     *
+     * @param date start date, rounded down to whole seconds
+     * @return next 'fire' date, empty if there is none
+     */
+    template <class Duration>
+    std::optional<sys_seconds> next(std::chrono::sys_time<Duration> date) const noexcept {
+        return from_c(cron_next(&raw_, to_c(std::chrono::floor<std::chrono::seconds>(date))));
+    }
+
+    /**
+     * Calculates the previous 'fire' date strictly before the specified date.
+     *
+     * @param date start date, rounded up to whole seconds
+     * @return previous 'fire' date, empty if there is none
+     */
+    template <class Duration>
+    std::optional<sys_seconds> prev(std::chrono::sys_time<Duration> date) const noexcept {
+        return from_c(cron_prev(&raw_, to_c(std::chrono::ceil<std::chrono::seconds>(date))));
+    }
+
+    /** Parsed expression for the C API */
+    constexpr const cron_expr& c_expr() const noexcept {
+        return raw_;
+    }
+
+    friend bool operator==(const expr& a, const expr& b) noexcept {
+        return 0 == std::memcmp(&a.raw_, &b.raw_, sizeof(cron_expr));
+    }
+
+private:
+    static time_t to_c(sys_seconds date) noexcept {
+        return static_cast<time_t>(date.time_since_epoch().count());
+    }
+
+    static std::optional<sys_seconds> from_c(time_t date) noexcept {
+        if (CRON_INVALID_INSTANT == date) return std::nullopt;
+        return sys_seconds(std::chrono::seconds(date));
+    }
+
+    cron_expr raw_;
+};
+
+/**
+ * Lazy view of the 'fire' dates of an expression strictly after a date,
+ * in ascending order. Every increment continues the search from the
+ * current date, the view ends when there is no next date.
+ */
+class occurrences_view : public std::ranges::view_interface<occurrences_view> {
+public:
+    class iterator {
+    public:
+        using value_type = sys_seconds;
+        using difference_type = std::ptrdiff_t;
+        using iterator_concept = std::forward_iterator_tag;
+
+        iterator() noexcept : expr_(nullptr), current_(), done_(true) { }
+
+        iterator(const expr* e, sys_seconds after) noexcept : expr_(e), current_(after), done_(false) {
+            ++*this;
+        }
+
+        sys_seconds operator*() const noexcept {
+            return current_;
+        }
+
+        iterator& operator++() noexcept {
+            std::optional<sys_seconds> next = expr_->next(current_);
+            if (next) {
+                current_ = *next;
+            } else {
+                done_ = true;
+            }
+            return *this;
+        }
+
+        iterator operator++(int) noexcept {
+            iterator res = *this;
+            ++*this;
+            return res;
+        }
+
+        friend bool operator==(const iterator& a, const iterator& b) noexcept {
+            return a.done_ == b.done_ && (a.done_ || a.current_ == b.current_);
+        }
+
+        friend bool operator==(const iterator& it, std::default_sentinel_t) noexcept {
+            return it.done_;
+        }
+
+    private:
+        const expr* expr_;
+        sys_seconds current_;
+        bool done_;
+    };
+
+    occurrences_view() noexcept = default;
+
+    occurrences_view(const expr& e, sys_seconds after) noexcept : expr_(e), after_(after) { }
+
+    /** Searches the first date, iterators keep a pointer to the view's expression */
+    iterator begin() const noexcept {
+        return iterator(&expr_, after_);
+    }
+
+    std::default_sentinel_t end() const noexcept {
+        return std::default_sentinel;
+    }
+
+private:
+    expr expr_;
+    sys_seconds after_;
+};
+
+/**
+ * Lazy view of the 'fire' dates of the expression strictly after the specified date,
+ * e.g. 'cron::occurrences(e, from) | std::views::take(100)'.
+ *
+ * @param e expression, copied into the view
+ * @param after start date, rounded down to whole seconds
+ * @return view of the 'fire' dates
+ */
+template <class Duration>
+occurrences_view occurrences(const expr& e, std::chrono::sys_time<Duration> after) noexcept {
+    return occurrences_view(e, std::chrono::floor<std::chrono::seconds>(after));
+}
+
+/**
+ * Compile-time parsing.
+ * A constexpr port of the C parser: the same fields, names, ranges, incrementers,
+ * hashed 'H' items and L, W and # modifiers, with the same error messages.
+ */
+namespace detail {
+
+constexpr int max_seconds = 60;
+constexpr int max_minutes = 60;
+constexpr int max_hours = 24;
+constexpr int max_days_of_month = 32;
+constexpr int max_days_of_week = 8;
+constexpr int max_months = 12;
+constexpr std::size_t max_expression_len = 256;
+
+constexpr const char* day_names[] = { "SUN", "MON", "TUE", "WED", "THU", "FRI", "SAT" };
+constexpr const char* month_names[] = { "FOO", "JAN", "FEB", "MAR", "APR", "MAY", "JUN", "JUL", "AUG", "SEP", "OCT", "NOV", "DEC" };
+
+constexpr void set_bit(std::uint8_t* bits, int idx) noexcept {
+    bits[idx / 8] = static_cast<std::uint8_t>(bits[idx / 8] | (1 << (idx % 8)));
+}
+
+constexpr void del_bit(std::uint8_t* bits, int idx) noexcept {
+    bits[idx / 8] = static_cast<std::uint8_t>(bits[idx / 8] & ~(1 << (idx % 8)));
+}
+
+constexpr bool get_bit(const std::uint8_t* bits, int idx) noexcept {
+    return 0 != (bits[idx / 8] & (1 << (idx % 8)));
+}
+
+constexpr std::uint32_t hash_field(std::uint32_t seed, int field) noexcept {
+    std::uint32_t h = seed ^ (static_cast<std::uint32_t>(field + 1) * 0x9e3779b9U);
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/* a slice of the expression buffer */
+struct slice {
+    char* str;
+    std::size_t len;
+};
+
+constexpr bool is_space(char c) noexcept {
+    return ' ' == c || '\t' == c || '\n' == c || '\v' == c || '\f' == c || '\r' == c;
+}
+
+constexpr bool has_char(std::string_view str, char ch) noexcept {
+    return std::string_view::npos != str.find(ch);
+}
+
+constexpr bool has_any_char(std::string_view str, std::string_view chars) noexcept {
+    return std::string_view::npos != str.find_first_of(chars);
+}
+
+/* next non-empty item of a separated slice, empty at the end */
+constexpr std::string_view next_item(std::string_view str, char del, std::size_t& pos) noexcept {
+    std::size_t start;
+    while (pos < str.size() && del == str[pos]) pos++;
+    start = pos;
+    while (pos < str.size() && del != str[pos]) pos++;
+    return str.substr(start, pos - start);
+}
+
+constexpr std::size_t count_items(std::string_view str, char del) noexcept {
+    std::size_t pos = 0;
+    std::size_t count = 0;
+    while (!next_item(str, del, pos).empty()) count++;
+    return count;
+}
+
+constexpr int parse_uint(std::string_view str, bool& err) noexcept {
+    std::size_t i = 0;
+    bool negative = false;
+    int res = 0;
+    err = true;
+    if (!str.empty() && ('+' == str[0] || '-' == str[0])) {
+        negative = '-' == str[0];
+        i = 1;
+        if (1 == str.size()) return 0;
+    }
+    for (; i < str.size(); i++) {
+        int digit = str[i] - '0';
+        if (digit < 0 || digit > 9) return 0;
+        if (res > (2147483647 - digit) / 10) return 0;
+        res = res * 10 + digit;
+    }
+    if (negative && 0 != res) return 0;
+    err = false;
+    return res;
+}
+
+constexpr void to_upper(slice field) noexcept {
+    for (std::size_t i = 0; i < field.len; i++) {
+        if (field.str[i] >= 'a' && field.str[i] <= 'z') field.str[i] = static_cast<char>(field.str[i] - 'a' + 'A');
+    }
+}
+
+/* names are replaced one after another by their indices, in place */
+template <std::size_t N>
+constexpr std::size_t replace_ordinals(slice field, const char* const (&names)[N]) noexcept {
+    std::size_t len = field.len;
+    for (std::size_t i = 0; i < N; i++) {
+        std::size_t from = 0;
+        std::size_t to = 0;
+        while (from < len) {
+            if (len - from >= 3 && field.str[from] == names[i][0] && field.str[from + 1] == names[i][1]
+                    && field.str[from + 2] == names[i][2]) {
+                if (i >= 10) field.str[to++] = static_cast<char>('0' + i / 10);
+                field.str[to++] = static_cast<char>('0' + i % 10);
+                from += 3;
+            } else {
+                field.str[to++] = field.str[from++];
+            }
+        }
+        len = to;
+    }
+    return len;
+}
+
+constexpr void get_range(std::string_view field, int min, int max, int* res, const char*& error) noexcept {
+    bool err = false;
+    res[0] = 0;
+    res[1] = 0;
+    if (1 == field.size() && '*' == field[0]) {
+        res[0] = min;
+        res[1] = max - 1;
+    } else if (!has_char(field, '-')) {
+        int val = parse_uint(field, err);
+        if (err) {
+            error = "Unsigned integer parse error 1";
+            return;
+        }
+        res[0] = val;
+        res[1] = val;
+    } else {
+        std::size_t pos = 0;
+        if (2 != count_items(field, '-')) {
+            error = "Specified range requires two fields";
+            return;
+        }
+        res[0] = parse_uint(next_item(field, '-', pos), err);
+        if (err) {
+            error = "Unsigned integer parse error 2";
+            return;
+        }
+        res[1] = parse_uint(next_item(field, '-', pos), err);
+        if (err) {
+            error = "Unsigned integer parse error 3";
+            return;
+        }
+    }
+    if (res[0] >= max || res[1] >= max) {
+        error = "Specified range exceeds maximum";
+    } else if (res[0] < min || res[1] < min) {
+        error = "Specified range is less than minimum";
+    } else if (res[0] > res[1]) {
+        error = "Specified range start exceeds range end";
+    } else {
+        error = nullptr;
+    }
+}
+
+constexpr void set_hashed_hits(std::string_view value, std::uint8_t* target, int min, int max, std::uint32_t hash, const char*& error) noexcept {
+    std::string_view cur = value.substr(1);
+    int range[2] = { min, max_days_of_month == max ? 28 : max_days_of_week == max ? 6 : max - 1 };
+    bool err = false;
+    int step = 0;
+    if (!cur.empty() && '(' == cur[0]) {
+        std::size_t close = cur.find(')');
+        if (std::string_view::npos == close) {
+            error = "Unterminated hash range";
+            return;
+        }
+        get_range(cur.substr(1, close - 1), min, max, range, error);
+        if (error) return;
+        cur = cur.substr(close + 1);
+    }
+    if (!cur.empty() && '/' == cur[0]) {
+        step = parse_uint(cur.substr(1), err);
+        if (err || 0 == step) {
+            error = "Invalid hash incrementer";
+            return;
+        }
+    } else if (!cur.empty()) {
+        error = "Invalid hash format";
+        return;
+    }
+    if (0 == step) {
+        set_bit(target, range[0] + static_cast<int>(hash % static_cast<std::uint32_t>(range[1] - range[0] + 1)));
+        return;
+    }
+    if (step > range[1] - range[0] + 1) {
+        step = range[1] - range[0] + 1;
+    }
+    for (int i = range[0] + static_cast<int>(hash % static_cast<std::uint32_t>(step)); i <= range[1]; i += step) {
+        set_bit(target, i);
+    }
+}
+
+constexpr void set_number_hits(std::string_view value, std::uint8_t* target, int min, int max, std::uint32_t hash, const char*& error) noexcept {
+    std::size_t pos = 0;
+    int range[2] = { 0, 0 };
+    if (0 == count_items(value, ',')) {
+        error = "Comma split error";
+        return;
+    }
+    for (std::string_view item = next_item(value, ',', pos); !item.empty(); item = next_item(value, ',', pos)) {
+        if ('H' == item[0] || 'h' == item[0]) {
+            set_hashed_hits(item, target, min, max, hash, error);
+            if (error) return;
+        } else if (!has_char(item, '/')) {
+            get_range(item, min, max, range, error);
+            if (error) return;
+            for (int i = range[0]; i <= range[1]; i++) {
+                set_bit(target, i);
+            }
+        } else {
+            std::size_t split_pos = 0;
+            bool err = false;
+            if (2 != count_items(item, '/')) {
+                error = "Incrementer must have two fields";
+                return;
+            }
+            std::string_view part = next_item(item, '/', split_pos);
+            get_range(part, min, max, range, error);
+            if (error) return;
+            if (!has_char(part, '-')) {
+                range[1] = max - 1;
+            }
+            int delta = parse_uint(next_item(item, '/', split_pos), err);
+            if (err) {
+                error = "Unsigned integer parse error 4";
+                return;
+            }
+            if (0 == delta) {
+                error = "Incrementer may not be zero";
+                return;
+            }
+            for (int i = range[0]; i <= range[1]; i += delta) {
+                set_bit(target, i);
+                if (delta > range[1] - i) break;
+            }
+        }
+    }
+}
+
+constexpr int parse_day_number(std::string_view str, int min, int max, bool& err) noexcept {
+    err = true;
+    if (str.empty()) return 0;
+    int res = parse_uint(str, err);
+    if (res < min || res > max) err = true;
+    return res;
+}
+
+constexpr void set_day_of_week_modifier(std::string_view item, cron_expr& target, const char*& error) noexcept {
+    bool err = false;
+    if (1 == item.size() && 'L' == item[0]) {
+        set_bit(target.days_of_week, 6);
+        return;
+    }
+    std::size_t hash = item.find('#');
+    if (std::string_view::npos != hash) {
+        int day = parse_day_number(item.substr(0, hash), 0, 7, err);
+        int nth = 0;
+        if (!err) nth = parse_day_number(item.substr(hash + 1), 1, 5, err);
+        if (err) {
+            error = "Invalid nth day of week";
+            return;
+        }
+        set_bit(&target.days_of_week_nth[nth - 1], day % 7);
+    } else if (item.size() > 1 && 'L' == item.back()) {
+        int day = parse_day_number(item.substr(0, item.size() - 1), 0, 7, err);
+        if (err) {
+            error = "Invalid last day of week";
+            return;
+        }
+        set_bit(target.days_of_week_last, day % 7);
+    } else {
+        error = "Invalid day of week modifier";
+    }
+}
+
+constexpr void set_day_of_month_modifier(std::string_view item, cron_expr& target, const char*& error) noexcept {
+    bool err = false;
+    if ("L" == item) {
+        set_bit(target.days_of_month_last, 0);
+    } else if ("LW" == item) {
+        set_bit(target.days_of_month_weekday, 0);
+    } else if (item.size() > 2 && 'L' == item[0] && '-' == item[1]) {
+        int day = parse_day_number(item.substr(2), 0, max_days_of_month - 2, err);
+        if (err) {
+            error = "Invalid offset from the last day of month";
+            return;
+        }
+        set_bit(target.days_of_month_last, day);
+    } else if (item.size() > 1 && 'W' == item.back()) {
+        int day = parse_day_number(item.substr(0, item.size() - 1), 1, max_days_of_month - 1, err);
+        if (err) {
+            error = "Invalid nearest weekday";
+            return;
+        }
+        set_bit(target.days_of_month_weekday, day);
+    } else {
+        error = "Invalid day of month modifier";
+    }
+}
+
+template <class Modifier>
+constexpr void set_modified_hits(std::string_view field, std::string_view modifiers, std::uint8_t* targ, int min, int max, std::uint32_t hash,
+        cron_expr& target, Modifier set_modifier, const char*& error) noexcept {
+    std::size_t pos = 0;
+    if (!has_any_char(field, modifiers)) {
+        set_number_hits(field, targ, min, max, hash, error);
+        return;
+    }
+    if (0 == count_items(field, ',')) {
+        error = "Comma split error";
+        return;
+    }
+    for (std::string_view item = next_item(field, ',', pos); !error && !item.empty(); item = next_item(field, ',', pos)) {
+        if (has_any_char(item, modifiers)) {
+            set_modifier(item, target, error);
+        } else {
+            set_number_hits(item, targ, min, max, hash, error);
+        }
+    }
+}
+
+/**
+ * Parses the expression into 'target' the same way as 'cron_parse_expr_seeded'.
+ *
+ * @param text cron expression
+ * @param seed seed of the hashed 'H' items
+ * @param target parsed expression
+ * @return error message, nullptr on success
+ */
+constexpr const char* parse(std::string_view text, std::uint32_t seed, cron_expr& target) noexcept {
+    char buf[max_expression_len] = {};
+    slice fields[6] = {};
+    std::size_t count = 0;
+    std::size_t bi = 0;
+    bool in_field = false;
+    const char* error = nullptr;
+
+    std::size_t len = text.find('\0');
+    if (std::string_view::npos != len) text = text.substr(0, len);
+    if (text.size() >= max_expression_len) count = 0;
+    else for (char c : text) {
+        if (' ' == c) {
+            in_field = false;
+        } else if (!is_space(c)) {
+            if (!in_field) {
+                in_field = true;
+                count++;
+                if (count <= 6) fields[count - 1] = slice { buf + bi, 0 };
+            }
+            if (count <= 6) {
+                buf[bi++] = c;
+                fields[count - 1].len++;
+            }
+        }
+    }
+    if (6 != count) return "Invalid number of fields, expression must consist of 6 fields";
+
+    target = cron_expr {};
+    set_number_hits(std::string_view(fields[0].str, fields[0].len), target.seconds, 0, max_seconds, hash_field(seed, 0), error);
+    if (error) return error;
+    set_number_hits(std::string_view(fields[1].str, fields[1].len), target.minutes, 0, max_minutes, hash_field(seed, 1), error);
+    if (error) return error;
+    set_number_hits(std::string_view(fields[2].str, fields[2].len), target.hours, 0, max_hours, hash_field(seed, 2), error);
+    if (error) return error;
+
+    /* days of month */
+    if (1 == fields[3].len && '?' == fields[3].str[0]) fields[3].str[0] = '*';
+    to_upper(fields[3]);
+    set_modified_hits(std::string_view(fields[3].str, fields[3].len), "LW", target.days_of_month, 1, max_days_of_month, hash_field(seed, 4),
+            target, set_day_of_month_modifier, error);
+    if (error) return error;
+
+    /* months, rotated to the front */
+    to_upper(fields[4]);
+    fields[4].len = replace_ordinals(fields[4], month_names);
+    set_number_hits(std::string_view(fields[4].str, fields[4].len), target.months, 1, max_months + 1, hash_field(seed, 5), error);
+    for (int i = 1; i <= max_months; i++) {
+        if (get_bit(target.months, i)) {
+            set_bit(target.months, i - 1);
+            del_bit(target.months, i);
+        }
+    }
+    if (error) return error;
+
+    /* days of week, Sunday is 0 or 7 */
+    if (1 == fields[5].len && '?' == fields[5].str[0]) fields[5].str[0] = '*';
+    to_upper(fields[5]);
+    fields[5].len = replace_ordinals(fields[5], day_names);
+    set_modified_hits(std::string_view(fields[5].str, fields[5].len), "L#", target.days_of_week, 0, max_days_of_week, hash_field(seed, 3),
+            target, set_day_of_week_modifier, error);
+    if (get_bit(target.days_of_week, 7)) {
+        set_bit(target.days_of_week, 0);
+        del_bit(target.days_of_week, 7);
+    }
+    return error;
+}
+
+template <std::size_t N>
+struct fixed_string {
+    char str[N] = {};
+
+    constexpr fixed_string(const char (&text)[N]) noexcept {
+        for (std::size_t i = 0; i < N; i++) str[i] = text[i];
+    }
+
+    constexpr std::string_view view() const noexcept {
+        return std::string_view(str, N - 1);
+    }
+};
+
+/* error message of the parser as a template argument, empty for a valid expression */
+struct parse_message {
+    char str[64] = {};
+
+    constexpr parse_message(const char* text) noexcept {
+        for (std::size_t i = 0; text && text[i] && i < sizeof(str) - 1; i++) str[i] = text[i];
+    }
+};
+
+template <fixed_string Text, std::uint32_t Seed>
+constexpr const char* parse_error() noexcept {
+    cron_expr res {};
+    return parse(Text.view(), Seed, res);
+}
+
+/* instantiated for every static expression, the compiler shows the message of an invalid one in the template argument */
+template <parse_message Message>
+struct invalid_cron_expression {
+    static_assert(Message.str[0] == '\0', "invalid cron expression, the parser's message is the template argument");
+    static constexpr bool valid = true;
+};
+
+constexpr int next_set_bit(const std::uint8_t* bits, int from, int max) noexcept {
+    for (int i = from; i < max; i++) {
+        if (get_bit(bits, i)) return i;
+    }
+    return -1;
+}
+
+constexpr int prev_set_bit(const std::uint8_t* bits, int from) noexcept {
+    for (int i = from; i >= 0; i--) {
+        if (get_bit(bits, i)) return i;
+    }
+    return -1;
+}
+
+constexpr bool all_bits(const std::uint8_t* bits, int from, int max) noexcept {
+    for (int i = from; i < max; i++) {
+        if (!get_bit(bits, i)) return false;
+    }
+    return true;
+}
+
+constexpr bool any_bits(const std::uint8_t* bits, std::size_t len) noexcept {
+    for (std::size_t i = 0; i < len; i++) {
+        if (bits[i]) return true;
+    }
+    return false;
+}
+
+/* fires every day: the time of day alone decides, dates are found without calendar arithmetic */
+constexpr bool fires_every_day(const cron_expr& e) noexcept {
+    return all_bits(e.days_of_month, 1, max_days_of_month) && all_bits(e.months, 0, max_months) && all_bits(e.days_of_week, 0, 7)
+            && !any_bits(e.days_of_month_last, sizeof(e.days_of_month_last)) && !any_bits(e.days_of_month_weekday, sizeof(e.days_of_month_weekday))
+            && !any_bits(e.days_of_week_last, sizeof(e.days_of_week_last)) && !any_bits(e.days_of_week_nth, sizeof(e.days_of_week_nth));
+}
+
+/* first matching second of the day at or after 'from', -1 if none */
+constexpr int next_second_of_day(const cron_expr& e, int from) noexcept {
+    int hour = from / 3600;
+    int minute = from / 60 % 60;
+    for (int h = next_set_bit(e.hours, hour, max_hours); h >= 0; h = next_set_bit(e.hours, h + 1, max_hours)) {
+        for (int m = next_set_bit(e.minutes, h == hour ? minute : 0, max_minutes); m >= 0; m = next_set_bit(e.minutes, m + 1, max_minutes)) {
+            int s = next_set_bit(e.seconds, h == hour && m == minute ? from % 60 : 0, max_seconds);
+            if (s >= 0) return h * 3600 + m * 60 + s;
+        }
+    }
+    return -1;
+}
+
+/* last matching second of the day at or before 'from', -1 if none */
+constexpr int prev_second_of_day(const cron_expr& e, int from) noexcept {
+    int hour = from / 3600;
+    int minute = from / 60 % 60;
+    for (int h = prev_set_bit(e.hours, hour); h >= 0; h = prev_set_bit(e.hours, h - 1)) {
+        for (int m = prev_set_bit(e.minutes, h == hour ? minute : max_minutes - 1); m >= 0; m = prev_set_bit(e.minutes, m - 1)) {
+            int s = prev_set_bit(e.seconds, h == hour && m == minute ? from % 60 : max_seconds - 1);
+            if (s >= 0) return h * 3600 + m * 60 + s;
+        }
+    }
+    return -1;
+}
+
+} // namespace detail
+
+/**
+ * Expression parsed at compile time, an invalid expression does not compile:
+ *
+ *     using heartbeat = cron::static_expr<"0 0,30 * * * *">;
+ *     std::optional<cron::sys_seconds> next = heartbeat::next(std::chrono::system_clock::now());
+ *
+ * Expressions that fire every day are evaluated from the time of day masks
+ * without calendar functions in the UTC build, others use the C search.
+ */
+template <detail::fixed_string Text, std::uint32_t Seed = 0>
+class static_expr {
+    static_assert(detail::invalid_cron_expression<detail::parse_message(detail::parse_error<Text, Seed>())>::valid);
+
+    static constexpr cron_expr parse() noexcept {
+        cron_expr res {};
+        detail::parse(Text.view(), Seed, res);
+        return res;
+    }
+
+public:
+    static constexpr cron_expr masks = parse();
+
+#ifdef CRON_USE_LOCAL_TIME
+    static constexpr bool every_day = false;
+#else
+    static constexpr bool every_day = detail::fires_every_day(masks);
+#endif
+
+    static constexpr expr value() noexcept {
+        return expr(masks);
+    }
+
+    /**
+     * Calculates the next 'fire' date strictly after the specified date.
+     *
+     * @param date start date, rounded down to whole seconds
+     * @return next 'fire' date, empty if there is none
+     */
+    template <class Duration>
+    static std::optional<sys_seconds> next(std::chrono::sys_time<Duration> date) noexcept {
+        if constexpr (every_day) {
+            std::chrono::sys_days day = std::chrono::floor<std::chrono::days>(date);
+            int from = static_cast<int>((std::chrono::floor<std::chrono::seconds>(date) - day).count()) + 1;
+            int second = from < 86400 ? detail::next_second_of_day(masks, from) : -1;
+            if (second < 0) {
+                day += std::chrono::days(1);
+                second = detail::next_second_of_day(masks, 0);
+            }
+            if (second < 0) return std::nullopt;
+            return sys_seconds(day) + std::chrono::seconds(second);
+        } else {
+            return value().next(date);
+        }
+    }
+
+    /**
+     * Calculates the previous 'fire' date strictly before the specified date.
+     *
+     * @param date start date, rounded up to whole seconds
+     * @return previous 'fire' date, empty if there is none
+     */
+    template <class Duration>
+    static std::optional<sys_seconds> prev(std::chrono::sys_time<Duration> date) noexcept {
+        if constexpr (every_day) {
+            sys_seconds rounded = std::chrono::ceil<std::chrono::seconds>(date);
+            std::chrono::sys_days day = std::chrono::floor<std::chrono::days>(rounded);
+            int from = static_cast<int>((rounded - day).count()) - 1;
+            int second = from >= 0 ? detail::prev_second_of_day(masks, from) : -1;
+            if (second < 0) {
+                day -= std::chrono::days(1);
+                second = detail::prev_second_of_day(masks, 86399);
+            }
+            if (second < 0) return std::nullopt;
+            return sys_seconds(day) + std::chrono::seconds(second);
+        } else {
+            return value().prev(date);
+        }
+    }
+};
+
+} // namespace cron
+
+#endif /* CCRONEXPR_HPP */
@@ -0,0 +1,317 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_bench.c
+ *
+ * Throughput and latency of parsing and searching over a corpus
+ * of representative and pathological expressions.
+ *
+ * Usage: ccronexpr_bench [--iterations N] [--filter TEXT] [--csv]
+ *                        [--baseline FILE] [--threshold PERCENT]
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ccronexpr.h"
+#include "ccronexpr_bench_util.h"
+
+#ifndef ARRAY_LEN
+#define ARRAY_LEN(x) sizeof(x)/sizeof(x[0])
+#endif
+
+#define BENCH_MAX_RESULTS 256
+#define BENCH_NAME_LEN 64
+
+typedef struct {
+    const char* name;
+    const char* expr;
+} bench_case;
+
+static const bench_case CORPUS[] = {
+    /* representative */
+    { "every_second", "* * * * * *" },
+    { "every_15_min", "0 */15 * * * *" },
+    { "workdays_7am", "0 0 7 ? * MON-FRI" },
+    { "monthly", "0 30 23 1 * ?" },
+    { "quarterly", "0 30 23 30 1/3 ?" },
+    { "ranges", "*/15 * 1-4 * * *" },
+    { "names", "0 0 12 ? JAN,APR,JUL,OCT SAT,SUN" },
+    { "hashed", "H H H * * *" },
+    { "last_weekday", "0 0 18 LW * ?" },
+    { "nth_friday", "0 0 9 ? * FRI#3" },
+    /* pathological: sparse dates that need long day scans */
+    { "leap_day_monday", "0 0 0 29 2 MON" },
+    { "day_31_february", "0 0 0 31 2 ?" },
+    { "fifth_friday_feb", "0 0 0 ? 2 FRI#5" },
+    { "last_second_of_year", "59 59 23 31 12 ?" },
+    { "sparse_all_fields", "7 13 17 13 * FRI" }
+};
+
+typedef struct {
+    char name[BENCH_NAME_LEN];
+    char op[16];
+    double ns_per_op;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+    double allocs_per_op;
+} bench_result;
+
+static bench_result results[BENCH_MAX_RESULTS];
+static size_t results_len = 0;
+
+static unsigned int lcg_next(unsigned int* state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/* start dates spread over 2012-2016, the same sequence for every run */
+static time_t start_date(unsigned int* state) {
+    return (time_t) 1325376000 + (time_t) (lcg_next(state) % (4u * 365u * 86400u / 64u)) * 64;
+}
+
+typedef time_t (*bench_fn)(const cron_expr* expr, const cron_zone* zone, time_t date);
+
+static time_t bench_next(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    (void) zone;
+    return cron_next(expr, date);
+}
+
+static time_t bench_prev(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    (void) zone;
+    return cron_prev(expr, date);
+}
+
+static time_t bench_next_tz(const cron_expr* expr, const cron_zone* zone, time_t date) {
+    return cron_next_tz(expr, zone, date);
+}
+
+static void add_result(const char* name, const char* op, double* samples, size_t iterations, double total, long allocs) {
+    bench_result* res;
+    if (results_len == BENCH_MAX_RESULTS) {
+        fprintf(stderr, "More than %d results\n", BENCH_MAX_RESULTS);
+        exit(2);
+    }
+    res = &results[results_len++];
+    qsort(samples, iterations, sizeof(double), bench_compare_double);
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    snprintf(res->op, sizeof(res->op), "%s", op);
+    res->ns_per_op = total / (double) iterations;
+    res->p50 = samples[iterations / 2];
+    res->p90 = samples[iterations * 9 / 10];
+    res->p99 = samples[iterations * 99 / 100];
+    res->max = samples[iterations - 1];
+    res->allocs_per_op = (double) allocs / (double) iterations;
+}
+
+static void bench_parse(const bench_case* bc, double* samples, size_t iterations) {
+    cron_expr parsed;
+    const char* err = NULL;
+    double total = 0;
+    long allocs = 0;
+    size_t i;
+    for (i = 0; i < iterations; i++) {
+#ifdef CRON_TEST_MALLOC
+        long before = bench_allocations;
+#endif
+        double start = bench_now_ns();
+        cron_parse_expr(bc->expr, &parsed, &err);
+        samples[i] = bench_now_ns() - start;
+        total += samples[i];
+#ifdef CRON_TEST_MALLOC
+        allocs += bench_allocations - before;
+#endif
+        if (err) {
+            fprintf(stderr, "Cannot parse '%s': %s\n", bc->expr, err);
+            exit(2);
+        }
+    }
+    add_result(bc->name, "parse", samples, iterations, total, allocs);
+}
+
+static void bench_search(const bench_case* bc, const char* op, bench_fn fn, const cron_zone* zone, double* samples, size_t iterations) {
+    cron_expr parsed;
+    const char* err = NULL;
+    unsigned int state = 42;
+    double total = 0;
+    long allocs = 0;
+    size_t i;
+    cron_parse_expr(bc->expr, &parsed, &err);
+    if (err) {
+        fprintf(stderr, "Cannot parse '%s': %s\n", bc->expr, err);
+        exit(2);
+    }
+    for (i = 0; i < iterations; i++) {
+        time_t date = start_date(&state);
+#ifdef CRON_TEST_MALLOC
+        long before = bench_allocations;
+#endif
+        double start = bench_now_ns();
+        time_t res = fn(&parsed, zone, date);
+        samples[i] = bench_now_ns() - start;
+        total += samples[i];
+#ifdef CRON_TEST_MALLOC
+        allocs += bench_allocations - before;
+#endif
+        (void) res;
+    }
+    add_result(bc->name, op, samples, iterations, total, allocs);
+}
+
+static const bench_result* find_result(const bench_result* arr, size_t len, const char* name, const char* op) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (0 == strcmp(arr[i].name, name) && 0 == strcmp(arr[i].op, op)) return &arr[i];
+    }
+    return NULL;
+}
+
+/* reads results previously written with --csv */
+static size_t load_baseline(const char* path, bench_result* out, size_t max) {
+    char line[256];
+    size_t len = 0;
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "Cannot open baseline: %s\n", path);
+        exit(2);
+    }
+    while (len < max && fgets(line, sizeof(line), file)) {
+        bench_result* res = &out[len];
+        char* comma = strchr(line, ',');
+        char* op;
+        if (!comma || '#' == line[0] || 0 == strncmp(line, "name,", 5)) continue;
+        *comma = '\0';
+        op = comma + 1;
+        comma = strchr(op, ',');
+        if (!comma) continue;
+        *comma = '\0';
+        snprintf(res->name, sizeof(res->name), "%s", line);
+        snprintf(res->op, sizeof(res->op), "%s", op);
+        if (6 == sscanf(comma + 1, "%lf,%lf,%lf,%lf,%lf,%lf", &res->ns_per_op, &res->p50, &res->p90,
+                &res->p99, &res->max, &res->allocs_per_op)) {
+            len++;
+        }
+    }
+    fclose(file);
+    return len;
+}
+
+int main(int argc, char** argv) {
+    size_t iterations = 20000;
+    const char* filter = NULL;
+    const char* baseline_path = NULL;
+    double threshold = 10;
+    int csv = 0;
+    int regressions = 0;
+    double* samples;
+    cron_zone zone;
+    const char* zone_name = "America/New_York";
+    size_t i;
+
+    for (i = 1; i < (size_t) argc; i++) {
+        if (0 == strcmp(argv[i], "--iterations") && i + 1 < (size_t) argc) {
+            iterations = (size_t) strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--filter") && i + 1 < (size_t) argc) {
+            filter = argv[++i];
+        } else if (0 == strcmp(argv[i], "--baseline") && i + 1 < (size_t) argc) {
+            baseline_path = argv[++i];
+        } else if (0 == strcmp(argv[i], "--threshold") && i + 1 < (size_t) argc) {
+            threshold = strtod(argv[++i], NULL);
+        } else if (0 == strcmp(argv[i], "--csv")) {
+            csv = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--iterations N] [--filter TEXT] [--csv] [--baseline FILE] [--threshold PERCENT]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1) iterations = 1;
+    samples = (double*) bench_malloc(iterations * sizeof(double));
+#ifdef CRON_FREESTANDING
+    zone_name = "UTC+0";
+    cron_zone_fixed(0, &zone);
+#else
+    if (0 != cron_zone_load_file(zone_name, &zone)) {
+        zone_name = "UTC+0";
+        cron_zone_fixed(0, &zone);
+    }
+#endif
+
+    for (i = 0; i < ARRAY_LEN(CORPUS); i++) {
+        const bench_case* bc = &CORPUS[i];
+        if (filter && !strstr(bc->name, filter)) continue;
+        bench_parse(bc, samples, iterations);
+        bench_search(bc, "next", bench_next, NULL, samples, iterations);
+        bench_search(bc, "prev", bench_prev, NULL, samples, iterations);
+        bench_search(bc, "next_tz", bench_next_tz, &zone, samples, iterations);
+    }
+    cron_zone_free(&zone);
+    free(samples);
+
+    if (csv) {
+#ifdef CRON_USE_LOCAL_TIME
+        printf("# local time, zone %s, %lu iterations\n", zone_name, (unsigned long) iterations);
+#else
+        printf("# utc, zone %s, %lu iterations\n", zone_name, (unsigned long) iterations);
+#endif
+        printf("name,op,ns_per_op,p50,p90,p99,max,allocs_per_op\n");
+        for (i = 0; i < results_len; i++) {
+            const bench_result* res = &results[i];
+            printf("%s,%s,%.1f,%.1f,%.1f,%.1f,%.1f,%.2f\n", res->name, res->op, res->ns_per_op,
+                    res->p50, res->p90, res->p99, res->max, res->allocs_per_op);
+        }
+    } else {
+#ifdef CRON_USE_LOCAL_TIME
+        printf("Mode: local time, zone for next_tz: %s, iterations: %lu\n\n", zone_name, (unsigned long) iterations);
+#else
+        printf("Mode: UTC, zone for next_tz: %s, iterations: %lu\n\n", zone_name, (unsigned long) iterations);
+#endif
+        printf("%-20s %-8s %10s %10s %10s %10s %10s %8s\n", "name", "op", "ns/op", "p50", "p90", "p99", "max", "allocs");
+        for (i = 0; i < results_len; i++) {
+            const bench_result* res = &results[i];
+            printf("%-20s %-8s %10.1f %10.1f %10.1f %10.1f %10.1f %8.2f\n", res->name, res->op, res->ns_per_op,
+                    res->p50, res->p90, res->p99, res->max, res->allocs_per_op);
+        }
+    }
+
+    if (baseline_path) {
+        static bench_result baseline[BENCH_MAX_RESULTS];
+        size_t baseline_len = load_baseline(baseline_path, baseline, BENCH_MAX_RESULTS);
+        fprintf(stderr, "\nComparison with %s (threshold %.1f%%):\n", baseline_path, threshold);
+        for (i = 0; i < results_len; i++) {
+            const bench_result* res = &results[i];
+            const bench_result* base = find_result(baseline, baseline_len, res->name, res->op);
+            double delta;
+            if (!base || base->ns_per_op <= 0) continue;
+            delta = (res->ns_per_op - base->ns_per_op) * 100 / base->ns_per_op;
+            if (delta > threshold || res->allocs_per_op > base->allocs_per_op) {
+                fprintf(stderr, "REGRESSION %-20s %-8s %10.1f -> %10.1f ns/op (%+.1f%%), allocs %.2f -> %.2f\n", res->name, res->op,
+                        base->ns_per_op, res->ns_per_op, delta, base->allocs_per_op, res->allocs_per_op);
+                regressions++;
+            }
+        }
+        fprintf(stderr, "%d regression(s)\n", regressions);
+    }
+    return regressions > 0 ? 1 : 0;
+}
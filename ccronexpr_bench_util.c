@@ -0,0 +1,120 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_bench_util.c
+ *
+ * Helpers shared by the benchmark, replay and simulation tools
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "ccronexpr_bench_util.h"
+
+long bench_allocations = 0;
+
+#ifdef CRON_TEST_MALLOC
+void* cron_malloc(size_t n) {
+    bench_allocations++;
+    return malloc(n);
+}
+
+void cron_free(void* p) {
+    free(p);
+}
+#endif
+
+double bench_now_ns(void) {
+#ifdef _WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    return (double) count.QuadPart * 1e9 / (double) freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec * 1e9 + (double) ts.tv_nsec;
+#else
+    return (double) clock() * 1e9 / CLOCKS_PER_SEC;
+#endif
+}
+
+int bench_compare_double(const void* a, const void* b) {
+    double da = *(const double*) a;
+    double db = *(const double*) b;
+    return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+void* bench_malloc(size_t n) {
+    void* res = malloc(n > 0 ? n : 1);
+    if (!res) {
+        fprintf(stderr, "Cannot allocate %lu bytes\n", (unsigned long) n);
+        exit(2);
+    }
+    return res;
+}
+
+size_t bench_get_varint(const uint8_t* in, size_t len, uint64_t* value) {
+    size_t i;
+    unsigned int shift = 0;
+    *value = 0;
+    for (i = 0; i < len && shift < 64; i++, shift += 7) {
+        *value |= (uint64_t) (in[i] & 0x7f) << shift;
+        if (!(in[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+int64_t bench_unzigzag(uint64_t value) {
+    return (value & 1) ? -(int64_t) (value >> 1) - 1 : (int64_t) (value >> 1);
+}
+
+/* http://howardhinnant.github.io/date_algorithms.html */
+long bench_days_from_civil(long year, int month, int day) {
+    long era;
+    long yoe;
+    long doy;
+    if (month <= 2) year -= 1;
+    era = (year >= 0 ? year : year - 399) / 400;
+    yoe = year - era * 400;
+    doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+void bench_format_date(time_t date, char* out, size_t len) {
+    struct tm tm;
+    struct tm* res;
+#ifdef _WIN32
+    res = 0 == gmtime_s(&tm, &date) ? &tm : NULL;
+#else
+    res = gmtime_r(&date, &tm);
+#endif
+    if (!res || 0 == strftime(out, len, "%Y-%m-%d_%H:%M:%S", res)) {
+        snprintf(out, len, "%ld", (long) date);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_bench_util.h
+ *
+ * Helpers shared by the benchmark, replay and simulation tools
+ */
+
+#ifndef CCRONEXPR_BENCH_UTIL_H
+#define CCRONEXPR_BENCH_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* calls of 'cron_malloc' with CRON_TEST_MALLOC */
+extern long bench_allocations;
+
+/**
+ * Monotonic clock.
+ *
+ * @return nanoseconds since an unspecified start
+ */
+double bench_now_ns(void);
+
+/**
+ * Ascending order of doubles, for 'qsort'.
+ */
+int bench_compare_double(const void* a, const void* b);
+
+/**
+ * Allocates memory, prints an error and exits with status 2 when it cannot.
+ * Unlike an assert, the check is kept in release builds.
+ *
+ * @param n number of bytes
+ * @return allocated memory, never NULL
+ */
+void* bench_malloc(size_t n);
+
+/**
+ * Decodes an unsigned LEB128 varint.
+ *
+ * @param in encoded bytes
+ * @param len number of available bytes
+ * @param value decoded value
+ * @return number of bytes read, 0 if truncated or too long
+ */
+size_t bench_get_varint(const uint8_t* in, size_t len, uint64_t* value);
+
+/**
+ * Decodes a zigzag encoded signed value.
+ */
+int64_t bench_unzigzag(uint64_t value);
+
+/**
+ * Days since the epoch of a date of the proleptic Gregorian calendar.
+ *
+ * @param year year
+ * @param month month, 1 to 12
+ * @param day day of month, 1 to 31
+ * @return days since 1970-01-01
+ */
+long bench_days_from_civil(long year, int month, int day);
+
+/**
+ * Formats a date as UTC 'YYYY-MM-DD_hh:mm:ss', or as a number if it cannot be represented.
+ *
+ * @param date date to format
+ * @param out output buffer
+ * @param len length of the buffer
+ */
+void bench_format_date(time_t date, char* out, size_t len);
+
+#endif /* CCRONEXPR_BENCH_UTIL_H */
@@ -0,0 +1,239 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_coro.hpp
+ *
+ * C++20 coroutines sleeping until the next 'fire' date:
+ *
+ *     std::optional<cron::sys_seconds> date = co_await cron::until_next(e);
+ *
+ * All waits of a timer service are kept in one heap ordered by date and
+ * resumed by one thread, so any number of waiting coroutines costs a single
+ * kernel timer.
+ */
+
+#ifndef CCRONEXPR_CORO_HPP
+#define CCRONEXPR_CORO_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "ccronexpr.hpp"
+
+namespace cron {
+
+/**
+ * Ordered set of suspended coroutines, each resumed once its date is reached.
+ * Coroutines are resumed on the thread calling 'run_due' or 'run', waits can
+ * be added from any thread.
+ */
+class timer_service {
+public:
+    using clock_fn = std::function<sys_seconds()>;
+
+    /** Timer service on the system clock */
+    timer_service() : timer_service(system_now) { }
+
+    /**
+     * Timer service on the specified clock, a virtual clock is driven by
+     * 'run_due' and 'next_date' instead of 'run'.
+     *
+     * @param now current date of the clock
+     */
+    explicit timer_service(clock_fn now) : now_(std::move(now)) { }
+
+    timer_service(const timer_service&) = delete;
+    timer_service& operator=(const timer_service&) = delete;
+
+    sys_seconds now() const {
+        return now_();
+    }
+
+    /**
+     * Resumes the coroutine on the first 'run_due' at or after the date.
+     *
+     * @param date date to resume at
+     * @param handle suspended coroutine
+     */
+    void schedule(sys_seconds date, std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        waits_.push_back(wait { date, sequence_++, handle });
+        std::push_heap(waits_.begin(), waits_.end(), later);
+        if (waits_.front().handle == handle) {
+            changed_.notify_one();
+        }
+    }
+
+    /**
+     * Resumes all coroutines with dates up to the current date,
+     * in the order of dates and then of scheduling.
+     *
+     * @return number of resumed coroutines
+     */
+    std::size_t run_due() {
+        sys_seconds date = now_();
+        std::size_t count = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        /* coroutines resumed here may schedule new waits, those are due no earlier than the next call */
+        std::uint64_t last = sequence_;
+        while (!waits_.empty() && waits_.front().date <= date && waits_.front().sequence < last) {
+            std::pop_heap(waits_.begin(), waits_.end(), later);
+            std::coroutine_handle<> handle = waits_.back().handle;
+            waits_.pop_back();
+            lock.unlock();
+            handle.resume();
+            count++;
+            lock.lock();
+        }
+        return count;
+    }
+
+    /** Date of the earliest wait, empty if there are no waits */
+    std::optional<sys_seconds> next_date() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        if (waits_.empty()) return std::nullopt;
+        return waits_.front().date;
+    }
+
+    std::size_t size() const {
+        std::lock_guard<std::mutex> guard(mutex_);
+        return waits_.size();
+    }
+
+    /**
+     * Resumes coroutines on the calling thread as their dates are reached
+     * until 'stop' is called. Sleeps until the earliest date or a new
+     * earlier wait, the clock must follow the system clock.
+     */
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stopped_) {
+            if (waits_.empty()) {
+                changed_.wait(lock);
+            } else if (waits_.front().date > now_()) {
+                changed_.wait_until(lock, std::chrono::system_clock::time_point(waits_.front().date));
+            } else {
+                lock.unlock();
+                run_due();
+                lock.lock();
+            }
+        }
+    }
+
+    /** Makes 'run' return, waits left are not resumed */
+    void stop() {
+        std::lock_guard<std::mutex> guard(mutex_);
+        stopped_ = true;
+        changed_.notify_all();
+    }
+
+private:
+    struct wait {
+        sys_seconds date;
+        std::uint64_t sequence;
+        std::coroutine_handle<> handle;
+    };
+
+    static sys_seconds system_now() {
+        return std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now());
+    }
+
+    /* heap order, the earliest date and then the earliest scheduled is on top */
+    static bool later(const wait& a, const wait& b) noexcept {
+        return a.date != b.date ? a.date > b.date : a.sequence > b.sequence;
+    }
+
+    clock_fn now_;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector<wait> waits_;
+    std::uint64_t sequence_ = 0;
+    bool stopped_ = false;
+};
+
+/**
+ * Timer service of the process on the system clock, its thread is started
+ * on the first call and stopped at exit.
+ */
+inline timer_service& shared_timer() {
+    struct shared {
+        timer_service service;
+        std::thread thread;
+
+        shared() : service(), thread([this] { service.run(); }) { }
+
+        ~shared() {
+            service.stop();
+            thread.join();
+        }
+    };
+    static shared instance;
+    return instance.service;
+}
+
+/**
+ * Awaitable suspending the coroutine until the next 'fire' date of an expression
+ */
+class next_awaitable {
+public:
+    next_awaitable(const expr& e, timer_service& service) noexcept : expr_(e), service_(service), date_() { }
+
+    /* does not suspend when the expression never fires */
+    bool await_ready() {
+        date_ = expr_.next(service_.now());
+        return !date_;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        service_.schedule(*date_, handle);
+    }
+
+    std::optional<sys_seconds> await_resume() const noexcept {
+        return date_;
+    }
+
+private:
+    expr expr_;
+    timer_service& service_;
+    std::optional<sys_seconds> date_;
+};
+
+/**
+ * Suspends the coroutine until the next 'fire' date strictly after the current
+ * date of the timer service.
+ *
+ * @param e expression, copied into the awaitable
+ * @param service timer service resuming the coroutine
+ * @return awaitable returning the 'fire' date, empty if the expression never fires
+ */
+inline next_awaitable until_next(const expr& e, timer_service& service = shared_timer()) {
+    return next_awaitable(e, service);
+}
+
+} // namespace cron
+
+#endif /* CCRONEXPR_CORO_HPP */
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_dispatch.c
+ *
+ * Linux dispatcher of many jobs on a single timerfd
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "ccronexpr_dispatch.h"
+
+/* due jobs popped from the scheduler at once */
+#define CRON_DISPATCH_BATCH 64
+
+/* the timerfd is armed at the earliest date, or disarmed if no job is scheduled */
+static int arm(cron_dispatcher* d) {
+    struct itimerspec spec;
+    time_t date = cron_sched_peek(&d->sched);
+    if (date == d->armed) return 0;
+    memset(&spec, 0, sizeof(spec));
+    if (CRON_INVALID_INSTANT != date) {
+        /* the epoch itself would disarm the timer */
+        spec.it_value.tv_sec = date > 0 ? date : 1;
+    }
+    if (0 != timerfd_settime(d->fd, TFD_TIMER_ABSTIME, &spec, NULL)) return 1;
+    d->armed = date;
+    return 0;
+}
+
+int cron_dispatcher_init(cron_dispatch_fn fn, void* data, cron_dispatcher* out) {
+    if (!fn || !out) return 1;
+    memset(out, 0, sizeof(*out));
+    out->fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (out->fd < 0) return 1;
+    out->fn = fn;
+    out->data = data;
+    cron_sched_init(&out->sched);
+    out->armed = CRON_INVALID_INSTANT;
+    return 0;
+}
+
+void cron_dispatcher_free(cron_dispatcher* dispatcher) {
+    if (!dispatcher) return;
+    if (dispatcher->fd >= 0) {
+        close(dispatcher->fd);
+    }
+    cron_sched_free(&dispatcher->sched);
+    memset(dispatcher, 0, sizeof(*dispatcher));
+    dispatcher->fd = -1;
+}
+
+int cron_dispatcher_fd(const cron_dispatcher* dispatcher) {
+    return dispatcher->fd;
+}
+
+int cron_dispatcher_add(cron_dispatcher* dispatcher, uint32_t job_id, const cron_expr* expr, time_t now) {
+    if (!dispatcher) return 1;
+    if (0 != cron_sched_add(&dispatcher->sched, job_id, expr, now)) return 1;
+    return arm(dispatcher);
+}
+
+int cron_dispatcher_remove(cron_dispatcher* dispatcher, uint32_t job_id) {
+    if (!dispatcher) return 1;
+    if (0 != cron_sched_remove(&dispatcher->sched, job_id)) return 1;
+    return arm(dispatcher);
+}
+
+time_t cron_dispatcher_next(const cron_dispatcher* dispatcher, uint32_t job_id) {
+    if (!dispatcher) return CRON_INVALID_INSTANT;
+    return cron_sched_next(&dispatcher->sched, job_id);
+}
+
+int cron_dispatcher_dispatch(cron_dispatcher* dispatcher) {
+    uint64_t expirations = 0;
+    struct timespec now;
+    if (!dispatcher) return -1;
+    /* the count is not used, dates are read from the scheduler */
+    if (read(dispatcher->fd, &expirations, sizeof(expirations)) < 0 && EAGAIN != errno) return -1;
+    if (0 != clock_gettime(CLOCK_REALTIME, &now)) return -1;
+    return cron_dispatcher_run_due(dispatcher, now.tv_sec);
+}
+
+int cron_dispatcher_run_due(cron_dispatcher* dispatcher, time_t now) {
+    cron_sched_fire due[CRON_DISPATCH_BATCH];
+    size_t len = CRON_DISPATCH_BATCH;
+    size_t i;
+    int count = 0;
+    if (!dispatcher) return -1;
+    while (CRON_DISPATCH_BATCH == len) {
+        len = cron_sched_pop_due(&dispatcher->sched, now, due, CRON_DISPATCH_BATCH);
+        for (i = 0; i < len; i++) {
+            /* popped jobs are already rescheduled, the function may add or remove jobs */
+            if (!cron_sched_contains(&dispatcher->sched, due[i].job_id)) continue;
+            dispatcher->fn(dispatcher->data, due[i].job_id, due[i].date);
+            count++;
+        }
+    }
+    if (0 != arm(dispatcher)) return -1;
+    return count;
+}
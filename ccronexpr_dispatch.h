@@ -0,0 +1,136 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_dispatch.h
+ *
+ * Linux dispatcher: 'fire' dates of any number of jobs driven by a single
+ * timerfd armed at the earliest date, to be polled by an existing epoll loop.
+ */
+
+#ifndef CCRONEXPR_DISPATCH_H
+#define CCRONEXPR_DISPATCH_H
+
+#include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+extern "C" {
+#endif
+
+/**
+ * Called for every job that fires.
+ *
+ * @param data user data passed to 'cron_dispatcher_init'
+ * @param job_id id of the job
+ * @param date scheduled 'fire' date of the job, not the date of the call
+ */
+typedef void (*cron_dispatch_fn)(void* data, uint32_t job_id, time_t date);
+
+/**
+ * Jobs in a scheduler core, the timerfd is armed at its earliest date.
+ * Fields are internal.
+ */
+typedef struct {
+    int fd;
+    cron_dispatch_fn fn;
+    void* data;
+    cron_sched sched;
+    time_t armed;  /* date the timerfd is armed at, -1 if disarmed */
+} cron_dispatcher;
+
+/**
+ * Initializes a dispatcher with a non-blocking timerfd on the realtime clock.
+ *
+ * @param fn function called for every job that fires
+ * @param data user data passed to the function
+ * @param out dispatcher to initialize, must be released with 'cron_dispatcher_free'
+ * @return 0 on success, non-zero on error
+ */
+int cron_dispatcher_init(cron_dispatch_fn fn, void* data, cron_dispatcher* out);
+
+/**
+ * Closes the timerfd and releases memory held by the dispatcher.
+ *
+ * @param dispatcher dispatcher to release
+ */
+void cron_dispatcher_free(cron_dispatcher* dispatcher);
+
+/**
+ * File descriptor to poll for reading, e.g. added to an epoll set with EPOLLIN.
+ * 'cron_dispatcher_dispatch' is called when it is readable.
+ *
+ * @param dispatcher dispatcher
+ * @return timerfd of the dispatcher
+ */
+int cron_dispatcher_fd(const cron_dispatcher* dispatcher);
+
+/**
+ * Adds a job or replaces the expression of a job with the same id.
+ * Ids index an array, so they should be dense, e.g. from 0 to the number of jobs.
+ *
+ * @param dispatcher dispatcher
+ * @param job_id id of the job
+ * @param expr parsed cron expression, copied
+ * @param now current date, the job first fires at its next 'fire' date after it
+ * @return 0 on success, non-zero on error
+ */
+int cron_dispatcher_add(cron_dispatcher* dispatcher, uint32_t job_id, const cron_expr* expr, time_t now);
+
+/**
+ * Removes a job, may be called from the dispatch function.
+ *
+ * @param dispatcher dispatcher
+ * @param job_id id of the job
+ * @return 0 on success, non-zero if there is no such job or on error
+ */
+int cron_dispatcher_remove(cron_dispatcher* dispatcher, uint32_t job_id);
+
+/**
+ * Next 'fire' date of a job.
+ *
+ * @param dispatcher dispatcher
+ * @param job_id id of the job
+ * @return next 'fire' date, '((time_t) -1)' if there is no such job or it never fires again
+ */
+time_t cron_dispatcher_next(const cron_dispatcher* dispatcher, uint32_t job_id);
+
+/**
+ * Consumes the expirations of the timerfd and fires the jobs due
+ * at the current date of the realtime clock.
+ *
+ * @param dispatcher dispatcher
+ * @return number of fired jobs, -1 on error
+ */
+int cron_dispatcher_dispatch(cron_dispatcher* dispatcher);
+
+/**
+ * Fires the jobs due at the specified date in the order of their 'fire' dates
+ * and re-arms the timerfd. Each job is rescheduled from its 'fire' date,
+ * so that late dispatching does not shift later dates; a job due more than once
+ * fires once and is rescheduled from the specified date.
+ *
+ * @param dispatcher dispatcher
+ * @param now current date
+ * @return number of fired jobs, -1 on error
+ */
+int cron_dispatcher_run_due(cron_dispatcher* dispatcher, time_t now);
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+} /* extern "C"*/
+#endif
+
+#endif /* CCRONEXPR_DISPATCH_H */
@@ -0,0 +1,228 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_dispatch_test.c
+ *
+ * Tests of the Linux dispatcher
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "ccronexpr_dispatch.h"
+#include "ccronexpr_sched_test_util.h"
+
+#define JOBS 1000
+
+typedef struct {
+    cron_expr exprs[JOBS];
+    time_t last[JOBS];
+    size_t fired;
+    time_t previous;
+    int remove_odd;
+    cron_dispatcher* dispatcher;
+} fire_log;
+
+// every fire is the next date of the previous one, in date order
+static void check_fire(void* data, uint32_t job_id, time_t date) {
+    fire_log* log = (fire_log*) data;
+    assert(job_id < JOBS);
+    assert(date >= log->previous);
+    assert(date == cron_next(&log->exprs[job_id], log->last[job_id]));
+    log->last[job_id] = date;
+    log->previous = date;
+    log->fired++;
+    if (log->remove_odd && 1 == job_id % 2) {
+        int res = cron_dispatcher_remove(log->dispatcher, job_id);
+        assert(0 == res);
+    }
+}
+
+static int is_armed(const cron_dispatcher* dispatcher) {
+    struct itimerspec spec;
+    int res = timerfd_gettime(cron_dispatcher_fd(dispatcher), &spec);
+    assert(0 == res);
+    return 0 != spec.it_value.tv_sec || 0 != spec.it_value.tv_nsec;
+}
+
+static int has_expired(const cron_dispatcher* dispatcher) {
+    uint64_t expirations = 0;
+    return read(cron_dispatcher_fd(dispatcher), &expirations, sizeof(expirations)) > 0 && expirations > 0;
+}
+
+void test_run_due() {
+    static fire_log log;
+    cron_dispatcher dispatcher;
+    const char* err = NULL;
+    time_t now;
+    uint32_t i;
+    int expired;
+    int res;
+    memset(&log, 0, sizeof(log));
+    res = cron_dispatcher_init(check_fire, &log, &dispatcher);
+    assert(0 == res);
+    log.dispatcher = &dispatcher;
+    for (i = 0; i < JOBS; i++) {
+        cron_parse_expr_seeded(0 == i % 3 ? "H H/5 * * * *" : 1 == i % 3 ? "H/20 * * * * *" : "0 H 10 * * *", &log.exprs[i], i, &err);
+        assert(!err);
+        log.last[i] = FROM;
+        res = cron_dispatcher_add(&dispatcher, i, &log.exprs[i], FROM);
+        assert(0 == res);
+        assert(cron_dispatcher_next(&dispatcher, i) == cron_next(&log.exprs[i], FROM));
+    }
+    assert(CRON_INVALID_INSTANT == cron_dispatcher_next(&dispatcher, JOBS));
+
+    // dates in the past expire at once
+    expired = has_expired(&dispatcher);
+    assert(expired);
+    expired = has_expired(&dispatcher);
+    assert(!expired);
+
+    for (now = FROM; now < FROM + 2 * 3600; now++) {
+        res = cron_dispatcher_run_due(&dispatcher, now);
+        assert(res >= 0);
+    }
+    assert(log.fired > JOBS * 10);
+    for (i = 0; i < JOBS; i++) {
+        assert(cron_dispatcher_next(&dispatcher, i) == cron_next(&log.exprs[i], log.last[i]));
+        assert(cron_dispatcher_next(&dispatcher, i) > now - 1);
+    }
+
+    // late dispatch fires every job once and reschedules after the current date
+    log.fired = 0;
+    now += 86400;
+    for (i = 0; i < JOBS; i++) {
+        log.last[i] = cron_prev(&log.exprs[i], cron_dispatcher_next(&dispatcher, i));
+    }
+    res = cron_dispatcher_run_due(&dispatcher, now);
+    assert(JOBS == res);
+    for (i = 0; i < JOBS; i++) {
+        assert(cron_dispatcher_next(&dispatcher, i) == cron_next(&log.exprs[i], now));
+    }
+
+    // jobs removed by the dispatch function
+    log.fired = 0;
+    log.remove_odd = 1;
+    log.previous = 0;
+    for (i = 0; i < JOBS; i++) {
+        log.last[i] = cron_prev(&log.exprs[i], cron_dispatcher_next(&dispatcher, i));
+    }
+    now += 86400;
+    res = cron_dispatcher_run_due(&dispatcher, now);
+    assert(JOBS == res);
+    for (i = 0; i < JOBS; i++) {
+        assert((1 == i % 2) == (CRON_INVALID_INSTANT == cron_dispatcher_next(&dispatcher, i)));
+    }
+    res = cron_dispatcher_remove(&dispatcher, 1);
+    assert(0 != res);
+
+    // removed jobs and jobs that never fire are not scheduled
+    for (i = 0; i < JOBS; i += 2) {
+        res = cron_dispatcher_remove(&dispatcher, i);
+        assert(0 == res);
+    }
+    assert(0 == dispatcher.sched.heap_len && !is_armed(&dispatcher));
+    cron_parse_expr("0 0 0 30 2 *", &log.exprs[5], &err);
+    res = cron_dispatcher_add(&dispatcher, 5, &log.exprs[5], now);
+    assert(0 == res);
+    assert(CRON_INVALID_INSTANT == cron_dispatcher_next(&dispatcher, 5));
+    assert(0 == dispatcher.sched.heap_len && !is_armed(&dispatcher));
+    res = cron_dispatcher_run_due(&dispatcher, now + 86400 * 365);
+    assert(0 == res);
+    cron_dispatcher_free(&dispatcher);
+}
+
+typedef struct {
+    int fired;
+    time_t date;
+} real_log;
+
+static void record_fire(void* data, uint32_t job_id, time_t date) {
+    real_log* log = (real_log*) data;
+    assert(7 == job_id);
+    log->fired++;
+    log->date = date;
+}
+
+void test_epoll() {
+    cron_dispatcher dispatcher;
+    cron_expr every_second;
+    real_log log = { 0, 0 };
+    struct epoll_event event;
+    struct timespec now;
+    const char* err = NULL;
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    int waits = 0;
+    int res;
+    assert(epoll >= 0);
+    res = cron_dispatcher_init(record_fire, &log, &dispatcher);
+    assert(0 == res);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    res = epoll_ctl(epoll, EPOLL_CTL_ADD, cron_dispatcher_fd(&dispatcher), &event);
+    assert(0 == res);
+
+    cron_parse_expr("* * * * * *", &every_second, &err);
+    res = clock_gettime(CLOCK_REALTIME, &now);
+    assert(0 == res);
+    res = cron_dispatcher_add(&dispatcher, 7, &every_second, now.tv_sec);
+    assert(0 == res);
+    while (0 == log.fired) {
+        waits++;
+        assert(waits <= 3);
+        if (1 == epoll_wait(epoll, &event, 1, 2000)) {
+            res = cron_dispatcher_dispatch(&dispatcher);
+            assert(res >= 0);
+        }
+    }
+    assert(1 == log.fired && now.tv_sec + 1 == log.date);
+    res = clock_gettime(CLOCK_REALTIME, &now);
+    assert(0 == res);
+    assert(now.tv_sec >= log.date && now.tv_sec - log.date <= 1);
+
+    // armed at a future date until the job is removed
+    cron_parse_expr("0 0 0 1 1 *", &every_second, &err);
+    res = cron_dispatcher_add(&dispatcher, 7, &every_second, now.tv_sec);
+    assert(0 == res);
+    res = cron_dispatcher_dispatch(&dispatcher);
+    assert(is_armed(&dispatcher) && 0 == res);
+    res = cron_dispatcher_remove(&dispatcher, 7);
+    assert(0 == res);
+    res = cron_dispatcher_dispatch(&dispatcher);
+    assert(!is_armed(&dispatcher) && 0 == res);
+    assert(1 == log.fired);
+    close(epoll);
+    cron_dispatcher_free(&dispatcher);
+}
+
+int main() {
+    test_run_due();
+    test_epoll();
+#ifdef CRON_TEST_MALLOC
+    assert(0 == test_allocations);
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}
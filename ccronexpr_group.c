@@ -0,0 +1,410 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_group.c
+ *
+ * Coalesced scheduler on interned expressions and a scheduler core of groups
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccronexpr_group.h"
+
+#ifndef CRON_TEST_MALLOC
+#define cron_malloc(x) malloc(x)
+#define cron_free(x) free(x)
+#else /* CRON_TEST_MALLOC */
+void* cron_malloc(size_t n);
+void cron_free(void* p);
+#endif /* CRON_TEST_MALLOC */
+
+/* Initial number of hash buckets, a power of two */
+#define BUCKETS_MIN 64
+
+/* copies the array into a new one of the specified capacity */
+static void* resize_array(void* arr, size_t len, size_t capacity, size_t elem_size) {
+    void* res = cron_malloc(capacity * elem_size);
+    if (!res) return NULL;
+    if (arr) {
+        memcpy(res, arr, len * elem_size);
+        cron_free(arr);
+    }
+    return res;
+}
+
+static size_t grown_capacity(size_t capacity, size_t needed) {
+    size_t cap = capacity > 0 ? capacity : 16;
+    while (cap < needed) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+static uint32_t hash_group(uint32_t expr, time_t date) {
+    uint64_t key = ((uint64_t) expr << 32) ^ (uint64_t) date;
+    key *= ((uint64_t) 0x9e3779b9UL << 32) | 0x7f4a7c15UL;
+    return (uint32_t) (key >> 32);
+}
+
+static uint32_t* new_buckets(size_t len) {
+    uint32_t* buckets = (uint32_t*) cron_malloc(len * sizeof(uint32_t));
+    if (buckets) memset(buckets, 0xff, len * sizeof(uint32_t));
+    return buckets;
+}
+
+static int rehash_exprs(cron_groups* groups, size_t len) {
+    uint32_t* buckets = new_buckets(len);
+    size_t i;
+    if (!buckets) return 1;
+    for (i = 0; i < groups->exprs_len; i++) {
+        cron_group_expr* entry = &groups->exprs[i];
+        if (0 == entry->refs) continue;
+        entry->chain = buckets[entry->hash & (len - 1)];
+        buckets[entry->hash & (len - 1)] = (uint32_t) i;
+    }
+    if (groups->expr_buckets) cron_free(groups->expr_buckets);
+    groups->expr_buckets = buckets;
+    groups->expr_buckets_len = len;
+    return 0;
+}
+
+static int rehash_groups(cron_groups* groups, size_t len) {
+    uint32_t* buckets = new_buckets(len);
+    size_t i;
+    if (!buckets) return 1;
+    for (i = 0; i < groups->groups_len; i++) {
+        cron_group* group = &groups->groups[i];
+        if (CRON_SCHED_NONE == group->expr) continue;
+        group->chain = buckets[group->hash & (len - 1)];
+        buckets[group->hash & (len - 1)] = (uint32_t) i;
+    }
+    if (groups->group_buckets) cron_free(groups->group_buckets);
+    groups->group_buckets = buckets;
+    groups->group_buckets_len = len;
+    return 0;
+}
+
+static uint32_t find_expr(const cron_groups* groups, const cron_expr* expr, uint32_t hash) {
+    uint32_t e;
+    if (0 == groups->expr_buckets_len) return CRON_SCHED_NONE;
+    e = groups->expr_buckets[hash & (groups->expr_buckets_len - 1)];
+    while (CRON_SCHED_NONE != e) {
+        const cron_group_expr* entry = &groups->exprs[e];
+        if (entry->hash == hash && 0 == memcmp(&entry->expr, expr, sizeof(cron_expr))) return e;
+        e = entry->chain;
+    }
+    return CRON_SCHED_NONE;
+}
+
+static uint32_t find_group(const cron_groups* groups, uint32_t expr, time_t date, uint32_t hash) {
+    uint32_t g;
+    if (0 == groups->group_buckets_len) return CRON_SCHED_NONE;
+    g = groups->group_buckets[hash & (groups->group_buckets_len - 1)];
+    while (CRON_SCHED_NONE != g) {
+        const cron_group* group = &groups->groups[g];
+        if (group->expr == expr && group->date == date) return g;
+        g = group->chain;
+    }
+    return CRON_SCHED_NONE;
+}
+
+/* finds or interns the expression and takes a reference to it */
+static int acquire_expr(cron_groups* groups, const cron_expr* expr, uint32_t* out) {
+    uint32_t hash = cron_expr_hash(expr);
+    uint32_t e = find_expr(groups, expr, hash);
+    if (CRON_SCHED_NONE == e) {
+        cron_group_expr* entry;
+        size_t bucket;
+        if (CRON_SCHED_NONE != groups->exprs_free) {
+            e = groups->exprs_free;
+            groups->exprs_free = groups->exprs[e].chain;
+        } else {
+            if (groups->exprs_len >= groups->expr_buckets_len) {
+                size_t len = groups->expr_buckets_len > 0 ? groups->expr_buckets_len * 2 : BUCKETS_MIN;
+                if (0 != rehash_exprs(groups, len)) return 1;
+            }
+            if (groups->exprs_len >= groups->exprs_capacity) {
+                size_t cap = grown_capacity(groups->exprs_capacity, groups->exprs_len + 1);
+                void* exprs = resize_array(groups->exprs, groups->exprs_len, cap, sizeof(cron_group_expr));
+                if (!exprs) return 1;
+                groups->exprs = (cron_group_expr*) exprs;
+                groups->exprs_capacity = cap;
+            }
+            e = (uint32_t) groups->exprs_len++;
+        }
+        entry = &groups->exprs[e];
+        entry->expr = *expr;
+        entry->hash = hash;
+        entry->refs = 0;
+        bucket = hash & (groups->expr_buckets_len - 1);
+        entry->chain = groups->expr_buckets[bucket];
+        groups->expr_buckets[bucket] = e;
+    }
+    groups->exprs[e].refs++;
+    *out = e;
+    return 0;
+}
+
+static void release_expr(cron_groups* groups, uint32_t e) {
+    cron_group_expr* entry = &groups->exprs[e];
+    uint32_t* link;
+    if (--entry->refs > 0) return;
+    link = &groups->expr_buckets[entry->hash & (groups->expr_buckets_len - 1)];
+    while (*link != e) {
+        link = &groups->exprs[*link].chain;
+    }
+    *link = entry->chain;
+    entry->chain = groups->exprs_free;
+    groups->exprs_free = e;
+}
+
+static void link_group(cron_groups* groups, uint32_t g) {
+    cron_group* group = &groups->groups[g];
+    size_t bucket = group->hash & (groups->group_buckets_len - 1);
+    group->chain = groups->group_buckets[bucket];
+    groups->group_buckets[bucket] = g;
+}
+
+static void unlink_group(cron_groups* groups, uint32_t g) {
+    uint32_t* link = &groups->group_buckets[groups->groups[g].hash & (groups->group_buckets_len - 1)];
+    while (*link != g) {
+        link = &groups->groups[*link].chain;
+    }
+    *link = groups->groups[g].chain;
+}
+
+/* an empty group, not scheduled yet */
+static uint32_t new_group(cron_groups* groups, uint32_t e, time_t date, uint32_t hash) {
+    cron_group* group;
+    uint32_t g;
+    if (CRON_SCHED_NONE != groups->groups_free) {
+        g = groups->groups_free;
+        groups->groups_free = groups->groups[g].chain;
+    } else {
+        if (groups->groups_len >= groups->group_buckets_len) {
+            size_t len = groups->group_buckets_len > 0 ? groups->group_buckets_len * 2 : BUCKETS_MIN;
+            if (0 != rehash_groups(groups, len)) return CRON_SCHED_NONE;
+        }
+        if (groups->groups_len >= groups->groups_capacity) {
+            size_t cap = grown_capacity(groups->groups_capacity, groups->groups_len + 1);
+            void* arr = resize_array(groups->groups, groups->groups_len, cap, sizeof(cron_group));
+            if (!arr) return CRON_SCHED_NONE;
+            groups->groups = (cron_group*) arr;
+            groups->groups_capacity = cap;
+        }
+        g = (uint32_t) groups->groups_len++;
+        groups->groups[g].jobs = NULL;
+        groups->groups[g].capacity = 0;
+    }
+    group = &groups->groups[g];
+    group->expr = e;
+    group->hash = hash;
+    group->date = date;
+    group->len = 0;
+    link_group(groups, g);
+    groups->exprs[e].refs++;
+    return g;
+}
+
+/* the jobs memory is kept for the next group, so that a popped batch stays valid */
+static void release_group(cron_groups* groups, uint32_t g) {
+    cron_group* group = &groups->groups[g];
+    cron_sched_remove(&groups->sched, g);
+    unlink_group(groups, g);
+    release_expr(groups, group->expr);
+    group->expr = CRON_SCHED_NONE;
+    group->len = 0;
+    group->chain = groups->groups_free;
+    groups->groups_free = g;
+}
+
+static int reserve_group(cron_group* group, size_t len) {
+    size_t cap;
+    void* jobs;
+    if (len <= group->capacity) return 0;
+    cap = grown_capacity(group->capacity, len);
+    jobs = resize_array(group->jobs, group->len, cap, sizeof(uint32_t));
+    if (!jobs) return 1;
+    group->jobs = (uint32_t*) jobs;
+    group->capacity = cap;
+    return 0;
+}
+
+static int append_job(cron_groups* groups, uint32_t g, uint32_t job_id) {
+    cron_group* group = &groups->groups[g];
+    if (0 != reserve_group(group, group->len + 1)) return 1;
+    group->jobs[group->len] = job_id;
+    groups->group_of[job_id] = g;
+    groups->index_of[job_id] = (uint32_t) group->len;
+    group->len += 1;
+    return 0;
+}
+
+/* appends the jobs of a group to another one */
+static int move_jobs(cron_groups* groups, uint32_t from, uint32_t to) {
+    cron_group* src = &groups->groups[from];
+    cron_group* dest = &groups->groups[to];
+    size_t i;
+    if (0 != reserve_group(dest, dest->len + src->len)) return 1;
+    for (i = 0; i < src->len; i++) {
+        uint32_t job_id = src->jobs[i];
+        dest->jobs[dest->len] = job_id;
+        groups->group_of[job_id] = to;
+        groups->index_of[job_id] = (uint32_t) dest->len;
+        dest->len += 1;
+    }
+    return 0;
+}
+
+static int reserve_jobs(cron_groups* groups, size_t len) {
+    if (len <= groups->jobs_len) return 0;
+    if (len > groups->jobs_capacity) {
+        size_t cap = grown_capacity(groups->jobs_capacity, len);
+        void* group_of = resize_array(groups->group_of, groups->jobs_len, cap, sizeof(uint32_t));
+        void* index_of;
+        if (!group_of) return 1;
+        groups->group_of = (uint32_t*) group_of;
+        index_of = resize_array(groups->index_of, groups->jobs_len, cap, sizeof(uint32_t));
+        if (!index_of) return 1;
+        groups->index_of = (uint32_t*) index_of;
+        groups->jobs_capacity = cap;
+    }
+    memset(groups->group_of + groups->jobs_len, 0xff, (len - groups->jobs_len) * sizeof(uint32_t));
+    groups->jobs_len = len;
+    return 0;
+}
+
+int cron_groups_init(cron_groups* out, int backend) {
+    if (!out) return 1;
+    memset(out, 0, sizeof(*out));
+    if (0 != cron_sched_init_backend(&out->sched, backend)) return 1;
+    out->exprs_free = CRON_SCHED_NONE;
+    out->groups_free = CRON_SCHED_NONE;
+    return 0;
+}
+
+void cron_groups_free(cron_groups* groups) {
+    size_t i;
+    if (!groups) return;
+    for (i = 0; i < groups->groups_len; i++) {
+        if (groups->groups[i].jobs) cron_free(groups->groups[i].jobs);
+    }
+    cron_sched_free(&groups->sched);
+    if (groups->exprs) cron_free(groups->exprs);
+    if (groups->expr_buckets) cron_free(groups->expr_buckets);
+    if (groups->groups) cron_free(groups->groups);
+    if (groups->group_buckets) cron_free(groups->group_buckets);
+    if (groups->group_of) cron_free(groups->group_of);
+    if (groups->index_of) cron_free(groups->index_of);
+    memset(groups, 0, sizeof(*groups));
+}
+
+int cron_groups_add(cron_groups* groups, uint32_t job_id, const cron_expr* expr, time_t now) {
+    time_t date;
+    uint32_t e;
+    uint32_t g;
+    uint32_t hash;
+    int created = 0;
+    if (!groups || !expr || CRON_SCHED_NONE == job_id) return 1;
+    if (0 != reserve_jobs(groups, (size_t) job_id + 1)) return 1;
+    /* the reference keeps the expression while its group is created */
+    if (0 != acquire_expr(groups, expr, &e)) return 1;
+    date = cron_next(expr, now);
+    hash = hash_group(e, date);
+    g = find_group(groups, e, date, hash);
+    if (CRON_SCHED_NONE == g) {
+        g = new_group(groups, e, date, hash);
+        if (CRON_SCHED_NONE == g) goto return_error;
+        created = 1;
+        if (0 != cron_sched_add_at(&groups->sched, g, expr, date, now)) goto return_error;
+    } else if (g == groups->group_of[job_id]) {
+        /* same expression and date, the job stays in its group */
+        release_expr(groups, e);
+        return 0;
+    }
+    /* a replaced job leaves its old group only once joining the new one cannot fail */
+    if (0 != reserve_group(&groups->groups[g], groups->groups[g].len + 1)) goto return_error;
+    cron_groups_remove(groups, job_id);
+    append_job(groups, g, job_id);
+    release_expr(groups, e);
+    groups->count += 1;
+    return 0;
+
+    return_error:
+    if (created) release_group(groups, g);
+    release_expr(groups, e);
+    return 1;
+}
+
+int cron_groups_remove(cron_groups* groups, uint32_t job_id) {
+    cron_group* group;
+    uint32_t g;
+    uint32_t last;
+    if (!groups || job_id >= groups->jobs_len || CRON_SCHED_NONE == groups->group_of[job_id]) return 1;
+    g = groups->group_of[job_id];
+    group = &groups->groups[g];
+    group->len -= 1;
+    last = group->jobs[group->len];
+    group->jobs[groups->index_of[job_id]] = last;
+    groups->index_of[last] = groups->index_of[job_id];
+    groups->group_of[job_id] = CRON_SCHED_NONE;
+    groups->count -= 1;
+    if (0 == group->len) release_group(groups, g);
+    return 0;
+}
+
+time_t cron_groups_next(const cron_groups* groups, uint32_t job_id) {
+    if (!groups || job_id >= groups->jobs_len || CRON_SCHED_NONE == groups->group_of[job_id]) {
+        return CRON_INVALID_INSTANT;
+    }
+    return groups->groups[groups->group_of[job_id]].date;
+}
+
+size_t cron_groups_pop_due(cron_groups* groups, time_t now, cron_group_batch* out) {
+    cron_sched_fire fire;
+    cron_group* group;
+    time_t date;
+    uint32_t hash;
+    uint32_t target;
+    size_t len;
+    if (!groups || !out) return 0;
+    if (0 == cron_sched_pop_due(&groups->sched, now, &fire, 1)) return 0;
+    group = &groups->groups[fire.job_id];
+    len = group->len;
+    /* rescheduled by the scheduler core, joins the group of the same expression at the new date */
+    date = cron_sched_next(&groups->sched, fire.job_id);
+    hash = hash_group(group->expr, date);
+    target = find_group(groups, group->expr, date, hash);
+    if (CRON_SCHED_NONE != target && group->len <= groups->groups[target].len
+            && 0 == move_jobs(groups, fire.job_id, target)) {
+        release_group(groups, fire.job_id);
+    } else {
+        /* the popped jobs stay first when the other group is appended */
+        if (CRON_SCHED_NONE != target && 0 == move_jobs(groups, target, fire.job_id)) {
+            release_group(groups, target);
+        }
+        unlink_group(groups, fire.job_id);
+        group->date = date;
+        group->hash = hash;
+        link_group(groups, fire.job_id);
+    }
+    out->date = fire.date;
+    out->job_ids = group->jobs;
+    out->len = len;
+    return len;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_group.h
+ *
+ * Coalesced scheduler: jobs with the same expression and next 'fire' date
+ * share a single entry of a scheduler core and fire as a batch.
+ */
+
+#ifndef CCRONEXPR_GROUP_H
+#define CCRONEXPR_GROUP_H
+
+#include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+extern "C" {
+#endif
+
+/**
+ * Jobs due at the same date, returned by 'cron_groups_pop_due'.
+ * The ids stay valid until the next call that changes the groups.
+ */
+typedef struct {
+    time_t date;              /* scheduled 'fire' date */
+    const uint32_t* job_ids;
+    size_t len;
+} cron_group_batch;
+
+/**
+ * Interned expression, shared by the groups of its jobs
+ */
+typedef struct {
+    cron_expr expr;
+    uint32_t hash;
+    uint32_t refs;            /* groups of the expression, 0 if the entry is free */
+    uint32_t chain;           /* next entry of the bucket, or the next free entry */
+} cron_group_expr;
+
+/**
+ * Jobs of an interned expression due at the same date
+ */
+typedef struct {
+    uint32_t expr;            /* CRON_SCHED_NONE if the group is free */
+    uint32_t hash;
+    time_t date;
+    uint32_t chain;           /* next group of the bucket, or the next free group */
+    uint32_t* jobs;
+    size_t len;
+    size_t capacity;
+} cron_group;
+
+/**
+ * Groups of jobs scheduled as single entries of a scheduler core: a due
+ * group costs one search of the next date whatever the number of its jobs.
+ * Groups of an expression that meet at the same date are merged.
+ * Fields are internal.
+ */
+typedef struct {
+    cron_sched sched;         /* by group id */
+    cron_group_expr* exprs;
+    size_t exprs_len;
+    size_t exprs_capacity;
+    uint32_t exprs_free;
+    uint32_t* expr_buckets;
+    size_t expr_buckets_len;
+    cron_group* groups;
+    size_t groups_len;
+    size_t groups_capacity;
+    uint32_t groups_free;
+    uint32_t* group_buckets;
+    size_t group_buckets_len;
+    uint32_t* group_of;       /* by job id, CRON_SCHED_NONE if there is no such job */
+    uint32_t* index_of;       /* by job id, in the jobs of its group */
+    size_t jobs_len;
+    size_t jobs_capacity;
+    size_t count;             /* number of jobs */
+} cron_groups;
+
+/**
+ * Initializes empty groups.
+ *
+ * @param out groups to initialize, must be released with 'cron_groups_free'
+ * @param backend CRON_SCHED_HEAP or CRON_SCHED_WHEEL, backend of the scheduler core
+ * @return 0 on success, non-zero for an unknown backend
+ */
+int cron_groups_init(cron_groups* out, int backend);
+
+/**
+ * Releases memory held by the groups.
+ *
+ * @param groups groups to release
+ */
+void cron_groups_free(cron_groups* groups);
+
+/**
+ * Adds a job to the group of its expression and next 'fire' date, or
+ * replaces the expression of the job with the same id.
+ *
+ * @param groups groups
+ * @param job_id id of the job, less than CRON_SCHED_NONE
+ * @param expr parsed cron expression, interned
+ * @param now current date, the job is scheduled at its next 'fire' date after it
+ * @return 0 on success, non-zero on error
+ */
+int cron_groups_add(cron_groups* groups, uint32_t job_id, const cron_expr* expr, time_t now);
+
+/**
+ * Removes a job.
+ *
+ * @param groups groups
+ * @param job_id id of the job
+ * @return 0 on success, non-zero if there is no such job
+ */
+int cron_groups_remove(cron_groups* groups, uint32_t job_id);
+
+/**
+ * Next 'fire' date of a job.
+ *
+ * @param groups groups
+ * @param job_id id of the job
+ * @return next 'fire' date, '((time_t) -1)' if there is no such job or it never fires again
+ */
+time_t cron_groups_next(const cron_groups* groups, uint32_t job_id);
+
+/**
+ * Pops the earliest group due at the specified date and reschedules it
+ * like 'cron_sched_pop_due' does with a job. Groups due at the same date, and
+ * the jobs of a group, come in no particular order.
+ *
+ * @param groups groups
+ * @param now current date
+ * @param out due jobs
+ * @return number of due jobs in the batch, 0 if no group is due
+ */
+size_t cron_groups_pop_due(cron_groups* groups, time_t now, cron_group_batch* out);
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+} /* extern "C"*/
+#endif
+
+#endif /* CCRONEXPR_GROUP_H */
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_group_test.c
+ *
+ * Tests of the coalesced scheduler
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ccronexpr_group.h"
+#include "ccronexpr_sched_test_util.h"
+
+#define JOBS 6000
+
+// the same jobs fire at the same dates as with a scheduler core of jobs
+void test_like_sched(int backend) {
+    static cron_expr exprs[JOBS];
+    static cron_sched_fire expected[JOBS];
+    static cron_sched_fire actual[JOBS];
+    cron_groups groups;
+    cron_groups invalid;
+    cron_sched sched;
+    time_t now = FROM;
+    uint32_t i;
+    int res;
+    int sched_res;
+    res = cron_groups_init(&groups, backend);
+    assert(0 == res);
+    res = cron_groups_init(&invalid, 7);
+    assert(0 != res);
+    cron_sched_init_backend(&sched, backend);
+    for (i = 0; i < JOBS; i++) {
+        /* few seeds, so that H items give a few distinct expressions */
+        test_parse_job(i, i % 2, &exprs[i]);
+    }
+    // jobs added at different dates join the same groups later
+    for (; now < FROM + 3; now++) {
+        for (i = 0; i < JOBS; i++) {
+            if ((i / TEST_EXPRESSIONS_LEN) % 3 != (uint32_t) (now - FROM)) continue;
+            res = cron_groups_add(&groups, i, &exprs[i], now);
+            sched_res = cron_sched_add(&sched, i, &exprs[i], now);
+            assert(0 == res && 0 == sched_res);
+        }
+    }
+    // 11 distinct expressions, the every second ones split by the date they were added at
+    assert(13 == groups.sched.count && 11 == groups.exprs_len);
+    res = cron_groups_remove(&groups, 8);
+    sched_res = cron_sched_remove(&sched, 8);
+    assert(0 == res && 0 == sched_res);
+    res = cron_groups_remove(&groups, 8);
+    assert(0 != res);
+    res = cron_groups_remove(&groups, JOBS);
+    assert(0 != res);
+    res = cron_groups_add(&groups, 9, &exprs[10], now);
+    sched_res = cron_sched_add(&sched, 9, &exprs[10], now);
+    assert(0 == res && 0 == sched_res);
+    for (; now < FROM + 4000; now += 1 + (now % 11 == 0 ? 50 : 0)) {
+        cron_group_batch batch;
+        size_t expected_len = test_pop_all(&sched, now, expected);
+        size_t actual_len = 0;
+        size_t k;
+        while (cron_groups_pop_due(&groups, now, &batch) > 0) {
+            assert(batch.date <= now);
+            for (k = 0; k < batch.len; k++) {
+                assert(cron_sched_next(&sched, batch.job_ids[k]) == cron_groups_next(&groups, batch.job_ids[k]));
+                actual[actual_len].job_id = batch.job_ids[k];
+                actual[actual_len].date = batch.date;
+                actual_len++;
+            }
+        }
+        assert(expected_len == actual_len);
+        qsort(expected, expected_len, sizeof(cron_sched_fire), test_compare_fires);
+        qsort(actual, actual_len, sizeof(cron_sched_fire), test_compare_fires);
+        for (k = 0; k < expected_len; k++) {
+            assert(expected[k].job_id == actual[k].job_id && expected[k].date == actual[k].date);
+        }
+    }
+    for (i = 0; i < JOBS; i++) {
+        assert(cron_sched_next(&sched, i) == cron_groups_next(&groups, i));
+    }
+    // groups added at different dates were merged
+    assert(11 == groups.sched.count);
+    assert(JOBS - 1 == groups.count);
+    cron_groups_free(&groups);
+    cron_sched_free(&sched);
+}
+
+// a spike of jobs sharing an expression is a single batch
+void test_batch() {
+    cron_groups groups;
+    cron_group_batch batch;
+    cron_expr hourly;
+    cron_expr never;
+    const char* err = NULL;
+    uint32_t i;
+    size_t len;
+    int res;
+    cron_parse_expr("0 0 * * * *", &hourly, &err);
+    cron_parse_expr("0 0 0 30 2 *", &never, &err);
+    res = cron_groups_init(&groups, CRON_SCHED_WHEEL);
+    assert(0 == res);
+    for (i = 0; i < 10000; i++) {
+        res = cron_groups_add(&groups, i, i % 1000 == 0 ? &never : &hourly, FROM);
+        assert(0 == res);
+    }
+    assert(2 == groups.sched.count && 2 == groups.exprs_len);
+    len = cron_groups_pop_due(&groups, FROM + 369, &batch);
+    assert(0 == len);
+    len = cron_groups_pop_due(&groups, FROM + 370, &batch);
+    assert(9990 == len);
+    assert(FROM + 370 == batch.date);
+    len = cron_groups_pop_due(&groups, FROM + 370, &batch);
+    assert(0 == len);
+    assert(FROM + 370 + 3600 == cron_groups_next(&groups, 1));
+    assert(CRON_INVALID_INSTANT == cron_groups_next(&groups, 1000));
+    // replaced with the same expression, the job stays in its group
+    res = cron_groups_add(&groups, 3, &hourly, FROM + 370);
+    assert(0 == res);
+    assert(10000 == groups.count && 2 == groups.sched.count && 9990 == groups.groups[groups.group_of[3]].len);
+    // replaced and removed jobs leave their groups
+    res = cron_groups_add(&groups, 1, &never, FROM);
+    assert(0 == res);
+    res = cron_groups_remove(&groups, 2);
+    assert(0 == res);
+    assert(CRON_INVALID_INSTANT == cron_groups_next(&groups, 1));
+    assert(CRON_INVALID_INSTANT == cron_groups_next(&groups, 2));
+    len = cron_groups_pop_due(&groups, FROM + 370 + 3600, &batch);
+    assert(9988 == len);
+    for (i = 0; i < 10000; i++) {
+        cron_groups_remove(&groups, i);
+    }
+    assert(0 == groups.sched.count && 0 == groups.count);
+    cron_groups_free(&groups);
+}
+
+int main() {
+    test_like_sched(CRON_SCHED_HEAP);
+    test_like_sched(CRON_SCHED_WHEEL);
+    test_batch();
+#ifdef CRON_TEST_MALLOC
+    assert(0 == test_allocations);
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}
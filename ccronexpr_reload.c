@@ -0,0 +1,223 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_reload.c
+ *
+ * Hot reload on versions released when every dispatcher moved past them
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccronexpr_reload.h"
+
+#ifndef CRON_TEST_MALLOC
+#define cron_malloc(x) malloc(x)
+#define cron_free(x) free(x)
+#else /* CRON_TEST_MALLOC */
+void* cron_malloc(size_t n);
+void cron_free(void* p);
+#endif /* CRON_TEST_MALLOC */
+
+/* Batches */
+
+void cron_reload_batch_init(cron_reload_batch* batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+void cron_reload_batch_free(cron_reload_batch* batch) {
+    if (!batch) return;
+    if (batch->changes) cron_free(batch->changes);
+    memset(batch, 0, sizeof(*batch));
+}
+
+static cron_reload_change* append_change(cron_reload_batch* batch, uint32_t job_id) {
+    cron_reload_change* change;
+    if (!batch || CRON_SCHED_NONE == job_id) return NULL;
+    if (batch->len == batch->capacity) {
+        size_t cap = batch->capacity > 0 ? batch->capacity * 2 : 16;
+        void* changes = cron_malloc(cap * sizeof(cron_reload_change));
+        if (!changes) return NULL;
+        if (batch->changes) {
+            memcpy(changes, batch->changes, batch->len * sizeof(cron_reload_change));
+            cron_free(batch->changes);
+        }
+        batch->changes = (cron_reload_change*) changes;
+        batch->capacity = cap;
+    }
+    change = &batch->changes[batch->len++];
+    memset(change, 0, sizeof(*change));
+    change->job_id = job_id;
+    return change;
+}
+
+int cron_reload_batch_set(cron_reload_batch* batch, uint32_t job_id, const cron_expr* expr) {
+    cron_reload_change* change;
+    if (!expr) return 1;
+    change = append_change(batch, job_id);
+    if (!change) return 1;
+    change->expr = *expr;
+    return 0;
+}
+
+int cron_reload_batch_remove(cron_reload_batch* batch, uint32_t job_id) {
+    cron_reload_change* change = append_change(batch, job_id);
+    if (!change) return 1;
+    change->removed = 1;
+    return 0;
+}
+
+/* Versions */
+
+static void free_version(cron_reload_version* version) {
+    if (version->changes) cron_free(version->changes);
+    cron_free(version);
+}
+
+/* with the lock, versions before the oldest one a dispatcher reads */
+static void release_versions(cron_reload* reload) {
+    unsigned long min = reload->latest->number;
+    size_t i;
+    for (i = 0; i < reload->len; i++) {
+        unsigned long applied = __atomic_load_n(&reload->dispatchers[i].applied, __ATOMIC_ACQUIRE);
+        if (applied < min) min = applied;
+    }
+    while (reload->oldest->number < min) {
+        cron_reload_version* version = reload->oldest;
+        reload->oldest = version->next;
+        free_version(version);
+    }
+}
+
+int cron_reload_init(size_t dispatchers, int backend, cron_reload* out) {
+    size_t i;
+    if (!out || 0 == dispatchers || (CRON_SCHED_HEAP != backend && CRON_SCHED_WHEEL != backend)) return 1;
+    memset(out, 0, sizeof(*out));
+    /* the first version has no changes, every dispatcher starts with it */
+    out->oldest = (cron_reload_version*) cron_malloc(sizeof(cron_reload_version));
+    out->dispatchers = (cron_reload_dispatcher*) cron_malloc(dispatchers * sizeof(cron_reload_dispatcher));
+    if (!out->oldest || !out->dispatchers) goto return_error;
+    memset(out->oldest, 0, sizeof(cron_reload_version));
+    memset(out->dispatchers, 0, dispatchers * sizeof(cron_reload_dispatcher));
+    out->latest = out->oldest;
+    out->len = dispatchers;
+    for (i = 0; i < dispatchers; i++) {
+        cron_sched_init_backend(&out->dispatchers[i].sched, backend);
+        out->dispatchers[i].version = out->oldest;
+    }
+    pthread_mutex_init(&out->lock, NULL);
+    return 0;
+
+    return_error:
+    if (out->oldest) cron_free(out->oldest);
+    if (out->dispatchers) cron_free(out->dispatchers);
+    memset(out, 0, sizeof(*out));
+    return 1;
+}
+
+void cron_reload_free(cron_reload* reload) {
+    size_t i;
+    if (!reload || !reload->dispatchers) return;
+    for (i = 0; i < reload->len; i++) {
+        cron_sched_free(&reload->dispatchers[i].sched);
+    }
+    while (reload->oldest) {
+        cron_reload_version* version = reload->oldest;
+        reload->oldest = version->next;
+        free_version(version);
+    }
+    cron_free(reload->dispatchers);
+    pthread_mutex_destroy(&reload->lock);
+    memset(reload, 0, sizeof(*reload));
+}
+
+int cron_reload_commit(cron_reload* reload, cron_reload_batch* batch, time_t now) {
+    cron_reload_version* version;
+    if (!reload || !batch) return 1;
+    version = (cron_reload_version*) cron_malloc(sizeof(cron_reload_version));
+    if (!version) return 1;
+    version->now = now;
+    version->changes = batch->changes;
+    version->len = batch->len;
+    version->next = NULL;
+    memset(batch, 0, sizeof(*batch));
+    pthread_mutex_lock(&reload->lock);
+    version->number = reload->latest->number + 1;
+    /* the changes are visible to a dispatcher that sees the link */
+    __atomic_store_n(&reload->latest->next, version, __ATOMIC_RELEASE);
+    reload->latest = version;
+    release_versions(reload);
+    pthread_mutex_unlock(&reload->lock);
+    return 0;
+}
+
+/* Dispatchers */
+
+int cron_reload_pending(const cron_reload* reload, size_t dispatcher) {
+    const cron_reload_dispatcher* d;
+    if (!reload || dispatcher >= reload->len) return 0;
+    d = &reload->dispatchers[dispatcher];
+    return NULL != __atomic_load_n(&d->version->next, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Looks at most at CRON_RELOAD_APPLY changes of the next versions. A change
+ * that cannot be applied, e.g. when the arrays cannot grow, is tried again
+ * by the next call.
+ */
+static void apply_changes(cron_reload* reload, size_t index) {
+    cron_reload_dispatcher* d = &reload->dispatchers[index];
+    size_t budget = CRON_RELOAD_APPLY;
+    for (;;) {
+        cron_reload_version* next = __atomic_load_n(&d->version->next, __ATOMIC_ACQUIRE);
+        if (!next) return;
+        for (; d->pos < next->len; d->pos++) {
+            const cron_reload_change* change = &next->changes[d->pos];
+            if (0 == budget) return;
+            budget--;
+            if (change->job_id % reload->len != index) continue;
+            if (change->removed) {
+                cron_sched_remove(&d->sched, (uint32_t) (change->job_id / reload->len));
+            } else if (0 != cron_sched_add(&d->sched, (uint32_t) (change->job_id / reload->len), &change->expr, next->now)) {
+                return;
+            }
+        }
+        /* the previous version is not read anymore */
+        d->version = next;
+        d->pos = 0;
+        __atomic_store_n(&d->applied, next->number, __ATOMIC_RELEASE);
+    }
+}
+
+size_t cron_reload_pop_due(cron_reload* reload, size_t dispatcher, time_t now, cron_sched_fire* out, size_t max) {
+    size_t len;
+    size_t i;
+    if (!reload || dispatcher >= reload->len || !out) return 0;
+    apply_changes(reload, dispatcher);
+    len = cron_sched_pop_due(&reload->dispatchers[dispatcher].sched, now, out, max);
+    /* local ids back to job ids */
+    for (i = 0; i < len; i++) {
+        out[i].job_id = (uint32_t) (out[i].job_id * reload->len + dispatcher);
+    }
+    return len;
+}
+
+time_t cron_reload_peek(cron_reload* reload, size_t dispatcher) {
+    if (!reload || dispatcher >= reload->len) return CRON_INVALID_INSTANT;
+    apply_changes(reload, dispatcher);
+    return cron_sched_peek(&reload->dispatchers[dispatcher].sched);
+}
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_reload.h
+ *
+ * Hot reload of the schedules: batches of changes are published as versions
+ * that the dispatch threads pick up without locks, old versions are released
+ * once every dispatcher moved past them.
+ */
+
+#ifndef CCRONEXPR_RELOAD_H
+#define CCRONEXPR_RELOAD_H
+
+#include <pthread.h>
+
+#include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+extern "C" {
+#endif
+
+/* Changes a dispatcher looks at per call, bounds the delay of a call by a large batch */
+#define CRON_RELOAD_APPLY 256
+
+/**
+ * Change of the schedule of a job
+ */
+typedef struct {
+    cron_expr expr;
+    uint32_t job_id;
+    int removed;
+} cron_reload_change;
+
+/**
+ * Changes collected by any thread before they are committed.
+ */
+typedef struct {
+    cron_reload_change* changes;
+    size_t len;
+    size_t capacity;
+} cron_reload_batch;
+
+/**
+ * Committed batch of changes. Versions are linked from the oldest to the
+ * latest, a version is not modified once it is linked.
+ */
+typedef struct cron_reload_version {
+    unsigned long number;
+    time_t now;                          /* changed jobs are scheduled after it */
+    cron_reload_change* changes;
+    size_t len;
+    struct cron_reload_version* next;    /* newer version, NULL for the latest */
+} cron_reload_version;
+
+/**
+ * Scheduler core of a dispatch thread, with the jobs whose ids modulo the
+ * number of dispatchers are its index. A job has the local id of its id
+ * divided by the number of dispatchers, so the arrays of the scheduler core
+ * are not larger than its share of the jobs.
+ */
+typedef struct {
+    cron_sched sched;                    /* by local id */
+    cron_reload_version* version;        /* last applied version */
+    size_t pos;                          /* changes of the next version applied so far */
+    unsigned long applied;               /* number of 'version', read by the writers */
+    char pad[64];
+} cron_reload_dispatcher;
+
+/**
+ * Schedules reloaded in batches while the dispatchers run. Writers are
+ * serialized by a lock; dispatchers never wait for it, they apply the
+ * committed changes between their calls, so a firing started by a call
+ * completes against the version it was scheduled with.
+ * Fields are internal.
+ */
+typedef struct {
+    cron_reload_dispatcher* dispatchers;
+    size_t len;
+    cron_reload_version* oldest;         /* still read by a dispatcher */
+    cron_reload_version* latest;
+    pthread_mutex_t lock;                /* writers */
+} cron_reload;
+
+/**
+ * Initializes an empty batch.
+ *
+ * @param batch batch to initialize, must be released with 'cron_reload_batch_free'
+ */
+void cron_reload_batch_init(cron_reload_batch* batch);
+
+/**
+ * Releases memory held by the batch.
+ *
+ * @param batch batch to release
+ */
+void cron_reload_batch_free(cron_reload_batch* batch);
+
+/**
+ * Adds a job, or replaces the expression of the job with the same id, in the batch.
+ *
+ * @param batch batch
+ * @param job_id id of the job, less than CRON_SCHED_NONE
+ * @param expr parsed cron expression, copied
+ * @return 0 on success, non-zero on error
+ */
+int cron_reload_batch_set(cron_reload_batch* batch, uint32_t job_id, const cron_expr* expr);
+
+/**
+ * Removes a job in the batch.
+ *
+ * @param batch batch
+ * @param job_id id of the job
+ * @return 0 on success, non-zero on error
+ */
+int cron_reload_batch_remove(cron_reload_batch* batch, uint32_t job_id);
+
+/**
+ * Initializes the schedules without jobs.
+ *
+ * @param dispatchers number of dispatch threads
+ * @param backend CRON_SCHED_HEAP or CRON_SCHED_WHEEL, backend of the dispatchers
+ * @param out schedules to initialize, must be released with 'cron_reload_free'
+ * @return 0 on success, non-zero on error
+ */
+int cron_reload_init(size_t dispatchers, int backend, cron_reload* out);
+
+/**
+ * Releases memory held by the schedules, the dispatchers must be stopped.
+ *
+ * @param reload schedules to release
+ */
+void cron_reload_free(cron_reload* reload);
+
+/**
+ * Publishes the changes of the batch as a new version and releases the
+ * versions every dispatcher moved past. Changes of the same job apply in
+ * their order. May be called from any thread.
+ *
+ * @param reload schedules
+ * @param batch changes, taken by the version, the batch is left empty
+ * @param now current date, changed jobs are scheduled at their next 'fire' date after it
+ * @return 0 on success, non-zero on error
+ */
+int cron_reload_commit(cron_reload* reload, cron_reload_batch* batch, time_t now);
+
+/**
+ * Checks if a dispatcher has committed changes left to apply, e.g. before
+ * its dispatch thread sleeps until the earliest date. Called by the dispatch
+ * thread only, never waits for the writers.
+ *
+ * @param reload schedules
+ * @param dispatcher index of the dispatcher
+ * @return 1 if changes are left, 0 otherwise
+ */
+int cron_reload_pending(const cron_reload* reload, size_t dispatcher);
+
+/**
+ * Applies at most CRON_RELOAD_APPLY committed changes, then pops the jobs of
+ * the dispatcher due at the specified date like 'cron_sched_pop_due'.
+ * Called by the dispatch thread only, never waits for the writers.
+ *
+ * @param reload schedules
+ * @param dispatcher index of the dispatcher
+ * @param now current date
+ * @param out array of due jobs
+ * @param max length of the array
+ * @return number of due jobs written to the array
+ */
+size_t cron_reload_pop_due(cron_reload* reload, size_t dispatcher, time_t now, cron_sched_fire* out, size_t max);
+
+/**
+ * Applies at most CRON_RELOAD_APPLY committed changes, then returns the
+ * earliest next 'fire' date of the jobs of the dispatcher.
+ * Called by the dispatch thread only, never waits for the writers.
+ *
+ * @param reload schedules
+ * @param dispatcher index of the dispatcher
+ * @return earliest date, '((time_t) -1)' if no job is scheduled
+ */
+time_t cron_reload_peek(cron_reload* reload, size_t dispatcher);
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+} /* extern "C"*/
+#endif
+
+#endif /* CCRONEXPR_RELOAD_H */
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_reload_test.c
+ *
+ * Tests of the hot reload
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ccronexpr_reload.h"
+#include "ccronexpr_sched_test_util.h"
+
+#define JOBS 3000
+
+static void apply_all(cron_reload* reload) {
+    size_t i;
+    for (i = 0; i < reload->len; i++) {
+        while (cron_reload_pending(reload, i)) {
+            cron_reload_peek(reload, i);
+        }
+    }
+}
+
+// the dispatchers fire the same jobs as a scheduler core, before and after a reload
+void test_like_sched(int backend) {
+    static cron_sched_fire expected[JOBS];
+    static cron_sched_fire actual[JOBS];
+    cron_reload reload;
+    cron_reload invalid;
+    cron_reload_batch batch;
+    cron_sched sched;
+    cron_expr expr;
+    time_t now = FROM;
+    int reloaded = 0;
+    uint32_t i;
+    int res;
+    int sched_res;
+    res = cron_reload_init(2, backend, &reload);
+    assert(0 == res);
+    res = cron_reload_init(2, 7, &invalid);
+    assert(0 != res);
+    res = cron_reload_init(0, backend, &invalid);
+    assert(0 != res);
+    cron_sched_init_backend(&sched, backend);
+    cron_reload_batch_init(&batch);
+    for (i = 0; i < JOBS; i++) {
+        test_parse_job(i, i, &expr);
+        res = cron_reload_batch_set(&batch, i, &expr);
+        sched_res = cron_sched_add(&sched, i, &expr, now);
+        assert(0 == res && 0 == sched_res);
+    }
+    res = cron_reload_commit(&reload, &batch, now);
+    assert(0 == res);
+    assert(0 == batch.len);
+    apply_all(&reload);
+    for (now = FROM + 1; now < FROM + 1200; now += 1 + (now % 13 == 0 ? 40 : 0)) {
+        size_t expected_len = 0;
+        size_t actual_len = 0;
+        size_t len;
+        size_t d;
+        if (now >= FROM + 600 && !reloaded) {
+            // every third job changes its expression, every tenth is removed
+            for (i = 0; i < JOBS; i += 3) {
+                test_parse_job(i + 1, i, &expr);
+                res = cron_reload_batch_set(&batch, i, &expr);
+                sched_res = cron_sched_add(&sched, i, &expr, now);
+                assert(0 == res && 0 == sched_res);
+            }
+            for (i = 0; i < JOBS; i += 10) {
+                res = cron_reload_batch_remove(&batch, i);
+                assert(0 == res);
+                cron_sched_remove(&sched, i);
+            }
+            res = cron_reload_commit(&reload, &batch, now);
+            assert(0 == res);
+            apply_all(&reload);
+            reloaded = 1;
+        }
+        expected_len = test_pop_all(&sched, now, expected);
+        for (d = 0; d < 2; d++) {
+            while ((len = cron_reload_pop_due(&reload, d, now, actual + actual_len, 256)) > 0) {
+                size_t k;
+                for (k = 0; k < len; k++) {
+                    assert(d == actual[actual_len + k].job_id % 2);
+                }
+                actual_len += len;
+            }
+        }
+        assert(expected_len == actual_len);
+        qsort(expected, expected_len, sizeof(cron_sched_fire), test_compare_fires);
+        qsort(actual, actual_len, sizeof(cron_sched_fire), test_compare_fires);
+        for (i = 0; i < expected_len; i++) {
+            assert(expected[i].job_id == actual[i].job_id && expected[i].date == actual[i].date);
+        }
+    }
+    for (i = 0; i < JOBS; i++) {
+        assert(cron_sched_next(&sched, i) == cron_sched_next(&reload.dispatchers[i % 2].sched, i / 2));
+    }
+    // each dispatcher holds its share of the jobs only
+    assert(JOBS / 2 == reload.dispatchers[0].sched.jobs_len && JOBS / 2 == reload.dispatchers[1].sched.jobs_len);
+    cron_reload_batch_free(&batch);
+    cron_reload_free(&reload);
+    cron_sched_free(&sched);
+}
+
+// a large batch is applied over several calls, versions are released once applied
+void test_bounded_apply() {
+    cron_reload reload;
+    cron_reload_batch batch;
+    cron_expr expr;
+    int calls = 0;
+    uint32_t i;
+    time_t next;
+    int res;
+    res = cron_reload_init(1, CRON_SCHED_HEAP, &reload);
+    assert(0 == res);
+    cron_reload_batch_init(&batch);
+    test_parse_job(2, 2, &expr);
+    for (i = 0; i < CRON_RELOAD_APPLY * 4; i++) {
+        res = cron_reload_batch_set(&batch, i, &expr);
+        assert(0 == res);
+    }
+    res = cron_reload_commit(&reload, &batch, FROM);
+    assert(0 == res);
+    while (cron_reload_pending(&reload, 0)) {
+        next = cron_reload_peek(&reload, 0);
+        calls++;
+        assert(FROM + 1 == next);
+        assert((size_t) calls * CRON_RELOAD_APPLY == reload.dispatchers[0].sched.count);
+    }
+    assert(4 == calls);
+    assert(0 == reload.oldest->number);
+    res = cron_reload_commit(&reload, &batch, FROM);
+    assert(0 == res);
+    assert(1 == reload.oldest->number && 2 == reload.latest->number);
+    res = cron_reload_batch_remove(&batch, 5);
+    assert(0 == res);
+    res = cron_reload_commit(&reload, &batch, FROM);
+    assert(0 == res);
+    assert(1 == reload.oldest->number);
+    cron_reload_peek(&reload, 0);
+    res = cron_reload_commit(&reload, &batch, FROM);
+    assert(0 == res);
+    assert(3 == reload.oldest->number);
+    assert(CRON_RELOAD_APPLY * 4 - 1 == reload.dispatchers[0].sched.count);
+    cron_reload_free(&reload);
+}
+
+typedef struct {
+    cron_reload* reload;
+    size_t index;
+    int stop;
+    unsigned long fires;
+} dispatch_thread;
+
+static void* dispatch_main(void* arg) {
+    dispatch_thread* t = (dispatch_thread*) arg;
+    cron_sched_fire due[64];
+    time_t now = FROM;
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        size_t len;
+        while ((len = cron_reload_pop_due(t->reload, t->index, now, due, 64)) > 0) {
+            t->fires += len;
+        }
+        now++;
+    }
+    return NULL;
+}
+
+// dispatch threads keep firing while batches are committed
+void test_concurrent() {
+    cron_reload reload;
+    cron_reload_batch batch;
+    dispatch_thread threads[2];
+    pthread_t ids[2];
+    static int present[JOBS];
+    cron_expr expr;
+    uint32_t i;
+    int round;
+    int res;
+    res = cron_reload_init(2, CRON_SCHED_WHEEL, &reload);
+    assert(0 == res);
+    cron_reload_batch_init(&batch);
+    for (i = 0; i < 2; i++) {
+        threads[i].reload = &reload;
+        threads[i].index = i;
+        threads[i].stop = 0;
+        threads[i].fires = 0;
+        res = pthread_create(&ids[i], NULL, dispatch_main, &threads[i]);
+        assert(0 == res);
+    }
+    memset(present, 0, sizeof(present));
+    for (round = 0; round < 300; round++) {
+        for (i = 0; i < 100; i++) {
+            uint32_t job_id = (uint32_t) (round * 7919 + i * 31) % JOBS;
+            if (round % 5 == 4 && present[job_id]) {
+                res = cron_reload_batch_remove(&batch, job_id);
+                assert(0 == res);
+                present[job_id] = 0;
+            } else {
+                test_parse_job(job_id + (uint32_t) round, job_id, &expr);
+                res = cron_reload_batch_set(&batch, job_id, &expr);
+                assert(0 == res);
+                present[job_id] = 1;
+            }
+        }
+        res = cron_reload_commit(&reload, &batch, FROM);
+        assert(0 == res);
+    }
+    for (i = 0; i < 2; i++) {
+        __atomic_store_n(&threads[i].stop, 1, __ATOMIC_RELEASE);
+        pthread_join(ids[i], NULL);
+    }
+    assert(threads[0].fires + threads[1].fires > 0);
+    apply_all(&reload);
+    for (i = 0; i < JOBS; i++) {
+        assert(present[i] == cron_sched_contains(&reload.dispatchers[i % 2].sched, i / 2));
+    }
+    cron_reload_free(&reload);
+}
+
+int main() {
+    test_like_sched(CRON_SCHED_HEAP);
+    test_like_sched(CRON_SCHED_WHEEL);
+    test_bounded_apply();
+    test_concurrent();
+#ifdef CRON_TEST_MALLOC
+    assert(0 == test_allocations);
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}
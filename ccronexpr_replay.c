@@ -0,0 +1,273 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_replay.c
+ *
+ * Replays a trace captured with 'cron_trace_start' against the current build,
+ * checks that every query returns the recorded result and reports the
+ * throughput and latency per API.
+ *
+ * Usage: ccronexpr_replay [--repeat N] [--quiet] TRACE
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ccronexpr.h"
+#include "ccronexpr_bench_util.h"
+
+#define REPLAY_VERSION 1
+#define REPLAY_FLAG_LOCAL_TIME 1
+#define REPLAY_HEADER_LEN 6
+#define REPLAY_MAX_MISMATCHES 10
+
+typedef struct {
+    char api;
+    uint32_t expr;
+    time_t date;
+    time_t result;
+} replay_query;
+
+typedef struct {
+    cron_expr* exprs;
+    size_t exprs_len;
+    replay_query* queries;
+    size_t queries_len;
+    size_t queries_capacity;
+    int flags;
+    int mixed_flags;
+} replay_trace;
+
+static uint8_t* read_file(const char* path, size_t* len) {
+    FILE* f = fopen(path, "rb");
+    uint8_t* data = NULL;
+    size_t capacity = 0;
+    size_t n;
+    *len = 0;
+    if (!f) return NULL;
+    do {
+        if (*len == capacity) {
+            uint8_t* grown;
+            capacity = capacity > 0 ? capacity * 2 : 65536;
+            grown = (uint8_t*) realloc(data, capacity);
+            if (!grown) {
+                free(data);
+                fclose(f);
+                return NULL;
+            }
+            data = grown;
+        }
+        n = fread(data + *len, 1, capacity - *len, f);
+        *len += n;
+    } while (n > 0);
+    fclose(f);
+    return data;
+}
+
+static int add_query(replay_trace* trace, char api, uint32_t expr, time_t date, time_t result) {
+    replay_query* query;
+    if (trace->queries_len == trace->queries_capacity) {
+        size_t capacity = trace->queries_capacity > 0 ? trace->queries_capacity * 2 : 1024;
+        replay_query* grown = (replay_query*) realloc(trace->queries, capacity * sizeof(replay_query));
+        if (!grown) return 1;
+        trace->queries = grown;
+        trace->queries_capacity = capacity;
+    }
+    query = &trace->queries[trace->queries_len++];
+    query->api = api;
+    query->expr = expr;
+    query->date = date;
+    query->result = result;
+    return 0;
+}
+
+/* Expression ids restart with every session, they are mapped to global indices */
+static int load_trace(const uint8_t* data, size_t len, replay_trace* trace) {
+    size_t pos = 0;
+    size_t session_base = 0;
+    int64_t last = 0;
+    int sessions = 0;
+    uint64_t id;
+    uint64_t delta;
+    uint64_t offset;
+    size_t n;
+
+    memset(trace, 0, sizeof(replay_trace));
+    while (pos < len) {
+        uint8_t type = data[pos];
+        if ('C' == type) {
+            if (len - pos < REPLAY_HEADER_LEN || 0 != memcmp(data + pos, "CRTR", 4)) return 1;
+            if (REPLAY_VERSION != data[pos + 4]) return 1;
+            if (sessions > 0 && trace->flags != data[pos + 5]) trace->mixed_flags = 1;
+            trace->flags = data[pos + 5];
+            session_base = trace->exprs_len;
+            last = 0;
+            sessions++;
+            pos += REPLAY_HEADER_LEN;
+            continue;
+        }
+        if (0 == sessions) return 1;
+        pos++;
+        n = bench_get_varint(data + pos, len - pos, &id);
+        if (0 == n || 0 == id) return 1;
+        pos += n;
+        if ('E' == type) {
+            cron_expr* grown;
+            if (id != trace->exprs_len - session_base + 1 || len - pos < sizeof(cron_expr)) return 1;
+            grown = (cron_expr*) realloc(trace->exprs, (trace->exprs_len + 1) * sizeof(cron_expr));
+            if (!grown) return 1;
+            trace->exprs = grown;
+            memcpy(&trace->exprs[trace->exprs_len++], data + pos, sizeof(cron_expr));
+            pos += sizeof(cron_expr);
+        } else if ('N' == type || 'P' == type) {
+            if (id > trace->exprs_len - session_base) return 1;
+            n = bench_get_varint(data + pos, len - pos, &delta);
+            if (0 == n) return 1;
+            pos += n;
+            n = bench_get_varint(data + pos, len - pos, &offset);
+            if (0 == n) return 1;
+            pos += n;
+            last += bench_unzigzag(delta);
+            if (0 != add_query(trace, (char) type, (uint32_t) (session_base + id - 1), (time_t) last,
+                    (time_t) (last + bench_unzigzag(offset)))) return 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void report(const char* api, double* samples, size_t count, double total) {
+    if (0 == count) return;
+    qsort(samples, count, sizeof(double), bench_compare_double);
+    printf("%-6s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", api, (unsigned long) count,
+            (double) count * 1e9 / total, total / (double) count, samples[count / 2], samples[count * 9 / 10],
+            samples[count * 99 / 100], samples[count - 1]);
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    unsigned long repeat = 1;
+    int quiet = 0;
+    uint8_t* data;
+    size_t len;
+    replay_trace trace;
+    double* next_samples;
+    double* prev_samples;
+    size_t next_len = 0;
+    size_t prev_len = 0;
+    double next_total = 0;
+    double prev_total = 0;
+    size_t mismatches = 0;
+    unsigned long r;
+    size_t i;
+    int local_build = 0;
+
+    for (i = 1; i < (size_t) argc; i++) {
+        if (0 == strcmp(argv[i], "--repeat") && i + 1 < (size_t) argc) {
+            repeat = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--quiet")) {
+            quiet = 1;
+        } else if (!path && '-' != argv[i][0]) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+    if (!path) {
+        fprintf(stderr, "Usage: %s [--repeat N] [--quiet] TRACE\n", argv[0]);
+        return 2;
+    }
+    if (repeat < 1) repeat = 1;
+    data = read_file(path, &len);
+    if (!data) {
+        fprintf(stderr, "Cannot read trace: %s\n", path);
+        return 2;
+    }
+    if (0 != load_trace(data, len, &trace)) {
+        fprintf(stderr, "Invalid trace: %s\n", path);
+        free(data);
+        free(trace.exprs);
+        free(trace.queries);
+        return 2;
+    }
+    free(data);
+
+#ifdef CRON_USE_LOCAL_TIME
+    local_build = 1;
+#endif
+    if (trace.mixed_flags) {
+        fprintf(stderr, "Warning: trace mixes UTC and local time sessions\n");
+    } else if (((trace.flags & REPLAY_FLAG_LOCAL_TIME) ? 1 : 0) != local_build) {
+        fprintf(stderr, "Warning: trace was captured in %s mode, replaying in %s mode\n",
+                (trace.flags & REPLAY_FLAG_LOCAL_TIME) ? "local time" : "UTC", local_build ? "local time" : "UTC");
+    }
+
+    next_samples = (double*) bench_malloc((trace.queries_len * repeat + 1) * sizeof(double));
+    prev_samples = (double*) bench_malloc((trace.queries_len * repeat + 1) * sizeof(double));
+    for (r = 0; r < repeat; r++) {
+        for (i = 0; i < trace.queries_len; i++) {
+            const replay_query* query = &trace.queries[i];
+            cron_expr* expr = &trace.exprs[query->expr];
+            time_t res;
+            double start = bench_now_ns();
+            double elapsed;
+            res = 'N' == query->api ? cron_next(expr, query->date) : cron_prev(expr, query->date);
+            elapsed = bench_now_ns() - start;
+            if ('N' == query->api) {
+                next_samples[next_len++] = elapsed;
+                next_total += elapsed;
+            } else {
+                prev_samples[prev_len++] = elapsed;
+                prev_total += elapsed;
+            }
+            if (0 == r && res != query->result) {
+                if (mismatches < REPLAY_MAX_MISMATCHES) {
+                    fprintf(stderr, "Mismatch: query %lu, %s from %ld, expected %ld, actual %ld\n", (unsigned long) i,
+                            'N' == query->api ? "next" : "prev", (long) query->date, (long) query->result, (long) res);
+                }
+                mismatches++;
+            }
+        }
+    }
+
+    if (!quiet) {
+        printf("Trace: %s, expressions: %lu, queries: %lu, repeat: %lu\n\n", path, (unsigned long) trace.exprs_len,
+                (unsigned long) trace.queries_len, repeat);
+        printf("%-6s %10s %12s %10s %10s %10s %10s %10s\n", "api", "calls", "calls/s", "ns/op", "p50", "p90", "p99", "max");
+        report("next", next_samples, next_len, next_total);
+        report("prev", prev_samples, prev_len, prev_total);
+    }
+    if (mismatches > 0) {
+        fprintf(stderr, "%lu of %lu queries returned different results\n", (unsigned long) mismatches,
+                (unsigned long) trace.queries_len);
+    }
+
+    free(next_samples);
+    free(prev_samples);
+    free(trace.exprs);
+    free(trace.queries);
+    return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,881 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sched.c
+ *
+ * Scheduler core on an indexed d-ary heap or a hierarchical timing wheel
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccronexpr_sched.h"
+
+#ifndef CRON_TEST_MALLOC
+#define cron_malloc(x) malloc(x)
+#define cron_free(x) free(x)
+#else /* CRON_TEST_MALLOC */
+void* cron_malloc(size_t n);
+void cron_free(void* p);
+#endif /* CRON_TEST_MALLOC */
+
+/* copies the array into a new one of the specified capacity */
+static void* resize_array(void* arr, size_t len, size_t capacity, size_t elem_size) {
+    void* res = cron_malloc(capacity * elem_size);
+    if (!res) return NULL;
+    if (arr) {
+        memcpy(res, arr, len * elem_size);
+        cron_free(arr);
+    }
+    return res;
+}
+
+static size_t grown_capacity(size_t capacity, size_t needed) {
+    size_t cap = capacity > 0 ? capacity : 16;
+    while (cap < needed) {
+        cap *= 2;
+    }
+    return cap;
+}
+
+static int reserve_jobs(cron_sched* sched, size_t jobs) {
+    size_t cap;
+    void* exprs = NULL;
+    void* positions = NULL;
+    void* used = NULL;
+    void* nodes = NULL;
+    int wheel = CRON_SCHED_WHEEL == sched->backend;
+    if (jobs <= sched->jobs_capacity) return 0;
+    if (jobs > (size_t) CRON_SCHED_NONE) return 1;
+    cap = grown_capacity(sched->jobs_capacity, jobs);
+    exprs = cron_malloc(cap * sizeof(cron_expr));
+    positions = cron_malloc(cap * sizeof(uint32_t));
+    used = cron_malloc(cap);
+    if (!exprs || !positions || !used) goto return_error;
+    if (wheel) {
+        nodes = cron_malloc(cap * sizeof(cron_sched_node));
+        if (!nodes) goto return_error;
+    }
+    if (sched->jobs_len > 0) {
+        memcpy(exprs, sched->exprs, sched->jobs_len * sizeof(cron_expr));
+        memcpy(positions, sched->positions, sched->jobs_len * sizeof(uint32_t));
+        memcpy(used, sched->used, sched->jobs_len);
+        if (wheel) {
+            memcpy(nodes, sched->nodes, sched->jobs_len * sizeof(cron_sched_node));
+        }
+    }
+    if (sched->exprs) cron_free(sched->exprs);
+    if (sched->positions) cron_free(sched->positions);
+    if (sched->used) cron_free(sched->used);
+    if (sched->nodes) cron_free(sched->nodes);
+    sched->exprs = (cron_expr*) exprs;
+    sched->positions = (uint32_t*) positions;
+    sched->used = (uint8_t*) used;
+    sched->nodes = (cron_sched_node*) nodes;
+    sched->jobs_capacity = cap;
+    return 0;
+
+    return_error:
+    if (exprs) cron_free(exprs);
+    if (positions) cron_free(positions);
+    if (used) cron_free(used);
+    if (nodes) cron_free(nodes);
+    return 1;
+}
+
+static int reserve_heap(cron_sched* sched, size_t len) {
+    size_t cap;
+    void* heap = NULL;
+    if (len <= sched->heap_capacity) return 0;
+    cap = grown_capacity(sched->heap_capacity, len);
+    heap = resize_array(sched->heap, sched->heap_len, cap, sizeof(cron_sched_entry));
+    if (!heap) return 1;
+    sched->heap = (cron_sched_entry*) heap;
+    sched->heap_capacity = cap;
+    return 0;
+}
+
+/* heap order: the earliest date first, then the lowest id */
+static int entry_before(const cron_sched_entry* a, const cron_sched_entry* b) {
+    return a->next != b->next ? a->next < b->next : a->job_id < b->job_id;
+}
+
+static void sift_up(cron_sched* sched, size_t pos, cron_sched_entry entry) {
+    while (pos > 0) {
+        size_t parent = (pos - 1) / CRON_SCHED_ARITY;
+        if (!entry_before(&entry, &sched->heap[parent])) break;
+        sched->heap[pos] = sched->heap[parent];
+        sched->positions[sched->heap[pos].job_id] = (uint32_t) pos;
+        pos = parent;
+    }
+    sched->heap[pos] = entry;
+    sched->positions[entry.job_id] = (uint32_t) pos;
+}
+
+static void sift_down(cron_sched* sched, size_t pos, cron_sched_entry entry) {
+    for (;;) {
+        size_t first = pos * CRON_SCHED_ARITY + 1;
+        size_t last = first + CRON_SCHED_ARITY;
+        size_t best = first;
+        size_t child;
+        if (first >= sched->heap_len) break;
+        if (last > sched->heap_len) last = sched->heap_len;
+        for (child = first + 1; child < last; child++) {
+            if (entry_before(&sched->heap[child], &sched->heap[best])) best = child;
+        }
+        if (!entry_before(&sched->heap[best], &entry)) break;
+        sched->heap[pos] = sched->heap[best];
+        sched->positions[sched->heap[pos].job_id] = (uint32_t) pos;
+        pos = best;
+    }
+    sched->heap[pos] = entry;
+    sched->positions[entry.job_id] = (uint32_t) pos;
+}
+
+/* moves the entry at the position to its place after its date changed */
+static void heap_fix(cron_sched* sched, size_t pos, cron_sched_entry entry) {
+    if (pos > 0 && entry_before(&entry, &sched->heap[(pos - 1) / CRON_SCHED_ARITY])) {
+        sift_up(sched, pos, entry);
+    } else {
+        sift_down(sched, pos, entry);
+    }
+}
+
+static void heap_remove(cron_sched* sched, uint32_t job_id) {
+    size_t pos = sched->positions[job_id];
+    cron_sched_entry last = sched->heap[--sched->heap_len];
+    sched->positions[job_id] = CRON_SCHED_NONE;
+    if (pos < sched->heap_len) {
+        heap_fix(sched, pos, last);
+    }
+}
+
+/* Timing wheel, slots of the levels are consecutive in 'slots' */
+
+#define WHEEL_MINUTE ((time_t) 60)
+#define WHEEL_HOUR ((time_t) 3600)
+#define WHEEL_DAY ((time_t) 86400)
+#define WHEEL_DAYS 64
+#define WHEEL_OVERFLOW (CRON_SCHED_WHEEL_SLOTS - 1)
+/* position of a job in the expired jobs */
+#define WHEEL_EXPIRED ((uint32_t) CRON_SCHED_WHEEL_SLOTS)
+
+static const size_t WHEEL_LEVELS[] = { 0, 60, 120, 144, WHEEL_OVERFLOW };
+
+/* division rounded down, dates before the epoch are negative */
+static time_t floor_div(time_t date, time_t unit) {
+    time_t res = date / unit;
+    return date % unit < 0 ? res - 1 : res;
+}
+
+static size_t floor_mod(time_t date, time_t unit) {
+    return (size_t) (date - floor_div(date, unit) * unit);
+}
+
+/* lowest set bit from the specified one, -1 if none */
+static int first_bit(uint64_t bits, size_t from) {
+    int res = (int) from;
+    bits >>= from;
+    if (!bits) return -1;
+    while (!(bits & 1)) {
+        bits >>= 1;
+        res++;
+    }
+    return res;
+}
+
+static size_t slot_level(size_t slot) {
+    size_t level = 0;
+    while (slot >= WHEEL_LEVELS[level + 1]) {
+        level++;
+    }
+    return level;
+}
+
+/* slot of the date relative to the current date, dates before it go to the current second */
+static size_t wheel_slot(const cron_sched* sched, time_t date) {
+    time_t cur = sched->current;
+    if (date < cur) date = cur;
+    if (floor_div(date, WHEEL_MINUTE) == floor_div(cur, WHEEL_MINUTE)) {
+        return WHEEL_LEVELS[0] + floor_mod(date, WHEEL_MINUTE);
+    }
+    if (floor_div(date, WHEEL_HOUR) == floor_div(cur, WHEEL_HOUR)) {
+        return WHEEL_LEVELS[1] + floor_mod(floor_div(date, WHEEL_MINUTE), 60);
+    }
+    if (floor_div(date, WHEEL_DAY) == floor_div(cur, WHEEL_DAY)) {
+        return WHEEL_LEVELS[2] + floor_mod(floor_div(date, WHEEL_HOUR), 24);
+    }
+    if (floor_div(date, WHEEL_DAY) - floor_div(cur, WHEEL_DAY) < WHEEL_DAYS) {
+        return WHEEL_LEVELS[3] + floor_mod(floor_div(date, WHEEL_DAY), WHEEL_DAYS);
+    }
+    return WHEEL_OVERFLOW;
+}
+
+static void slot_push(cron_sched* sched, size_t slot, uint32_t job_id) {
+    uint32_t head = sched->slots[slot];
+    sched->nodes[job_id].prev = CRON_SCHED_NONE;
+    sched->nodes[job_id].next = head;
+    if (CRON_SCHED_NONE != head) {
+        sched->nodes[head].prev = job_id;
+    } else if (WHEEL_OVERFLOW != slot) {
+        size_t level = slot_level(slot);
+        sched->occupied[level] |= (uint64_t) 1 << (slot - WHEEL_LEVELS[level]);
+    }
+    if (WHEEL_OVERFLOW == slot && (CRON_SCHED_NONE == head || sched->nodes[job_id].date < sched->overflow_min)) {
+        sched->overflow_min = sched->nodes[job_id].date;
+    }
+    sched->slots[slot] = job_id;
+    sched->positions[job_id] = (uint32_t) slot;
+}
+
+/* detaches the jobs of the slot, returns the first one */
+static uint32_t slot_take(cron_sched* sched, size_t slot) {
+    uint32_t head = sched->slots[slot];
+    sched->slots[slot] = CRON_SCHED_NONE;
+    if (WHEEL_OVERFLOW != slot) {
+        size_t level = slot_level(slot);
+        sched->occupied[level] &= ~((uint64_t) 1 << (slot - WHEEL_LEVELS[level]));
+    }
+    return head;
+}
+
+static void slot_unlink(cron_sched* sched, uint32_t job_id) {
+    size_t slot = sched->positions[job_id];
+    uint32_t prev = sched->nodes[job_id].prev;
+    uint32_t next = sched->nodes[job_id].next;
+    if (CRON_SCHED_NONE != next) {
+        sched->nodes[next].prev = prev;
+    }
+    if (CRON_SCHED_NONE != prev) {
+        sched->nodes[prev].next = next;
+    } else if (CRON_SCHED_NONE != next) {
+        sched->slots[slot] = next;
+    } else {
+        slot_take(sched, slot);
+    }
+    sched->positions[job_id] = CRON_SCHED_NONE;
+}
+
+/* moves the jobs of the slot to the slots of their dates relative to the current date */
+static void slot_cascade(cron_sched* sched, size_t slot) {
+    uint32_t job_id = slot_take(sched, slot);
+    while (CRON_SCHED_NONE != job_id) {
+        uint32_t next = sched->nodes[job_id].next;
+        slot_push(sched, wheel_slot(sched, sched->nodes[job_id].date), job_id);
+        job_id = next;
+    }
+}
+
+/* earliest date of the jobs of the slot */
+static time_t slot_min(const cron_sched* sched, size_t slot) {
+    uint32_t job_id = sched->slots[slot];
+    time_t res = sched->nodes[job_id].date;
+    for (job_id = sched->nodes[job_id].next; CRON_SCHED_NONE != job_id; job_id = sched->nodes[job_id].next) {
+        if (sched->nodes[job_id].date < res) res = sched->nodes[job_id].date;
+    }
+    return res;
+}
+
+/*
+ * Moves the current date forward. Slots of the current minute, hour and day
+ * are always empty on the upper levels, they are cascaded when reached.
+ */
+static void wheel_advance(cron_sched* sched, time_t date) {
+    time_t old = sched->current;
+    sched->current = date;
+    if (floor_div(date, WHEEL_DAY) != floor_div(old, WHEEL_DAY)) {
+        if (CRON_SCHED_NONE != sched->slots[WHEEL_OVERFLOW] &&
+                floor_div(sched->overflow_min, WHEEL_DAY) - floor_div(date, WHEEL_DAY) < WHEEL_DAYS) {
+            slot_cascade(sched, WHEEL_OVERFLOW);
+        }
+        slot_cascade(sched, WHEEL_LEVELS[3] + floor_mod(floor_div(date, WHEEL_DAY), WHEEL_DAYS));
+    }
+    if (floor_div(date, WHEEL_HOUR) != floor_div(old, WHEEL_HOUR)) {
+        slot_cascade(sched, WHEEL_LEVELS[2] + floor_mod(floor_div(date, WHEEL_HOUR), 24));
+    }
+    if (floor_div(date, WHEEL_MINUTE) != floor_div(old, WHEEL_MINUTE)) {
+        slot_cascade(sched, WHEEL_LEVELS[1] + floor_mod(floor_div(date, WHEEL_MINUTE), 60));
+    }
+}
+
+/* first day slot after the current day, -1 if none */
+static int next_day_slot(const cron_sched* sched, time_t* date) {
+    time_t day = floor_div(sched->current, WHEEL_DAY);
+    time_t k;
+    for (k = 1; k < WHEEL_DAYS; k++) {
+        size_t bit = floor_mod(day + k, WHEEL_DAYS);
+        if (sched->occupied[3] & ((uint64_t) 1 << bit)) {
+            *date = (day + k) * WHEEL_DAY;
+            return (int) bit;
+        }
+    }
+    return -1;
+}
+
+static int entry_compare(const void* a, const void* b) {
+    const cron_sched_entry* ea = (const cron_sched_entry*) a;
+    const cron_sched_entry* eb = (const cron_sched_entry*) b;
+    return entry_before(ea, eb) ? -1 : (entry_before(eb, ea) ? 1 : 0);
+}
+
+/*
+ * Moves the jobs of the second slot to the expired jobs, sorted by date and id.
+ * Jobs of a large slot usually share the date, they are then sorted
+ * by a pass over their positions.
+ */
+static void wheel_expire_slot(cron_sched* sched, size_t slot, time_t date) {
+    uint32_t job_id = slot_take(sched, slot);
+    uint32_t first = job_id;
+    size_t len = 0;
+    int same_date = 1;
+    size_t i;
+    for (; CRON_SCHED_NONE != job_id; job_id = sched->nodes[job_id].next) {
+        sched->positions[job_id] = WHEEL_EXPIRED;
+        same_date &= sched->nodes[job_id].date == date;
+        len++;
+    }
+    sched->heap_len = 0;
+    sched->expired_pos = 0;
+    if (same_date && len * 64 >= sched->jobs_len) {
+        for (i = 0; i < sched->jobs_len; i++) {
+            if (WHEEL_EXPIRED != sched->positions[i]) continue;
+            sched->heap[sched->heap_len].next = date;
+            sched->heap[sched->heap_len].job_id = (uint32_t) i;
+            sched->nodes[i].prev = (uint32_t) sched->heap_len;
+            sched->heap_len++;
+        }
+        return;
+    }
+    for (job_id = first; CRON_SCHED_NONE != job_id; job_id = sched->nodes[job_id].next) {
+        sched->heap[sched->heap_len].next = sched->nodes[job_id].date;
+        sched->heap[sched->heap_len].job_id = job_id;
+        sched->heap_len++;
+    }
+    qsort(sched->heap, sched->heap_len, sizeof(cron_sched_entry), entry_compare);
+    for (i = 0; i < sched->heap_len; i++) {
+        sched->nodes[sched->heap[i].job_id].prev = (uint32_t) i;
+    }
+}
+
+/*
+ * Advances the wheel to the next non-empty second up to the specified date
+ * and expires its jobs. Returns 0 if no job is due.
+ */
+static int wheel_expire(cron_sched* sched, time_t now) {
+    for (;;) {
+        time_t cur = sched->current;
+        time_t minute = floor_div(cur, WHEEL_MINUTE) * WHEEL_MINUTE;
+        time_t hour = floor_div(cur, WHEEL_HOUR) * WHEEL_HOUR;
+        time_t day = floor_div(cur, WHEEL_DAY) * WHEEL_DAY;
+        time_t date;
+        int bit = first_bit(sched->occupied[0], (size_t) (cur - minute));
+        if (bit >= 0) {
+            date = minute + bit;
+            if (date > now) return 0;
+            wheel_expire_slot(sched, WHEEL_LEVELS[0] + (size_t) bit, date);
+            wheel_advance(sched, date + 1);
+            return 1;
+        }
+        if ((bit = first_bit(sched->occupied[1], (size_t) ((minute - hour) / WHEEL_MINUTE) + 1)) >= 0) {
+            date = hour + bit * WHEEL_MINUTE;
+        } else if ((bit = first_bit(sched->occupied[2], (size_t) ((hour - day) / WHEEL_HOUR) + 1)) >= 0) {
+            date = day + bit * WHEEL_HOUR;
+        } else if (next_day_slot(sched, &date) < 0) {
+            if (CRON_SCHED_NONE == sched->slots[WHEEL_OVERFLOW]) return 0;
+            sched->overflow_min = slot_min(sched, WHEEL_OVERFLOW);
+            date = floor_div(sched->overflow_min, WHEEL_DAY) * WHEEL_DAY;
+        }
+        if (date > now) return 0;
+        wheel_advance(sched, date);
+    }
+}
+
+/* no job is left in the slots or in the expired jobs */
+static int wheel_empty(cron_sched* sched) {
+    size_t level;
+    while (sched->expired_pos < sched->heap_len && CRON_SCHED_NONE == sched->heap[sched->expired_pos].job_id) {
+        sched->expired_pos++;
+    }
+    if (sched->expired_pos < sched->heap_len || CRON_SCHED_NONE != sched->slots[WHEEL_OVERFLOW]) return 0;
+    for (level = 0; level < 4; level++) {
+        if (sched->occupied[level]) return 0;
+    }
+    return 1;
+}
+
+static void wheel_schedule(cron_sched* sched, uint32_t job_id, time_t next, time_t now) {
+    uint32_t pos = sched->positions[job_id];
+    if (WHEEL_EXPIRED == pos) {
+        sched->heap[sched->nodes[job_id].prev].job_id = CRON_SCHED_NONE;
+        sched->positions[job_id] = CRON_SCHED_NONE;
+    } else if (CRON_SCHED_NONE != pos) {
+        slot_unlink(sched, job_id);
+    }
+    if (CRON_INVALID_INSTANT == next) return;
+    /* an empty wheel starts at the current date */
+    if (wheel_empty(sched)) {
+        sched->current = now + 1;
+        sched->heap_len = 0;
+        sched->expired_pos = 0;
+    }
+    sched->nodes[job_id].date = next;
+    slot_push(sched, wheel_slot(sched, next), job_id);
+}
+
+static size_t wheel_pop_due(cron_sched* sched, time_t now, cron_sched_fire* out, size_t max) {
+    size_t count = 0;
+    while (count < max) {
+        cron_sched_entry entry;
+        const cron_expr* expr;
+        if (sched->expired_pos == sched->heap_len) {
+            if (!wheel_expire(sched, now)) break;
+            continue;
+        }
+        entry = sched->heap[sched->expired_pos++];
+        if (CRON_SCHED_NONE == entry.job_id) continue;
+        expr = &sched->exprs[entry.job_id];
+        out[count].job_id = entry.job_id;
+        out[count].date = entry.next;
+        count++;
+        sched->positions[entry.job_id] = CRON_SCHED_NONE;
+        entry.next = cron_next(expr, entry.next);
+        if (CRON_INVALID_INSTANT != entry.next && entry.next <= now) {
+            entry.next = cron_next(expr, now);
+        }
+        if (CRON_INVALID_INSTANT != entry.next) {
+            sched->nodes[entry.job_id].date = entry.next;
+            slot_push(sched, wheel_slot(sched, entry.next), entry.job_id);
+        }
+    }
+    return count;
+}
+
+static time_t wheel_peek(const cron_sched* sched) {
+    time_t cur = sched->current;
+    time_t minute = floor_div(cur, WHEEL_MINUTE) * WHEEL_MINUTE;
+    time_t hour = floor_div(cur, WHEEL_HOUR) * WHEEL_HOUR;
+    time_t day = floor_div(cur, WHEEL_DAY) * WHEEL_DAY;
+    time_t date;
+    size_t pos;
+    int bit;
+    for (pos = sched->expired_pos; pos < sched->heap_len; pos++) {
+        if (CRON_SCHED_NONE != sched->heap[pos].job_id) return sched->heap[pos].next;
+    }
+    if ((bit = first_bit(sched->occupied[0], (size_t) (cur - minute))) >= 0) {
+        return slot_min(sched, WHEEL_LEVELS[0] + (size_t) bit);
+    }
+    if ((bit = first_bit(sched->occupied[1], (size_t) ((minute - hour) / WHEEL_MINUTE) + 1)) >= 0) {
+        return slot_min(sched, WHEEL_LEVELS[1] + (size_t) bit);
+    }
+    if ((bit = first_bit(sched->occupied[2], (size_t) ((hour - day) / WHEEL_HOUR) + 1)) >= 0) {
+        return slot_min(sched, WHEEL_LEVELS[2] + (size_t) bit);
+    }
+    if ((bit = next_day_slot(sched, &date)) >= 0) {
+        return slot_min(sched, WHEEL_LEVELS[3] + (size_t) bit);
+    }
+    if (CRON_SCHED_NONE != sched->slots[WHEEL_OVERFLOW]) {
+        return slot_min(sched, WHEEL_OVERFLOW);
+    }
+    return CRON_INVALID_INSTANT;
+}
+
+/* schedules, reschedules or unschedules the job at the specified date */
+static void schedule(cron_sched* sched, uint32_t job_id, time_t next, time_t now) {
+    uint32_t pos = sched->positions[job_id];
+    cron_sched_entry entry;
+    if (CRON_SCHED_WHEEL == sched->backend) {
+        wheel_schedule(sched, job_id, next, now);
+        return;
+    }
+    entry.next = next;
+    entry.job_id = job_id;
+    if (CRON_INVALID_INSTANT == next) {
+        if (CRON_SCHED_NONE != pos) heap_remove(sched, job_id);
+    } else if (CRON_SCHED_NONE == pos) {
+        sched->heap_len += 1;
+        sift_up(sched, sched->heap_len - 1, entry);
+    } else {
+        heap_fix(sched, pos, entry);
+    }
+}
+
+void cron_sched_init(cron_sched* out) {
+    memset(out, 0, sizeof(*out));
+}
+
+int cron_sched_init_backend(cron_sched* out, int backend) {
+    size_t i;
+    if (!out || (CRON_SCHED_HEAP != backend && CRON_SCHED_WHEEL != backend)) return 1;
+    cron_sched_init(out);
+    out->backend = backend;
+    for (i = 0; i < CRON_SCHED_WHEEL_SLOTS; i++) {
+        out->slots[i] = CRON_SCHED_NONE;
+    }
+    return 0;
+}
+
+void cron_sched_free(cron_sched* sched) {
+    if (!sched) return;
+    if (sched->exprs) cron_free(sched->exprs);
+    if (sched->positions) cron_free(sched->positions);
+    if (sched->used) cron_free(sched->used);
+    if (sched->heap) cron_free(sched->heap);
+    if (sched->nodes) cron_free(sched->nodes);
+    memset(sched, 0, sizeof(*sched));
+}
+
+int cron_sched_reserve(cron_sched* sched, size_t jobs) {
+    if (!sched) return 1;
+    if (0 != reserve_jobs(sched, jobs)) return 1;
+    return reserve_heap(sched, jobs);
+}
+
+int cron_sched_add(cron_sched* sched, uint32_t job_id, const cron_expr* expr, time_t now) {
+    if (!sched || !expr) return 1;
+    return cron_sched_add_at(sched, job_id, expr, cron_next(expr, now), now);
+}
+
+int cron_sched_add_at(cron_sched* sched, uint32_t job_id, const cron_expr* expr, time_t next, time_t now) {
+    if (!sched || !expr || CRON_SCHED_NONE == job_id) return 1;
+    if (job_id >= sched->jobs_len) {
+        size_t len = (size_t) job_id + 1;
+        if (0 != reserve_jobs(sched, len)) return 1;
+        memset(sched->used + sched->jobs_len, 0, len - sched->jobs_len);
+        memset(sched->positions + sched->jobs_len, 0xff, (len - sched->jobs_len) * sizeof(uint32_t));
+        sched->jobs_len = len;
+    }
+    /* the heap, or the expired jobs of the wheel, hold at most one entry per job */
+    if (0 != reserve_heap(sched, sched->count + 1)) return 1;
+    if (!sched->used[job_id]) {
+        sched->used[job_id] = 1;
+        sched->count += 1;
+    }
+    sched->exprs[job_id] = *expr;
+    schedule(sched, job_id, next, now);
+    return 0;
+}
+
+int cron_sched_update(cron_sched* sched, uint32_t job_id, const cron_expr* expr, time_t now) {
+    if (!cron_sched_contains(sched, job_id) || !expr) return 1;
+    sched->exprs[job_id] = *expr;
+    schedule(sched, job_id, cron_next(expr, now), now);
+    return 0;
+}
+
+int cron_sched_remove(cron_sched* sched, uint32_t job_id) {
+    if (!cron_sched_contains(sched, job_id)) return 1;
+    schedule(sched, job_id, CRON_INVALID_INSTANT, CRON_INVALID_INSTANT);
+    sched->used[job_id] = 0;
+    sched->count -= 1;
+    return 0;
+}
+
+int cron_sched_contains(const cron_sched* sched, uint32_t job_id) {
+    return sched && job_id < sched->jobs_len && sched->used[job_id];
+}
+
+time_t cron_sched_next(const cron_sched* sched, uint32_t job_id) {
+    uint32_t pos;
+    if (!cron_sched_contains(sched, job_id)) return CRON_INVALID_INSTANT;
+    pos = sched->positions[job_id];
+    if (CRON_SCHED_NONE == pos) return CRON_INVALID_INSTANT;
+    return CRON_SCHED_WHEEL == sched->backend ? sched->nodes[job_id].date : sched->heap[pos].next;
+}
+
+time_t cron_sched_peek(const cron_sched* sched) {
+    if (!sched) return CRON_INVALID_INSTANT;
+    if (CRON_SCHED_WHEEL == sched->backend) return wheel_peek(sched);
+    if (0 == sched->heap_len) return CRON_INVALID_INSTANT;
+    return sched->heap[0].next;
+}
+
+size_t cron_sched_pop_due(cron_sched* sched, time_t now, cron_sched_fire* out, size_t max) {
+    size_t count = 0;
+    if (!sched || !out) return 0;
+    if (CRON_SCHED_WHEEL == sched->backend) return wheel_pop_due(sched, now, out, max);
+    while (count < max && sched->heap_len > 0 && sched->heap[0].next <= now) {
+        cron_sched_entry top = sched->heap[0];
+        const cron_expr* expr = &sched->exprs[top.job_id];
+        out[count].job_id = top.job_id;
+        out[count].date = top.next;
+        count++;
+        top.next = cron_next(expr, top.next);
+        if (CRON_INVALID_INSTANT != top.next && top.next <= now) {
+            top.next = cron_next(expr, now);
+        }
+        /* the top is replaced by the rescheduled entry, a single pass down the heap */
+        if (CRON_INVALID_INSTANT != top.next) {
+            sift_down(sched, 0, top);
+        } else {
+            heap_remove(sched, top.job_id);
+        }
+    }
+    return count;
+}
+
+/* Snapshots: header, then sections padded to 8 bytes */
+
+#define SNAPSHOT_BYTE_ORDER ((uint32_t) 0x01020304UL)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t expr_size;
+    uint32_t backend;
+    uint64_t jobs_len;
+    uint64_t count;
+    uint64_t heap_len;
+    uint64_t expired_pos;
+    int64_t current;
+    uint64_t size;
+    uint64_t checksum;     /* of the sections */
+} snapshot_header;
+
+static const char SNAPSHOT_MAGIC[8] = { 'C', 'R', 'O', 'N', 'S', 'C', 'H', 'D' };
+
+static size_t padded(size_t len) {
+    return (len + 7) / 8 * 8;
+}
+
+/* entries and nodes are written as a 64-bit date and two 32-bit fields */
+static size_t snapshot_len(size_t jobs, size_t heap, int wheel) {
+    size_t len = padded(sizeof(snapshot_header));
+    len += padded(jobs * sizeof(cron_expr)) + padded(jobs * sizeof(uint32_t)) + padded(jobs);
+    len += heap * 16;
+    if (wheel) {
+        len += jobs * 16 + padded(CRON_SCHED_WHEEL_SLOTS * sizeof(uint32_t));
+    }
+    return len;
+}
+
+/* FNV-1a over 64-bit words, the sections are padded to them */
+static uint64_t snapshot_checksum(const uint8_t* data, size_t len) {
+    uint64_t hash = ((uint64_t) 0xcbf29ce4UL << 32) | 0x84222325UL;
+    uint64_t prime = ((uint64_t) 0x100UL << 32) | 0x1b3UL;
+    size_t i;
+    for (i = 0; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    return hash;
+}
+
+static uint8_t* put_record(uint8_t* dest, time_t date, uint32_t a, uint32_t b) {
+    int64_t value = (int64_t) date;
+    memcpy(dest, &value, 8);
+    memcpy(dest + 8, &a, 4);
+    memcpy(dest + 12, &b, 4);
+    return dest + 16;
+}
+
+static const uint8_t* get_record(const uint8_t* src, time_t* date, uint32_t* a, uint32_t* b) {
+    int64_t value;
+    memcpy(&value, src, 8);
+    memcpy(a, src + 8, 4);
+    memcpy(b, src + 12, 4);
+    *date = (time_t) value;
+    return src + 16;
+}
+
+size_t cron_sched_snapshot_size(const cron_sched* sched) {
+    if (!sched) return 0;
+    return snapshot_len(sched->jobs_len, sched->heap_len, CRON_SCHED_WHEEL == sched->backend);
+}
+
+size_t cron_sched_snapshot(const cron_sched* sched, void* buf, size_t len) {
+    snapshot_header header;
+    uint8_t* start = (uint8_t*) buf;
+    uint8_t* dest;
+    size_t size = cron_sched_snapshot_size(sched);
+    size_t jobs;
+    size_t i;
+    if (!sched || !buf || len < size) return 0;
+    jobs = sched->jobs_len;
+    memset(start, 0, size);
+    dest = start + padded(sizeof(snapshot_header));
+    /* expressions and nodes of the unused ids are left zeroed */
+    for (i = 0; i < jobs; i++) {
+        if (sched->used[i]) memcpy(dest + i * sizeof(cron_expr), &sched->exprs[i], sizeof(cron_expr));
+    }
+    dest += padded(jobs * sizeof(cron_expr));
+    if (jobs > 0) {
+        memcpy(dest, sched->positions, jobs * sizeof(uint32_t));
+        memcpy(dest + padded(jobs * sizeof(uint32_t)), sched->used, jobs);
+    }
+    dest += padded(jobs * sizeof(uint32_t)) + padded(jobs);
+    for (i = 0; i < sched->heap_len; i++) {
+        dest = put_record(dest, sched->heap[i].next, sched->heap[i].job_id, 0);
+    }
+    if (CRON_SCHED_WHEEL == sched->backend) {
+        for (i = 0; i < jobs; i++) {
+            if (CRON_SCHED_NONE == sched->positions[i]) {
+                dest += 16;
+            } else {
+                dest = put_record(dest, sched->nodes[i].date, sched->nodes[i].prev, sched->nodes[i].next);
+            }
+        }
+        memcpy(dest, sched->slots, sizeof(sched->slots));
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = CRON_SCHED_SNAPSHOT_VERSION;
+    header.byte_order = SNAPSHOT_BYTE_ORDER;
+    header.expr_size = (uint32_t) sizeof(cron_expr);
+    header.backend = (uint32_t) sched->backend;
+    header.jobs_len = jobs;
+    header.count = sched->count;
+    header.heap_len = sched->heap_len;
+    header.expired_pos = sched->expired_pos;
+    header.current = (int64_t) sched->current;
+    header.size = size;
+    header.checksum = snapshot_checksum(start + padded(sizeof(header)), size - padded(sizeof(header)));
+    memcpy(start, &header, sizeof(header));
+    return size;
+}
+
+/* every scheduled job is in the heap at its position and only there, parents come first */
+static int heap_valid(const cron_sched* sched) {
+    uint32_t position;
+    size_t i;
+    for (i = 0; i < sched->heap_len; i++) {
+        uint32_t job_id = sched->heap[i].job_id;
+        if (job_id >= sched->jobs_len || sched->positions[job_id] != i) return 0;
+        if (i > 0 && entry_before(&sched->heap[i], &sched->heap[(i - 1) / CRON_SCHED_ARITY])) return 0;
+    }
+    for (i = 0; i < sched->jobs_len; i++) {
+        position = sched->positions[i];
+        if (CRON_SCHED_NONE == position) continue;
+        if (position >= sched->heap_len || sched->heap[position].job_id != i) return 0;
+    }
+    return 1;
+}
+
+/*
+ * Every scheduled job is linked once in its slot or in the expired jobs in
+ * order; the occupied bits and the earliest overflow date are rebuilt.
+ */
+static int wheel_valid(cron_sched* sched) {
+    const cron_sched_entry* last = NULL;
+    size_t listed = 0;
+    size_t scheduled = 0;
+    size_t slot;
+    size_t i;
+    memset(sched->occupied, 0, sizeof(sched->occupied));
+    sched->overflow_min = 0;
+    for (slot = 0; slot < CRON_SCHED_WHEEL_SLOTS; slot++) {
+        uint32_t prev = CRON_SCHED_NONE;
+        uint32_t job_id = sched->slots[slot];
+        while (CRON_SCHED_NONE != job_id) {
+            cron_sched_node* node;
+            if (job_id >= sched->jobs_len || sched->positions[job_id] != slot) return 0;
+            node = &sched->nodes[job_id];
+            if (node->prev != prev || ++listed > sched->jobs_len) return 0;
+            if (WHEEL_OVERFLOW != slot) {
+                size_t level = slot_level(slot);
+                sched->occupied[level] |= (uint64_t) 1 << (slot - WHEEL_LEVELS[level]);
+            } else if (CRON_SCHED_NONE == prev || node->date < sched->overflow_min) {
+                sched->overflow_min = node->date;
+            }
+            prev = job_id;
+            job_id = node->next;
+        }
+    }
+    for (i = sched->expired_pos; i < sched->heap_len; i++) {
+        const cron_sched_entry* entry = &sched->heap[i];
+        if (CRON_SCHED_NONE == entry->job_id) continue;
+        if (entry->job_id >= sched->jobs_len || WHEEL_EXPIRED != sched->positions[entry->job_id]) return 0;
+        if (sched->nodes[entry->job_id].prev != i || (last && entry_before(entry, last))) return 0;
+        last = entry;
+        listed++;
+    }
+    for (i = 0; i < sched->jobs_len; i++) {
+        if (CRON_SCHED_NONE != sched->positions[i]) scheduled++;
+    }
+    return scheduled == listed;
+}
+
+int cron_sched_restore(const void* data, size_t len, time_t now, cron_sched* out, size_t* stale) {
+    snapshot_header header;
+    const uint8_t* src = (const uint8_t*) data;
+    cron_sched_fire due[64];
+    size_t jobs;
+    size_t count = 0;
+    size_t popped;
+    size_t i;
+    int wheel;
+    if (!data || !out || len < sizeof(header)) return 1;
+    memcpy(&header, src, sizeof(header));
+    if (0 != memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+            || CRON_SCHED_SNAPSHOT_VERSION != header.version || SNAPSHOT_BYTE_ORDER != header.byte_order
+            || sizeof(cron_expr) != header.expr_size || header.size != len
+            || header.jobs_len > len / (sizeof(cron_expr) + 5) || header.heap_len > len / 16
+            || header.expired_pos > header.heap_len || header.count > header.jobs_len) return 1;
+    if (0 != cron_sched_init_backend(out, (int) header.backend)) return 1;
+    jobs = (size_t) header.jobs_len;
+    wheel = CRON_SCHED_WHEEL == out->backend;
+    if (len != snapshot_len(jobs, (size_t) header.heap_len, wheel)
+            || header.checksum != snapshot_checksum(src + padded(sizeof(header)), len - padded(sizeof(header)))) {
+        return 1;
+    }
+    if (0 != reserve_jobs(out, jobs)) goto return_error;
+    if (0 != reserve_heap(out, jobs > header.heap_len ? jobs : (size_t) header.heap_len)) goto return_error;
+    src += padded(sizeof(header));
+    if (jobs > 0) {
+        memcpy(out->exprs, src, jobs * sizeof(cron_expr));
+        src += padded(jobs * sizeof(cron_expr));
+        memcpy(out->positions, src, jobs * sizeof(uint32_t));
+        src += padded(jobs * sizeof(uint32_t));
+        memcpy(out->used, src, jobs);
+        src += padded(jobs);
+    }
+    out->jobs_len = jobs;
+    for (i = 0; i < jobs; i++) {
+        if (out->used[i] > 1 || (!out->used[i] && CRON_SCHED_NONE != out->positions[i])) goto return_error;
+        count += out->used[i];
+    }
+    if (count != header.count) goto return_error;
+    out->count = count;
+    out->heap_len = (size_t) header.heap_len;
+    for (i = 0; i < out->heap_len; i++) {
+        uint32_t zero;
+        src = get_record(src, &out->heap[i].next, &out->heap[i].job_id, &zero);
+    }
+    if (wheel) {
+        for (i = 0; i < jobs; i++) {
+            src = get_record(src, &out->nodes[i].date, &out->nodes[i].prev, &out->nodes[i].next);
+        }
+        memcpy(out->slots, src, sizeof(out->slots));
+        out->current = (time_t) header.current;
+        out->expired_pos = (size_t) header.expired_pos;
+        if (!wheel_valid(out)) goto return_error;
+    } else if (!heap_valid(out)) {
+        goto return_error;
+    }
+    /* only the jobs due at 'now' are recomputed */
+    popped = 0;
+    while ((i = cron_sched_pop_due(out, now, due, sizeof(due) / sizeof(due[0]))) > 0) {
+        popped += i;
+    }
+    if (stale) *stale = popped;
+    return 0;
+
+    return_error:
+    cron_sched_free(out);
+    return 1;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sched.h
+ *
+ * Scheduler core: the next 'fire' dates of many jobs in an indexed
+ * d-ary min-heap, or in a hierarchical timing wheel, popped in date order
+ * as they become due.
+ */
+
+#ifndef CCRONEXPR_SCHED_H
+#define CCRONEXPR_SCHED_H
+
+#include <stddef.h>
+
+#include "ccronexpr.h"
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+extern "C" {
+#endif
+
+/* Children of a heap node: 4 entries of 16 bytes, 64 bytes read together,
+   not aligned to a cache line, so they span at most two of them */
+#define CRON_SCHED_ARITY 4
+
+/* Heap position of a job that is not scheduled */
+#define CRON_SCHED_NONE ((uint32_t) -1)
+
+/* Backends of the scheduler */
+#define CRON_SCHED_HEAP 0
+#define CRON_SCHED_WHEEL 1
+
+/* Timing wheel slots: 60 seconds, 60 minutes, 24 hours, 64 days and the overflow list */
+#define CRON_SCHED_WHEEL_SLOTS (60 + 60 + 24 + 64 + 1)
+
+/* Version of the snapshot format, snapshots of other versions are rejected */
+#define CRON_SCHED_SNAPSHOT_VERSION 1
+
+/**
+ * Due job returned by 'cron_sched_pop_due'
+ */
+typedef struct {
+    uint32_t job_id;
+    time_t date;    /* scheduled 'fire' date */
+} cron_sched_fire;
+
+/**
+ * Heap entry, the date is stored in the entry so that sifting does not
+ * touch the job arrays
+ */
+typedef struct {
+    time_t next;
+    uint32_t job_id;
+} cron_sched_entry;
+
+/**
+ * Job of the timing wheel, 'prev' is the index in the expired jobs once expired
+ */
+typedef struct {
+    time_t date;
+    uint32_t prev;
+    uint32_t next;
+} cron_sched_node;
+
+/**
+ * Jobs indexed by id in flat arrays and a heap of the scheduled ones.
+ * Arrays grow geometrically, a job does not allocate on its own.
+ *
+ * With the timing wheel backend a job is instead linked into the slot of its
+ * next date: a second of the current minute, a minute of the current hour,
+ * an hour of the current day, one of the next 63 days, or the overflow list.
+ * Slots of a level are moved down to the lower levels only when the wheel
+ * reaches them, so a job is moved at most 4 times before it fires.
+ * Fields are internal.
+ */
+typedef struct {
+    cron_expr* exprs;        /* by job id */
+    uint32_t* positions;     /* by job id, CRON_SCHED_NONE if not scheduled, the slot with the wheel */
+    uint8_t* used;           /* by job id */
+    size_t jobs_len;
+    size_t jobs_capacity;
+    cron_sched_entry* heap;  /* with the wheel, expired jobs in date and id order */
+    size_t heap_len;
+    size_t heap_capacity;
+    size_t count;            /* number of jobs */
+    int backend;             /* CRON_SCHED_HEAP or CRON_SCHED_WHEEL */
+    /* timing wheel */
+    cron_sched_node* nodes;  /* by job id */
+    uint32_t slots[CRON_SCHED_WHEEL_SLOTS];  /* first job of each slot */
+    uint64_t occupied[4];    /* bits of the non-empty slots of each level */
+    time_t current;          /* dates before it are expired */
+    time_t overflow_min;     /* no date of the overflow list is before it */
+    size_t expired_pos;      /* first expired job not popped yet */
+} cron_sched;
+
+/**
+ * Initializes an empty scheduler.
+ *
+ * @param out scheduler to initialize, must be released with 'cron_sched_free'
+ */
+void cron_sched_init(cron_sched* out);
+
+/**
+ * Initializes an empty scheduler with the specified backend.
+ * The heap costs O(log n) per add and 'fire', the timing wheel amortized O(1),
+ * plus sorting the jobs that fire in the same second by id.
+ * The wheel expects the dates passed to the scheduler not to go back in time.
+ *
+ * @param out scheduler to initialize, must be released with 'cron_sched_free'
+ * @param backend CRON_SCHED_HEAP or CRON_SCHED_WHEEL
+ * @return 0 on success, non-zero for an unknown backend
+ */
+int cron_sched_init_backend(cron_sched* out, int backend);
+
+/**
+ * Releases memory held by the scheduler.
+ *
+ * @param sched scheduler to release
+ */
+void cron_sched_free(cron_sched* sched);
+
+/**
+ * Allocates the arrays for job ids up to 'jobs - 1' at once.
+ *
+ * @param sched scheduler
+ * @param jobs number of job ids
+ * @return 0 on success, non-zero on error
+ */
+int cron_sched_reserve(cron_sched* sched, size_t jobs);
+
+/**
+ * Adds a job, or replaces the expression of the job with the same id.
+ * Ids index the arrays, so they should be dense, e.g. from 0 to the number of jobs.
+ *
+ * @param sched scheduler
+ * @param job_id id of the job, less than CRON_SCHED_NONE
+ * @param expr parsed cron expression, copied
+ * @param now current date, the job is scheduled at its next 'fire' date after it
+ * @return 0 on success, non-zero on error
+ */
+int cron_sched_add(cron_sched* sched, uint32_t job_id, const cron_expr* expr, time_t now);
+
+/**
+ * Adds a job like 'cron_sched_add', at a next 'fire' date the caller has
+ * already searched for.
+ *
+ * @param sched scheduler
+ * @param job_id id of the job, less than CRON_SCHED_NONE
+ * @param expr parsed cron expression, copied
+ * @param next 'cron_next(expr, now)', the date the job is scheduled at
+ * @param now current date
+ * @return 0 on success, non-zero on error
+ */
+int cron_sched_add_at(cron_sched* sched, uint32_t job_id, const cron_expr* expr, time_t next, time_t now);
+
+/**
+ * Replaces the expression of an existing job.
+ *
+ * @param sched scheduler
+ * @param job_id id of the job
+ * @param expr parsed cron expression, copied
+ * @param now current date, the job is rescheduled at its next 'fire' date after it
+ * @return 0 on success, non-zero if there is no such job
+ */
+int cron_sched_update(cron_sched* sched, uint32_t job_id, const cron_expr* expr, time_t now);
+
+/**
+ * Removes a job.
+ *
+ * @param sched scheduler
+ * @param job_id id of the job
+ * @return 0 on success, non-zero if there is no such job
+ */
+int cron_sched_remove(cron_sched* sched, uint32_t job_id);
+
+/**
+ * Checks if a job was added and not removed.
+ *
+ * @param sched scheduler
+ * @param job_id id of the job
+ * @return 1 if the job exists, 0 otherwise
+ */
+int cron_sched_contains(const cron_sched* sched, uint32_t job_id);
+
+/**
+ * Next 'fire' date of a job.
+ *
+ * @param sched scheduler
+ * @param job_id id of the job
+ * @return next 'fire' date, '((time_t) -1)' if there is no such job or it never fires again
+ */
+time_t cron_sched_next(const cron_sched* sched, uint32_t job_id);
+
+/**
+ * Earliest next 'fire' date of all jobs.
+ *
+ * @param sched scheduler
+ * @return earliest date, '((time_t) -1)' if no job is scheduled
+ */
+time_t cron_sched_peek(const cron_sched* sched);
+
+/**
+ * Pops the jobs due at the specified date in the order of their 'fire' dates,
+ * then of their ids, and reschedules them. Only the popped jobs are recomputed:
+ * each from its 'fire' date, so that late calls do not shift later dates;
+ * a job due more than once is returned once and rescheduled from 'now'.
+ * Jobs left due when 'out' is full are returned by the next call.
+ *
+ * @param sched scheduler
+ * @param now current date
+ * @param out array of due jobs
+ * @param max length of the array
+ * @return number of due jobs written to the array
+ */
+size_t cron_sched_pop_due(cron_sched* sched, time_t now, cron_sched_fire* out, size_t max);
+
+/**
+ * Size of the snapshot of the scheduler, see 'cron_sched_snapshot'.
+ *
+ * @param sched scheduler
+ * @return size in bytes
+ */
+size_t cron_sched_snapshot_size(const cron_sched* sched);
+
+/**
+ * Writes the state of the scheduler: a versioned header with a checksum, then
+ * the parsed expressions, the next 'fire' dates and the heap or the wheel as
+ * they are, in the byte order and layout of the build.
+ *
+ * @param sched scheduler
+ * @param buf memory to write to, e.g. a mapped file
+ * @param len size of the memory, at least 'cron_sched_snapshot_size'
+ * @return number of written bytes, 0 if the memory is too small
+ */
+size_t cron_sched_snapshot(const cron_sched* sched, void* buf, size_t len);
+
+/**
+ * Restores a scheduler from a snapshot after validating it. The dates are
+ * not recomputed, except those of the jobs due at 'now' that are rescheduled
+ * after it, so the cost beyond copying depends on the number of stale jobs.
+ *
+ * @param data snapshot written by 'cron_sched_snapshot', e.g. a mapped file
+ * @param len size of the snapshot
+ * @param now current date
+ * @param out scheduler to initialize, must be released with 'cron_sched_free' on success
+ * @param stale number of rescheduled jobs, may be NULL
+ * @return 0 on success, non-zero if the snapshot is invalid or on error
+ */
+int cron_sched_restore(const void* data, size_t len, time_t now, cron_sched* out, size_t* stale);
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+} /* extern "C"*/
+#endif
+
+#endif /* CCRONEXPR_SCHED_H */
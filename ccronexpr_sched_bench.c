@@ -0,0 +1,414 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sched_bench.c
+ *
+ * Scheduler backends on the same generated jobs, mostly firing at second
+ * granularity, over a span of virtual time. Each 'fire' costs a search of
+ * the next date and the scheduler operations; the searches are replayed alone
+ * to tell the overhead of the backends apart. The coalesced scheduler runs the
+ * same jobs grouped by expression. Times are the best of the rounds.
+ * Builds with the sharded scheduler also run the jobs on 1, 2, 4 ... shards,
+ * up to the number of online processors or '--threads'.
+ *
+ * Usage: ccronexpr_sched_bench [--jobs N] [--seconds N] [--rounds N] [--threads N] [--csv]
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ccronexpr_sched.h"
+#include "ccronexpr_group.h"
+#include "ccronexpr_bench_util.h"
+#ifdef CRON_SCHED_BENCH_SHARDS
+#include "ccronexpr_shard.h"
+#endif
+
+#define FROM 1341136430 /* 2012-07-01_09:53:50 UTC */
+#define BATCH 1024
+
+/* generated jobs, H items are seeded with the job id */
+static const char* const GENERATED[] = {
+    "H/5 * * * * *",
+    "H/10 * * * * *",
+    "H/30 * * * * *",
+    "H * * * * *",
+    "H * * * * *",
+    "H H/5 * * * *",
+    "H H * * * *",
+    "H H H * * *"
+};
+
+#define GENERATED_LEN (sizeof(GENERATED) / sizeof(GENERATED[0]))
+
+typedef struct {
+    const char* name;
+    int backend;
+    int grouped;
+    double add_ns;
+    double fire_ns;
+    unsigned long fires;
+    unsigned long checksum;
+} bench_run;
+
+typedef struct {
+    size_t threads;
+    double fire_ns;
+    unsigned long fires;
+    int matches;
+} bench_shards;
+
+/* popped jobs, replayed without the scheduler */
+static cron_sched_fire* fired = NULL;
+static size_t fired_len = 0;
+static size_t fired_capacity = 0;
+
+static void record(const cron_sched_fire* due, size_t len) {
+    if (fired_len + len > fired_capacity) {
+        size_t cap = fired_capacity > 0 ? fired_capacity : 4096;
+        while (cap < fired_len + len) {
+            cap *= 2;
+        }
+        fired = (cron_sched_fire*) realloc(fired, cap * sizeof(cron_sched_fire));
+        if (!fired) {
+            fprintf(stderr, "Cannot record %lu jobs\n", (unsigned long) cap);
+            exit(2);
+        }
+        fired_capacity = cap;
+    }
+    memcpy(fired + fired_len, due, len * sizeof(cron_sched_fire));
+    fired_len += len;
+}
+
+static double min_ns(double a, double b) {
+    return a > 0 && a < b ? a : b;
+}
+
+/* the sums do not depend on the order of the jobs that fire together */
+static unsigned long fire_sum(uint32_t job_id, time_t date) {
+    return ((unsigned long) job_id * 2654435761UL) ^ (unsigned long) (date - FROM);
+}
+
+static void run(bench_run* br, const cron_expr* exprs, size_t jobs, long seconds, int record_fires) {
+    cron_sched sched;
+    cron_sched_fire* due;
+    time_t now;
+    double start;
+    size_t i;
+    int err = 0;
+    due = (cron_sched_fire*) malloc(BATCH * sizeof(cron_sched_fire));
+    err |= !due;
+    err |= cron_sched_init_backend(&sched, br->backend);
+    err |= cron_sched_reserve(&sched, jobs);
+    start = bench_now_ns();
+    for (i = 0; i < jobs; i++) {
+        err |= cron_sched_add(&sched, (uint32_t) i, &exprs[i], FROM);
+    }
+    if (err) {
+        fprintf(stderr, "Cannot add %lu jobs\n", (unsigned long) jobs);
+        exit(2);
+    }
+    br->add_ns = min_ns(br->add_ns, (bench_now_ns() - start) / (double) jobs);
+    br->fires = 0;
+    br->checksum = 0;
+    start = bench_now_ns();
+    for (now = FROM + 1; now <= FROM + seconds; now++) {
+        size_t len;
+        while ((len = cron_sched_pop_due(&sched, now, due, BATCH)) > 0) {
+            for (i = 0; i < len; i++) {
+                br->checksum += fire_sum(due[i].job_id, due[i].date);
+            }
+            br->fires += (unsigned long) len;
+        }
+    }
+    if (br->fires > 0) {
+        br->fire_ns = min_ns(br->fire_ns, (bench_now_ns() - start) / (double) br->fires);
+    }
+    /* the same run again, recorded outside of the measurement */
+    if (record_fires) {
+        cron_sched_free(&sched);
+        cron_sched_init_backend(&sched, br->backend);
+        for (i = 0; i < jobs; i++) {
+            cron_sched_add(&sched, (uint32_t) i, &exprs[i], FROM);
+        }
+        for (now = FROM + 1; now <= FROM + seconds; now++) {
+            size_t len;
+            while ((len = cron_sched_pop_due(&sched, now, due, BATCH)) > 0) {
+                record(due, len);
+            }
+        }
+    }
+    cron_sched_free(&sched);
+    free(due);
+}
+
+static void run_groups(bench_run* br, const cron_expr* exprs, size_t jobs, long seconds) {
+    cron_groups groups;
+    cron_group_batch batch;
+    time_t now;
+    double start;
+    size_t i;
+    int err = 0;
+    err |= cron_groups_init(&groups, br->backend);
+    start = bench_now_ns();
+    for (i = 0; i < jobs; i++) {
+        err |= cron_groups_add(&groups, (uint32_t) i, &exprs[i], FROM);
+    }
+    if (err) {
+        fprintf(stderr, "Cannot add %lu jobs\n", (unsigned long) jobs);
+        exit(2);
+    }
+    br->add_ns = min_ns(br->add_ns, (bench_now_ns() - start) / (double) jobs);
+    br->fires = 0;
+    br->checksum = 0;
+    start = bench_now_ns();
+    for (now = FROM + 1; now <= FROM + seconds; now++) {
+        while (cron_groups_pop_due(&groups, now, &batch) > 0) {
+            for (i = 0; i < batch.len; i++) {
+                br->checksum += fire_sum(batch.job_ids[i], batch.date);
+            }
+            br->fires += (unsigned long) batch.len;
+        }
+    }
+    if (br->fires > 0) {
+        br->fire_ns = min_ns(br->fire_ns, (bench_now_ns() - start) / (double) br->fires);
+    }
+    cron_groups_free(&groups);
+}
+
+/* the searches of the next dates of the recorded jobs alone */
+static double search_ns(const cron_expr* exprs) {
+    double start = bench_now_ns();
+    time_t sum = 0;
+    size_t i;
+    for (i = 0; i < fired_len; i++) {
+        sum += cron_next(&exprs[fired[i].job_id], fired[i].date);
+    }
+    if (0 == sum) fprintf(stderr, "\n");
+    return fired_len > 0 ? (bench_now_ns() - start) / (double) fired_len : 0;
+}
+
+#ifdef CRON_SCHED_BENCH_SHARDS
+/* jobs fire at most once per round, so each count is written by one worker at a time */
+static void on_shard_fire(void* data, uint32_t job_id, time_t date) {
+    unsigned long* counts = (unsigned long*) data;
+    counts[job_id]++;
+    (void) date;
+}
+
+/* the recorded fires counted by job, to compare with the sharded runs */
+static unsigned long* count_fired(size_t jobs) {
+    unsigned long* counts = (unsigned long*) calloc(jobs, sizeof(unsigned long));
+    size_t i;
+    if (!counts) {
+        fprintf(stderr, "Cannot count %lu jobs\n", (unsigned long) jobs);
+        exit(2);
+    }
+    for (i = 0; i < fired_len; i++) {
+        counts[fired[i].job_id]++;
+    }
+    return counts;
+}
+
+/* returns the number of shards the run used */
+static size_t run_shards(bench_shards* bs, const cron_expr* exprs, size_t jobs, long seconds,
+        const unsigned long* expected) {
+    cron_shards pool;
+    unsigned long* counts;
+    time_t now;
+    double start;
+    size_t threads;
+    size_t i;
+    int err = 0;
+    counts = (unsigned long*) calloc(jobs, sizeof(unsigned long));
+    err |= !counts;
+    err |= cron_shards_init(bs->threads, CRON_SCHED_WHEEL, on_shard_fire, counts, &pool);
+    if (err) {
+        fprintf(stderr, "Cannot start %lu shards\n", (unsigned long) bs->threads);
+        exit(2);
+    }
+    for (i = 0; i < jobs; i++) {
+        err |= cron_shards_add(&pool, (uint32_t) i, &exprs[i], FROM);
+    }
+    if (err) {
+        fprintf(stderr, "Cannot add %lu jobs\n", (unsigned long) jobs);
+        exit(2);
+    }
+    bs->fires = 0;
+    start = bench_now_ns();
+    for (now = FROM + 1; now <= FROM + seconds; now++) {
+        bs->fires += (unsigned long) cron_shards_run_due(&pool, now);
+    }
+    if (bs->fires > 0) {
+        bs->fire_ns = min_ns(bs->fire_ns, (bench_now_ns() - start) / (double) bs->fires);
+    }
+    bs->matches = 1;
+    for (i = 0; i < jobs; i++) {
+        if (counts[i] != expected[i]) bs->matches = 0;
+    }
+    threads = pool.len;
+    cron_shards_free(&pool);
+    free(counts);
+    return threads;
+}
+#endif /* CRON_SCHED_BENCH_SHARDS */
+
+int main(int argc, char** argv) {
+    size_t jobs = 100000;
+    long seconds = 300;
+    int rounds = 3;
+    int csv = 0;
+    cron_expr* exprs;
+    bench_run runs[3];
+    bench_shards shards[16];
+    size_t shards_len = 0;
+    size_t threads = 0;
+    double search = 0;
+    size_t i;
+    int round;
+    int mismatch = 0;
+
+    for (i = 1; i < (size_t) argc; i++) {
+        if (0 == strcmp(argv[i], "--jobs") && i + 1 < (size_t) argc) {
+            jobs = (size_t) strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--seconds") && i + 1 < (size_t) argc) {
+            seconds = strtol(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--rounds") && i + 1 < (size_t) argc) {
+            rounds = atoi(argv[++i]);
+        } else if (0 == strcmp(argv[i], "--threads") && i + 1 < (size_t) argc) {
+            threads = (size_t) strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--csv")) {
+            csv = 1;
+        } else {
+            fprintf(stderr, "Usage: %s [--jobs N] [--seconds N] [--rounds N] [--threads N] [--csv]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (jobs < 1) jobs = 1;
+    if (rounds < 1) rounds = 1;
+    exprs = (cron_expr*) malloc(jobs * sizeof(cron_expr));
+    if (!exprs) {
+        fprintf(stderr, "Cannot allocate %lu jobs\n", (unsigned long) jobs);
+        return 2;
+    }
+    for (i = 0; i < jobs; i++) {
+        const char* err = NULL;
+        cron_parse_expr_seeded(GENERATED[i % GENERATED_LEN], &exprs[i], (uint32_t) i, &err);
+        if (err) {
+            fprintf(stderr, "Cannot parse '%s': %s\n", GENERATED[i % GENERATED_LEN], err);
+            return 2;
+        }
+    }
+
+    memset(runs, 0, sizeof(runs));
+    runs[0].name = "heap";
+    runs[0].backend = CRON_SCHED_HEAP;
+    runs[1].name = "wheel";
+    runs[1].backend = CRON_SCHED_WHEEL;
+    runs[2].name = "groups";
+    runs[2].backend = CRON_SCHED_WHEEL;
+    runs[2].grouped = 1;
+    for (round = 0; round < rounds; round++) {
+        for (i = 0; i < 3; i++) {
+            if (runs[i].grouped) {
+                run_groups(&runs[i], exprs, jobs, seconds);
+            } else {
+                run(&runs[i], exprs, jobs, seconds, 0 == round && 0 == i);
+            }
+        }
+        search = min_ns(search, search_ns(exprs));
+    }
+    memset(shards, 0, sizeof(shards));
+#ifdef CRON_SCHED_BENCH_SHARDS
+    {
+        unsigned long* expected = count_fired(jobs);
+        /* without '--threads', a first run tells the number of online processors */
+        shards[0].threads = threads;
+        threads = run_shards(&shards[0], exprs, jobs, seconds, expected);
+        shards[0].fire_ns = 0;
+        for (i = 1; i <= threads && shards_len < sizeof(shards) / sizeof(shards[0]); i *= 2) {
+            shards[shards_len++].threads = i;
+        }
+        if (shards[shards_len - 1].threads < threads && shards_len < sizeof(shards) / sizeof(shards[0])) {
+            shards[shards_len++].threads = threads;
+        }
+        for (round = 0; round < rounds; round++) {
+            for (i = 0; i < shards_len; i++) {
+                run_shards(&shards[i], exprs, jobs, seconds, expected);
+            }
+        }
+        free(expected);
+    }
+#else
+    (void) threads;
+#endif
+    free(exprs);
+    free(fired);
+
+    if (csv) {
+        printf("# %lu jobs, %ld seconds, %d rounds\n", (unsigned long) jobs, seconds, rounds);
+        printf("backend,add_ns,fire_ns,sched_ns,fires,fires_per_second\n");
+        for (i = 0; i < 3; i++) {
+            printf("%s,%.1f,%.1f,%.1f,%lu,%.0f\n", runs[i].name, runs[i].add_ns, runs[i].fire_ns,
+                    runs[i].fire_ns - search, runs[i].fires, runs[i].fire_ns > 0 ? 1e9 / runs[i].fire_ns : 0);
+        }
+        if (shards_len > 0) {
+            printf("shards,fire_ns,fires,fires_per_second,speedup\n");
+        }
+        for (i = 0; i < shards_len; i++) {
+            printf("%lu,%.1f,%lu,%.0f,%.2f\n", (unsigned long) shards[i].threads, shards[i].fire_ns,
+                    shards[i].fires, shards[i].fire_ns > 0 ? 1e9 / shards[i].fire_ns : 0,
+                    shards[i].fire_ns > 0 ? shards[0].fire_ns / shards[i].fire_ns : 0);
+        }
+    } else {
+        printf("Jobs: %lu, virtual seconds: %ld, rounds: %d, search of the next date: %.1f ns/fire\n\n",
+                (unsigned long) jobs, seconds, rounds, search);
+        printf("%-8s %12s %12s %12s %12s %14s\n", "backend", "add ns/op", "fire ns/op", "sched ns/op", "fires", "fires/s");
+        for (i = 0; i < 3; i++) {
+            printf("%-8s %12.1f %12.1f %12.1f %12lu %14.0f\n", runs[i].name, runs[i].add_ns, runs[i].fire_ns,
+                    runs[i].fire_ns - search, runs[i].fires, runs[i].fire_ns > 0 ? 1e9 / runs[i].fire_ns : 0);
+        }
+        if (shards_len > 0) {
+            printf("\n%-8s %12s %12s %14s %12s\n", "shards", "fire ns/op", "fires", "fires/s", "speedup");
+        }
+        for (i = 0; i < shards_len; i++) {
+            printf("%-8lu %12.1f %12lu %14.0f %12.2f\n", (unsigned long) shards[i].threads, shards[i].fire_ns,
+                    shards[i].fires, shards[i].fire_ns > 0 ? 1e9 / shards[i].fire_ns : 0,
+                    shards[i].fire_ns > 0 ? shards[0].fire_ns / shards[i].fire_ns : 0);
+        }
+    }
+    for (i = 1; i < 3; i++) {
+        mismatch |= runs[0].fires != runs[i].fires || runs[0].checksum != runs[i].checksum;
+    }
+    if (mismatch) {
+        fprintf(stderr, "Backends fired different jobs\n");
+        return 1;
+    }
+    for (i = 0; i < shards_len; i++) {
+        if (!shards[i].matches) {
+            fprintf(stderr, "Shards fired different jobs\n");
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sched_test.c
+ *
+ * Tests of the scheduler core
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ccronexpr_sched_test_util.h"
+
+/* simple deterministic generator, the same sequence on every platform */
+static uint32_t next_random(uint32_t* state) {
+    *state = *state * 1103515245U + 12345U;
+    return *state >> 8;
+}
+
+// every node is not after its children, positions point back to the entries
+static void check_heap(const cron_sched* sched) {
+    size_t pos;
+    size_t scheduled = 0;
+    uint32_t id;
+    for (pos = 1; pos < sched->heap_len; pos++) {
+        const cron_sched_entry* parent = &sched->heap[(pos - 1) / CRON_SCHED_ARITY];
+        const cron_sched_entry* child = &sched->heap[pos];
+        assert(parent->next < child->next || (parent->next == child->next && parent->job_id < child->job_id));
+    }
+    for (id = 0; id < sched->jobs_len; id++) {
+        if (CRON_SCHED_NONE == sched->positions[id]) continue;
+        assert(sched->used[id]);
+        assert(sched->heap[sched->positions[id]].job_id == id);
+        scheduled++;
+    }
+    assert(scheduled == sched->heap_len);
+}
+
+// slots hold the jobs at the slot of their dates, upper slots of the current date are empty
+static void check_wheel(const cron_sched* sched) {
+    size_t slot;
+    size_t linked = 0;
+    size_t scheduled = 0;
+    uint32_t id;
+    for (slot = 0; slot < CRON_SCHED_WHEEL_SLOTS; slot++) {
+        uint32_t prev = CRON_SCHED_NONE;
+        for (id = sched->slots[slot]; CRON_SCHED_NONE != id; id = sched->nodes[id].next) {
+            assert(sched->positions[id] == slot && sched->nodes[id].prev == prev);
+            assert(sched->nodes[id].date >= sched->current);
+            if (slot < 60) {
+                assert(sched->nodes[id].date / 60 == sched->current / 60 && (size_t) (sched->nodes[id].date % 60) == slot);
+            } else if (slot < 120) {
+                assert(sched->nodes[id].date / 3600 == sched->current / 3600 && sched->nodes[id].date / 60 > sched->current / 60);
+            } else if (slot < 144) {
+                assert(sched->nodes[id].date / 86400 == sched->current / 86400 && sched->nodes[id].date / 3600 > sched->current / 3600);
+            } else if (slot < 208) {
+                assert(sched->nodes[id].date / 86400 > sched->current / 86400);
+            } else {
+                assert(sched->nodes[id].date >= sched->overflow_min);
+            }
+            prev = id;
+            linked++;
+        }
+    }
+    for (id = 0; id < sched->jobs_len; id++) {
+        if (CRON_SCHED_NONE == sched->positions[id]) continue;
+        assert(sched->used[id]);
+        scheduled++;
+    }
+    for (slot = sched->expired_pos; slot < sched->heap_len; slot++) {
+        if (CRON_SCHED_NONE != sched->heap[slot].job_id) linked++;
+    }
+    assert(scheduled == linked);
+}
+
+static void check_sched(const cron_sched* sched) {
+    if (CRON_SCHED_WHEEL == sched->backend) {
+        check_wheel(sched);
+    } else {
+        check_heap(sched);
+    }
+}
+
+void test_pop_due(int backend) {
+    cron_sched sched;
+    cron_sched_fire due[16];
+    cron_expr expr;
+    const char* err = NULL;
+    time_t now = FROM;
+    uint32_t i;
+    size_t len;
+    int res;
+    res = cron_sched_init_backend(&sched, backend);
+    assert(0 == res);
+    assert(CRON_INVALID_INSTANT == cron_sched_peek(&sched));
+    len = cron_sched_pop_due(&sched, now, due, 16);
+    assert(0 == len);
+
+    cron_parse_expr("*/10 * * * * *", &expr, &err);
+    for (i = 0; i < 20; i++) {
+        res = cron_sched_add(&sched, 19 - i, &expr, now);
+        assert(0 == res);
+    }
+    assert(20 == sched.count && FROM + 10 == cron_sched_peek(&sched));
+    len = cron_sched_pop_due(&sched, FROM + 9, due, 16);
+    assert(0 == len);
+
+    // due jobs in date and id order, the rest on the next call
+    len = cron_sched_pop_due(&sched, FROM + 10, due, 16);
+    assert(16 == len);
+    for (i = 0; i < 16; i++) {
+        assert(i == due[i].job_id && FROM + 10 == due[i].date);
+        assert(FROM + 20 == cron_sched_next(&sched, i));
+    }
+    len = cron_sched_pop_due(&sched, FROM + 10, due, 16);
+    assert(4 == len);
+    assert(16 == due[0].job_id && 19 == due[3].job_id);
+    len = cron_sched_pop_due(&sched, FROM + 10, due, 16);
+    assert(0 == len);
+    check_sched(&sched);
+
+    // a late call returns a job once and reschedules it after the current date
+    len = cron_sched_pop_due(&sched, FROM + 65, due, 16);
+    assert(16 == len);
+    assert(FROM + 20 == due[0].date && FROM + 70 == cron_sched_next(&sched, 0));
+
+    // updated and removed jobs
+    cron_parse_expr("0 0 0 30 2 *", &expr, &err);
+    res = cron_sched_update(&sched, 3, &expr, now);
+    assert(0 == res);
+    assert(CRON_INVALID_INSTANT == cron_sched_next(&sched, 3) && cron_sched_contains(&sched, 3));
+    res = cron_sched_remove(&sched, 3);
+    assert(0 == res && !cron_sched_contains(&sched, 3));
+    res = cron_sched_remove(&sched, 3);
+    assert(0 != res);
+    res = cron_sched_update(&sched, 3, &expr, now);
+    assert(0 != res);
+    res = cron_sched_remove(&sched, 100);
+    assert(0 != res);
+    res = cron_sched_add(&sched, CRON_SCHED_NONE, &expr, now);
+    assert(0 != res);
+    res = cron_sched_add_at(&sched, 3, &expr, CRON_INVALID_INSTANT, now);
+    assert(0 == res && cron_sched_contains(&sched, 3) && CRON_INVALID_INSTANT == cron_sched_next(&sched, 3));
+    res = cron_sched_remove(&sched, 3);
+    assert(0 == res);
+    assert(19 == sched.count);
+    check_sched(&sched);
+    cron_sched_free(&sched);
+}
+
+// random operations against a plain array of next dates
+void test_random(int backend) {
+    enum { JOBS = 500, STEPS = 10000 };
+    static cron_expr exprs[JOBS];
+    static time_t model[JOBS];
+    static int used[JOBS];
+    cron_sched sched;
+    cron_sched_fire due[64];
+    uint32_t state = 42;
+    time_t now = FROM;
+    int step;
+    uint32_t i;
+    int res;
+    res = cron_sched_init_backend(&sched, backend);
+    assert(0 == res);
+    for (i = 0; i < JOBS; i++) {
+        test_parse_job(i, i, &exprs[i]);
+        model[i] = CRON_INVALID_INSTANT;
+        used[i] = 0;
+    }
+    for (step = 0; step < STEPS; step++) {
+        uint32_t op = next_random(&state) % 10;
+        uint32_t id = next_random(&state) % JOBS;
+        if (op < 4) {
+            res = cron_sched_add(&sched, id, &exprs[id], now);
+            assert(0 == res);
+            used[id] = 1;
+            model[id] = cron_next(&exprs[id], now);
+        } else if (op < 5) {
+            res = cron_sched_remove(&sched, id);
+            assert(used[id] == (0 == res));
+            used[id] = 0;
+            model[id] = CRON_INVALID_INSTANT;
+        } else if (op < 6) {
+            uint32_t other = next_random(&state) % JOBS;
+            res = cron_sched_update(&sched, id, &exprs[other], now);
+            assert(used[id] == (0 == res));
+            if (used[id]) {
+                exprs[id] = exprs[other];
+                model[id] = cron_next(&exprs[id], now);
+            }
+        } else {
+            size_t len;
+            size_t k;
+            now += (time_t) (next_random(&state) % 600);
+            len = cron_sched_pop_due(&sched, now, due, 64);
+            for (k = 0; k < len; k++) {
+                uint32_t job = due[k].job_id;
+                // the earliest due job of the model
+                time_t earliest = CRON_INVALID_INSTANT;
+                uint32_t first = 0;
+                for (i = 0; i < JOBS; i++) {
+                    if (CRON_INVALID_INSTANT != model[i] && (CRON_INVALID_INSTANT == earliest || model[i] < earliest)) {
+                        earliest = model[i];
+                        first = i;
+                    }
+                }
+                assert(job == first && earliest == due[k].date && earliest <= now);
+                model[job] = cron_next(&exprs[job], earliest);
+                if (CRON_INVALID_INSTANT != model[job] && model[job] <= now) {
+                    model[job] = cron_next(&exprs[job], now);
+                }
+            }
+            if (len < 64) {
+                for (i = 0; i < JOBS; i++) {
+                    assert(CRON_INVALID_INSTANT == model[i] || model[i] > now);
+                }
+            }
+        }
+        if (0 == step % 1000) {
+            check_sched(&sched);
+            for (i = 0; i < JOBS; i++) {
+                assert(model[i] == cron_sched_next(&sched, i));
+            }
+        }
+    }
+    cron_sched_free(&sched);
+}
+
+// reserved jobs do not allocate, popped jobs are the only ones recomputed
+void test_many_jobs(int backend) {
+    enum { JOBS = 50000 };
+    static cron_expr exprs[TEST_EXPRESSIONS_LEN];
+    cron_sched sched;
+    cron_sched_fire due[256];
+    time_t now = FROM;
+    time_t last = 0;
+    size_t fired = 0;
+    uint32_t i;
+    int res;
+    for (i = 0; i < TEST_EXPRESSIONS_LEN; i++) {
+        test_parse_job(i, i, &exprs[i]);
+    }
+    res = cron_sched_init_backend(&sched, backend);
+    assert(0 == res);
+    res = cron_sched_reserve(&sched, JOBS);
+    assert(0 == res);
+#ifdef CRON_TEST_MALLOC
+    int allocations = test_total_allocations;
+#endif
+    for (i = 0; i < JOBS; i++) {
+        res = cron_sched_add(&sched, i, &exprs[i % TEST_EXPRESSIONS_LEN], now);
+        assert(0 == res);
+    }
+    for (; now < FROM + 120; now++) {
+        size_t len;
+        while ((len = cron_sched_pop_due(&sched, now, due, 256)) > 0) {
+            assert(due[0].date >= last);
+            last = due[len - 1].date;
+            fired += len;
+        }
+    }
+#ifdef CRON_TEST_MALLOC
+    assert(allocations == test_total_allocations);
+#endif
+    assert(fired > JOBS / 2 && JOBS == sched.count);
+    check_sched(&sched);
+    cron_sched_free(&sched);
+}
+
+// the wheel pops the same jobs as the heap over gaps of seconds to months
+void test_wheel_like_heap() {
+    enum { JOBS = 300, STEPS = 4000 };
+    static const char* const SPARSE[] = {
+        "H * * * * *",
+        "H H * * * *",
+        "H H H * * *",
+        "H H H H * ?",
+        "H H H ? * H",
+        "0 0 0 1 1 *",
+        "H H H L 2 ?",
+        "0 0 12 29 2 *"
+    };
+    static const time_t GAPS[] = { 1, 59, 3600, 86400, 40 * 86400 };
+    static cron_expr exprs[JOBS];
+    cron_sched heap;
+    cron_sched wheel;
+    cron_sched_fire heap_due[32];
+    cron_sched_fire wheel_due[32];
+    uint32_t state = 7;
+    time_t now = FROM;
+    int step;
+    uint32_t i;
+    int heap_res;
+    int wheel_res;
+    heap_res = cron_sched_init_backend(&heap, CRON_SCHED_HEAP);
+    assert(0 == heap_res);
+    wheel_res = cron_sched_init_backend(&wheel, CRON_SCHED_WHEEL);
+    assert(0 == wheel_res);
+    wheel_res = cron_sched_init_backend(&wheel, 2);
+    assert(0 != wheel_res);
+    wheel_res = cron_sched_init_backend(&wheel, CRON_SCHED_WHEEL);
+    assert(0 == wheel_res);
+    for (i = 0; i < JOBS; i++) {
+        const char* err = NULL;
+        cron_parse_expr_seeded(SPARSE[i % (sizeof(SPARSE) / sizeof(SPARSE[0]))], &exprs[i], i, &err);
+        assert(!err);
+    }
+    for (step = 0; step < STEPS; step++) {
+        uint32_t op = next_random(&state) % 10;
+        uint32_t id = next_random(&state) % JOBS;
+        if (op < 3) {
+            heap_res = cron_sched_add(&heap, id, &exprs[id], now);
+            assert(0 == heap_res);
+            wheel_res = cron_sched_add(&wheel, id, &exprs[id], now);
+            assert(0 == wheel_res);
+        } else if (op < 4) {
+            heap_res = cron_sched_remove(&heap, id);
+            wheel_res = cron_sched_remove(&wheel, id);
+            assert(heap_res == wheel_res);
+        } else {
+            size_t len;
+            size_t wheel_len;
+            size_t k;
+            now += GAPS[next_random(&state) % (sizeof(GAPS) / sizeof(GAPS[0]))] + (time_t) (next_random(&state) % 60);
+            // small batches leave expired jobs in the wheel across calls
+            do {
+                size_t max = 1 + next_random(&state) % 32;
+                len = cron_sched_pop_due(&heap, now, heap_due, max);
+                wheel_len = cron_sched_pop_due(&wheel, now, wheel_due, max);
+                assert(len == wheel_len);
+                for (k = 0; k < len; k++) {
+                    assert(heap_due[k].job_id == wheel_due[k].job_id && heap_due[k].date == wheel_due[k].date);
+                }
+                if (len > 0 && 0 == next_random(&state) % 4) {
+                    // remove a job still waiting in the expired jobs
+                    id = next_random(&state) % JOBS;
+                    heap_res = cron_sched_remove(&heap, id);
+                    wheel_res = cron_sched_remove(&wheel, id);
+                    assert(heap_res == wheel_res);
+                }
+            } while (len > 0);
+        }
+        assert(cron_sched_peek(&heap) == cron_sched_peek(&wheel));
+        if (0 == step % 500) {
+            check_heap(&heap);
+            check_wheel(&wheel);
+            for (i = 0; i < JOBS; i++) {
+                assert(cron_sched_next(&heap, i) == cron_sched_next(&wheel, i));
+            }
+        }
+    }
+    assert(heap.count == wheel.count);
+    cron_sched_free(&heap);
+    cron_sched_free(&wheel);
+}
+
+int main() {
+    test_pop_due(CRON_SCHED_HEAP);
+    test_pop_due(CRON_SCHED_WHEEL);
+    test_random(CRON_SCHED_HEAP);
+    test_random(CRON_SCHED_WHEEL);
+    test_many_jobs(CRON_SCHED_HEAP);
+    test_many_jobs(CRON_SCHED_WHEEL);
+    test_wheel_like_heap();
+#ifdef CRON_TEST_MALLOC
+    assert(0 == test_allocations);
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sched_test_util.c
+ *
+ * Fixture shared by the tests of the scheduler core and the schedulers built on it
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "ccronexpr_sched_test_util.h"
+
+const char* const TEST_EXPRESSIONS[TEST_EXPRESSIONS_LEN] = {
+    "H H/5 * * * *",
+    "H/20 * * * * *",
+    "* * * * * *",
+    "0 0 H * * MON-FRI",
+    "0 H H(0-5) LW * ?",
+    "0 0 0 1 1 *",
+    "0 0 0 30 2 *"
+};
+
+int test_allocations = 0;
+int test_total_allocations = 0;
+
+#ifdef CRON_TEST_MALLOC
+void* cron_malloc(size_t n) {
+#ifdef __GNUC__
+    __atomic_add_fetch(&test_allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&test_total_allocations, 1, __ATOMIC_RELAXED);
+#else
+    test_allocations++;
+    test_total_allocations++;
+#endif
+    return malloc(n);
+}
+
+void cron_free(void* p) {
+#ifdef __GNUC__
+    __atomic_sub_fetch(&test_allocations, 1, __ATOMIC_RELAXED);
+#else
+    test_allocations--;
+#endif
+    free(p);
+}
+#endif
+
+void test_parse_job(uint32_t index, uint32_t seed, cron_expr* expr) {
+    const char* err = NULL;
+    cron_parse_expr_seeded(TEST_EXPRESSIONS[index % TEST_EXPRESSIONS_LEN], expr, seed, &err);
+    assert(!err);
+}
+
+size_t test_pop_all(cron_sched* sched, time_t now, cron_sched_fire* out) {
+    size_t count = 0;
+    size_t len;
+    while ((len = cron_sched_pop_due(sched, now, out + count, 256)) > 0) {
+        count += len;
+    }
+    return count;
+}
+
+int test_compare_fires(const void* a, const void* b) {
+    const cron_sched_fire* x = (const cron_sched_fire*) a;
+    const cron_sched_fire* y = (const cron_sched_fire*) b;
+    if (x->job_id != y->job_id) return x->job_id < y->job_id ? -1 : 1;
+    return x->date < y->date ? -1 : x->date > y->date;
+}
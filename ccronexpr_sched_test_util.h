@@ -0,0 +1,67 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sched_test_util.h
+ *
+ * Fixture shared by the tests of the scheduler core and the schedulers built on it
+ */
+
+#ifndef CCRONEXPR_SCHED_TEST_UTIL_H
+#define CCRONEXPR_SCHED_TEST_UTIL_H
+
+#include <stddef.h>
+
+#include "ccronexpr_sched.h"
+
+#define FROM 1341136430 /* 2012-07-01_09:53:50 UTC */
+
+/* Jobs cycle through the expressions, 7 is prime to the strides the tests pick jobs with */
+#define TEST_EXPRESSIONS_LEN 7
+
+/* every second to never, the seed of a job picks its H values */
+extern const char* const TEST_EXPRESSIONS[TEST_EXPRESSIONS_LEN];
+
+/* live and total calls of 'cron_malloc' with CRON_TEST_MALLOC, atomic as worker threads allocate too */
+extern int test_allocations;
+extern int test_total_allocations;
+
+/**
+ * Parses the expression of a generated job.
+ *
+ * @param index index in TEST_EXPRESSIONS, modulo their number
+ * @param seed seed of the H values
+ * @param expr parsed expression
+ */
+void test_parse_job(uint32_t index, uint32_t seed, cron_expr* expr);
+
+/**
+ * Pops all the jobs due at the specified date, the reference of the tests
+ * that compare a scheduler with the scheduler core.
+ *
+ * @param sched scheduler core
+ * @param now current date
+ * @param out due jobs, large enough for all of them
+ * @return number of due jobs
+ */
+size_t test_pop_all(cron_sched* sched, time_t now, cron_sched_fire* out);
+
+/**
+ * Order of due jobs by job id, then date, for 'qsort'.
+ */
+int test_compare_fires(const void* a, const void* b);
+
+#endif /* CCRONEXPR_SCHED_TEST_UTIL_H */
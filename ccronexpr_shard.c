@@ -0,0 +1,550 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_shard.c
+ *
+ * Sharded scheduler on POSIX threads and work-stealing deques
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ccronexpr_shard.h"
+
+#ifndef CRON_TEST_MALLOC
+#define cron_malloc(x) malloc(x)
+#define cron_free(x) free(x)
+#else /* CRON_TEST_MALLOC */
+void* cron_malloc(size_t n);
+void cron_free(void* p);
+#endif /* CRON_TEST_MALLOC */
+
+#define DEQUE_MASK (CRON_SHARD_DEQUE - 1)
+
+/* Chase-Lev deque on a fixed array */
+
+static size_t deque_space(cron_shard_deque* d) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+    return (size_t) (CRON_SHARD_DEQUE - (b - t));
+}
+
+/* by the owner only, with space left */
+static void deque_push(cron_shard_deque* d, uint64_t item) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->items[b & DEQUE_MASK], item, __ATOMIC_RELAXED);
+    __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/* by the owner only, returns 0 if an item was taken */
+static int deque_pop(cron_shard_deque* d, uint64_t* item) {
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+    long t;
+    int res = 0;
+    /* sequentially consistent store and load instead of a fence, ordered against 'deque_steal' */
+    __atomic_store_n(&d->bottom, b, __ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    if (t > b) {
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    *item = __atomic_load_n(&d->items[b & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (t == b) {
+        /* the last item, races with thieves */
+        if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            res = 1;
+        }
+        __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return res;
+}
+
+/* by any other worker, returns 0 if an item was stolen, 1 if empty, 2 if another worker took it first */
+static int deque_steal(cron_shard_deque* d, uint64_t* item) {
+    long t = __atomic_load_n(&d->top, __ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&d->bottom, __ATOMIC_SEQ_CST);
+    if (t >= b) return 1;
+    *item = __atomic_load_n(&d->items[t & DEQUE_MASK], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&d->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return 2;
+    return 0;
+}
+
+/* job id and the distance of the date to the date of the round */
+static uint64_t pack_item(uint32_t job_id, time_t date, time_t now) {
+    uint64_t late = (uint64_t) (now - date);
+    if (late > 0xffffffffUL) late = 0xffffffffUL;
+    return (late << 32) | job_id;
+}
+
+/* a job removed since it was pushed to a deque does not fire, returns 1 if the job fired */
+static int run_item(cron_shards* pool, uint64_t item, time_t now) {
+    uint32_t job_id = (uint32_t) (item & 0xffffffffUL);
+    int present;
+    pthread_mutex_lock(&pool->jobs_lock);
+    present = job_id < pool->jobs_len && CRON_SCHED_NONE != pool->shard_of[job_id];
+    pthread_mutex_unlock(&pool->jobs_lock);
+    if (!present) return 0;
+    pool->fn(pool->data, job_id, now - (time_t) (item >> 32));
+    return 1;
+}
+
+/* Shards, jobs have local ids in their scheduler cores */
+
+static int shard_reserve(cron_shard* shard, size_t len) {
+    size_t cap;
+    void* globals = NULL;
+    void* fires = NULL;
+    void* free_ids = NULL;
+    if (len <= shard->globals_capacity) return 0;
+    cap = shard->globals_capacity > 0 ? shard->globals_capacity : 16;
+    while (cap < len) {
+        cap *= 2;
+    }
+    globals = cron_malloc(cap * sizeof(uint32_t));
+    fires = cron_malloc(cap * sizeof(uint32_t));
+    free_ids = cron_malloc(cap * sizeof(uint32_t));
+    if (!globals || !fires || !free_ids) goto return_error;
+    if (shard->globals) {
+        memcpy(globals, shard->globals, shard->globals_len * sizeof(uint32_t));
+        memcpy(fires, shard->fires, shard->globals_len * sizeof(uint32_t));
+        memcpy(free_ids, shard->free_ids, shard->free_len * sizeof(uint32_t));
+        cron_free(shard->globals);
+        cron_free(shard->fires);
+        cron_free(shard->free_ids);
+    }
+    shard->globals = (uint32_t*) globals;
+    shard->fires = (uint32_t*) fires;
+    shard->free_ids = (uint32_t*) free_ids;
+    shard->globals_capacity = cap;
+    return 0;
+
+    return_error:
+    if (globals) cron_free(globals);
+    if (fires) cron_free(fires);
+    if (free_ids) cron_free(free_ids);
+    return 1;
+}
+
+/* with the lock of the shard */
+static int shard_add(cron_shard* shard, uint32_t job_id, const cron_expr* expr, time_t now, uint32_t* local) {
+    uint32_t id;
+    if (shard->free_len > 0) {
+        id = shard->free_ids[shard->free_len - 1];
+    } else {
+        if (0 != shard_reserve(shard, shard->globals_len + 1)) return 1;
+        id = (uint32_t) shard->globals_len;
+    }
+    if (0 != cron_sched_add(&shard->sched, id, expr, now)) return 1;
+    if (shard->free_len > 0) {
+        shard->free_len--;
+    } else {
+        shard->globals_len++;
+    }
+    shard->globals[id] = job_id;
+    shard->fires[id] = 0;
+    *local = id;
+    return 0;
+}
+
+/* with the lock of the shard */
+static void shard_remove(cron_shard* shard, uint32_t local) {
+    cron_sched_remove(&shard->sched, local);
+    shard->globals[local] = CRON_SCHED_NONE;
+    shard->free_ids[shard->free_len++] = local;
+}
+
+/* Rounds */
+
+static void run_own(cron_shard* shard, time_t now, size_t* fired) {
+    uint64_t item;
+    while (0 == deque_pop(shard->deque, &item)) {
+        *fired += (size_t) run_item(shard->pool, item, now);
+    }
+}
+
+/* pops the due jobs of the shard to its deque, runs them when it is full */
+static void produce(cron_shard* shard, time_t now, size_t* fired) {
+    cron_sched_fire due[CRON_SHARD_BATCH];
+    for (;;) {
+        size_t space = deque_space(shard->deque);
+        size_t max = space < CRON_SHARD_BATCH ? space : CRON_SHARD_BATCH;
+        size_t len;
+        size_t i;
+        if (0 == max) {
+            run_own(shard, now, fired);
+            continue;
+        }
+        pthread_mutex_lock(&shard->lock);
+        len = cron_sched_pop_due(&shard->sched, now, due, max);
+        for (i = 0; i < len; i++) {
+            uint32_t job_id = shard->globals[due[i].job_id];
+            shard->fires[due[i].job_id]++;
+            shard->recent[shard->recent_pos % CRON_SHARD_RECENT] = job_id;
+            shard->recent_pos++;
+            deque_push(shard->deque, pack_item(job_id, due[i].date, now));
+        }
+        shard->load += len;
+        pthread_mutex_unlock(&shard->lock);
+        if (len < max) break;
+    }
+}
+
+static void run_round(cron_shard* shard, time_t now) {
+    cron_shards* pool = shard->pool;
+    size_t self = (size_t) (shard - pool->shards);
+    size_t fired = 0;
+    produce(shard, now, &fired);
+    __atomic_sub_fetch(&pool->producing, 1, __ATOMIC_ACQ_REL);
+    run_own(shard, now, &fired);
+    /* the round is over for the worker once all deques are empty after all workers stopped producing */
+    for (;;) {
+        int busy = __atomic_load_n(&pool->producing, __ATOMIC_ACQUIRE) > 0;
+        int stolen = 0;
+        size_t k;
+        for (k = 1; k < pool->len; k++) {
+            cron_shard_deque* victim = pool->shards[(self + k) % pool->len].deque;
+            uint64_t item;
+            int res;
+            while (1 != (res = deque_steal(victim, &item))) {
+                if (0 == res) {
+                    fired += (size_t) run_item(pool, item, now);
+                    stolen = 1;
+                }
+                busy = 1;
+            }
+        }
+        if (!busy) break;
+        if (!stolen) sched_yield();
+    }
+    __atomic_add_fetch(&pool->fired, fired, __ATOMIC_RELAXED);
+}
+
+static void* worker_main(void* arg) {
+    cron_shard* shard = (cron_shard*) arg;
+    cron_shards* pool = shard->pool;
+    unsigned long seen = 0;
+    for (;;) {
+        time_t now;
+        pthread_mutex_lock(&pool->lock);
+        while (pool->round == seen && !pool->stop) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        seen = pool->round;
+        now = pool->now;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_round(shard, now);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        if (pool->finished == pool->len) {
+            pthread_cond_signal(&pool->done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/* Moves of jobs between shards */
+
+/* with the jobs lock, the job keeps its next date and its fires */
+static int move_job(cron_shards* pool, uint32_t job_id, size_t to) {
+    cron_shard* src = &pool->shards[pool->shard_of[job_id]];
+    cron_shard* dest = &pool->shards[to];
+    uint32_t local = pool->local_of[job_id];
+    uint32_t moved;
+    cron_expr expr;
+    time_t next;
+    uint32_t fires;
+    int res;
+    pthread_mutex_lock(&src->lock);
+    expr = src->sched.exprs[local];
+    next = cron_sched_next(&src->sched, local);
+    fires = src->fires[local];
+    pthread_mutex_unlock(&src->lock);
+    pthread_mutex_lock(&dest->lock);
+    /* the next date is the first date after the second before it */
+    res = shard_add(dest, job_id, &expr, CRON_INVALID_INSTANT != next ? next - 1 : pool->now, &moved);
+    if (0 == res) dest->fires[moved] = fires;
+    pthread_mutex_unlock(&dest->lock);
+    if (0 != res) return 1;
+    pthread_mutex_lock(&src->lock);
+    shard_remove(src, local);
+    pthread_mutex_unlock(&src->lock);
+    pool->shard_of[job_id] = (uint32_t) to;
+    pool->local_of[job_id] = moved;
+    pool->moved++;
+    return 0;
+}
+
+/*
+ * Between rounds: once enough jobs fired, the recently fired jobs of a shard
+ * that fired over a quarter more than the average are moved to the shard
+ * that fired the least, until about half of the difference moved.
+ * The jobs lock is held throughout, so that 'cron_shards_add' and
+ * 'cron_shards_remove' from other threads do not grow the arrays of a shard
+ * while they are read.
+ */
+static void rebalance(cron_shards* pool) {
+    size_t total = 0;
+    size_t heavy = 0;
+    size_t light = 0;
+    size_t i;
+    pthread_mutex_lock(&pool->jobs_lock);
+    for (i = 0; i < pool->len; i++) {
+        cron_shard* shard = &pool->shards[i];
+        total += shard->load;
+        if (shard->load > pool->shards[heavy].load) heavy = i;
+        if (shard->load < pool->shards[light].load) light = i;
+    }
+    if (total < CRON_SHARD_WINDOW || pool->len < 2) {
+        pthread_mutex_unlock(&pool->jobs_lock);
+        return;
+    }
+    if (pool->shards[heavy].load * 4 * pool->len > total * 5) {
+        cron_shard* shard = &pool->shards[heavy];
+        size_t target = (shard->load - pool->shards[light].load) / 2;
+        size_t recent = shard->recent_pos < CRON_SHARD_RECENT ? shard->recent_pos : CRON_SHARD_RECENT;
+        size_t moved = 0;
+        for (i = 0; i < recent && moved < target; i++) {
+            uint32_t job_id = shard->recent[(shard->recent_pos - 1 - i) % CRON_SHARD_RECENT];
+            size_t fires;
+            if (job_id >= pool->jobs_len || pool->shard_of[job_id] != heavy) continue;
+            pthread_mutex_lock(&shard->lock);
+            fires = shard->fires[pool->local_of[job_id]];
+            pthread_mutex_unlock(&shard->lock);
+            if (0 != move_job(pool, job_id, light)) break;
+            moved += fires;
+        }
+    }
+    for (i = 0; i < pool->len; i++) {
+        cron_shard* shard = &pool->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->load = 0;
+        if (shard->fires) memset(shard->fires, 0, shard->globals_len * sizeof(uint32_t));
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&pool->jobs_lock);
+}
+
+/* API */
+
+static void destroy_shards(cron_shards* pool, size_t started) {
+    size_t i;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < started; i++) {
+        pthread_join(pool->shards[i].thread, NULL);
+    }
+    for (i = 0; i < pool->len; i++) {
+        cron_shard* shard = &pool->shards[i];
+        cron_sched_free(&shard->sched);
+        if (shard->globals) cron_free(shard->globals);
+        if (shard->fires) cron_free(shard->fires);
+        if (shard->free_ids) cron_free(shard->free_ids);
+        if (shard->deque) cron_free(shard->deque);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    if (pool->shards) cron_free(pool->shards);
+    if (pool->shard_of) cron_free(pool->shard_of);
+    if (pool->local_of) cron_free(pool->local_of);
+    pthread_mutex_destroy(&pool->jobs_lock);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    memset(pool, 0, sizeof(*pool));
+}
+
+int cron_shards_init(size_t threads, int backend, cron_shards_fn fn, void* data, cron_shards* out) {
+    size_t i;
+    size_t started = 0;
+    if (!fn || !out || (CRON_SCHED_HEAP != backend && CRON_SCHED_WHEEL != backend)) return 1;
+    if (0 == threads) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? (size_t) online : 1;
+    }
+    memset(out, 0, sizeof(*out));
+    out->fn = fn;
+    out->data = data;
+    out->backend = backend;
+    pthread_mutex_init(&out->jobs_lock, NULL);
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->start, NULL);
+    pthread_cond_init(&out->done, NULL);
+    out->shards = (cron_shard*) cron_malloc(threads * sizeof(cron_shard));
+    if (!out->shards) goto return_error;
+    memset(out->shards, 0, threads * sizeof(cron_shard));
+    out->len = threads;
+    for (i = 0; i < threads; i++) {
+        out->shards[i].pool = out;
+        pthread_mutex_init(&out->shards[i].lock, NULL);
+        cron_sched_init_backend(&out->shards[i].sched, backend);
+    }
+    for (i = 0; i < threads; i++) {
+        cron_shard* shard = &out->shards[i];
+        shard->deque = (cron_shard_deque*) cron_malloc(sizeof(cron_shard_deque));
+        if (!shard->deque) goto return_error;
+        memset(shard->deque, 0, sizeof(cron_shard_deque));
+    }
+    for (; started < threads; started++) {
+        if (0 != pthread_create(&out->shards[started].thread, NULL, worker_main, &out->shards[started])) {
+            goto return_error;
+        }
+    }
+    return 0;
+
+    return_error:
+    destroy_shards(out, started);
+    return 1;
+}
+
+void cron_shards_free(cron_shards* pool) {
+    if (!pool || !pool->shards) return;
+    destroy_shards(pool, pool->len);
+}
+
+/* with the jobs lock */
+static int reserve_jobs(cron_shards* pool, size_t len) {
+    size_t cap;
+    void* shard_of = NULL;
+    void* local_of = NULL;
+    if (len <= pool->jobs_capacity) return 0;
+    cap = pool->jobs_capacity > 0 ? pool->jobs_capacity : 16;
+    while (cap < len) {
+        cap *= 2;
+    }
+    shard_of = cron_malloc(cap * sizeof(uint32_t));
+    local_of = cron_malloc(cap * sizeof(uint32_t));
+    if (!shard_of || !local_of) goto return_error;
+    if (pool->shard_of) {
+        memcpy(shard_of, pool->shard_of, pool->jobs_len * sizeof(uint32_t));
+        memcpy(local_of, pool->local_of, pool->jobs_len * sizeof(uint32_t));
+        cron_free(pool->shard_of);
+        cron_free(pool->local_of);
+    }
+    pool->shard_of = (uint32_t*) shard_of;
+    pool->local_of = (uint32_t*) local_of;
+    pool->jobs_capacity = cap;
+    return 0;
+
+    return_error:
+    if (shard_of) cron_free(shard_of);
+    if (local_of) cron_free(local_of);
+    return 1;
+}
+
+int cron_shards_add(cron_shards* pool, uint32_t job_id, const cron_expr* expr, time_t now) {
+    cron_shard* shard;
+    size_t best = 0;
+    size_t i;
+    int res;
+    if (!pool || !expr || CRON_SCHED_NONE == job_id) return 1;
+    pthread_mutex_lock(&pool->jobs_lock);
+    if (job_id >= pool->jobs_len) {
+        size_t len = (size_t) job_id + 1;
+        if (0 != reserve_jobs(pool, len)) {
+            pthread_mutex_unlock(&pool->jobs_lock);
+            return 1;
+        }
+        memset(pool->shard_of + pool->jobs_len, 0xff, (len - pool->jobs_len) * sizeof(uint32_t));
+        pool->jobs_len = len;
+    }
+    if (CRON_SCHED_NONE != pool->shard_of[job_id]) {
+        shard = &pool->shards[pool->shard_of[job_id]];
+        pthread_mutex_lock(&shard->lock);
+        res = cron_sched_update(&shard->sched, pool->local_of[job_id], expr, now);
+        pthread_mutex_unlock(&shard->lock);
+        pthread_mutex_unlock(&pool->jobs_lock);
+        return res;
+    }
+    /* counts change only with the jobs lock */
+    for (i = 1; i < pool->len; i++) {
+        if (pool->shards[i].sched.count < pool->shards[best].sched.count) best = i;
+    }
+    shard = &pool->shards[best];
+    pthread_mutex_lock(&shard->lock);
+    res = shard_add(shard, job_id, expr, now, &pool->local_of[job_id]);
+    pthread_mutex_unlock(&shard->lock);
+    if (0 == res) {
+        pool->shard_of[job_id] = (uint32_t) best;
+    }
+    pthread_mutex_unlock(&pool->jobs_lock);
+    return res;
+}
+
+int cron_shards_remove(cron_shards* pool, uint32_t job_id) {
+    cron_shard* shard;
+    if (!pool) return 1;
+    pthread_mutex_lock(&pool->jobs_lock);
+    if (job_id >= pool->jobs_len || CRON_SCHED_NONE == pool->shard_of[job_id]) {
+        pthread_mutex_unlock(&pool->jobs_lock);
+        return 1;
+    }
+    shard = &pool->shards[pool->shard_of[job_id]];
+    pthread_mutex_lock(&shard->lock);
+    shard_remove(shard, pool->local_of[job_id]);
+    pthread_mutex_unlock(&shard->lock);
+    pool->shard_of[job_id] = CRON_SCHED_NONE;
+    pthread_mutex_unlock(&pool->jobs_lock);
+    return 0;
+}
+
+time_t cron_shards_next(cron_shards* pool, uint32_t job_id) {
+    cron_shard* shard;
+    time_t res = CRON_INVALID_INSTANT;
+    if (!pool) return CRON_INVALID_INSTANT;
+    pthread_mutex_lock(&pool->jobs_lock);
+    if (job_id < pool->jobs_len && CRON_SCHED_NONE != pool->shard_of[job_id]) {
+        shard = &pool->shards[pool->shard_of[job_id]];
+        pthread_mutex_lock(&shard->lock);
+        res = cron_sched_next(&shard->sched, pool->local_of[job_id]);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    pthread_mutex_unlock(&pool->jobs_lock);
+    return res;
+}
+
+size_t cron_shards_run_due(cron_shards* pool, time_t now) {
+    size_t fired;
+    if (!pool || !pool->shards) return 0;
+    pthread_mutex_lock(&pool->lock);
+    pool->now = now;
+    pool->finished = 0;
+    pool->fired = 0;
+    __atomic_store_n(&pool->producing, pool->len, __ATOMIC_RELAXED);
+    pool->round++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->finished < pool->len) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    fired = __atomic_load_n(&pool->fired, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool->lock);
+    rebalance(pool);
+    return fired;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_shard.h
+ *
+ * Sharded scheduler: jobs spread over per-thread scheduler cores, due jobs
+ * handed to the worker threads through lock-free work-stealing deques.
+ */
+
+#ifndef CCRONEXPR_SHARD_H
+#define CCRONEXPR_SHARD_H
+
+#include <pthread.h>
+
+#include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+extern "C" {
+#endif
+
+/* Due jobs a shard pops from its scheduler core at once */
+#define CRON_SHARD_BATCH 256
+
+/* Capacity of a deque, a power of two */
+#define CRON_SHARD_DEQUE 4096
+
+/* Recently fired jobs of a shard, candidates to move to another shard */
+#define CRON_SHARD_RECENT 4096
+
+/* Fires of all shards between two checks of the skew */
+#define CRON_SHARD_WINDOW 4096
+
+/**
+ * Called for every job that fires, concurrently from the worker threads.
+ *
+ * @param data user data passed to 'cron_shards_init'
+ * @param job_id id of the job
+ * @param date scheduled 'fire' date of the job
+ */
+typedef void (*cron_shards_fn)(void* data, uint32_t job_id, time_t date);
+
+/**
+ * Chase-Lev deque of due jobs: the owner pushes and pops at the bottom,
+ * other workers steal from the top. An item packs the job id and the
+ * distance of its date to the date of the round.
+ */
+typedef struct {
+    long top;
+    char pad_top[64 - sizeof(long)];
+    long bottom;
+    char pad_bottom[64 - sizeof(long)];
+    uint64_t items[CRON_SHARD_DEQUE];
+} cron_shard_deque;
+
+struct cron_shards;
+
+/**
+ * Scheduler core of a worker thread, jobs have local ids in it.
+ */
+typedef struct {
+    struct cron_shards* pool;
+    cron_sched sched;          /* by local id */
+    uint32_t* globals;         /* job id by local id */
+    uint32_t* fires;           /* by local id, fires since the last check of the skew */
+    size_t globals_len;
+    size_t globals_capacity;
+    uint32_t* free_ids;        /* local ids of removed jobs */
+    size_t free_len;
+    uint32_t recent[CRON_SHARD_RECENT];  /* last fired job ids, a ring */
+    size_t recent_pos;
+    size_t load;               /* fires since the last check of the skew */
+    pthread_mutex_t lock;      /* scheduler core and ids */
+    pthread_t thread;
+    cron_shard_deque* deque;
+} cron_shard;
+
+/**
+ * Shards and their worker threads. Rounds are started by 'cron_shards_run_due':
+ * every worker pops the due jobs of its shard, recomputes their next dates,
+ * pushes them to its deque and runs them; idle workers steal from the others.
+ * Jobs fired mostly by one shard are moved to the least loaded one.
+ * Fields are internal.
+ */
+typedef struct cron_shards {
+    cron_shard* shards;
+    size_t len;
+    cron_shards_fn fn;
+    void* data;
+    int backend;
+    uint32_t* shard_of;        /* by job id, CRON_SCHED_NONE if there is no such job */
+    uint32_t* local_of;        /* by job id */
+    size_t jobs_len;
+    size_t jobs_capacity;
+    pthread_mutex_t jobs_lock; /* job ids and moves between shards */
+    pthread_mutex_t lock;      /* rounds */
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned long round;
+    time_t now;
+    size_t finished;
+    int stop;
+    size_t producing;          /* workers still popping their shard in the round */
+    size_t fired;              /* fired jobs in the round */
+    size_t moved;              /* jobs moved between shards */
+} cron_shards;
+
+/**
+ * Initializes the shards and starts a worker thread per shard.
+ *
+ * @param threads number of shards and worker threads, 0 for the number of online processors
+ * @param backend CRON_SCHED_HEAP or CRON_SCHED_WHEEL, backend of the shards
+ * @param fn function called for every job that fires
+ * @param data user data passed to the function
+ * @param out shards to initialize, must be released with 'cron_shards_free'
+ * @return 0 on success, non-zero on error
+ */
+int cron_shards_init(size_t threads, int backend, cron_shards_fn fn, void* data, cron_shards* out);
+
+/**
+ * Stops the worker threads and releases memory held by the shards.
+ *
+ * @param pool shards to release
+ */
+void cron_shards_free(cron_shards* pool);
+
+/**
+ * Adds a job to the shard with the fewest jobs, or replaces the expression
+ * of the job with the same id. May be called from any thread, also from the
+ * function called for the fired jobs.
+ *
+ * @param pool shards
+ * @param job_id id of the job, less than CRON_SCHED_NONE
+ * @param expr parsed cron expression, copied
+ * @param now current date, the job is scheduled at its next 'fire' date after it
+ * @return 0 on success, non-zero on error
+ */
+int cron_shards_add(cron_shards* pool, uint32_t job_id, const cron_expr* expr, time_t now);
+
+/**
+ * Removes a job. May be called from any thread. A job removed during a round
+ * does not fire once the call returns, but the call does not wait for the
+ * function already running for the job on another worker.
+ *
+ * @param pool shards
+ * @param job_id id of the job
+ * @return 0 on success, non-zero if there is no such job
+ */
+int cron_shards_remove(cron_shards* pool, uint32_t job_id);
+
+/**
+ * Next 'fire' date of a job.
+ *
+ * @param pool shards
+ * @param job_id id of the job
+ * @return next 'fire' date, '((time_t) -1)' if there is no such job or it never fires again
+ */
+time_t cron_shards_next(cron_shards* pool, uint32_t job_id);
+
+/**
+ * Fires the jobs due at the specified date on the worker threads and waits
+ * for them, then moves jobs away from a skewed shard. Jobs are rescheduled
+ * like with 'cron_sched_pop_due'. Rounds must not overlap.
+ *
+ * @param pool shards
+ * @param now current date
+ * @return number of fired jobs
+ */
+size_t cron_shards_run_due(cron_shards* pool, time_t now);
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+} /* extern "C"*/
+#endif
+
+#endif /* CCRONEXPR_SHARD_H */
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_shard_test.c
+ *
+ * Tests of the sharded scheduler
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ccronexpr_shard.h"
+#include "ccronexpr_sched_test_util.h"
+
+#define JOBS 4000
+
+// jobs fire at most once per round, so each one is written by one worker at a time
+typedef struct {
+    uint32_t fires[JOBS];
+    time_t last[JOBS];
+    cron_shards* pool;
+    cron_expr every_second;
+    time_t now;
+} fired_jobs;
+
+static void on_fire(void* data, uint32_t job_id, time_t date) {
+    fired_jobs* fired = (fired_jobs*) data;
+    assert(job_id < JOBS && date > fired->last[job_id]);
+    fired->fires[job_id]++;
+    fired->last[job_id] = date;
+}
+
+// the same jobs fire at the same dates as with a single scheduler core
+void test_like_sched(int backend, size_t threads) {
+    static fired_jobs fired;
+    static cron_expr exprs[JOBS];
+    cron_shards pool;
+    cron_shards invalid;
+    cron_sched sched;
+    static cron_sched_fire due[JOBS];
+    static uint32_t fires[JOBS];
+    static time_t last[JOBS];
+    time_t now = FROM;
+    size_t total = 0;
+    uint32_t i;
+    int res;
+    int sched_res;
+    memset(&fired, 0, sizeof(fired));
+    memset(fires, 0, sizeof(fires));
+    memset(last, 0, sizeof(last));
+    res = cron_shards_init(threads, backend, on_fire, &fired, &pool);
+    assert(0 == res);
+    res = cron_shards_init(threads, 7, on_fire, &fired, &invalid);
+    assert(0 != res);
+    cron_sched_init_backend(&sched, backend);
+    for (i = 0; i < JOBS; i++) {
+        test_parse_job(i, i, &exprs[i]);
+        res = cron_shards_add(&pool, i, &exprs[i], now);
+        sched_res = cron_sched_add(&sched, i, &exprs[i], now);
+        assert(0 == res && 0 == sched_res);
+    }
+    res = cron_shards_remove(&pool, 7);
+    sched_res = cron_sched_remove(&sched, 7);
+    assert(0 == res && 0 == sched_res);
+    res = cron_shards_remove(&pool, 7);
+    assert(0 != res);
+    res = cron_shards_remove(&pool, JOBS);
+    assert(0 != res);
+    for (; now < FROM + 900; now += 1 + (now % 7 == 0 ? 30 : 0)) {
+        size_t round = cron_shards_run_due(&pool, now);
+        size_t len = test_pop_all(&sched, now, due);
+        size_t k;
+        for (k = 0; k < len; k++) {
+            fires[due[k].job_id]++;
+            last[due[k].job_id] = due[k].date;
+        }
+        assert(len == round);
+        total += cron_shards_run_due(&pool, now);
+    }
+    assert(0 == total);
+    for (i = 0; i < JOBS; i++) {
+        assert(fires[i] == fired.fires[i] && last[i] == fired.last[i]);
+        assert(cron_sched_next(&sched, i) == cron_shards_next(&pool, i));
+    }
+    cron_shards_free(&pool);
+    cron_sched_free(&sched);
+}
+
+// every second jobs all on one shard are spread over the shards without missing a fire
+void test_rebalance() {
+    static fired_jobs fired;
+    cron_shards pool;
+    cron_expr never;
+    const char* err = NULL;
+    size_t per_shard[4] = { 0, 0, 0, 0 };
+    size_t heavy = 0;
+    size_t rounds = 0;
+    time_t now = FROM;
+    uint32_t i;
+    size_t len;
+    int res;
+    memset(&fired, 0, sizeof(fired));
+    cron_parse_expr("0 0 0 30 2 *", &never, &err);
+    cron_parse_expr("* * * * * *", &fired.every_second, &err);
+    res = cron_shards_init(4, CRON_SCHED_HEAP, on_fire, &fired, &pool);
+    assert(0 == res);
+    for (i = 0; i < JOBS; i++) {
+        res = cron_shards_add(&pool, i, &never, now);
+        assert(0 == res);
+    }
+    for (i = 0; i < JOBS; i++) {
+        if (0 == pool.shard_of[i]) {
+            res = cron_shards_add(&pool, i, &fired.every_second, now);
+            assert(0 == res);
+            heavy++;
+        }
+    }
+    assert(JOBS / 4 == heavy);
+    for (now = FROM + 1; now <= FROM + 120; now++) {
+        len = cron_shards_run_due(&pool, now);
+        assert(heavy == len);
+        rounds++;
+    }
+    assert(pool.moved > 0);
+    for (i = 0; i < JOBS; i++) {
+        if (fired.fires[i] > 0) {
+            assert(rounds == fired.fires[i] && FROM + 120 == fired.last[i]);
+            per_shard[pool.shard_of[i]]++;
+        }
+    }
+    for (i = 0; i < 4; i++) {
+        assert(per_shard[i] > 0 && per_shard[i] < heavy / 2);
+    }
+    cron_shards_free(&pool);
+}
+
+// jobs remove themselves and add others from the workers
+static void on_fire_once(void* data, uint32_t job_id, time_t date) {
+    fired_jobs* fired = (fired_jobs*) data;
+    int res;
+    on_fire(data, job_id, date);
+    res = cron_shards_remove(fired->pool, job_id);
+    assert(0 == res);
+    if (job_id + 1000 < JOBS) {
+        res = cron_shards_add(fired->pool, job_id + 1000, &fired->every_second, date);
+        assert(0 == res);
+    }
+}
+
+void test_add_remove_from_workers() {
+    static fired_jobs fired;
+    cron_shards pool;
+    const char* err = NULL;
+    time_t now;
+    uint32_t i;
+    size_t len;
+    int res;
+    memset(&fired, 0, sizeof(fired));
+    fired.pool = &pool;
+    cron_parse_expr("* * * * * *", &fired.every_second, &err);
+    res = cron_shards_init(3, CRON_SCHED_WHEEL, on_fire_once, &fired, &pool);
+    assert(0 == res);
+    for (i = 0; i < 1000; i++) {
+        res = cron_shards_add(&pool, i, &fired.every_second, FROM);
+        assert(0 == res);
+    }
+    // each round fires the jobs added by the previous one
+    for (now = FROM + 1; now <= FROM + JOBS / 1000; now++) {
+        len = cron_shards_run_due(&pool, now);
+        assert(1000 == len);
+    }
+    len = cron_shards_run_due(&pool, now);
+    assert(0 == len);
+    for (i = 0; i < JOBS; i++) {
+        assert(1 == fired.fires[i] && CRON_INVALID_INSTANT == cron_shards_next(&pool, i));
+    }
+    cron_shards_free(&pool);
+}
+
+// the partner of a fired job is removed while its item waits in the deque
+static void on_fire_partner(void* data, uint32_t job_id, time_t date) {
+    fired_jobs* fired = (fired_jobs*) data;
+    int res;
+    on_fire(data, job_id, date);
+    res = cron_shards_remove(fired->pool, job_id ^ 1);
+    assert(0 == res);
+}
+
+// jobs removed during a round after they were pushed to a deque do not fire
+void test_remove_during_round() {
+    static fired_jobs fired;
+    cron_shards pool;
+    const char* err = NULL;
+    uint32_t i;
+    size_t len;
+    int res;
+    memset(&fired, 0, sizeof(fired));
+    fired.pool = &pool;
+    cron_parse_expr("* * * * * *", &fired.every_second, &err);
+    /* a single worker pushes all the due jobs before it runs them */
+    res = cron_shards_init(1, CRON_SCHED_HEAP, on_fire_partner, &fired, &pool);
+    assert(0 == res);
+    for (i = 0; i < JOBS; i++) {
+        res = cron_shards_add(&pool, i, &fired.every_second, FROM);
+        assert(0 == res);
+    }
+    len = cron_shards_run_due(&pool, FROM + 1);
+    assert(JOBS / 2 == len);
+    for (i = 0; i < JOBS; i += 2) {
+        assert(1 == fired.fires[i] + fired.fires[i + 1]);
+        assert(CRON_INVALID_INSTANT == cron_shards_next(&pool, 0 == fired.fires[i] ? i : i + 1));
+    }
+    cron_shards_free(&pool);
+}
+
+typedef struct {
+    cron_shards* pool;
+    cron_expr never;
+    int stop;
+    unsigned long ops;
+} churn_thread;
+
+// adds and removes jobs that never fire, growing the arrays of the shards
+static void* churn_main(void* arg) {
+    churn_thread* t = (churn_thread*) arg;
+    uint32_t i = 0;
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t job_id = JOBS + i % 20000;
+        int res;
+        if (0 == (i / 20000) % 2) {
+            res = cron_shards_add(t->pool, job_id, &t->never, FROM);
+        } else {
+            res = cron_shards_remove(t->pool, job_id);
+        }
+        assert(0 == res);
+        i++;
+    }
+    t->ops = i;
+    return NULL;
+}
+
+// jobs are added and removed from another thread while the rounds run and rebalance
+void test_add_remove_during_rounds() {
+    static fired_jobs fired;
+    cron_shards pool;
+    churn_thread churn;
+    pthread_t id;
+    const char* err = NULL;
+    size_t heavy = 0;
+    time_t now;
+    uint32_t i;
+    size_t len;
+    int res;
+    memset(&fired, 0, sizeof(fired));
+    memset(&churn, 0, sizeof(churn));
+    churn.pool = &pool;
+    cron_parse_expr("0 0 0 30 2 *", &churn.never, &err);
+    cron_parse_expr("* * * * * *", &fired.every_second, &err);
+    res = cron_shards_init(4, CRON_SCHED_WHEEL, on_fire, &fired, &pool);
+    assert(0 == res);
+    for (i = 0; i < JOBS; i++) {
+        res = cron_shards_add(&pool, i, &churn.never, FROM);
+        assert(0 == res);
+    }
+    for (i = 0; i < JOBS; i++) {
+        if (0 == pool.shard_of[i]) {
+            res = cron_shards_add(&pool, i, &fired.every_second, FROM);
+            assert(0 == res);
+            heavy++;
+        }
+    }
+    res = pthread_create(&id, NULL, churn_main, &churn);
+    assert(0 == res);
+    for (now = FROM + 1; now <= FROM + 200; now++) {
+        len = cron_shards_run_due(&pool, now);
+        assert(heavy == len);
+    }
+    __atomic_store_n(&churn.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(id, NULL);
+    assert(churn.ops > 0 && pool.moved > 0);
+    for (i = 0; i < JOBS; i++) {
+        if (fired.fires[i] > 0) {
+            assert(200 == fired.fires[i] && FROM + 200 == fired.last[i]);
+        }
+    }
+    cron_shards_free(&pool);
+}
+
+int main() {
+    test_like_sched(CRON_SCHED_HEAP, 4);
+    test_like_sched(CRON_SCHED_WHEEL, 3);
+    test_like_sched(CRON_SCHED_HEAP, 1);
+    test_rebalance();
+    test_add_remove_from_workers();
+    test_remove_during_round();
+    test_add_remove_during_rounds();
+#ifdef CRON_TEST_MALLOC
+    assert(0 == test_allocations);
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}
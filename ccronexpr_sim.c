@@ -0,0 +1,475 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_sim.c
+ *
+ * Virtual time simulation of a jobs schedule: every 'fire' date of every job
+ * in the time range is visited in time order and summarized per interval
+ * (fires, peak fires per second, peak running jobs, longest gap without fires).
+ *
+ * Job file: one job per line, a cron expression optionally followed by the job
+ * duration in seconds (1 by default), empty lines and lines starting with '#'
+ * are skipped. 'H' items are seeded with the line number.
+ *
+ *     0 0 7 ? * MON-FRI 3600
+ *     0 H H * * *
+ *
+ * Usage: ccronexpr_sim [--from YYYY-MM-DD] [--days N] [--interval SECONDS] [--csv]
+ *                      (--generate N | JOBS)
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "ccronexpr.h"
+#include "ccronexpr_bench_util.h"
+
+#ifndef ARRAY_LEN
+#define ARRAY_LEN(x) sizeof(x)/sizeof(x[0])
+#endif
+
+#define SIM_LINE_LEN 512
+#define SIM_MAX_DURATION (366 * 24 * 3600)
+
+/* mix of generated jobs, H items are seeded with the job number */
+static const char* const GENERATED[] = {
+    "0 H * * * *",
+    "0 H H * * *",
+    "0 H H * * *",
+    "0 H H ? * MON-FRI",
+    "0 H H H * ?",
+    "0 H/15 * * * *"
+};
+
+/* durations of generated jobs in seconds */
+static const uint32_t GENERATED_DURATIONS[] = { 1, 30, 60, 300, 600 };
+
+typedef struct {
+    uint32_t seconds;
+    uint64_t weight;
+} sim_duration;
+
+/* Jobs with the same expression share a stream and are searched once, 'weight' is their number */
+typedef struct {
+    cron_expr expr;
+    sim_duration* durations;
+    size_t durations_len;
+    uint64_t weight;
+    time_t next;
+} sim_stream;
+
+typedef struct {
+    time_t time;
+    uint64_t weight;
+} sim_end;
+
+typedef struct {
+    sim_stream* streams;
+    size_t len;
+    size_t capacity;
+    size_t* table; /* open addressing, stream index + 1, 0 for empty */
+    size_t table_len;
+    uint64_t jobs;
+} sim_jobs;
+
+typedef struct {
+    time_t start;
+    time_t end;
+    uint64_t fires;
+    uint64_t peak_second;
+    uint64_t peak_running;
+    time_t max_gap;
+    time_t last_fire; /* last fire in the interval or its start */
+} sim_interval;
+
+static int grow_table(sim_jobs* jobs) {
+    size_t len = jobs->table_len > 0 ? jobs->table_len * 2 : 1024;
+    size_t* table = (size_t*) calloc(len, sizeof(size_t));
+    size_t i;
+    size_t j;
+    if (!table) return 1;
+    for (i = 0; i < jobs->len; i++) {
+        j = (size_t) cron_expr_hash(&jobs->streams[i].expr) & (len - 1);
+        while (table[j]) j = (j + 1) & (len - 1);
+        table[j] = i + 1;
+    }
+    free(jobs->table);
+    jobs->table = table;
+    jobs->table_len = len;
+    return 0;
+}
+
+static int add_duration(sim_stream* stream, uint32_t seconds) {
+    sim_duration* grown;
+    size_t i;
+    for (i = 0; i < stream->durations_len; i++) {
+        if (stream->durations[i].seconds == seconds) {
+            stream->durations[i].weight++;
+            return 0;
+        }
+    }
+    grown = (sim_duration*) realloc(stream->durations, (stream->durations_len + 1) * sizeof(sim_duration));
+    if (!grown) return 1;
+    stream->durations = grown;
+    stream->durations[stream->durations_len].seconds = seconds;
+    stream->durations[stream->durations_len].weight = 1;
+    stream->durations_len++;
+    return 0;
+}
+
+static int add_job(sim_jobs* jobs, const cron_expr* expr, uint32_t duration) {
+    sim_stream* stream;
+    size_t i;
+    if (2 * (jobs->len + 1) > jobs->table_len && 0 != grow_table(jobs)) return 1;
+    i = (size_t) cron_expr_hash(expr) & (jobs->table_len - 1);
+    while (jobs->table[i]) {
+        stream = &jobs->streams[jobs->table[i] - 1];
+        if (0 == memcmp(&stream->expr, expr, sizeof(cron_expr))) goto add_to_stream;
+        i = (i + 1) & (jobs->table_len - 1);
+    }
+    if (jobs->len == jobs->capacity) {
+        size_t capacity = jobs->capacity > 0 ? jobs->capacity * 2 : 1024;
+        sim_stream* grown = (sim_stream*) realloc(jobs->streams, capacity * sizeof(sim_stream));
+        if (!grown) return 1;
+        jobs->streams = grown;
+        jobs->capacity = capacity;
+    }
+    stream = &jobs->streams[jobs->len++];
+    memset(stream, 0, sizeof(sim_stream));
+    memcpy(&stream->expr, expr, sizeof(cron_expr));
+    jobs->table[i] = jobs->len;
+
+    add_to_stream:
+    stream->weight++;
+    jobs->jobs++;
+    return add_duration(stream, duration);
+}
+
+static void free_jobs(sim_jobs* jobs) {
+    size_t i;
+    for (i = 0; i < jobs->len; i++) {
+        free(jobs->streams[i].durations);
+    }
+    free(jobs->streams);
+    free(jobs->table);
+    memset(jobs, 0, sizeof(sim_jobs));
+}
+
+static int load_jobs(const char* path, sim_jobs* jobs) {
+    FILE* f = fopen(path, "r");
+    char line[SIM_LINE_LEN];
+    unsigned long line_num = 0;
+    if (!f) {
+        fprintf(stderr, "Cannot open job file: %s\n", path);
+        return 1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        char* start = line;
+        char* end;
+        char* last = NULL;
+        char* p;
+        int fields;
+        unsigned long duration = 1;
+        cron_expr expr;
+        const char* err = NULL;
+
+        line_num++;
+        while (isspace((unsigned char) *start)) start++;
+        end = start + strlen(start);
+        while (end > start && isspace((unsigned char) end[-1])) *--end = '\0';
+        if ('\0' == *start || '#' == *start) continue;
+        /* a seventh field is the duration */
+        fields = 0;
+        for (p = start; '\0' != *p; p++) {
+            if (!isspace((unsigned char) *p) && (p == start || isspace((unsigned char) p[-1]))) {
+                fields++;
+                last = p;
+            }
+        }
+        if (7 == fields) {
+            duration = strtoul(last, &p, 10);
+            if ('\0' != *p) duration = 0;
+            last[-1] = '\0';
+        }
+        cron_parse_expr_seeded(start, &expr, (uint32_t) line_num, &err);
+        if (err || duration < 1 || duration > SIM_MAX_DURATION) {
+            fprintf(stderr, "%s:%lu: invalid job: %s\n", path, line_num, err ? err : "invalid duration");
+            fclose(f);
+            return 1;
+        }
+        if (0 != add_job(jobs, &expr, (uint32_t) duration)) {
+            fclose(f);
+            return 1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int generate_jobs(unsigned long count, sim_jobs* jobs) {
+    unsigned long i;
+    for (i = 0; i < count; i++) {
+        cron_expr expr;
+        const char* err = NULL;
+        uint32_t seed = (uint32_t) (i + 1) * 2654435761u;
+        cron_parse_expr_seeded(GENERATED[i % ARRAY_LEN(GENERATED)], &expr, seed, &err);
+        if (err) {
+            fprintf(stderr, "Cannot parse '%s': %s\n", GENERATED[i % ARRAY_LEN(GENERATED)], err);
+            return 1;
+        }
+        if (0 != add_job(jobs, &expr, GENERATED_DURATIONS[(seed >> 8) % ARRAY_LEN(GENERATED_DURATIONS)])) return 1;
+    }
+    return 0;
+}
+
+/* min-heap of stream indices ordered by their next fire date */
+static void streams_down(size_t* heap, size_t len, const sim_stream* streams, size_t pos) {
+    size_t child;
+    size_t tmp;
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= len) return;
+        if (child + 1 < len && streams[heap[child + 1]].next < streams[heap[child]].next) child += 1;
+        if (streams[heap[child]].next >= streams[heap[pos]].next) return;
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+}
+
+/* min-heap of the end dates of running jobs */
+static void ends_up(sim_end* heap, size_t pos) {
+    sim_end tmp;
+    while (pos > 0 && heap[(pos - 1) / 2].time > heap[pos].time) {
+        tmp = heap[pos];
+        heap[pos] = heap[(pos - 1) / 2];
+        heap[(pos - 1) / 2] = tmp;
+        pos = (pos - 1) / 2;
+    }
+}
+
+static void ends_down(sim_end* heap, size_t len, size_t pos) {
+    size_t child;
+    sim_end tmp;
+    for (;;) {
+        child = 2 * pos + 1;
+        if (child >= len) return;
+        if (child + 1 < len && heap[child + 1].time < heap[child].time) child += 1;
+        if (heap[child].time >= heap[pos].time) return;
+        tmp = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = tmp;
+        pos = child;
+    }
+}
+
+static int push_end(sim_end** heap, size_t* len, size_t* capacity, time_t time, uint64_t weight) {
+    if (*len == *capacity) {
+        size_t grown_capacity = *capacity > 0 ? *capacity * 2 : 1024;
+        sim_end* grown = (sim_end*) realloc(*heap, grown_capacity * sizeof(sim_end));
+        if (!grown) return 1;
+        *heap = grown;
+        *capacity = grown_capacity;
+    }
+    (*heap)[*len].time = time;
+    (*heap)[*len].weight = weight;
+    ends_up(*heap, (*len)++);
+    return 0;
+}
+
+/* jobs ending at or before the date are not running any more */
+static void release_ends(sim_end* heap, size_t* len, uint64_t* running, time_t date) {
+    while (*len > 0 && heap[0].time <= date) {
+        *running -= heap[0].weight;
+        heap[0] = heap[--*len];
+        ends_down(heap, *len, 0);
+    }
+}
+
+static void print_interval(const sim_interval* in, int csv) {
+    char date[32];
+    bench_format_date(in->start, date, sizeof(date));
+    if (csv) {
+        printf("%s,%llu,%llu,%llu,%ld\n", date, (unsigned long long) in->fires, (unsigned long long) in->peak_second,
+                (unsigned long long) in->peak_running, (long) in->max_gap);
+    } else {
+        printf("%-20s %14llu %12llu %12llu %10ld\n", date, (unsigned long long) in->fires,
+                (unsigned long long) in->peak_second, (unsigned long long) in->peak_running, (long) in->max_gap);
+    }
+}
+
+static void close_interval(sim_interval* in, int csv) {
+    if (in->end - in->last_fire > in->max_gap) in->max_gap = in->end - in->last_fire;
+    print_interval(in, csv);
+}
+
+static void open_interval(sim_interval* in, time_t start, time_t end, uint64_t running) {
+    in->start = start;
+    in->end = end;
+    in->fires = 0;
+    in->peak_second = 0;
+    in->peak_running = running;
+    in->max_gap = 0;
+    in->last_fire = start;
+}
+
+int main(int argc, char** argv) {
+    const char* path = NULL;
+    unsigned long generate = 0;
+    long days = 365;
+    long interval = 86400;
+    int csv = 0;
+    time_t from = (time_t) bench_days_from_civil(2024, 1, 1) * 86400;
+    time_t to;
+    sim_jobs jobs;
+    size_t* heap;
+    size_t heap_len = 0;
+    sim_end* ends = NULL;
+    size_t ends_len = 0;
+    size_t ends_capacity = 0;
+    sim_interval in;
+    uint64_t running = 0;
+    uint64_t second_fires = 0;
+    time_t second = CRON_INVALID_INSTANT;
+    uint64_t fires = 0;
+    uint64_t searches = 0;
+    uint64_t peak_running = 0;
+    double start_ns;
+    double elapsed;
+    size_t i;
+
+    for (i = 1; i < (size_t) argc; i++) {
+        if (0 == strcmp(argv[i], "--from") && i + 1 < (size_t) argc) {
+            int y, m, d;
+            if (3 != sscanf(argv[++i], "%d-%d-%d", &y, &m, &d)) {
+                path = NULL;
+                generate = 0;
+                break;
+            }
+            from = (time_t) bench_days_from_civil(y, m, d) * 86400;
+        } else if (0 == strcmp(argv[i], "--days") && i + 1 < (size_t) argc) {
+            days = strtol(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--interval") && i + 1 < (size_t) argc) {
+            interval = strtol(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--generate") && i + 1 < (size_t) argc) {
+            generate = strtoul(argv[++i], NULL, 10);
+        } else if (0 == strcmp(argv[i], "--csv")) {
+            csv = 1;
+        } else if (!path && '-' != argv[i][0]) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            generate = 0;
+            break;
+        }
+    }
+    if ((!path && 0 == generate) || (path && generate > 0) || days < 1 || interval < 1) {
+        fprintf(stderr, "Usage: %s [--from YYYY-MM-DD] [--days N] [--interval SECONDS] [--csv] (--generate N | JOBS)\n", argv[0]);
+        return 2;
+    }
+    to = from + (time_t) days * 86400;
+
+    memset(&jobs, 0, sizeof(jobs));
+    if (0 != (path ? load_jobs(path, &jobs) : generate_jobs(generate, &jobs))) {
+        free_jobs(&jobs);
+        return 2;
+    }
+    heap = (size_t*) bench_malloc((jobs.len + 1) * sizeof(size_t));
+
+    start_ns = bench_now_ns();
+    for (i = 0; i < jobs.len; i++) {
+        sim_stream* stream = &jobs.streams[i];
+        stream->next = cron_next(&stream->expr, from - 1);
+        searches++;
+        if (CRON_INVALID_INSTANT != stream->next && stream->next < to) heap[heap_len++] = i;
+    }
+    for (i = heap_len / 2; i > 0; i--) {
+        streams_down(heap, heap_len, jobs.streams, i - 1);
+    }
+
+    if (csv) {
+        printf("interval,fires,peak_per_second,peak_running,max_gap\n");
+    } else {
+        printf("Jobs: %llu, streams: %lu, days: %ld, interval: %lds\n\n", (unsigned long long) jobs.jobs,
+                (unsigned long) jobs.len, days, interval);
+        printf("%-20s %14s %12s %12s %10s\n", "interval", "fires", "peak/s", "peak running", "max gap");
+    }
+    open_interval(&in, from, from + interval < to ? from + interval : to, 0);
+
+    while (heap_len > 0) {
+        sim_stream* stream = &jobs.streams[heap[0]];
+        time_t date = stream->next;
+
+        while (date >= in.end) {
+            close_interval(&in, csv);
+            release_ends(ends, &ends_len, &running, in.end);
+            open_interval(&in, in.end, in.end + interval < to ? in.end + interval : to, running);
+        }
+        release_ends(ends, &ends_len, &running, date);
+        running += stream->weight;
+        for (i = 0; i < stream->durations_len; i++) {
+            const sim_duration* duration = &stream->durations[i];
+            if (0 != push_end(&ends, &ends_len, &ends_capacity, date + (time_t) duration->seconds, duration->weight)) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        }
+
+        second_fires = date == second ? second_fires + stream->weight : stream->weight;
+        second = date;
+        if (second_fires > in.peak_second) in.peak_second = second_fires;
+        if (running > in.peak_running) in.peak_running = running;
+        if (running > peak_running) peak_running = running;
+        if (date - in.last_fire > in.max_gap) in.max_gap = date - in.last_fire;
+        in.last_fire = date;
+        in.fires += stream->weight;
+        fires += stream->weight;
+
+        stream->next = cron_next(&stream->expr, date);
+        searches++;
+        if (CRON_INVALID_INSTANT == stream->next || stream->next <= date || stream->next >= to) {
+            heap[0] = heap[--heap_len];
+        }
+        streams_down(heap, heap_len, jobs.streams, 0);
+    }
+    for (;;) {
+        close_interval(&in, csv);
+        if (in.end >= to) break;
+        release_ends(ends, &ends_len, &running, in.end);
+        open_interval(&in, in.end, in.end + interval < to ? in.end + interval : to, running);
+    }
+    elapsed = bench_now_ns() - start_ns;
+
+    fflush(stdout);
+    fprintf(stderr, "\nFires: %llu, peak running: %llu, simulated %ld days in %.2fs, %.0f searches/s\n",
+            (unsigned long long) fires, (unsigned long long) peak_running, days, elapsed / 1e9,
+            (double) searches * 1e9 / elapsed);
+
+    free(heap);
+    free(ends);
+    free_jobs(&jobs);
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_snapshot.c
+ *
+ * Snapshot files on POSIX mmap
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ccronexpr_snapshot.h"
+
+#ifndef CRON_TEST_MALLOC
+#define cron_malloc(x) malloc(x)
+#define cron_free(x) free(x)
+#else /* CRON_TEST_MALLOC */
+void* cron_malloc(size_t n);
+void cron_free(void* p);
+#endif /* CRON_TEST_MALLOC */
+
+int cron_sched_save(const cron_sched* sched, const char* path) {
+    size_t size;
+    size_t path_len;
+    char* tmp = NULL;
+    void* map = MAP_FAILED;
+    int fd = -1;
+    if (!sched || !path) return 1;
+    size = cron_sched_snapshot_size(sched);
+    path_len = strlen(path);
+    tmp = (char*) cron_malloc(path_len + 5);
+    if (!tmp) return 1;
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", 5);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) goto return_error;
+    if (0 != ftruncate(fd, (off_t) size)) goto return_error;
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == map) goto return_error;
+    if (size != cron_sched_snapshot(sched, map, size)) goto return_error;
+    if (0 != munmap(map, size)) {
+        map = MAP_FAILED;
+        goto return_error;
+    }
+    map = MAP_FAILED;
+    if (0 != fsync(fd)) goto return_error;
+    if (0 != close(fd)) {
+        fd = -1;
+        goto return_error;
+    }
+    fd = -1;
+    if (0 != rename(tmp, path)) goto return_error;
+    cron_free(tmp);
+    return 0;
+
+    return_error:
+    if (MAP_FAILED != map) munmap(map, size);
+    if (fd >= 0) close(fd);
+    unlink(tmp);
+    cron_free(tmp);
+    return 1;
+}
+
+int cron_sched_load(const char* path, time_t now, cron_sched* out, size_t* stale) {
+    struct stat st;
+    void* map;
+    int fd;
+    int res;
+    if (!path || !out) return 1;
+    fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    if (0 != fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return 1;
+    }
+    map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (MAP_FAILED == map) return 1;
+    res = cron_sched_restore(map, (size_t) st.st_size, now, out, stale);
+    munmap(map, (size_t) st.st_size);
+    return res;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_snapshot.h
+ *
+ * Snapshot files of the scheduler core, written and read through mmap.
+ */
+
+#ifndef CCRONEXPR_SNAPSHOT_H
+#define CCRONEXPR_SNAPSHOT_H
+
+#include "ccronexpr.h"
+#include "ccronexpr_sched.h"
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+extern "C" {
+#endif
+
+/**
+ * Writes the snapshot of the scheduler to a file. The snapshot is written
+ * to 'path' followed by '.tmp' first, then renamed, so a crash leaves the
+ * previous file in place.
+ *
+ * @param sched scheduler
+ * @param path file to write
+ * @return 0 on success, non-zero on error
+ */
+int cron_sched_save(const cron_sched* sched, const char* path);
+
+/**
+ * Restores a scheduler from a snapshot file mapped in memory, see
+ * 'cron_sched_restore'.
+ *
+ * @param path file written by 'cron_sched_save'
+ * @param now current date, jobs due at it are rescheduled after it
+ * @param out scheduler to initialize, must be released with 'cron_sched_free' on success
+ * @param stale number of rescheduled jobs, may be NULL
+ * @return 0 on success, non-zero if the file cannot be read or is invalid
+ */
+int cron_sched_load(const char* path, time_t now, cron_sched* out, size_t* stale);
+
+#if defined(__cplusplus) && !defined(CRON_COMPILE_AS_CXX)
+} /* extern "C"*/
+#endif
+
+#endif /* CCRONEXPR_SNAPSHOT_H */
@@ -0,0 +1,201 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_snapshot_test.c
+ *
+ * Tests of the snapshots of the scheduler core
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ccronexpr_snapshot.h"
+#include "ccronexpr_sched_test_util.h"
+
+#define JOBS 3000
+#define PATH "ccronexpr_snapshot_test.bin"
+
+static void assert_same(cron_sched* a, cron_sched* b) {
+    uint32_t i;
+    assert(a->count == b->count && a->jobs_len == b->jobs_len);
+    for (i = 0; i < a->jobs_len; i++) {
+        assert(cron_sched_contains(a, i) == cron_sched_contains(b, i));
+        assert(cron_sched_next(a, i) == cron_sched_next(b, i));
+    }
+    assert(cron_sched_peek(a) == cron_sched_peek(b));
+}
+
+// a restored scheduler goes on like the saved one, only the stale jobs are recomputed
+void test_round_trip(int backend) {
+    static cron_sched_fire expected[JOBS];
+    static cron_sched_fire actual[JOBS];
+    cron_sched sched;
+    cron_sched restored;
+    size_t stale = 1;
+    size_t len;
+    time_t now;
+    uint32_t i;
+    int res;
+    cron_sched_init_backend(&sched, backend);
+    for (i = 0; i < JOBS; i++) {
+        cron_expr expr;
+        test_parse_job(i, i, &expr);
+        res = cron_sched_add(&sched, i, &expr, FROM);
+        assert(0 == res);
+    }
+    for (now = FROM + 1; now < FROM + 2000; now += 7) {
+        test_pop_all(&sched, now, expected);
+    }
+    test_pop_all(&sched, now, expected);
+    for (i = 0; i < JOBS; i += 11) {
+        cron_sched_remove(&sched, i);
+    }
+    // saved and loaded as is
+    res = cron_sched_save(&sched, PATH);
+    assert(0 == res);
+    res = cron_sched_load(PATH, now, &restored, &stale);
+    assert(0 == res);
+    assert(0 == stale);
+    assert_same(&sched, &restored);
+    cron_sched_free(&restored);
+    // jobs due during the downtime are rescheduled after it
+    res = cron_sched_load(PATH, now + 600, &restored, &stale);
+    assert(0 == res);
+    len = test_pop_all(&sched, now + 600, expected);
+    assert(len > 0 && len < JOBS / 2 && stale == len);
+    assert_same(&sched, &restored);
+    for (now += 601; now < FROM + 6000; now += 13) {
+        size_t k;
+        size_t restored_len;
+        len = test_pop_all(&sched, now, expected);
+        restored_len = test_pop_all(&restored, now, actual);
+        assert(len == restored_len);
+        for (k = 0; k < len; k++) {
+            assert(expected[k].job_id == actual[k].job_id && expected[k].date == actual[k].date);
+        }
+    }
+    assert_same(&sched, &restored);
+    cron_sched_free(&restored);
+    cron_sched_free(&sched);
+}
+
+static void write_file(const uint8_t* data, size_t len) {
+    FILE* file = fopen(PATH, "wb");
+    size_t written;
+    assert(file);
+    written = fwrite(data, 1, len, file);
+    assert(len == written);
+    fclose(file);
+}
+
+// corrupted, truncated and foreign snapshots are rejected
+void test_invalid() {
+    cron_sched sched;
+    cron_sched restored;
+    cron_expr expr;
+    const char* err = NULL;
+    uint8_t* data;
+    size_t size;
+    uint32_t i;
+    size_t len;
+    int res;
+    cron_parse_expr("H/3 * * * * *", &expr, &err);
+    cron_sched_init_backend(&sched, CRON_SCHED_WHEEL);
+    for (i = 0; i < 100; i++) {
+        res = cron_sched_add(&sched, i, &expr, FROM);
+        assert(0 == res);
+    }
+    size = cron_sched_snapshot_size(&sched);
+    data = (uint8_t*) malloc(size);
+    len = cron_sched_snapshot(&sched, data, size - 1);
+    assert(0 == len);
+    len = cron_sched_snapshot(&sched, data, size);
+    assert(size == len);
+    res = cron_sched_restore(data, size, FROM, &restored, NULL);
+    assert(0 == res);
+    assert_same(&sched, &restored);
+    cron_sched_free(&restored);
+    res = cron_sched_restore(data, size - 8, FROM, &restored, NULL);
+    assert(0 != res);
+    res = cron_sched_restore(data, 16, FROM, &restored, NULL);
+    assert(0 != res);
+    // any changed byte fails the checksum
+    data[size / 2] ^= 1;
+    write_file(data, size);
+    res = cron_sched_load(PATH, FROM, &restored, NULL);
+    assert(0 != res);
+    assert(NULL == restored.exprs);
+    data[size / 2] ^= 1;
+    // other version of the format
+    data[8] ^= 0x80;
+    res = cron_sched_restore(data, size, FROM, &restored, NULL);
+    assert(0 != res);
+    data[8] ^= 0x80;
+    write_file(data, size / 2);
+    res = cron_sched_load(PATH, FROM, &restored, NULL);
+    assert(0 != res);
+    write_file(data, 0);
+    res = cron_sched_load(PATH, FROM, &restored, NULL);
+    assert(0 != res);
+    res = remove(PATH);
+    assert(0 == res);
+    res = cron_sched_load(PATH, FROM, &restored, NULL);
+    assert(0 != res);
+    free(data);
+    // two jobs claiming the same heap position
+    cron_sched_free(&sched);
+    cron_sched_init(&sched);
+    res = cron_sched_add(&sched, 0, &expr, FROM);
+    assert(0 == res);
+    cron_parse_expr("0 0 0 30 2 *", &expr, &err);
+    res = cron_sched_add(&sched, 1, &expr, FROM);
+    assert(0 == res);
+    assert(1 == sched.heap_len && CRON_SCHED_NONE == sched.positions[1]);
+    sched.positions[1] = 0;
+    size = cron_sched_snapshot_size(&sched);
+    data = (uint8_t*) malloc(size);
+    len = cron_sched_snapshot(&sched, data, size);
+    assert(size == len);
+    res = cron_sched_restore(data, size, FROM, &restored, NULL);
+    assert(0 != res);
+    sched.positions[1] = CRON_SCHED_NONE;
+    free(data);
+    // an empty scheduler
+    cron_sched_free(&sched);
+    cron_sched_init(&sched);
+    res = cron_sched_save(&sched, PATH);
+    assert(0 == res);
+    res = cron_sched_load(PATH, FROM, &restored, NULL);
+    assert(0 == res);
+    assert(0 == restored.count && CRON_INVALID_INSTANT == cron_sched_peek(&restored));
+    cron_sched_free(&restored);
+    cron_sched_free(&sched);
+}
+
+int main() {
+    test_round_trip(CRON_SCHED_HEAP);
+    test_round_trip(CRON_SCHED_WHEEL);
+    test_invalid();
+    remove(PATH);
+#ifdef CRON_TEST_MALLOC
+    assert(0 == test_allocations);
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}
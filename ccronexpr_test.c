@@ -29,6 +29,10 @@
 
 #include "ccronexpr.h"
 
+#if defined(CRON_USE_STATS) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 #define MAX_SECONDS 60
 #define CRON_MAX_MINUTES 60
 #define CRON_MAX_HOURS 24
@@ -71,6 +75,15 @@ uint8_t cron_get_bit(const uint8_t* rbyte, int idx);
 void cron_set_bit(uint8_t* rbyte, int idx);
 void cron_del_bit(uint8_t* rbyte, int idx);
 
+static int count_bits(const uint8_t* bits, int max) {
+    int i;
+    int res = 0;
+    for (i = 0; i < max; i++) {
+        res += cron_get_bit(bits, i);
+    }
+    return res;
+}
+
 static int crons_equal(cron_expr* cr1, cron_expr* cr2) {
     unsigned int i;
     for (i = 0; i < ARRAY_LEN(cr1->seconds); i++) {
@@ -109,6 +122,10 @@ static int crons_equal(cron_expr* cr1, cron_expr* cr2) {
             return 0;
         }
     }
+    if (0 != memcmp(cr1, cr2, sizeof(cron_expr))) {
+        printf("day modifiers not equal");
+        return 0;
+    }
     return 1;
 }
 
@@ -167,7 +184,15 @@ void poors_mans_strptime(const char* str, struct tm* cal) {
     cal->tm_isdst = -1;
 }
 
-typedef time_t (*cron_find_fn)(cron_expr*, time_t);
+time_t parse_date(const char* str) {
+    struct tm cal;
+    poors_mans_strptime(str, &cal);
+    time_t res = cron_mktime(&cal);
+    assert(-1 != res);
+    return res;
+}
+
+typedef time_t (*cron_find_fn)(const cron_expr*, time_t);
 
 void check_fn(cron_find_fn fn, const char* pattern, const char* initial, const char* expected, int line) {
     const char* err = NULL;
@@ -207,6 +232,12 @@ void check_same(const char* expr1, const char* expr2) {
     assert(crons_equal(&parsed1, &parsed2));
 }
 
+void check_same_expr(cron_expr* parsed1, const char* expr2) {
+    cron_expr parsed2;
+    cron_parse_expr(expr2, &parsed2, NULL);
+    assert(crons_equal(parsed1, &parsed2));
+}
+
 void check_calc_invalid() {
     cron_expr parsed;
     cron_parse_expr("0 0 0 31 6 *", &parsed, NULL);
@@ -215,6 +246,20 @@ void check_calc_invalid() {
     time_t dateinit = cron_mktime(&calinit);
     time_t res = cron_next(&parsed, dateinit);
     assert(CRON_INVALID_INSTANT == res);
+
+    // zeroed and partially parsed expressions never fire
+    memset(&parsed, 0, sizeof(parsed));
+    res = cron_next(&parsed, dateinit);
+    assert(CRON_INVALID_INSTANT == res);
+    res = cron_prev(&parsed, dateinit);
+    assert(CRON_INVALID_INSTANT == res);
+    const char* err = NULL;
+    cron_parse_expr("0 0 25 * * *", &parsed, &err);
+    assert(err);
+    res = cron_next(&parsed, dateinit);
+    assert(CRON_INVALID_INSTANT == res);
+    res = cron_prev(&parsed, dateinit);
+    assert(CRON_INVALID_INSTANT == res);
 }
 
 void check_expr_invalid(const char* expr) {
@@ -289,8 +334,12 @@ void test_expr() {
     check_fn(cron_next, "* * * * * *", "2020-12-31_23:59:59", "2021-01-01_00:00:00", __LINE__);
     check_fn(cron_next, "0 0 * * * *", "2020-02-28_23:00:00", "2020-02-29_00:00:00", __LINE__);
     check_fn(cron_next, "0 0 0 * * *", "2020-02-29_01:02:03", "2020-03-01_00:00:00", __LINE__);
+    check_fn(cron_next, "0,30 10 * * * *", "2012-07-01_10:05:20", "2012-07-01_10:10:00", __LINE__);
+    check_fn(cron_next, "12,49 * 7 * * *", "2012-01-06_04:39:36", "2012-01-06_07:00:12", __LINE__);
 
     check_fn(cron_prev, "* 15 11 * * *", "2019-03-09_11:43:00", "2019-03-09_11:15:59", __LINE__);
+    check_fn(cron_prev, "0,30 10 * * * *", "2012-07-01_10:15:40", "2012-07-01_10:10:30", __LINE__);
+    check_fn(cron_prev, "12,49 * 7 * * *", "2012-01-06_04:39:36", "2012-01-05_07:59:49", __LINE__);
     check_fn(cron_prev, "*/15 * 1-4 * * *", "2012-07-01_09:53:50", "2012-07-01_04:59:45", __LINE__);
     check_fn(cron_prev, "*/15 * 1-4 * * *", "2012-07-01_01:00:14", "2012-07-01_01:00:00", __LINE__);
     check_fn(cron_prev, "*/15 * 1-4 * * *", "2012-07-01_01:00:00", "2012-06-30_04:59:45", __LINE__);
@@ -299,6 +348,63 @@ void test_expr() {
     check_fn(cron_prev, "0 0 * * * *", "2020-02-29_00:00:00", "2020-02-28_23:00:00", __LINE__);
     check_fn(cron_prev, "0 0 0 * * *", "2020-03-01_00:00:00", "2020-02-29_00:00:00", __LINE__);
     check_fn(cron_prev, "0 0 * * * *", "2020-03-01_00:00:00", "2020-02-29_23:00:00", __LINE__);
+    check_fn(cron_prev, "0 30 23 30 4,7,10 SAT", "2012-07-01_09:53:50", "2011-07-30_23:30:00", __LINE__);
+    check_fn(cron_prev, "0 0 0 29 2 *", "2015-07-01_09:53:50", "2012-02-29_00:00:00", __LINE__);
+}
+
+void test_day_modifiers() {
+    check_fn(cron_next, "0 0 0 L * ?", "2012-02-10_00:00:00", "2012-02-29_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 L * ?", "2012-02-29_00:00:00", "2012-03-31_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 L 4 ?", "2012-02-29_00:00:00", "2012-04-30_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 L-2 * ?", "2012-02-10_00:00:00", "2012-02-27_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 l-30 * ?", "2012-02-10_00:00:00", "2012-03-01_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 LW * ?", "2012-09-01_00:00:00", "2012-09-28_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 LW * ?", "2012-06-01_00:00:00", "2012-06-29_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 15W * ?", "2012-09-01_00:00:00", "2012-09-14_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 15W * ?", "2012-07-01_00:00:00", "2012-07-16_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 1W * ?", "2012-08-31_12:00:00", "2012-09-03_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 30W * ?", "2012-09-01_00:00:00", "2012-09-28_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 31W * ?", "2012-09-01_00:00:00", "2012-10-31_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 1,L * ?", "2012-02-10_00:00:00", "2012-02-29_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 1,L * ?", "2012-02-29_00:00:00", "2012-03-01_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * 5#3", "2012-07-01_00:00:00", "2012-07-20_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * FRI#5", "2012-07-01_00:00:00", "2012-08-31_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * SUN#1,SAT#1", "2012-07-02_00:00:00", "2012-07-07_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * 7#1", "2012-07-02_00:00:00", "2012-08-05_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * 5L", "2012-07-01_00:00:00", "2012-07-27_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * friL", "2012-07-27_00:00:00", "2012-08-31_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * L", "2012-07-01_00:00:00", "2012-07-07_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 ? * MON,5L", "2012-07-24_00:00:00", "2012-07-27_00:00:00", __LINE__);
+    check_fn(cron_next, "0 0 0 13 * 5#2", "2012-07-14_00:00:00", "2013-09-13_00:00:00", __LINE__);
+    check_fn(cron_next, "0 15 10 ? * 1#2", "2012-10-08_10:15:00", "2012-11-12_10:15:00", __LINE__);
+
+    check_fn(cron_prev, "0 0 0 L * ?", "2012-03-15_00:00:00", "2012-02-29_00:00:00", __LINE__);
+    check_fn(cron_prev, "0 0 0 LW * ?", "2012-10-01_00:00:00", "2012-09-28_00:00:00", __LINE__);
+    check_fn(cron_prev, "0 0 0 15W * ?", "2012-10-01_00:00:00", "2012-09-14_00:00:00", __LINE__);
+    check_fn(cron_prev, "0 0 0 ? * 5#3", "2012-07-01_00:00:00", "2012-06-15_00:00:00", __LINE__);
+    check_fn(cron_prev, "0 0 0 ? * 5L", "2012-07-27_00:00:00", "2012-06-29_00:00:00", __LINE__);
+
+    /* the last friday is never earlier than the 22nd */
+    cron_expr parsed;
+    time_t res;
+    cron_parse_expr("0 0 0 13 * 5L", &parsed, NULL);
+    res = cron_next(&parsed, parse_date("2012-07-01_00:00:00"));
+    assert(CRON_INVALID_INSTANT == res);
+    res = cron_prev(&parsed, parse_date("2012-07-01_00:00:00"));
+    assert(CRON_INVALID_INSTANT == res);
+
+    check_expr_invalid("0 0 0 L-31 * ?");
+    check_expr_invalid("0 0 0 32W * ?");
+    check_expr_invalid("0 0 0 0W * ?");
+    check_expr_invalid("0 0 0 XW * ?");
+    check_expr_invalid("0 0 0 L-* * ?");
+    check_expr_invalid("0 0 0 WL * ?");
+    check_expr_invalid("0 0 0 ? * 5#6");
+    check_expr_invalid("0 0 0 ? * 5#0");
+    check_expr_invalid("0 0 0 ? * #3");
+    check_expr_invalid("0 0 0 ? * 5#");
+    check_expr_invalid("0 0 0 ? * 8L");
+    check_expr_invalid("0 0 0 ? * 1-5L");
 }
 
 void test_parse() {
@@ -313,6 +419,8 @@ void test_parse() {
     check_same("* * * * 1-12 *", "* * * * FEB,JAN,MAR,APR,MAY,JUN,JUL,AUG,SEP,OCT,NOV,DEC *");
     check_same("* * * * 2 *", "* * * * Feb *");
     check_same("*  *  * *  1 *", "* * * * 1 *");
+    check_same("0 0 0 1 */2147483647 *", "0 0 0 1 1 *");
+    check_same("0 0 0 1 1-12/2147483646 *", "0 0 0 1 1 *");
 
     check_expr_invalid("77 * * * * *");
     check_expr_invalid("44-77 * * * * *");
@@ -368,17 +476,842 @@ void test_bits() {
     assert(!err);
 }
 
+#ifndef CRON_FREESTANDING
+void test_timeline() {
+    cron_expr exprs[3];
+    uint32_t ids[3] = { 7, 42, 3 };
+    cron_timeline tl;
+    cron_timeline loaded;
+    cron_timeline_iter it;
+    time_t from = parse_date("2012-07-01_00:00:00");
+    time_t to = parse_date("2012-07-02_00:00:00");
+    time_t date;
+    time_t prev;
+    time_t expected;
+    uint32_t id;
+    size_t n;
+    uint8_t huge[40];
+    int found;
+    int res;
+#ifdef CRON_TEST_MALLOC
+    int allocations = cronAllocations;
+#endif
+
+    cron_parse_expr("0 */15 * * * *", &exprs[0], NULL);
+    cron_parse_expr("0 0 */2 * * *", &exprs[1], NULL);
+    cron_parse_expr("*/20 * 10 * * *", &exprs[2], NULL);
+
+    /* single expression matches the cron_next chain */
+    res = cron_timeline_build(&exprs[0], from, to, &tl);
+    assert(0 == res);
+    assert(96 == tl.count);
+    assert(!tl.merged);
+    cron_timeline_begin(&tl, &it);
+    expected = from;
+    n = 0;
+    while (cron_timeline_next(&it, &date, &id)) {
+        assert(expected == date);
+        assert(0 == id);
+        expected = cron_next(&exprs[0], date);
+        n++;
+    }
+    assert(96 == n);
+
+    cron_timeline_seek(&tl, parse_date("2012-07-01_10:07:00"), &it);
+    found = cron_timeline_next(&it, &date, NULL);
+    assert(found);
+    assert(parse_date("2012-07-01_10:15:00") == date);
+    cron_timeline_seek(&tl, parse_date("2012-07-01_10:15:00"), &it);
+    found = cron_timeline_next(&it, &date, NULL);
+    assert(found);
+    assert(parse_date("2012-07-01_10:30:00") == date);
+    cron_timeline_seek(&tl, from - 1, &it);
+    found = cron_timeline_next(&it, &date, NULL);
+    assert(found);
+    assert(from == date);
+    cron_timeline_seek(&tl, parse_date("2012-07-01_23:45:00"), &it);
+    found = cron_timeline_next(&it, &date, NULL);
+    assert(!found);
+    cron_timeline_free(&tl);
+
+    /* merged timeline is ordered and contains every occurrence */
+    res = cron_timeline_build_merged(exprs, ids, 3, from, to, &tl);
+    assert(0 == res);
+    assert(96 + 12 + 180 == tl.count);
+    assert(tl.merged);
+    cron_timeline_begin(&tl, &it);
+    prev = from;
+    n = 0;
+    while (cron_timeline_next(&it, &date, &id)) {
+        assert(date >= prev);
+        assert(7 == id || 42 == id || 3 == id);
+        expected = cron_next(&exprs[7 == id ? 0 : 42 == id ? 1 : 2], date - 1);
+        assert(expected == date);
+        if (date == prev && n > 0) {
+            /* ties are ordered as the input expressions */
+            assert(7 != id);
+        }
+        prev = date;
+        n++;
+    }
+    assert(tl.count == n);
+
+    /* serialized buffer round trip */
+    res = cron_timeline_load(tl.data, tl.len, &loaded);
+    assert(0 == res);
+    assert(loaded.count == tl.count);
+    cron_timeline_seek(&loaded, parse_date("2012-07-01_10:00:00"), &it);
+    found = cron_timeline_next(&it, &date, &id);
+    assert(found);
+    assert(parse_date("2012-07-01_10:00:20") == date);
+    assert(3 == id);
+    cron_timeline_free(&loaded);
+    res = cron_timeline_load(tl.data, tl.len - 1, &loaded);
+    assert(0 != res);
+    res = cron_timeline_load(tl.data, 10, &loaded);
+    assert(0 != res);
+    /* a delta that would overflow the date, after the 30 bytes of the header with a count of 1 */
+    memcpy(huge, tl.data, 30);
+    memset(huge + 22, 0, 8);
+    huge[22] = 1;
+    memset(huge + 30, 0xff, 8);
+    huge[38] = 0x7f;
+    huge[39] = 0;
+    res = cron_timeline_load(huge, sizeof(huge), &loaded);
+    assert(0 != res);
+    cron_timeline_free(&tl);
+
+    /* empty range */
+    res = cron_timeline_build(&exprs[0], to, from, &tl);
+    assert(0 == res);
+    assert(0 == tl.count);
+    cron_timeline_begin(&tl, &it);
+    found = cron_timeline_next(&it, &date, NULL);
+    assert(!found);
+    cron_timeline_free(&tl);
+
+#ifdef CRON_TEST_MALLOC
+    assert(allocations == cronAllocations);
+#endif
+}
+
+void check_histogram(const char** patterns, size_t len, const char* from_str, time_t range, unsigned int bucket) {
+    cron_expr exprs[16];
+    uint64_t counts[2000];
+    uint64_t expected[2000];
+    time_t from = parse_date(from_str);
+    time_t to = from + range;
+    size_t buckets = (size_t) ((range + bucket - 1) / bucket);
+    size_t i;
+    int res;
+    assert(len <= ARRAY_LEN(exprs) && buckets <= ARRAY_LEN(counts));
+
+    memset(expected, 0, sizeof(expected));
+    for (i = 0; i < len; i++) {
+        cron_parse_expr(patterns[i], &exprs[i], NULL);
+        for (time_t date = cron_next(&exprs[i], from - 1); CRON_INVALID_INSTANT != date && date < to; date = cron_next(&exprs[i], date)) {
+            expected[(date - from) / bucket] += 1;
+        }
+    }
+    memset(counts, 0, sizeof(counts));
+    res = cron_load_histogram(exprs, len, from, to, bucket, counts);
+    assert(0 == res);
+    for (i = 0; i < buckets; i++) {
+        if (expected[i] != counts[i]) {
+            printf("Histogram bucket %u: expected %llu, actual %llu\n", (unsigned) i,
+                    (unsigned long long) expected[i], (unsigned long long) counts[i]);
+            assert(0);
+        }
+    }
+}
+
+void test_histogram() {
+    const char* patterns[] = {
+        "0 0 * * * *",
+        "0 */15 * * * *",
+        "*/7 5-10 3,4 * * *",
+        "0 30 23 * * MON-FRI",
+        "* * 12 1,15 * *",
+        "0 0 0 29 2 *",
+        "0 0 7 ? * SUN",
+        "13 * * * * *",
+        "0 */15 * * * *",
+        "0 0 * * * *",
+        "0 0 12 L * ?",
+        "0 0 9 ? * 1#1",
+        "0 0 9 LW * ?"
+    };
+    uint64_t counts[24];
+    cron_expr* every_second;
+    size_t i;
+    int res;
+
+    check_histogram(patterns, ARRAY_LEN(patterns), "2012-07-01_00:00:00", 86400, 60);
+    check_histogram(patterns, ARRAY_LEN(patterns), "2012-07-01_00:00:00", 86400, 3600);
+    check_histogram(patterns, ARRAY_LEN(patterns), "2012-02-28_22:10:17", 2 * 86400, 97);
+    check_histogram(patterns, ARRAY_LEN(patterns), "2012-07-01_10:53:50", 7 * 86400, 600);
+    check_histogram(patterns, ARRAY_LEN(patterns), "2012-07-01_03:04:00", 1000, 1);
+
+    /* counts are accumulated */
+    cron_expr expr;
+    cron_parse_expr("0 0 * * * *", &expr, NULL);
+    memset(counts, 0, sizeof(counts));
+    res = cron_load_histogram(&expr, 1, parse_date("2012-07-01_00:00:00"), parse_date("2012-07-02_00:00:00"), 3600, counts);
+    assert(0 == res);
+    res = cron_load_histogram(&expr, 1, parse_date("2012-07-01_00:00:00"), parse_date("2012-07-02_00:00:00"), 3600, counts);
+    assert(0 == res);
+    assert(2 == counts[0] && 2 == counts[23]);
+    res = cron_load_histogram(&expr, 1, 0, 100, 0, counts);
+    assert(0 != res);
+
+    /* a day-wide bucket of many every second jobs does not fit 32 bits */
+    every_second = (cron_expr*) malloc(50000 * sizeof(cron_expr));
+    assert(every_second);
+    cron_parse_expr("* * * * * *", &every_second[0], NULL);
+    for (i = 1; i < 50000; i++) {
+        memcpy(&every_second[i], &every_second[0], sizeof(cron_expr));
+    }
+    memset(counts, 0, sizeof(counts));
+    res = cron_load_histogram(every_second, 50000, parse_date("2012-07-01_00:00:00"), parse_date("2012-07-03_00:00:00"), 86400, counts);
+    assert(0 == res);
+    assert(50000ULL * 86400 == counts[0] && 50000ULL * 86400 == counts[1]);
+    free(every_second);
+}
+
+#endif
+
+void check_common(const char* pattern1, const char* pattern2, const char* initial, const char* expected_next, const char* expected_prev) {
+    cron_expr a;
+    cron_expr b;
+    cron_parse_expr(pattern1, &a, NULL);
+    cron_parse_expr(pattern2, &b, NULL);
+    time_t date = parse_date(initial);
+    time_t next = cron_next_common(&a, &b, date);
+    time_t prev = cron_prev_common(&a, &b, date);
+    assert((expected_next ? parse_date(expected_next) : CRON_INVALID_INSTANT) == next);
+    assert((expected_prev ? parse_date(expected_prev) : CRON_INVALID_INSTANT) == prev);
+    /* same as filtering the occurrences of one expression by the other */
+    if (next != CRON_INVALID_INSTANT) {
+        time_t brute = cron_next(&a, date);
+        while (cron_next(&b, brute - 1) != brute) {
+            brute = cron_next(&a, brute);
+        }
+        assert(brute == next);
+    }
+}
+
+void test_intersect() {
+    cron_expr a;
+    cron_expr b;
+    cron_expr common;
+    int res;
+
+    check_common("0 */15 * * * *", "0 0,20,40 * * * *", "2012-07-01_09:53:50", "2012-07-01_10:00:00", "2012-07-01_09:00:00");
+    check_common("*/10 * * * * *", "*/15 * * * * *", "2012-07-01_09:53:50", "2012-07-01_09:54:00", "2012-07-01_09:53:30");
+    check_common("0 0 7 ? * MON-FRI", "0 0 7 1 * *", "2012-07-01_09:53:50", "2012-08-01_07:00:00", "2012-06-01_07:00:00");
+    check_common("0 0 12 * * MON", "0 0 12 13 * *", "2012-07-01_09:53:50", "2012-08-13_12:00:00", "2012-02-13_12:00:00");
+    check_common("0 0 * * * *", "30 * * * * *", "2012-07-01_09:53:50", NULL, NULL);
+
+    check_common("0 0 0 31 * *", "0 0 0 * 2 *", "2012-07-01_09:53:50", NULL, NULL);
+    check_common("0 0 0 L * ?", "0 0 0 * * FRI", "2012-07-01_09:53:50", "2012-08-31_00:00:00", "2011-09-30_00:00:00");
+    check_common("0 0 0 L * ?", "0 0 0 15W * ?", "2012-07-01_09:53:50", NULL, NULL);
+    check_common("0 0 0,12 LW * ?", "0 0 12 ? * 5L", "2012-07-01_09:53:50", "2012-08-31_12:00:00", "2012-06-29_12:00:00");
+    check_common("0 0 * L * ?", "0 0 0 * * *", "2012-07-01_09:53:50", "2012-07-31_00:00:00", "2012-06-30_00:00:00");
+
+    /* both non-empty but never fire at the same date */
+    cron_parse_expr("0 0 0 31 * *", &a, NULL);
+    cron_parse_expr("0 0 0 * 2 *", &b, NULL);
+    res = cron_expr_intersect(&a, &b, &common);
+    assert(1 == res);
+
+    /* day modifiers are kept if the other expression fires on every day */
+    cron_parse_expr("0 0 * L * ?", &a, NULL);
+    cron_parse_expr("0 0 0 * * *", &b, NULL);
+    res = cron_expr_intersect(&a, &b, &common);
+    assert(1 == res);
+    check_same_expr(&common, "0 0 0 L * ?");
+    cron_parse_expr("0 0 0 * * FRI", &b, NULL);
+    res = cron_expr_intersect(&a, &b, &common);
+    assert(-1 == res);
+
+    cron_parse_expr("0 0 * * * *", &a, NULL);
+    cron_parse_expr("30 * * * * *", &b, NULL);
+    res = cron_expr_intersect(&a, &b, &common);
+    assert(0 == res);
+    cron_parse_expr("0 */2 1-4 * * *", &b, NULL);
+    res = cron_expr_intersect(&a, &b, &a);
+    assert(1 == res);
+    check_same_expr(&a, "0 0 1-4 * * *");
+}
+
+void check_ms(int64_t (*fn)(const cron_expr*, int64_t), const cron_expr* parsed, int64_t date, int64_t expected) {
+    int64_t res = fn(parsed, date);
+    assert(expected == res);
+}
+
+void test_ms() {
+    cron_expr parsed;
+    const char* err = NULL;
+    int64_t date;
+    cron_parse_expr("0 * * * * *", &parsed, &err);
+    assert(!err);
+    date = (int64_t) parse_date("2012-07-01_09:53:00") * 1000;
+
+    /* exactly at a 'fire' date */
+    check_ms(cron_next_ms, &parsed, date, date + 60000);
+    check_ms(cron_prev_ms, &parsed, date, date - 60000);
+    /* within the second of a 'fire' date */
+    check_ms(cron_next_ms, &parsed, date + 1, date + 60000);
+    check_ms(cron_prev_ms, &parsed, date + 1, date);
+    check_ms(cron_prev_ms, &parsed, date + 999, date);
+    /* just before a 'fire' date */
+    check_ms(cron_next_ms, &parsed, date - 1, date);
+    check_ms(cron_prev_ms, &parsed, date - 1, date - 60000);
+    /* consistent with whole seconds */
+    check_ms(cron_next_ms, &parsed, date + 30500, (int64_t) cron_next(&parsed, (time_t) (date / 1000) + 30) * 1000);
+
+#ifndef CRON_USE_LOCAL_TIME
+    /* negative dates are rounded down */
+    check_ms(cron_next_ms, &parsed, -1001, 0);
+    check_ms(cron_prev_ms, &parsed, -59999, -60000);
+    check_ms(cron_prev_ms, &parsed, 1, 0);
+#endif
+}
+
+/* dates in UTC regardless of CRON_USE_LOCAL_TIME */
+time_t parse_utc(const char* str) {
+    struct tm cal;
+    poors_mans_strptime(str, &cal);
+    int y = cal.tm_year + 1900 - (cal.tm_mon < 2 ? 1 : 0);
+    int m = cal.tm_mon + 1;
+    int era = (y >= 0 ? y : y - 399) / 400;
+    int yoe = y - era * 400;
+    int doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + cal.tm_mday - 1;
+    long days = (long) era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    return (time_t) (days * 86400 + cal.tm_hour * 3600 + cal.tm_min * 60 + cal.tm_sec);
+}
+
+/* TZif version 2 data with an empty version 1 block */
+size_t make_tzif(uint8_t* buf, const int64_t* transitions, size_t count, int32_t initial, int32_t offset, const char* rule) {
+    uint8_t header[44] = { 'T', 'Z', 'i', 'f', '2' };
+    size_t len = 0;
+    size_t i;
+    size_t j;
+    /* typecnt 1, charcnt 1 */
+    header[39] = 1;
+    header[43] = 1;
+    memcpy(buf, header, 44);
+    len = 44;
+    memset(buf + len, 0, 7);
+    len += 7;
+    header[35] = (uint8_t) count;
+    header[39] = 2;
+    memcpy(buf + len, header, 44);
+    len += 44;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 8; j++) {
+            buf[len++] = (uint8_t) ((uint64_t) transitions[i] >> (56 - j * 8));
+        }
+    }
+    /* alternate between the two time types */
+    for (i = 0; i < count; i++) {
+        buf[len++] = (uint8_t) (i % 2 == 0 ? 1 : 0);
+    }
+    for (i = 0; i < 2; i++) {
+        uint32_t off = (uint32_t) (0 == i ? initial : offset);
+        for (j = 0; j < 4; j++) {
+            buf[len++] = (uint8_t) (off >> (24 - j * 8));
+        }
+        buf[len++] = (uint8_t) i;
+        buf[len++] = 0;
+    }
+    buf[len++] = 0;
+    buf[len++] = '\n';
+    memcpy(buf + len, rule, strlen(rule));
+    len += strlen(rule);
+    buf[len++] = '\n';
+    return len;
+}
+
+void check_tz(const cron_zone* zone, const char* pattern, const char* initial, const char* expected_next, const char* expected_prev) {
+    cron_expr parsed;
+    const char* err = NULL;
+    cron_parse_expr(pattern, &parsed, &err);
+    assert(!err);
+    for (int forward = 1; forward >= 0; forward--) {
+        const char* expected = forward ? expected_next : expected_prev;
+        time_t res = forward ? cron_next_tz(&parsed, zone, parse_utc(initial)) : cron_prev_tz(&parsed, zone, parse_utc(initial));
+        if (expected && res != parse_utc(expected)) {
+            char buffer[21];
+            memset(buffer, 0, sizeof(buffer));
+            strftime(buffer, 20, DATE_FORMAT, gmtime(&res));
+            printf("Pattern: %s\n", pattern);
+            printf("Initial: %s\n", initial);
+            printf("Expected %s: %s\n", forward ? "next" : "prev", expected);
+            printf("Actual: %s\n", buffer);
+            assert(0);
+        }
+    }
+}
+
+void check_new_york(const cron_zone* zone) {
+    /* 2021-03-14 02:00 EST -> 03:00 EDT, 2021-11-07 02:00 EDT -> 01:00 EST, all dates in UTC */
+    check_tz(zone, "0 0 12 * * *", "2021-07-01_00:00:00", "2021-07-01_16:00:00", "2021-06-30_16:00:00");
+    check_tz(zone, "0 0 12 * * *", "2021-12-01_00:00:00", "2021-12-01_17:00:00", "2021-11-30_17:00:00");
+    /* gap */
+    check_tz(zone, "0 30 2 * * *", "2021-03-14_05:00:00", "2021-03-14_07:30:00", "2021-03-13_07:30:00");
+    check_tz(zone, "0 30 2 * * *", "2021-03-14_07:30:00", "2021-03-15_06:30:00", "2021-03-13_07:30:00");
+    check_tz(zone, "0 30 2 * * *", "2021-03-14_07:10:00", "2021-03-14_07:30:00", "2021-03-13_07:30:00");
+    check_tz(zone, "0 30 2 * * *", "2021-03-14_07:40:00", "2021-03-15_06:30:00", "2021-03-14_07:30:00");
+    check_tz(zone, "0 10,50 2,3 * * *", "2021-03-14_06:55:00", "2021-03-14_07:10:00", "2021-03-13_08:50:00");
+    check_tz(zone, "0 10,50 2,3 * * *", "2021-03-14_07:20:00", "2021-03-14_07:50:00", "2021-03-14_07:10:00");
+    check_tz(zone, "0 * * * * *", "2021-03-14_06:59:30", "2021-03-14_07:00:00", "2021-03-14_06:59:00");
+    /* overlap */
+    check_tz(zone, "0 30 1 * * *", "2021-11-07_04:00:00", "2021-11-07_05:30:00", "2021-11-06_05:30:00");
+    check_tz(zone, "0 30 1 * * *", "2021-11-07_05:30:00", "2021-11-08_06:30:00", "2021-11-06_05:30:00");
+    check_tz(zone, "0 30 1 * * *", "2021-11-07_06:45:00", "2021-11-08_06:30:00", "2021-11-07_05:30:00");
+    check_tz(zone, "0 0 * * * *", "2021-11-07_05:30:00", "2021-11-07_07:00:00", "2021-11-07_05:00:00");
+    check_tz(zone, "0 0 * * * *", "2021-11-07_06:30:00", "2021-11-07_07:00:00", "2021-11-07_05:00:00");
+}
+
+void test_tz() {
+#ifndef CRON_FREESTANDING
+    uint8_t buf[512];
+    size_t len;
+    cron_zone file_zone;
+#endif
+    cron_zone zone;
+    cron_expr parsed;
+    const char* err = NULL;
+    int i;
+    int res;
+
+#ifndef CRON_FREESTANDING
+    /* rule only */
+    len = make_tzif(buf, NULL, 0, -18000, -18000, "EST5EDT,M3.2.0,M11.1.0");
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 == res);
+    check_new_york(&zone);
+    if (0 == cron_zone_load_file("America/New_York", &file_zone)) {
+        check_new_york(&file_zone);
+        cron_parse_expr("0 0 9 * * MON-FRI", &parsed, &err);
+        for (i = 0; i < 1000; i++) {
+            time_t date = parse_utc("2020-01-01_00:00:00") + i * 86400 * 3 / 2;
+            time_t next = cron_next_tz(&parsed, &zone, date);
+            time_t prev = cron_prev_tz(&parsed, &zone, date);
+            time_t file_next = cron_next_tz(&parsed, &file_zone, date);
+            time_t file_prev = cron_prev_tz(&parsed, &file_zone, date);
+            assert(next == file_next && prev == file_prev);
+        }
+        cron_zone_free(&file_zone);
+    }
+    cron_zone_free(&zone);
+
+    /* explicit transitions: 2021-03-28 01:00 UTC CET -> CEST, 2021-10-31 01:00 UTC CEST -> CET */
+    {
+        int64_t transitions[] = { 1616893200, 1635642000 };
+        len = make_tzif(buf, transitions, 2, 3600, 7200, "");
+        res = cron_zone_load(buf, len, &zone);
+        assert(0 == res);
+        assert(2 == zone.count);
+        check_tz(&zone, "0 30 2 * * *", "2021-03-28_00:00:00", "2021-03-28_01:30:00", "2021-03-27_01:30:00");
+        check_tz(&zone, "0 30 2 * * *", "2021-10-31_00:00:00", "2021-10-31_00:30:00", "2021-10-30_00:30:00");
+        check_tz(&zone, "0 30 2 * * *", "2021-10-31_01:00:00", "2021-11-01_01:30:00", "2021-10-31_00:30:00");
+        check_tz(&zone, "0 0 0 1 1 *", "2021-06-01_00:00:00", "2021-12-31_23:00:00", "2020-12-31_23:00:00");
+        cron_zone_free(&zone);
+    }
+
+    /* southern hemisphere: 2021-10-03 02:00 AEST -> 03:00 AEDT, 2022-04-03 03:00 AEDT -> 02:00 AEST */
+    len = make_tzif(buf, NULL, 0, 36000, 36000, "AEST-10AEDT,M10.1.0,M4.1.0/3");
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 == res);
+    check_tz(&zone, "0 0 12 * * *", "2021-07-01_00:00:00", "2021-07-01_02:00:00", "2021-06-30_02:00:00");
+    check_tz(&zone, "0 0 12 * * *", "2022-01-15_00:00:00", "2022-01-15_01:00:00", "2022-01-14_01:00:00");
+    check_tz(&zone, "0 30 2 * * *", "2021-10-02_15:00:00", "2021-10-02_16:30:00", "2021-10-01_16:30:00");
+    check_tz(&zone, "0 30 2 * * *", "2022-04-02_15:00:00", "2022-04-02_15:30:00", "2022-04-01_15:30:00");
+    check_tz(&zone, "0 30 2 * * *", "2022-04-02_16:00:00", "2022-04-03_16:30:00", "2022-04-02_15:30:00");
+    cron_zone_free(&zone);
+
+    /* half hour shift: 2022-10-02 02:00 +1030 -> 02:30 +11 */
+    len = make_tzif(buf, NULL, 0, 37800, 37800, "<+1030>-10:30<+11>-11,M10.1.0,M4.1.0");
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 == res);
+    check_tz(&zone, "0 */7 * * * *", "2022-10-01_16:00:00", "2022-10-01_16:07:00", "2022-10-01_15:58:00");
+    check_tz(&zone, "0 */7 * * * *", "2022-10-01_15:56:00", "2022-10-01_15:58:00", "2022-10-01_15:51:00");
+    cron_zone_free(&zone);
+
+    /* fixed offset with angle bracket names */
+    len = make_tzif(buf, NULL, 0, 0, 0, "<+0530>-5:30");
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 == res);
+    assert(0 == zone.count && 19800 == zone.initial_offset);
+    check_tz(&zone, "0 0 12 * * *", "2021-07-01_00:00:00", "2021-07-01_06:30:00", "2021-06-30_06:30:00");
+    cron_zone_free(&zone);
+
+#endif
+
+    /* fixed offsets */
+    res = cron_zone_fixed(-5 * 3600, &zone);
+    assert(0 == res);
+    check_tz(&zone, "0 30 2 * * *", "2021-03-14_05:00:00", "2021-03-14_07:30:00", "2021-03-13_07:30:00");
+    check_tz(&zone, "0 0 0 1 1 *", "2021-06-01_00:00:00", "2022-01-01_05:00:00", "2021-01-01_05:00:00");
+    res = cron_zone_fixed(0, &zone);
+    assert(0 == res);
+    cron_parse_expr("0 0 9 * * MON-FRI", &parsed, &err);
+    for (i = 0; i < 1000; i++) {
+        time_t date = parse_utc("2020-01-01_00:00:00") + i * 86400 * 3 / 2 + i;
+        time_t next = cron_next_tz(&parsed, &zone, date);
+        time_t prev = cron_prev_tz(&parsed, &zone, date);
+        assert(next > date && prev < date && next - prev <= 4 * 86400);
+        assert(32400 == next % 86400 && 32400 == prev % 86400);
+#ifndef CRON_USE_LOCAL_TIME
+        time_t utc_next = cron_next(&parsed, date);
+        time_t utc_prev = cron_prev(&parsed, date);
+        assert(next == utc_next && prev == utc_prev);
+#endif
+    }
+    res = cron_zone_fixed(26 * 3600, &zone);
+    assert(0 != res);
+    res = cron_zone_fixed(-26 * 3600, &zone);
+    assert(0 != res);
+
+#ifndef CRON_FREESTANDING
+    /* malformed data */
+    len = make_tzif(buf, NULL, 0, -18000, -18000, "EST5EDT,M3.2.0,M11.1.0");
+    res = cron_zone_load(buf, len - 1, &zone);
+    assert(0 != res);
+    res = cron_zone_load(buf, 40, &zone);
+    assert(0 != res);
+    len = make_tzif(buf, NULL, 0, -18000, -18000, "EST5EDT,M3.2.0");
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 != res);
+    len = make_tzif(buf, NULL, 0, -18000, -18000, "5EDT");
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 != res);
+    buf[0] = 'X';
+    res = cron_zone_load(buf, len, &zone);
+    assert(0 != res);
+    res = cron_zone_load_file("../etc/passwd", &zone);
+    assert(0 != res);
+    res = cron_zone_load_file("No/Such_Zone", &zone);
+    assert(0 != res);
+#endif
+}
+
+void check_hashed_invalid(const char* expr) {
+    const char* err = NULL;
+    cron_expr test;
+    cron_parse_expr_seeded(expr, &test, 42, &err);
+    assert(err);
+}
+
+void test_hashed() {
+    cron_expr expr1;
+    cron_expr expr2;
+    const char* err = NULL;
+    int seen[CRON_MAX_MINUTES];
+    int distinct = 0;
+    int outside;
+    int steps;
+    uint32_t seed;
+    uint32_t hash;
+    int i;
+
+    /* stable for the same seed */
+    cron_parse_expr_seeded("H H H H H H", &expr1, 12345, &err);
+    assert(!err);
+    cron_parse_expr_seeded("H H H H H H", &expr2, 12345, &err);
+    assert(crons_equal(&expr1, &expr2));
+    /* and the same on every platform */
+    check_same_expr(&expr1, "25 24 18 10 10 2");
+    cron_parse_expr("H 0 0 * * *", &expr1, NULL);
+    cron_parse_expr_seeded("H 0 0 * * *", &expr2, 0, NULL);
+    assert(crons_equal(&expr1, &expr2));
+    /* identical expressions are interned under the same hash */
+    hash = cron_expr_hash(&expr1);
+    assert(cron_expr_hash(&expr2) == hash);
+    cron_parse_expr_seeded("H 0 0 * * *", &expr2, 1, NULL);
+    assert(!crons_equal(&expr1, &expr2) && cron_expr_hash(&expr2) != hash);
+
+    /* spread over the range */
+    memset(seen, 0, sizeof(seen));
+    for (seed = 0; seed < 1000; seed++) {
+        cron_parse_expr_seeded("0 H(0-29) * * * *", &expr1, seed, &err);
+        assert(!err);
+        for (i = 0; i < CRON_MAX_MINUTES; i++) {
+            if (cron_get_bit(expr1.minutes, i)) {
+                assert(i < 30);
+                distinct += seen[i] ? 0 : 1;
+                seen[i] += 1;
+            }
+        }
+    }
+    assert(30 == distinct);
+    for (i = 0; i < 30; i++) {
+        assert(seen[i] > 10 && seen[i] < 60);
+    }
+
+    for (seed = 0; seed < 100; seed++) {
+        cron_parse_expr_seeded("H/15 H(10-40)/10 * H * H", &expr1, seed, &err);
+        assert(!err);
+        for (i = 0; i < 15 && !cron_get_bit(expr1.seconds, i); i++);
+        steps = i < 15 && cron_get_bit(expr1.seconds, i + 15) && cron_get_bit(expr1.seconds, i + 30) && cron_get_bit(expr1.seconds, i + 45);
+        assert(steps);
+        assert(4 == count_bits(expr1.seconds, MAX_SECONDS));
+        assert(count_bits(expr1.minutes, CRON_MAX_MINUTES) >= 3);
+        outside = 0;
+        for (i = 0; i < CRON_MAX_MINUTES; i++) {
+            outside += (i < 10 || i > 40) && cron_get_bit(expr1.minutes, i);
+        }
+        for (i = 29; i < CRON_MAX_DAYS_OF_MONTH; i++) {
+            outside += cron_get_bit(expr1.days_of_month, i);
+        }
+        assert(0 == outside);
+        assert(1 == count_bits(expr1.days_of_month, CRON_MAX_DAYS_OF_MONTH));
+        assert(1 == count_bits(expr1.days_of_week, 8));
+    }
+
+    /* seeds lead to different results */
+    cron_parse_expr_seeded("H H * * * *", &expr1, 1, NULL);
+    cron_parse_expr_seeded("H H * * * *", &expr2, 2, NULL);
+    assert(!crons_equal(&expr1, &expr2));
+    cron_parse_expr_seeded("H,30 h(0-1) * * * *", &expr1, 7, &err);
+    assert(!err);
+
+    check_hashed_invalid("H( * * * * *");
+    check_hashed_invalid("H(5-2) * * * * *");
+    check_hashed_invalid("H(0-60) * * * * *");
+    check_hashed_invalid("H/0 * * * * *");
+    check_hashed_invalid("H/x * * * * *");
+    check_hashed_invalid("HX * * * * *");
+    check_hashed_invalid("H-5 * * * * *");
+}
+
+void check_next_step(const char* pattern, const char* initial, const char* expected) {
+    cron_expr parsed;
+    const char* err = NULL;
+    cron_next_state state;
+    time_t date = parse_date(initial);
+    time_t res = expected ? parse_date(expected) : CRON_INVALID_INSTANT;
+    unsigned long bound;
+    int steps = 0;
+    time_t next;
+    int status;
+
+    cron_parse_expr(pattern, &parsed, &err);
+    assert(!err);
+    bound = cron_next_cost_bound(&parsed);
+    next = cron_next(&parsed, date);
+    assert(res == next);
+
+    cron_next_init(&state, &parsed, date);
+    status = cron_next_step(&state, bound);
+    assert(CRON_STEP_DONE == status);
+    assert(res == state.result);
+    assert(state.spent <= bound);
+
+    // every step makes progress, however small the budget
+    cron_next_init(&state, &parsed, date);
+    while (CRON_STEP_PENDING == cron_next_step(&state, 0)) {
+        steps++;
+        assert((unsigned long) steps <= bound);
+    }
+    assert(res == state.result);
+    status = cron_next_step(&state, 0);
+    assert(CRON_STEP_DONE == status);
+
+    // steps of a larger budget are bounded by the cost bound
+    steps = 0;
+    cron_next_init(&state, &parsed, date);
+    while (CRON_STEP_PENDING == cron_next_step(&state, 2 * CRON_STEP_MIN_BUDGET)) {
+        steps++;
+    }
+    assert(res == state.result);
+    assert((unsigned long) steps <= bound / CRON_STEP_MIN_BUDGET + 1);
+}
+
+void test_next_step() {
+    check_next_step("* * * * * *", "2012-07-01_09:53:50", "2012-07-01_09:53:51");
+    check_next_step("0 */15 * * * *", "2012-07-01_09:53:50", "2012-07-01_10:00:00");
+    check_next_step("0,30 10 * * * *", "2012-07-01_10:05:20", "2012-07-01_10:10:00");
+    check_next_step("0 0 7 ? * MON-FRI", "2009-09-26_00:42:55", "2009-09-28_07:00:00");
+    check_next_step("0 0 7 ? * MON-FRI", "2009-09-28_07:00:00", "2009-09-29_07:00:00");
+    check_next_step("0 30 23 30 1/3 ?", "2011-04-30_23:30:00", "2011-07-30_23:30:00");
+    check_next_step("0 0 0 29 2 *", "2012-03-01_00:00:00", "2016-02-29_00:00:00");
+    check_next_step("0 0 0 ? 2 MON#5", "2012-03-01_00:00:00", "2016-02-29_00:00:00");
+    check_next_step("59 59 23 31 12 ?", "2012-12-31_23:59:59", "2013-12-31_23:59:59");
+    check_next_step("0 0 9 ? * FRI#3", "2012-07-01_09:53:50", "2012-07-20_09:00:00");
+    check_next_step("0 0 0 18 * THU#1", "2012-07-01_09:53:50", NULL);
+
+    // expressions without day restrictions need few normalizations
+    cron_expr parsed;
+    unsigned long bound;
+    const char* err = NULL;
+    cron_parse_expr("* * * * * *", &parsed, &err);
+    bound = cron_next_cost_bound(&parsed);
+    assert(bound < CRON_STEP_MIN_BUDGET);
+    cron_parse_expr("0 0 0 29 2 *", &parsed, &err);
+    bound = cron_next_cost_bound(&parsed);
+    assert(bound > CRON_STEP_MIN_BUDGET);
+}
+
+#ifdef CRON_USE_STATS
+uint64_t sum_latency(const cron_stats* stats, int api) {
+    uint64_t res = 0;
+    for (int i = 0; i < CRON_STATS_LATENCY_BUCKETS; i++) {
+        res += stats->latency[api][i];
+    }
+    return res;
+}
+
+#ifndef _WIN32
+void* stats_thread(void* arg) {
+    cron_expr* parsed = (cron_expr*) arg;
+    for (int i = 0; i < 10; i++) {
+        time_t res = cron_next(parsed, parse_date("2012-07-01_09:53:50"));
+        assert(CRON_INVALID_INSTANT != res);
+    }
+    return NULL;
+}
+#endif
+
+void test_stats() {
+    cron_expr parsed;
+    const char* err = NULL;
+    cron_stats stats;
+
+    cron_stats_reset();
+    cron_parse_expr("0 0 12 * * *", &parsed, &err);
+    assert(!err);
+    cron_next(&parsed, parse_date("2012-07-01_09:53:50"));
+    cron_prev(&parsed, parse_date("2012-07-01_09:53:50"));
+    cron_stats_read(&stats);
+    assert(1 == stats.calls[CRON_STATS_PARSE] && 1 == sum_latency(&stats, CRON_STATS_PARSE));
+    assert(1 == stats.calls[CRON_STATS_NEXT] && 1 == sum_latency(&stats, CRON_STATS_NEXT));
+    assert(1 == stats.calls[CRON_STATS_PREV] && 1 == sum_latency(&stats, CRON_STATS_PREV));
+    assert(0 == stats.calls[CRON_STATS_NEXT_TZ]);
+    assert(0 == stats.parse_allocations && 0 == stats.allocations);
+    assert(stats.recursions >= 2 && stats.max_depth >= 1 && stats.max_depth <= stats.recursions);
+    assert(stats.day_iterations >= 2 && stats.normalizations > stats.recursions);
+
+#ifndef _WIN32
+    {
+        pthread_t thread;
+        int res;
+        res = pthread_create(&thread, NULL, stats_thread, &parsed);
+        assert(0 == res);
+        res = pthread_join(thread, NULL);
+        assert(0 == res);
+        cron_stats_read(&stats);
+        assert(11 == stats.calls[CRON_STATS_NEXT]);
+        /* counters of a finished thread are kept */
+        res = pthread_create(&thread, NULL, stats_thread, &parsed);
+        assert(0 == res);
+        res = pthread_join(thread, NULL);
+        assert(0 == res);
+        cron_stats_read(&stats);
+        assert(21 == stats.calls[CRON_STATS_NEXT]);
+    }
+#endif
+
+    cron_stats_reset();
+    cron_stats_read(&stats);
+    assert(0 == stats.calls[CRON_STATS_NEXT] && 0 == stats.recursions);
+}
+#endif
+
 /* For this test to work you need to set "-DCRON_TEST_MALLOC=1"*/
+#ifdef CRON_USE_TRACE
+size_t read_varint(const uint8_t* in, uint64_t* value) {
+    size_t i = 0;
+    *value = 0;
+    do {
+        *value |= (uint64_t) (in[i] & 0x7f) << (7 * i);
+    } while (in[i++] & 0x80);
+    return i;
+}
+
+void test_trace() {
+    const char* path = "ccronexpr_test.trace";
+    cron_expr first;
+    cron_expr second;
+    const char* err = NULL;
+    uint8_t data[1024];
+    uint64_t value;
+    size_t len;
+    size_t pos;
+    int exprs = 0;
+    int queries = 0;
+    time_t date = 0;
+    time_t res;
+    int started;
+
+    cron_parse_expr("0 0 7 ? * MON-FRI", &first, &err);
+    assert(!err);
+    cron_parse_expr("0 */15 * * * *", &second, &err);
+    assert(!err);
+    remove(path);
+    started = cron_trace_start(path);
+    assert(0 == started);
+    started = cron_trace_start(path);
+    assert(0 != started);
+    res = cron_next(&first, parse_date("2012-07-01_09:53:50"));
+    assert(CRON_INVALID_INSTANT != res);
+    res = cron_next(&second, parse_date("2012-07-01_09:53:50"));
+    assert(CRON_INVALID_INSTANT != res);
+    res = cron_prev(&first, parse_date("2012-07-02_09:53:50"));
+    assert(CRON_INVALID_INSTANT != res);
+    cron_trace_stop();
+    res = cron_next(&first, parse_date("2012-07-01_09:53:50"));
+    assert(CRON_INVALID_INSTANT != res);
+
+    FILE* f = fopen(path, "rb");
+    assert(f);
+    len = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    remove(path);
+    assert(len > 6);
+    assert(0 == memcmp(data, "CRTR", 4));
+    assert(1 == data[4]);
+    for (pos = 6; pos < len;) {
+        uint8_t type = data[pos++];
+        pos += read_varint(data + pos, &value);
+        if ('E' == type) {
+            exprs++;
+            assert(value == (uint64_t) exprs);
+            assert(0 == memcmp(data + pos, 1 == exprs ? &first : &second, sizeof(cron_expr)));
+            pos += sizeof(cron_expr);
+        } else {
+            assert('N' == type || 'P' == type);
+            assert(value == (queries < 2 ? (uint64_t) queries + 1 : 1));
+            queries++;
+            pos += read_varint(data + pos, &value);
+            date += (time_t) ((value & 1) ? -(int64_t) (value >> 1) - 1 : (int64_t) (value >> 1));
+            pos += read_varint(data + pos, &value);
+            assert((3 == queries ? 'P' : 'N') == type);
+        }
+    }
+    assert(len == pos);
+    assert(2 == exprs);
+    assert(3 == queries);
+    assert(parse_date("2012-07-02_09:53:50") == date);
+}
+#endif
+
 #ifdef CRON_TEST_MALLOC
 void test_memory() {
     cron_expr cron;
     const char* err;
+    int total = cronTotalAllocations;
 
     cron_parse_expr("* * * * * *", &cron, &err);
     if (cronAllocations != 0) {
         printf("Allocations != 0 but %d", cronAllocations);
         assert(0);
     }
+    // parsing does not allocate
+    cron_parse_expr("0 0 12 L-2,LW,15W JAN-MAR,SEP 1L,MON#2", &cron, &err);
+    assert(!err && total == cronTotalAllocations);
     printf("Allocations: total: %d, max: %d", cronTotalAllocations, maxAlloc);
 }
 #endif
@@ -388,8 +1321,24 @@ int main() {
     test_bits();
 
     test_expr();
+    test_day_modifiers();
+    test_hashed();
     test_parse();
     check_calc_invalid();
+#ifndef CRON_FREESTANDING
+    test_timeline();
+    test_histogram();
+#endif
+    test_intersect();
+    test_ms();
+    test_next_step();
+    test_tz();
+    #ifdef CRON_USE_STATS
+    test_stats();
+    #endif
+    #ifdef CRON_USE_TRACE
+    test_trace();
+    #endif
     #ifdef CRON_TEST_MALLOC
     test_memory(); /* For this test to work you need to set "-DCRON_TEST_MALLOC=1"*/
     #endif
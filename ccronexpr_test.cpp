@@ -0,0 +1,326 @@
+/*
+ * Copyright 2015, alex at staticlibs.net
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * File:   ccronexpr_test.cpp
+ *
+ * Tests of the C++20 layer, the C API is covered by ccronexpr_test.c
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <ranges>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "ccronexpr.hpp"
+#include "ccronexpr_coro.hpp"
+
+using namespace std::chrono;
+
+#ifdef CRON_TEST_MALLOC
+#ifndef CRON_COMPILE_AS_CXX
+extern "C" {
+#endif
+void* cron_malloc(size_t n) {
+    return malloc(n);
+}
+
+void cron_free(void* p) {
+    free(p);
+}
+#ifndef CRON_COMPILE_AS_CXX
+}
+#endif
+#endif
+
+static_assert(std::ranges::view<cron::occurrences_view>);
+static_assert(std::ranges::forward_range<cron::occurrences_view>);
+static_assert(std::is_trivially_copyable_v<cron::expr>);
+
+// masks of static expressions are constants
+using every_5_minutes = cron::static_expr<"0 */5 * * * *">;
+static_assert(cron::detail::get_bit(every_5_minutes::masks.minutes, 55) && !cron::detail::get_bit(every_5_minutes::masks.minutes, 56));
+static_assert(every_5_minutes::masks.seconds[0] == 1 && every_5_minutes::masks.months[1] == 0x0f);
+static_assert(cron::static_expr<"0 0 12 * JAN-MAR MON">::masks.months[0] == 0x07);
+static_assert(cron::static_expr<"0 0 0 ? * 7">::masks.days_of_week[0] == 1);
+static_assert(cron::static_expr<"0 0 0 L-2 * ?">::masks.days_of_month_last[0] == 4);
+static_assert(cron::detail::get_bit(cron::static_expr<"H * * * * *", 1>::masks.seconds, static_cast<int>(cron::detail::hash_field(1, 0) % 60)));
+#ifndef CRON_USE_LOCAL_TIME
+static_assert(every_5_minutes::every_day && cron::static_expr<"0 0 12 ? * *">::every_day);
+static_assert(!cron::static_expr<"0 0 12 * * MON-FRI">::every_day && !cron::static_expr<"0 0 12 LW * *">::every_day);
+#endif
+
+#ifdef CRON_TEST_STATIC_INVALID
+// must not compile, built by the ccronexpr_static_invalid test
+cron::expr invalid_static = cron::static_expr<"0 0 25 * * *">::value();
+#endif
+
+// dates are compared as UTC instants, tests with local time are covered by the C tests
+static sys_seconds utc(int y, unsigned m, unsigned d, int hh, int mm, int ss) {
+    return sys_days(year(y) / month(m) / day(d)) + hours(hh) + minutes(mm) + seconds(ss);
+}
+
+void test_parse() {
+    cron::result<cron::expr> parsed = cron::expr::parse("0 */15 * * * *");
+    assert(parsed.has_value() && parsed);
+    cron_expr raw;
+    const char* err = NULL;
+    cron_parse_expr("0 */15 * * * *", &raw, &err);
+    assert(!err && 0 == memcmp(&raw, &parsed->c_expr(), sizeof(cron_expr)));
+    assert(cron::expr(raw) == *parsed);
+
+    // not null-terminated
+    std::string text = "0 0 12 * * MON-FRI and more";
+    assert(cron::expr::parse(std::string_view(text).substr(0, 18)));
+
+    cron::result<cron::expr> invalid = cron::expr::parse("0 0 12 * *");
+    assert(!invalid && !invalid.has_value());
+    assert(0 == strcmp("Invalid number of fields, expression must consist of 6 fields", invalid.error().message()));
+    assert(cron::parse_error(invalid.error().message()) == invalid.error());
+    assert(!cron::expr::parse("0 0 25 * * *"));
+    assert(!cron::expr::parse(std::string(300, '*')));
+    assert(cron::expr::parse("0 0 25 * * *").value_or(cron::expr()) == cron::expr());
+
+    // seeded hashes
+    assert(*cron::expr::parse("H H * * * *", 1) == cron::expr::parse("H H * * * *", 1).value());
+}
+
+void test_next_prev() {
+    cron::expr e = cron::expr::parse("0 0 7 ? * MON-FRI").value();
+    sys_seconds from = utc(2009, 9, 26, 0, 42, 55);
+    assert(e.next(from) == utc(2009, 9, 28, 7, 0, 0));
+    assert(e.prev(from) == utc(2009, 9, 25, 7, 0, 0));
+    assert(e.next(from) == sys_seconds(seconds(cron_next(&e.c_expr(), from.time_since_epoch().count()))));
+
+    // strictly after and before the sub-second dates
+    cron::expr every = cron::expr::parse("* * * * * *").value();
+    sys_time<milliseconds> ms = utc(2012, 7, 1, 9, 53, 50) + milliseconds(500);
+    assert(every.next(ms) == utc(2012, 7, 1, 9, 53, 51));
+    assert(every.prev(ms) == utc(2012, 7, 1, 9, 53, 50));
+    assert(every.next(utc(2012, 7, 1, 9, 53, 50)) == utc(2012, 7, 1, 9, 53, 51));
+    assert(every.prev(utc(2012, 7, 1, 9, 53, 50)) == utc(2012, 7, 1, 9, 53, 49));
+
+    cron::expr never = cron::expr::parse("0 0 0 30 2 *").value();
+    assert(!never.next(from) && !never.prev(from));
+    assert(!cron::expr().next(from));
+}
+
+// parses the same masks and reports the same errors as the C parser
+void check_static_parse(const char* text, uint32_t seed) {
+    cron_expr c_parsed, parsed;
+    const char* c_err = NULL;
+    cron_parse_expr_seeded(text, &c_parsed, seed, &c_err);
+    const char* err = cron::detail::parse(text, seed, parsed);
+    if (c_err) {
+        assert(err && 0 == strcmp(c_err, err));
+    } else {
+        assert(!err && 0 == memcmp(&c_parsed, &parsed, sizeof(cron_expr)));
+    }
+}
+
+void test_static_parse() {
+    const char* texts[] = {
+        "0 */15 * * * *", "*  *  * *  1 *", "\t0 0\t12 * * *", "57/2 * * * * *", "1-6/2 * * * * *", "* * 4/4 * * *",
+        "* * * * * TUE,WED,THU,FRI,SAT,SUN,MON", "* * * * Feb *", "* * * * feb-dec/3 sun", "0 0 0 1 */2147483647 *",
+        "0 0 0 ? * 7", "+1 -0 * * * *", "H H H H H H", "H(0-29)/10 H/15 H(8-17) ? * *", "h h * * * *",
+        "0 0 0 L * ?", "0 0 0 L-3 * ?", "0 0 0 LW * ?", "0 0 0 15W,L * ?", "0 0 0 ? * 5#3", "0 0 0 ? * FRIL", "0 0 0 ? * L",
+        "0 0 0 ? * MON#1,5L,2", "0 0 0 1,L,10W * *",
+        "0 0 12 * *", "0 0 12 * * * *", "", "77 * * * * *", "44-77 * * * * *", "* * 27 * * *", "0 0 0 25 0 ?",
+        "* * * * 11-13 *", "-5 * * * * *", "3-2 */5 * * * *", "/5 * * * * *", "*/0 * * * * *", "1-2-3 * * * * *",
+        "1/2/3 * * * * *", "a * * * * *", "1- * * * * *", "-1 * * * * *", "99999999999 * * * * *", "*/x * * * * *",
+        "H( * * * * *", "H(0-5 * * * * *", "H/0 * * * * *", "Hx * * * * *", "H(5-1) * * * * *",
+        "0 0 0 ? * 5#6", "0 0 0 ? * #3", "0 0 0 ? * 8L", "0 0 0 ? * 1-5L", "0 0 0 ? * 5#",
+        "0 0 0 L-31 * ?", "0 0 0 32W * ?", "0 0 0 0W * ?", "0 0 0 WL * ?", "0 0 0 L-* * ?",
+    };
+    for (const char* text : texts) {
+        check_static_parse(text, 0);
+        check_static_parse(text, 0xdeadbeef);
+    }
+    std::string long_text(250, ' ');
+    long_text += "* * * * * *";
+    check_static_parse(long_text.c_str(), 0);
+    check_static_parse(long_text.c_str() + 10, 0);
+
+    // compile-time and run-time parses are the same
+    cron_expr c_parsed;
+    const char* err = NULL;
+    cron_parse_expr("0 */5 * * * *", &c_parsed, &err);
+    assert(!err && cron::expr(c_parsed) == every_5_minutes::value());
+}
+
+template <class Static>
+void check_static_dates(const char* text) {
+    cron::expr e = cron::expr::parse(text).value();
+    assert(e == Static::value());
+    sys_seconds date = utc(2019, 12, 31, 23, 59, 59) - seconds(3);
+    for (int i = 0; i < 2000; i++) {
+        assert(Static::next(date) == e.next(date));
+        assert(Static::prev(date) == e.prev(date));
+        assert(Static::next(date + milliseconds(999)) == e.next(date + milliseconds(999)));
+        assert(Static::prev(date - milliseconds(999)) == e.prev(date - milliseconds(999)));
+        date += seconds(7919 * (i % 7) + 1);
+    }
+    // around midnight and before the epoch, away from -1 which is CRON_INVALID_INSTANT in the C API
+    for (sys_seconds day : { utc(1969, 6, 15, 0, 0, 0), utc(2020, 2, 29, 0, 0, 0), utc(2038, 1, 19, 0, 0, 0) }) {
+        for (seconds offset : { seconds(-1), seconds(0), seconds(1), seconds(86399), seconds(86400) }) {
+            assert(Static::next(day + offset) == e.next(day + offset));
+            assert(Static::prev(day + offset) == e.prev(day + offset));
+        }
+    }
+}
+
+void test_static_next_prev() {
+    check_static_dates<every_5_minutes>("0 */5 * * * *");
+    check_static_dates<cron::static_expr<"* * * * * *">>("* * * * * *");
+    check_static_dates<cron::static_expr<"0 0 0 * * *">>("0 0 0 * * *");
+    check_static_dates<cron::static_expr<"59 59 23 ? * *">>("59 59 23 ? * *");
+    check_static_dates<cron::static_expr<"15,45 10/20 1-3,22 * * *">>("15,45 10/20 1-3,22 * * *");
+    check_static_dates<cron::static_expr<"0 0 7 ? * MON-FRI">>("0 0 7 ? * MON-FRI");
+    check_static_dates<cron::static_expr<"0 30 12 LW * ?">>("0 30 12 LW * ?");
+    check_static_dates<cron::static_expr<"0 0 0 29 2 *">>("0 0 0 29 2 *");
+    assert(!cron::static_expr<"0 0 0 30 2 *">::next(utc(2012, 7, 1, 9, 53, 50)));
+}
+
+void test_occurrences() {
+    cron::expr e = cron::expr::parse("0 */15 * * * *").value();
+    sys_seconds from = utc(2012, 7, 1, 9, 53, 50);
+    std::vector<sys_seconds> dates;
+    for (sys_seconds date : cron::occurrences(e, from) | std::views::take(100)) {
+        dates.push_back(date);
+    }
+    assert(100 == dates.size());
+    assert(utc(2012, 7, 1, 10, 0, 0) == dates[0]);
+    for (size_t i = 1; i < dates.size(); i++) {
+        assert(minutes(15) == dates[i] - dates[i - 1]);
+    }
+
+    // the same dates as repeated searches
+    sys_seconds date = from;
+    for (sys_seconds occurrence : cron::occurrences(cron::expr::parse("0 0 0 LW * ?").value(), from) | std::views::take(24)) {
+        date = *cron::expr::parse("0 0 0 LW * ?")->next(date);
+        assert(date == occurrence);
+    }
+
+    // iterators are independent
+    cron::occurrences_view view = cron::occurrences(e, from);
+    auto it = view.begin();
+    auto copy = it++;
+    assert(utc(2012, 7, 1, 10, 0, 0) == *copy && utc(2012, 7, 1, 10, 15, 0) == *it);
+    ++copy;
+    assert(copy == it);
+
+    // never fires
+    assert(cron::occurrences(cron::expr::parse("0 0 0 30 2 *").value(), from).empty());
+    assert(std::ranges::empty(cron::occurrences(cron::expr(), from)));
+    assert(utc(2012, 7, 1, 10, 0, 0) == cron::occurrences(e, from).front());
+}
+
+// fire and forget coroutine
+struct job {
+    struct promise_type {
+        job get_return_object() noexcept { return job(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept { }
+        void unhandled_exception() noexcept { abort(); }
+    };
+};
+
+using fire_log = std::vector<std::pair<sys_seconds, int>>;
+
+job fire_times(cron::expr e, int id, int count, cron::timer_service& service, fire_log& log) {
+    for (int i = 0; i < count; i++) {
+        std::optional<sys_seconds> date = co_await cron::until_next(e, service);
+        if (!date) co_return;
+        assert(*date == service.now());
+        log.emplace_back(*date, id);
+    }
+}
+
+job fire_once(cron::expr e, std::promise<std::optional<sys_seconds>>& fired) {
+    fired.set_value(co_await cron::until_next(e));
+}
+
+void test_until_next() {
+    sys_seconds now = utc(2012, 7, 1, 9, 53, 50);
+    cron::timer_service service([&now] { return now; });
+    fire_log log;
+    const int jobs = 2000;
+    const int count = 20;
+    std::vector<cron::expr> exprs;
+    for (int i = 0; i < jobs; i++) {
+        exprs.push_back(cron::expr::parse(0 == i % 2 ? "H H/10 * * * *" : "H */15 * * * MON-FRI", static_cast<uint32_t>(i)).value());
+        fire_times(exprs.back(), i, count, service, log);
+    }
+    assert(jobs == service.size());
+
+    // the virtual clock jumps to the earliest wait
+    while (std::optional<sys_seconds> date = service.next_date()) {
+        assert(*date > now);
+        now = *date;
+        size_t ran = service.run_due();
+        assert(ran > 0);
+    }
+    assert(static_cast<size_t>(jobs * count) == log.size());
+    assert(std::is_sorted(log.begin(), log.end()));
+    std::vector<std::vector<sys_seconds>> dates(jobs);
+    for (const auto& fire : log) {
+        dates[static_cast<size_t>(fire.second)].push_back(fire.first);
+    }
+    for (int i = 0; i < jobs; i += 97) {
+        std::vector<sys_seconds> expected;
+        for (sys_seconds date : cron::occurrences(exprs[static_cast<size_t>(i)], utc(2012, 7, 1, 9, 53, 50)) | std::views::take(count)) {
+            expected.push_back(date);
+        }
+        assert(expected == dates[static_cast<size_t>(i)]);
+    }
+
+    // never fires, does not suspend
+    fire_times(cron::expr::parse("0 0 0 30 2 *").value(), -1, 1, service, log);
+    assert(0 == service.size() && !service.next_date());
+    size_t ran = service.run_due();
+    assert(0 == ran);
+
+    // shared timer thread on the system clock
+    std::promise<std::optional<sys_seconds>> fired;
+    fire_once(cron::expr::parse("* * * * * *").value(), fired);
+    std::future<std::optional<sys_seconds>> date = fired.get_future();
+    std::future_status status = date.wait_for(seconds(3));
+    assert(std::future_status::ready == status);
+    std::optional<sys_seconds> fired_date = date.get();
+    assert(fired_date <= floor<seconds>(system_clock::now()));
+}
+
+int main() {
+    test_parse();
+    test_static_parse();
+#ifndef CRON_USE_LOCAL_TIME
+    test_next_prev();
+    test_occurrences();
+    test_static_next_prev();
+    test_until_next();
+#endif
+    printf("\nAll OK!\n");
+    return 0;
+}